@@ -0,0 +1,625 @@
+#include "local_grid_file.h"
+#include "fs_options.h"
+#include "fs_logger.h"
+
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <boost/random/mersenne_twister.hpp>
+
+using namespace std;
+using namespace mgridfs;
+
+/**
+ * Micro-benchmark for the in-memory buffer layer (LocalMemoryGridFile) that runs without fuse or
+ * mongod, to have repeatable numbers before and after any change to the buffers. Every case is
+ * run with FUSE like request sizes over sequential, random and strided offsets and reports the
+ * throughput, the allocations done per operation and the latency percentiles.
+ */
+
+namespace {
+	// Every allocation in the process goes through the operators below, the benchmark only looks
+	// at the difference over the timed loops for which all its own buffers are allocated upfront
+	boost::atomic<uint64_t> allocationCount(0);
+}
+
+// Dynamic exception specifications are an error from C++17 on, the replacements have to match
+// the declarations of <new> under either standard
+#if __cplusplus < 201103L
+#define MGRIDFS_THROW_BAD_ALLOC throw (std::bad_alloc)
+#define MGRIDFS_NOTHROW throw ()
+#else
+#define MGRIDFS_THROW_BAD_ALLOC
+#define MGRIDFS_NOTHROW noexcept
+#endif
+
+void* operator new(size_t size) MGRIDFS_THROW_BAD_ALLOC {
+	allocationCount.fetch_add(1, boost::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+
+	return p;
+}
+
+void* operator new[](size_t size) MGRIDFS_THROW_BAD_ALLOC {
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) MGRIDFS_NOTHROW {
+	allocationCount.fetch_add(1, boost::memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& nt) MGRIDFS_NOTHROW {
+	return operator new(size, nt);
+}
+
+void operator delete(void* p) MGRIDFS_NOTHROW {
+	free(p);
+}
+
+void operator delete[](void* p) MGRIDFS_NOTHROW {
+	free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) MGRIDFS_NOTHROW {
+	free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) MGRIDFS_NOTHROW {
+	free(p);
+}
+
+namespace mgridfs {
+
+class LocalGridFileBench {
+public:
+	static boost::shared_array<char> createFlushBuffer(const LocalMemoryGridFile& file, size_t& bufferLen) {
+		return file.createFlushBuffer(bufferLen);
+	}
+};
+
+}
+
+namespace {
+	const size_t KB = 1024;
+
+	typedef enum {
+		AP_SEQUENTIAL,
+		AP_RANDOM,
+		AP_STRIDED,
+	} AccessPattern;
+
+	struct BenchOptions {
+		BenchOptions() : _iterations(5), _seed(42) {}
+
+		vector<size_t> _chunkSizes; // In KB, as with --memChunkSize of mgridfs
+		vector<size_t> _fileSizes; // In KB
+		vector<size_t> _requestSizes; // In KB
+		vector<AccessPattern> _patterns;
+		size_t _iterations;
+		uint32_t _seed;
+	};
+
+	struct BenchResult {
+		BenchResult() : _ops(0), _bytes(0), _elapsedNanos(0), _allocations(0) {}
+
+		uint64_t _ops;
+		uint64_t _bytes;
+		uint64_t _elapsedNanos;
+		uint64_t _allocations;
+		vector<uint64_t> _latencies; // In nanos, one per operation
+	};
+
+	const char* patternToString(AccessPattern pattern) {
+		switch (pattern) {
+			case AP_SEQUENTIAL: return "seq";
+			case AP_RANDOM: return "random";
+			case AP_STRIDED: return "strided";
+		}
+
+		return "unknown";
+	}
+
+	uint64_t nowNanos() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	size_t gcd(size_t a, size_t b) {
+		while (b) {
+			size_t t = a % b;
+			a = b;
+			b = t;
+		}
+
+		return a;
+	}
+
+	/**
+	 * Generates the offsets of the requests, always aligned to the request size. The strided
+	 * pattern steps over a chunk worth of data with every request and still covers every block
+	 * of the file exactly once. The random offsets are seeded so that the runs are repeatable.
+	 */
+	class OffsetGenerator {
+	public:
+		OffsetGenerator(AccessPattern pattern, size_t fileSize, size_t requestSize, size_t chunkSize, uint32_t seed)
+			: _pattern(pattern), _requestSize(requestSize), _blocks(fileSize / requestSize), _stride(1),
+			_next(0), _random(seed) {
+			if (_pattern == AP_STRIDED) {
+				_stride = chunkSize / requestSize + 1;
+				while (_blocks > 1 && gcd(_stride, _blocks) != 1) {
+					++_stride;
+				}
+			}
+		}
+
+		off_t next() {
+			size_t block = 0;
+			switch (_pattern) {
+				case AP_SEQUENTIAL:
+					block = _next++ % _blocks;
+					break;
+				case AP_RANDOM:
+					block = _random() % _blocks;
+					break;
+				case AP_STRIDED:
+					block = (_next++ * _stride) % _blocks;
+					break;
+			}
+
+			return (off_t)block * _requestSize;
+		}
+
+		size_t getBlocks() const { return _blocks; }
+
+	private:
+		AccessPattern _pattern;
+		size_t _requestSize;
+		size_t _blocks;
+		size_t _stride;
+		size_t _next;
+		boost::mt19937 _random;
+	};
+
+	// The content of every written block is the same, so that the expected byte at any offset
+	// is known without keeping a copy of the file
+	void fillSource(vector<char>& source) {
+		for (size_t i = 0; i < source.size(); ++i) {
+			source[i] = (char)((i * 131 + 7) % 251);
+		}
+	}
+
+	bool verifyContent(const LocalMemoryGridFile& file, const vector<char>& source, size_t fileSize) {
+		if (file.getSize() != fileSize) {
+			cerr << "Unexpected file size {expected: " << fileSize << ", actual: " << file.getSize() << "}" << endl;
+			return false;
+		}
+
+		size_t bufferLen = 0;
+		boost::shared_array<char> buffer = LocalGridFileBench::createFlushBuffer(file, bufferLen);
+		if (bufferLen != fileSize || (fileSize && !buffer.get())) {
+			cerr << "Unexpected flush buffer {expected: " << fileSize << ", actual: " << bufferLen << "}" << endl;
+			return false;
+		}
+
+		for (size_t i = 0; i < bufferLen; ++i) {
+			if (buffer[i] != source[i % source.size()]) {
+				cerr << "Unexpected file content {offset: " << i << "}" << endl;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Files dropped by the benchmark are marked clean first, a dirty file flushes to the server
+	// on destruction
+	void dropFile(LocalMemoryGridFile* file) {
+		file->setDirty(false);
+		delete file;
+	}
+
+	LocalMemoryGridFile* createFilledFile(const vector<char>& source, size_t fileSize) {
+		LocalMemoryGridFile* file = new LocalMemoryGridFile("bench");
+		for (size_t offset = 0; offset < fileSize; offset += source.size()) {
+			file->write(&source[0], source.size(), offset);
+		}
+
+		return file;
+	}
+
+	class BenchCase {
+	public:
+		BenchCase(const BenchOptions& options, size_t chunkSize, size_t fileSize, size_t requestSize)
+			: _options(options), _chunkSize(chunkSize), _fileSize(fileSize), _requestSize(requestSize),
+			_failed(false) {
+		}
+
+		bool hasFailed() const { return _failed; }
+
+		BenchResult runWrite(AccessPattern pattern) {
+			BenchResult result;
+			vector<char> source(_requestSize);
+			fillSource(source);
+
+			OffsetGenerator offsets(pattern, _fileSize, _requestSize, _chunkSize, _options._seed);
+			result._latencies.reserve(offsets.getBlocks() * _options._iterations);
+			for (size_t iteration = 0; iteration < _options._iterations; ++iteration) {
+				// Every iteration starts with an empty file so that the cost of growing the
+				// buffers is part of the numbers
+				OffsetGenerator iterationOffsets(pattern, _fileSize, _requestSize, _chunkSize, _options._seed + iteration);
+				LocalMemoryGridFile* file = new LocalMemoryGridFile("bench");
+
+				uint64_t allocationsBefore = allocationCount.load(boost::memory_order_relaxed);
+				uint64_t start = nowNanos();
+				for (size_t i = 0; i < iterationOffsets.getBlocks(); ++i) {
+					off_t offset = iterationOffsets.next();
+					uint64_t opStart = nowNanos();
+					int rc = file->write(&source[0], _requestSize, offset);
+					result._latencies.push_back(nowNanos() - opStart);
+					if (rc != (int)_requestSize) {
+						reportFailure("write", rc);
+						break;
+					}
+				}
+
+				result._elapsedNanos += nowNanos() - start;
+				result._allocations += allocationCount.load(boost::memory_order_relaxed) - allocationsBefore;
+				result._ops += iterationOffsets.getBlocks();
+				result._bytes += iterationOffsets.getBlocks() * _requestSize;
+
+				// Random offsets leave holes behind with undefined content
+				if (!iteration && pattern != AP_RANDOM && !verifyContent(*file, source, _fileSize)) {
+					_failed = true;
+				}
+
+				dropFile(file);
+			}
+
+			return result;
+		}
+
+		BenchResult runRead(AccessPattern pattern) {
+			BenchResult result;
+			vector<char> source(_requestSize);
+			fillSource(source);
+			vector<char> target(_requestSize);
+
+			LocalMemoryGridFile* file = createFilledFile(source, _fileSize);
+			if (!verifyContent(*file, source, _fileSize)) {
+				_failed = true;
+			}
+
+			OffsetGenerator offsets(pattern, _fileSize, _requestSize, _chunkSize, _options._seed);
+			result._latencies.reserve(offsets.getBlocks() * _options._iterations);
+			for (size_t iteration = 0; iteration < _options._iterations; ++iteration) {
+				OffsetGenerator iterationOffsets(pattern, _fileSize, _requestSize, _chunkSize, _options._seed + iteration);
+
+				uint64_t allocationsBefore = allocationCount.load(boost::memory_order_relaxed);
+				uint64_t start = nowNanos();
+				for (size_t i = 0; i < iterationOffsets.getBlocks(); ++i) {
+					off_t offset = iterationOffsets.next();
+					uint64_t opStart = nowNanos();
+					int rc = file->read(&target[0], _requestSize, offset);
+					result._latencies.push_back(nowNanos() - opStart);
+					if (rc != (int)_requestSize) {
+						reportFailure("read", rc);
+						break;
+					}
+				}
+
+				result._elapsedNanos += nowNanos() - start;
+				result._allocations += allocationCount.load(boost::memory_order_relaxed) - allocationsBefore;
+				result._ops += iterationOffsets.getBlocks();
+				result._bytes += iterationOffsets.getBlocks() * _requestSize;
+			}
+
+			// Reads past the end of file have to come back empty
+			if (file->read(&target[0], _requestSize, _fileSize) != 0) {
+				reportFailure("read past end of file", -1);
+			}
+
+			dropFile(file);
+			return result;
+		}
+
+		// Grows an empty file to the file size in steps of the request size, as with a truncate
+		// or fallocate per request
+		BenchResult runSetSize() {
+			BenchResult result;
+			size_t steps = _fileSize / _requestSize;
+			result._latencies.reserve(steps * _options._iterations);
+			for (size_t iteration = 0; iteration < _options._iterations; ++iteration) {
+				LocalMemoryGridFile* file = new LocalMemoryGridFile("bench");
+
+				uint64_t allocationsBefore = allocationCount.load(boost::memory_order_relaxed);
+				uint64_t start = nowNanos();
+				for (size_t i = 1; i <= steps; ++i) {
+					uint64_t opStart = nowNanos();
+					bool status = file->setSize(i * _requestSize);
+					result._latencies.push_back(nowNanos() - opStart);
+					if (!status) {
+						reportFailure("setSize", -1);
+						break;
+					}
+				}
+
+				result._elapsedNanos += nowNanos() - start;
+				result._allocations += allocationCount.load(boost::memory_order_relaxed) - allocationsBefore;
+				result._ops += steps;
+				result._bytes += steps * _requestSize;
+
+				if (file->getSize() != steps * _requestSize) {
+					reportFailure("setSize", (int)file->getSize());
+				}
+
+				dropFile(file);
+			}
+
+			return result;
+		}
+
+		// Every operation builds the full file buffer handed to the server on flush
+		BenchResult runFlushBuffer() {
+			BenchResult result;
+			vector<char> source(_requestSize);
+			fillSource(source);
+
+			LocalMemoryGridFile* file = createFilledFile(source, _fileSize);
+			if (!verifyContent(*file, source, _fileSize)) {
+				_failed = true;
+			}
+
+			result._latencies.reserve(_options._iterations);
+			for (size_t iteration = 0; iteration < _options._iterations; ++iteration) {
+				size_t bufferLen = 0;
+				uint64_t allocationsBefore = allocationCount.load(boost::memory_order_relaxed);
+				uint64_t opStart = nowNanos();
+				{
+					boost::shared_array<char> buffer = LocalGridFileBench::createFlushBuffer(*file, bufferLen);
+				}
+				uint64_t elapsed = nowNanos() - opStart;
+
+				result._latencies.push_back(elapsed);
+				result._elapsedNanos += elapsed;
+				result._allocations += allocationCount.load(boost::memory_order_relaxed) - allocationsBefore;
+				result._ops += 1;
+				result._bytes += bufferLen;
+			}
+
+			dropFile(file);
+			return result;
+		}
+
+	private:
+		void reportFailure(const char* op, int rc) {
+			cerr << "Operation failed {op: " << op << ", chunkSize: " << _chunkSize << ", fileSize: " << _fileSize
+				<< ", requestSize: " << _requestSize << ", rc: " << rc << "}" << endl;
+			_failed = true;
+		}
+
+		const BenchOptions& _options;
+		size_t _chunkSize;
+		size_t _fileSize;
+		size_t _requestSize;
+		bool _failed;
+	};
+
+	double percentileMicros(const vector<uint64_t>& sorted, double percentile) {
+		if (sorted.empty()) {
+			return 0;
+		}
+
+		size_t index = (size_t)(percentile * (sorted.size() - 1) + 0.5);
+		return sorted[index] / 1000.0;
+	}
+
+	void printHeader() {
+		cout << left << setw(10) << "op" << setw(9) << "pattern" << right << setw(8) << "chunkKB"
+			<< setw(10) << "fileKB" << setw(7) << "reqKB" << setw(10) << "ops" << setw(13) << "ops/s"
+			<< setw(9) << "GB/s" << setw(11) << "allocs/op" << setw(10) << "p50(us)" << setw(10) << "p99(us)"
+			<< setw(10) << "p999(us)" << endl;
+	}
+
+	void printResult(const char* op, const char* pattern, size_t chunkSize, size_t fileSize, size_t requestSize,
+			BenchResult& result) {
+		sort(result._latencies.begin(), result._latencies.end());
+		double seconds = result._elapsedNanos / 1e9;
+		double opsPerSec = seconds > 0 ? result._ops / seconds : 0;
+		double gbPerSec = seconds > 0 ? result._bytes / seconds / (1024.0 * 1024.0 * 1024.0) : 0;
+		double allocsPerOp = result._ops ? (double)result._allocations / result._ops : 0;
+
+		cout << left << setw(10) << op << setw(9) << pattern << right << setw(8) << chunkSize / KB
+			<< setw(10) << fileSize / KB << setw(7) << requestSize / KB << setw(10) << result._ops
+			<< fixed << setprecision(0) << setw(13) << opsPerSec
+			<< setprecision(3) << setw(9) << gbPerSec
+			<< setprecision(2) << setw(11) << allocsPerOp
+			<< setw(10) << percentileMicros(result._latencies, 0.50)
+			<< setw(10) << percentileMicros(result._latencies, 0.99)
+			<< setw(10) << percentileMicros(result._latencies, 0.999) << endl;
+	}
+
+	bool parseSizeList(const string& value, vector<size_t>& sizes) {
+		sizes.clear();
+		stringstream ss(value);
+		string item;
+		while (getline(ss, item, ',')) {
+			char* end = NULL;
+			unsigned long size = strtoul(item.c_str(), &end, 10);
+			if (item.empty() || *end || !size) {
+				return false;
+			}
+
+			sizes.push_back(size);
+		}
+
+		return !sizes.empty();
+	}
+
+	bool parsePatternList(const string& value, vector<AccessPattern>& patterns) {
+		patterns.clear();
+		stringstream ss(value);
+		string item;
+		while (getline(ss, item, ',')) {
+			if (item == "seq") {
+				patterns.push_back(AP_SEQUENTIAL);
+			} else if (item == "random") {
+				patterns.push_back(AP_RANDOM);
+			} else if (item == "strided") {
+				patterns.push_back(AP_STRIDED);
+			} else {
+				return false;
+			}
+		}
+
+		return !patterns.empty();
+	}
+
+	void printHelp(const char* program) {
+		cout << "usage: " << program << " [options]" << endl
+			<< endl
+			<< "Benchmarks the in-memory local grid file buffers without fuse or mongod." << endl
+			<< endl
+			<< "Options:" << endl
+			<< " --memChunkSize=<list>      Comma separated chunk sizes in KB, defaults to 64,128,1024" << endl
+			<< " --fileSize=<list>          Comma separated file sizes in KB, defaults to 1024,16384" << endl
+			<< " --requestSize=<list>       Comma separated request sizes in KB, defaults to 4,128" << endl
+			<< " --pattern=<list>           Comma separated access patterns out of seq, random, strided," << endl
+			<< "                            defaults to all of them" << endl
+			<< " --iterations=<num>         Times each case is repeated, defaults to 5" << endl
+			<< " --seed=<num>               Seed for the random offsets, defaults to 42" << endl
+			<< " --help                     Prints this help" << endl;
+	}
+
+	bool parseOptions(int argc, char* argv[], BenchOptions& options) {
+		parseSizeList("64,128,1024", options._chunkSizes);
+		parseSizeList("1024,16384", options._fileSizes);
+		parseSizeList("4,128", options._requestSizes);
+		parsePatternList("seq,random,strided", options._patterns);
+
+		for (int i = 1; i < argc; ++i) {
+			string arg = argv[i];
+			size_t pos = arg.find('=');
+			string name = arg.substr(0, pos);
+			string value = (pos == string::npos) ? "" : arg.substr(pos + 1);
+
+			bool valid = true;
+			if (name == "--memChunkSize") {
+				valid = parseSizeList(value, options._chunkSizes);
+			} else if (name == "--fileSize") {
+				valid = parseSizeList(value, options._fileSizes);
+			} else if (name == "--requestSize") {
+				valid = parseSizeList(value, options._requestSizes);
+			} else if (name == "--pattern") {
+				valid = parsePatternList(value, options._patterns);
+			} else if (name == "--iterations") {
+				options._iterations = strtoul(value.c_str(), NULL, 10);
+				valid = options._iterations > 0;
+			} else if (name == "--seed") {
+				options._seed = strtoul(value.c_str(), NULL, 10);
+			} else {
+				valid = false;
+			}
+
+			if (!valid) {
+				cerr << "Invalid option {option: " << arg << "}" << endl;
+				return false;
+			}
+		}
+
+		for (size_t i = 0; i < options._chunkSizes.size(); ++i) {
+			options._chunkSizes[i] *= KB;
+		}
+
+		for (size_t i = 0; i < options._fileSizes.size(); ++i) {
+			options._fileSizes[i] *= KB;
+		}
+
+		for (size_t i = 0; i < options._requestSizes.size(); ++i) {
+			options._requestSizes[i] *= KB;
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char* argv[], char* arge[]) {
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+			printHelp(argv[0]);
+			return 0;
+		}
+	}
+
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printHelp(argv[0]);
+		return 1;
+	}
+
+	// Messages of the buffer layer would otherwise end up in the timings
+	FSLogManager::get().setLogLevel(LL_ERROR);
+
+	size_t maxFileSize = *max_element(options._fileSizes.begin(), options._fileSizes.end());
+	bool failed = false;
+	printHeader();
+	for (size_t c = 0; c < options._chunkSizes.size(); ++c) {
+		size_t chunkSize = options._chunkSizes[c];
+
+		// The files are sized by the benchmark, not by the limits of the mounted file system
+		globalFSOptions._memChunkSize = chunkSize;
+		globalFSOptions._maxMemFileChunks = maxFileSize / chunkSize + 2;
+		globalFSOptions._maxMemFileSize = globalFSOptions._maxMemFileChunks * chunkSize;
+
+		for (size_t f = 0; f < options._fileSizes.size(); ++f) {
+			size_t fileSize = options._fileSizes[f];
+			for (size_t r = 0; r < options._requestSizes.size(); ++r) {
+				size_t requestSize = options._requestSizes[r];
+				if (requestSize > fileSize || fileSize % requestSize) {
+					cerr << "Skipping file size that is not a multiple of the request size {fileSize: "
+						<< fileSize << ", requestSize: " << requestSize << "}" << endl;
+					continue;
+				}
+
+				BenchCase benchCase(options, chunkSize, fileSize, requestSize);
+				for (size_t p = 0; p < options._patterns.size(); ++p) {
+					AccessPattern pattern = options._patterns[p];
+					BenchResult writeResult = benchCase.runWrite(pattern);
+					printResult("write", patternToString(pattern), chunkSize, fileSize, requestSize, writeResult);
+
+					BenchResult readResult = benchCase.runRead(pattern);
+					printResult("read", patternToString(pattern), chunkSize, fileSize, requestSize, readResult);
+				}
+
+				BenchResult setSizeResult = benchCase.runSetSize();
+				printResult("setSize", "seq", chunkSize, fileSize, requestSize, setSizeResult);
+				failed = failed || benchCase.hasFailed();
+			}
+
+			BenchCase flushCase(options, chunkSize, fileSize, fileSize);
+			BenchResult flushResult = flushCase.runFlushBuffer();
+			printResult("flushBuf", "-", chunkSize, fileSize, fileSize, flushResult);
+			failed = failed || flushCase.hasFailed();
+		}
+	}
+
+	if (failed) {
+		cerr << "Benchmark run had failures, the numbers above are not valid." << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+#include "buffer_budget.h"
+#include "fs_logger.h"
+#include "fs_stats.h"
+#include "local_gridfs.h"
+#include "work_queue.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread_time.hpp>
+
+using namespace mgridfs;
+using namespace std;
+
+namespace {
+	// Throttled reservations re-check for idle files to reclaim at least this often
+	const size_t RECLAIM_RETRY_MILLIS = 100;
+}
+
+BufferBudget::BufferBudget()
+	: _used(0), _limit(0), _highWatermark(0), _lowWatermark(0), _throttleMillis(0), _reclaiming(false),
+	_throttled(0), _throttleMicros(0), _failed(0), _reclaims(0), _reclaimedBytes(0) {
+}
+
+BufferBudget& BufferBudget::get() {
+	static BufferBudget instance;
+	return instance;
+}
+
+void BufferBudget::configure(size_t limit, size_t highWatermark, size_t lowWatermark, size_t throttleMillis) {
+	boost::mutex::scoped_lock lock(_lock);
+	_limit = limit;
+	_highWatermark = limit / 100 * highWatermark;
+	_lowWatermark = limit / 100 * lowWatermark;
+	_throttleMillis = throttleMillis;
+
+	// The limit may have been raised for the waiting reservations
+	_released.notify_all();
+}
+
+bool BufferBudget::isOverHighWatermark() const {
+	return _limit && _used > _highWatermark;
+}
+
+bool BufferBudget::needsReclaim() {
+	if (_reclaiming || !isOverHighWatermark()) {
+		return false;
+	}
+
+	_reclaiming = true;
+	return true;
+}
+
+bool BufferBudget::reserve(size_t bytes) {
+	boost::mutex::scoped_lock lock(_lock);
+	if (_limit && _used + bytes > _limit) {
+		// Over the limit, wait for the reclaim or the files being closed to make room. Reclaim never
+		// waits for a file in use, so the file of the caller is never waited on.
+		uint64_t startMicros = FSStats::nowMicros();
+		boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(_throttleMillis);
+		bool timedOut = false;
+		++_throttled;
+		while (_limit && _used + bytes > _limit && !timedOut) {
+			if (!_reclaiming) {
+				_reclaiming = true;
+				lock.unlock();
+				startReclaim();
+				lock.lock();
+				if (!_limit || _used + bytes <= _limit) {
+					break;
+				}
+			}
+
+			// Reclaim in progress or without anything left to free, wait for it or for files being
+			// closed before trying again
+			boost::system_time retryTime = boost::get_system_time() + boost::posix_time::milliseconds(RECLAIM_RETRY_MILLIS);
+			_released.timed_wait(lock, min(retryTime, deadline));
+			timedOut = boost::get_system_time() >= deadline;
+		}
+
+		uint64_t waitMicros = FSStats::nowMicros() - startMicros;
+		_throttleMicros += waitMicros;
+		if (_limit && _used + bytes > _limit) {
+			++_failed;
+			warn() << "Out of memory for local file buffers {requested: " << bytes << ", used: " << _used
+				<< ", limit: " << _limit << ", waitedMillis: " << waitMicros / 1000 << "}" << endl;
+			return false;
+		}
+
+		debug() << "Throttled local file buffer allocation {requested: " << bytes << ", used: " << _used
+			<< ", limit: " << _limit << ", waitedMicros: " << waitMicros << "}" << endl;
+	}
+
+	_used += bytes;
+	if (needsReclaim()) {
+		lock.unlock();
+		startReclaim();
+	}
+
+	return true;
+}
+
+void BufferBudget::release(size_t bytes) {
+	boost::mutex::scoped_lock lock(_lock);
+	_used = (bytes < _used) ? _used - bytes : 0;
+	_released.notify_all();
+}
+
+void BufferBudget::startReclaim() {
+	// Runs inline if the work queue is full or has not been started, where it still cannot wait for
+	// the file of the caller, as files in use are skipped
+	if (!FSWorkQueue::get().trySubmit(boost::bind(&BufferBudget::reclaim, this))) {
+		reclaim();
+	}
+}
+
+int BufferBudget::reclaim() {
+	size_t excess = 0;
+	{
+		boost::mutex::scoped_lock lock(_lock);
+		excess = (_used > _lowWatermark) ? _used - _lowWatermark : 0;
+	}
+
+	size_t reclaimed = excess ? LocalGridFS::get().reclaimBuffers(excess) : 0;
+
+	boost::mutex::scoped_lock lock(_lock);
+	_reclaiming = false;
+	++_reclaims;
+	_reclaimedBytes += reclaimed;
+	debug() << "Reclaimed local file buffers {requested: " << excess << ", reclaimed: " << reclaimed
+		<< ", used: " << _used << ", limit: " << _limit << "}" << endl;
+	return 0;
+}
+
+void BufferBudget::getStats(BufferBudgetStats& stats) const {
+	boost::mutex::scoped_lock lock(_lock);
+	stats._usedBytes = _used;
+	stats._limitBytes = _limit;
+	stats._throttled = _throttled;
+	stats._throttleMicros = _throttleMicros;
+	stats._failed = _failed;
+	stats._reclaims = _reclaims;
+	stats._reclaimedBytes = _reclaimedBytes;
+}
@@ -0,0 +1,77 @@
+#ifndef mgridfs_buffer_budget_h
+#define mgridfs_buffer_budget_h
+
+#include <stdint.h>
+#include <cstddef>
+
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace mgridfs {
+
+struct BufferBudgetStats {
+	size_t _usedBytes;
+	size_t _limitBytes;
+	uint64_t _throttled; // Reservations that had to wait for memory
+	uint64_t _throttleMicros;
+	uint64_t _failed; // Reservations that gave up waiting
+	uint64_t _reclaims;
+	uint64_t _reclaimedBytes;
+};
+
+/**
+ * Process-wide accounting of the memory held by the buffers of the local files.
+ *
+ * Crossing the high watermark starts a reclaim in the background, which flushes the largest
+ * open files and frees their buffers until the usage is back under the low watermark. Files
+ * whose buffers have been freed reload them from the server on their next access. Reservations
+ * that would take the usage over the limit wait for the reclaim or for files to be closed, and
+ * only fail once they have waited for the throttle time.
+ *
+ * Until configured, or with a limit of 0, the usage is only accounted and never limited.
+ */
+class BufferBudget : protected boost::noncopyable {
+public:
+	static BufferBudget& get();
+
+	// Limit in bytes, watermarks in percent of the limit
+	void configure(size_t limit, size_t highWatermark, size_t lowWatermark, size_t throttleMillis);
+
+	// Accounts for the buffers about to be allocated, blocking while there is no room for them.
+	// Returns false if there still was no room after the throttle time, nothing is accounted then.
+	bool reserve(size_t bytes);
+	void release(size_t bytes);
+
+	void getStats(BufferBudgetStats& stats) const;
+
+private:
+	BufferBudget();
+
+	mutable boost::mutex _lock;
+	boost::condition_variable _released;
+
+	size_t _used;
+	size_t _limit;
+	size_t _highWatermark;
+	size_t _lowWatermark;
+	size_t _throttleMillis;
+	bool _reclaiming;
+
+	uint64_t _throttled;
+	uint64_t _throttleMicros;
+	uint64_t _failed;
+	uint64_t _reclaims;
+	uint64_t _reclaimedBytes;
+
+	// Expect the lock to be held
+	bool isOverHighWatermark() const;
+	bool needsReclaim();
+
+	void startReclaim();
+	int reclaim();
+};
+
+}
+
+#endif
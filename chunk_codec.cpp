@@ -0,0 +1,118 @@
+#include "chunk_codec.h"
+#include "fs_logger.h"
+
+#include <cmath>
+
+#include <zlib.h>
+
+using namespace mgridfs;
+
+namespace {
+	// Chunks looking more random than this are not worth compressing, compressed / encrypted
+	// data samples at 7.9 and over while text and most binaries stay well under 7
+	const double MAX_COMPRESSIBLE_ENTROPY = 7.5;
+
+	// Probe samples these many windows spread evenly over the chunk
+	const size_t PROBE_WINDOWS = 16;
+	const size_t PROBE_WINDOW_SIZE = 256;
+
+	// Too small to save anything worth the fields marking the chunk as compressed
+	const size_t MIN_COMPRESSED_CHUNK = 512;
+}
+
+const char* const ChunkCodec::FORMAT = "zlib";
+
+ChunkCodec::ChunkCodec() {
+	_stats._compressedChunks = 0;
+	_stats._probeSkippedChunks = 0;
+	_stats._incompressibleChunks = 0;
+	_stats._rawBytes = 0;
+	_stats._storedBytes = 0;
+	_stats._decompressedChunks = 0;
+	_stats._failures = 0;
+}
+
+ChunkCodec& ChunkCodec::get() {
+	static ChunkCodec instance;
+	return instance;
+}
+
+double ChunkCodec::estimateEntropy(const char* data, size_t len) {
+	size_t counts[256] = { 0 };
+	size_t sampled = 0;
+	if (len <= PROBE_WINDOWS * PROBE_WINDOW_SIZE) {
+		for (size_t i = 0; i < len; ++i) {
+			++counts[(unsigned char)data[i]];
+		}
+		sampled = len;
+	} else {
+		size_t stride = (len - PROBE_WINDOW_SIZE) / (PROBE_WINDOWS - 1);
+		for (size_t w = 0; w < PROBE_WINDOWS; ++w) {
+			const char* window = data + w * stride;
+			for (size_t i = 0; i < PROBE_WINDOW_SIZE; ++i) {
+				++counts[(unsigned char)window[i]];
+			}
+		}
+		sampled = PROBE_WINDOWS * PROBE_WINDOW_SIZE;
+	}
+
+	double entropy = 0;
+	for (size_t b = 0; b < 256; ++b) {
+		if (counts[b]) {
+			double p = (double)counts[b] / sampled;
+			entropy -= p * log(p) / log(2.0);
+		}
+	}
+	return entropy;
+}
+
+bool ChunkCodec::compress(const char* data, size_t len, string& compressed) {
+	if (len < MIN_COMPRESSED_CHUNK) {
+		return false;
+	}
+
+	if (estimateEntropy(data, len) > MAX_COMPRESSIBLE_ENTROPY) {
+		boost::mutex::scoped_lock lock(_lock);
+		++_stats._probeSkippedChunks;
+		return false;
+	}
+
+	// Output is bounded to what would be worth storing, a chunk not fitting is incompressible
+	uLongf compressedLen = len - len / 8;
+	compressed.resize(compressedLen);
+	int zRetCode = compress2((Bytef*)&compressed[0], &compressedLen, (const Bytef*)data, len, Z_BEST_SPEED);
+	if (zRetCode != Z_OK) {
+		boost::mutex::scoped_lock lock(_lock);
+		++(zRetCode == Z_BUF_ERROR ? _stats._incompressibleChunks : _stats._failures);
+		return false;
+	}
+
+	compressed.resize(compressedLen);
+	boost::mutex::scoped_lock lock(_lock);
+	++_stats._compressedChunks;
+	_stats._rawBytes += len;
+	_stats._storedBytes += compressedLen;
+	return true;
+}
+
+bool ChunkCodec::decompress(const char* data, size_t len, size_t rawLen, string& raw) {
+	raw.resize(rawLen);
+	uLongf inflatedLen = rawLen;
+	int zRetCode = rawLen ? uncompress((Bytef*)&raw[0], &inflatedLen, (const Bytef*)data, len) : Z_DATA_ERROR;
+	if (zRetCode != Z_OK || inflatedLen != rawLen) {
+		error() << "Failed to decompress chunk {len: " << len << ", rawLength: " << rawLen << ", zlibCode: " << zRetCode
+			<< ", inflated: " << inflatedLen << "}" << endl;
+		boost::mutex::scoped_lock lock(_lock);
+		++_stats._failures;
+		return false;
+	}
+
+	boost::mutex::scoped_lock lock(_lock);
+	++_stats._decompressedChunks;
+	return true;
+}
+
+void ChunkCodec::getStats(ChunkCodecStats& stats) const {
+	boost::mutex::scoped_lock lock(_lock);
+	stats = _stats;
+}
@@ -0,0 +1,61 @@
+#ifndef mgridfs_chunk_codec_h
+#define mgridfs_chunk_codec_h
+
+#include <stdint.h>
+#include <cstddef>
+
+#include <string>
+
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+
+using namespace std;
+
+namespace mgridfs {
+
+struct ChunkCodecStats {
+	uint64_t _compressedChunks;
+	uint64_t _probeSkippedChunks; // Left as they are on the entropy probe alone
+	uint64_t _incompressibleChunks; // Compressed without saving enough to be worth it
+	uint64_t _rawBytes; // Of the chunks compressed
+	uint64_t _storedBytes; // Compressed size of the same chunks
+	uint64_t _decompressedChunks;
+	uint64_t _failures; // Chunks that could not be compressed / decompressed
+};
+
+/**
+ * Compression of the chunk payloads stored with --compress, zlib at its fastest level.
+ *
+ * Chunks that would not compress are left as they are: an entropy probe over a sample of the
+ * chunk skips the ones that look already compressed or random (media, archives, encrypted data)
+ * without running the compressor, and the chunks compressing by less than an eighth are stored
+ * uncompressed as well. The decision is per chunk, readers go by the fields of every chunk.
+ */
+class ChunkCodec : protected boost::noncopyable {
+public:
+	static ChunkCodec& get();
+
+	// Value of the compression fields of the chunks and files compressed
+	static const char* const FORMAT;
+
+	// Returns whether the chunk was compressed into compressed, false if it is better stored as it is
+	bool compress(const char* data, size_t len, string& compressed);
+
+	// Returns false if the data is corrupt or does not inflate to exactly rawLen bytes
+	bool decompress(const char* data, size_t len, size_t rawLen, string& raw);
+
+	// Shannon entropy in bits per byte of a sample spread over the data
+	static double estimateEntropy(const char* data, size_t len);
+
+	void getStats(ChunkCodecStats& stats) const;
+
+private:
+	ChunkCodec();
+
+	mutable boost::mutex _lock;
+	ChunkCodecStats _stats;
+};
+
+}
+
+#endif
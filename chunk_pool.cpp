@@ -0,0 +1,268 @@
+#include "chunk_pool.h"
+#include "fs_logger.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace mgridfs;
+
+namespace {
+	// Slabs hold at least one chunk and otherwise as many chunks as fit this size
+	const size_t SLAB_BYTES = 2 * 1024 * 1024;
+
+	// Chunks at least this large are backed by huge pages if enabled, with the slabs aligned to them
+	const size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+	const size_t HUGE_PAGE_MIN_CHUNK_BYTES = 1024 * 1024;
+
+	// Free chunks kept by each thread, per chunk size and for that many chunk sizes
+	const size_t THREAD_CACHE_BYTES = 1024 * 1024;
+	const size_t THREAD_CACHE_CLASSES = 4;
+
+	size_t roundUp(size_t value, size_t multiple) {
+		return (value + multiple - 1) / multiple * multiple;
+	}
+
+	size_t getThreadCacheChunks(size_t chunkSize) {
+		return max((size_t)1, THREAD_CACHE_BYTES / chunkSize);
+	}
+}
+
+struct ChunkPool::ThreadCache {
+	struct Entry {
+		Entry() : _chunkSize(0) {}
+
+		size_t _chunkSize;
+		vector<char*> _chunks;
+	};
+
+	Entry _entries[THREAD_CACHE_CLASSES];
+
+	// NULL if the thread already caches as many other chunk sizes
+	Entry* getEntry(size_t chunkSize) {
+		Entry* unused = NULL;
+		for (size_t i = 0; i < THREAD_CACHE_CLASSES; ++i) {
+			if (_entries[i]._chunkSize == chunkSize) {
+				return &_entries[i];
+			} else if (!unused && _entries[i]._chunks.empty()) {
+				unused = &_entries[i];
+			}
+		}
+
+		if (unused) {
+			unused->_chunkSize = chunkSize;
+		}
+		return unused;
+	}
+};
+
+ChunkPool::ChunkPool()
+	: _retainBytes((size_t)-1), _hugePages(false), _mappedBytes(0), _freeBytes(0), _releasedBytes(0), _slabs(0),
+	_threadCache(&ChunkPool::retireThreadCache) {
+	_threadCachedBytes.store(0);
+	_allocations.store(0);
+	_threadCacheHits.store(0);
+}
+
+ChunkPool::~ChunkPool() {
+	// Slabs stay mapped until the process exits, chunks may still be referenced by static objects
+}
+
+ChunkPool& ChunkPool::get() {
+	static ChunkPool instance;
+	return instance;
+}
+
+void ChunkPool::configure(size_t retainBytes, bool hugePages) {
+	boost::mutex::scoped_lock lock(_lock);
+	_retainBytes = retainBytes;
+	_hugePages = hugePages;
+	releaseLocked(_retainBytes);
+}
+
+ChunkPool::SizeClass& ChunkPool::getSizeClass(size_t chunkSize) {
+	// Chunk size is the same for all the files unless changed live, there are only a handful of them
+	for (vector<SizeClass*>::const_iterator cIt = _classes.begin(); cIt != _classes.end(); ++cIt) {
+		if ((*cIt)->_chunkSize == chunkSize) {
+			return **cIt;
+		}
+	}
+
+	_classes.push_back(new SizeClass(chunkSize));
+	return *_classes.back();
+}
+
+bool ChunkPool::mapSlab(SizeClass& sizeClass) {
+	size_t chunkSize = sizeClass._chunkSize;
+	size_t chunkCount = max((size_t)1, SLAB_BYTES / chunkSize);
+	bool hugePages = _hugePages && chunkSize >= HUGE_PAGE_MIN_CHUNK_BYTES;
+	size_t slabBytes = roundUp(chunkCount * chunkSize, hugePages ? HUGE_PAGE_BYTES : sysconf(_SC_PAGESIZE));
+
+	// Huge pages need the slab to be aligned to them, map an extra huge page and trim to alignment
+	size_t mapBytes = hugePages ? slabBytes + HUGE_PAGE_BYTES : slabBytes;
+	void* mapped = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED) {
+		error() << "Failed to map chunk slab {chunkSize: " << chunkSize << ", bytes: " << mapBytes
+			<< ", errno: " << errno << "}" << endl;
+		return false;
+	}
+
+	char* slab = (char*)mapped;
+	if (hugePages) {
+		char* aligned = (char*)roundUp((size_t)slab, HUGE_PAGE_BYTES);
+		if (aligned > slab) {
+			munmap(slab, aligned - slab);
+		}
+		munmap(aligned + slabBytes, (slab + mapBytes) - (aligned + slabBytes));
+		slab = aligned;
+#ifdef MADV_HUGEPAGE
+		madvise(slab, slabBytes, MADV_HUGEPAGE);
+#endif
+	}
+
+	for (size_t i = chunkCount; i > 0; --i) {
+		sizeClass._free.push_back(slab + (i - 1) * chunkSize);
+	}
+
+	++sizeClass._slabs;
+	++_slabs;
+	_mappedBytes += chunkCount * chunkSize;
+	_freeBytes += chunkCount * chunkSize;
+	debug() << "Mapped chunk slab {chunkSize: " << chunkSize << ", chunks: " << chunkCount << ", bytes: " << slabBytes
+		<< ", hugePages: " << hugePages << ", slabs: " << sizeClass._slabs << "}" << endl;
+	return true;
+}
+
+char* ChunkPool::allocateLocked(SizeClass& sizeClass) {
+	if (sizeClass._free.empty() && !sizeClass._released.empty()) {
+		char* chunk = sizeClass._released.back();
+		sizeClass._released.pop_back();
+		_releasedBytes -= sizeClass._chunkSize;
+		return chunk;
+	}
+
+	if (sizeClass._free.empty() && !mapSlab(sizeClass)) {
+		return NULL;
+	}
+
+	char* chunk = sizeClass._free.back();
+	sizeClass._free.pop_back();
+	_freeBytes -= sizeClass._chunkSize;
+	return chunk;
+}
+
+void ChunkPool::freeLocked(SizeClass& sizeClass, char* chunk) {
+	sizeClass._free.push_back(chunk);
+	_freeBytes += sizeClass._chunkSize;
+}
+
+void ChunkPool::releaseLocked(size_t retainBytes) {
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	for (vector<SizeClass*>::const_iterator cIt = _classes.begin(); cIt != _classes.end() && _freeBytes > retainBytes; ++cIt) {
+		SizeClass& sizeClass = **cIt;
+		while (!sizeClass._free.empty() && _freeBytes > retainBytes) {
+			// The most recently freed chunks are the most likely to be reused, release the oldest
+			char* chunk = sizeClass._free.front();
+			sizeClass._free.pop_front();
+
+			// Only the pages entirely within the chunk can be dropped, the rest is shared with the
+			// neighbouring chunks
+			char* first = (char*)roundUp((size_t)chunk, pageSize);
+			char* end = (char*)((size_t)(chunk + sizeClass._chunkSize) / pageSize * pageSize);
+			if (end > first) {
+				madvise(first, end - first, MADV_DONTNEED);
+			}
+
+			sizeClass._released.push_back(chunk);
+			_freeBytes -= sizeClass._chunkSize;
+			_releasedBytes += sizeClass._chunkSize;
+		}
+	}
+}
+
+char* ChunkPool::allocate(size_t chunkSize) {
+	_allocations.fetch_add(1, boost::memory_order_relaxed);
+
+	ThreadCache* cache = _threadCache.get();
+	if (!cache) {
+		cache = new ThreadCache();
+		_threadCache.reset(cache);
+	}
+
+	ThreadCache::Entry* entry = cache->getEntry(chunkSize);
+	if (entry && !entry->_chunks.empty()) {
+		char* chunk = entry->_chunks.back();
+		entry->_chunks.pop_back();
+		_threadCachedBytes.fetch_sub(chunkSize, boost::memory_order_relaxed);
+		_threadCacheHits.fetch_add(1, boost::memory_order_relaxed);
+		return chunk;
+	}
+
+	boost::mutex::scoped_lock lock(_lock);
+	return allocateLocked(getSizeClass(chunkSize));
+}
+
+void ChunkPool::free(char* chunk, size_t chunkSize) {
+	if (!chunk) {
+		return;
+	}
+
+	ThreadCache* cache = _threadCache.get();
+	if (!cache) {
+		cache = new ThreadCache();
+		_threadCache.reset(cache);
+	}
+
+	ThreadCache::Entry* entry = cache->getEntry(chunkSize);
+	if (entry && entry->_chunks.size() < getThreadCacheChunks(chunkSize)) {
+		entry->_chunks.push_back(chunk);
+		_threadCachedBytes.fetch_add(chunkSize, boost::memory_order_relaxed);
+		return;
+	}
+
+	boost::mutex::scoped_lock lock(_lock);
+	freeLocked(getSizeClass(chunkSize), chunk);
+	releaseLocked(_retainBytes);
+}
+
+void ChunkPool::trim() {
+	boost::mutex::scoped_lock lock(_lock);
+	releaseLocked(0);
+	info() << "Trimmed chunk pool {mapped: " << _mappedBytes << ", released: " << _releasedBytes << "}" << endl;
+}
+
+void ChunkPool::retireThreadCache(ThreadCache* cache) {
+	ChunkPool& pool = ChunkPool::get();
+	{
+		boost::mutex::scoped_lock lock(pool._lock);
+		for (size_t i = 0; i < THREAD_CACHE_CLASSES; ++i) {
+			ThreadCache::Entry& entry = cache->_entries[i];
+			if (entry._chunks.empty()) {
+				continue;
+			}
+
+			SizeClass& sizeClass = pool.getSizeClass(entry._chunkSize);
+			for (vector<char*>::const_iterator cIt = entry._chunks.begin(); cIt != entry._chunks.end(); ++cIt) {
+				pool.freeLocked(sizeClass, *cIt);
+			}
+			pool._threadCachedBytes.fetch_sub(entry._chunks.size() * entry._chunkSize, boost::memory_order_relaxed);
+		}
+		pool.releaseLocked(pool._retainBytes);
+	}
+
+	delete cache;
+}
+
+void ChunkPool::getStats(ChunkPoolStats& stats) const {
+	boost::mutex::scoped_lock lock(_lock);
+	stats._mappedBytes = _mappedBytes;
+	stats._freeBytes = _freeBytes;
+	stats._releasedBytes = _releasedBytes;
+	stats._threadCachedBytes = _threadCachedBytes.load(boost::memory_order_relaxed);
+	stats._inUseBytes = _mappedBytes - min(_mappedBytes, _freeBytes + _releasedBytes + stats._threadCachedBytes);
+	stats._slabs = _slabs;
+	stats._allocations = _allocations.load(boost::memory_order_relaxed);
+	stats._threadCacheHits = _threadCacheHits.load(boost::memory_order_relaxed);
+}
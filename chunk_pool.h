@@ -0,0 +1,101 @@
+#ifndef mgridfs_chunk_pool_h
+#define mgridfs_chunk_pool_h
+
+#include <stdint.h>
+#include <cstddef>
+
+#include <deque>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+using namespace std;
+
+namespace mgridfs {
+
+struct ChunkPoolStats {
+	size_t _mappedBytes; // Slabs mapped from the system
+	size_t _inUseBytes; // Chunks held by the local files
+	size_t _freeBytes; // Free chunks kept resident for reuse
+	size_t _threadCachedBytes; // Free chunks kept by the threads
+	size_t _releasedBytes; // Free chunks whose memory has been returned to the system
+	uint64_t _slabs;
+	uint64_t _allocations;
+	uint64_t _threadCacheHits;
+};
+
+/**
+ * Pool of the buffers of the local files, so that the open / write / close of many files does
+ * not go through malloc for every chunk and fragment the heap over time.
+ *
+ * Chunks of every chunk size are carved out of slabs mapped from the system and are never
+ * returned to malloc. Each thread keeps a few free chunks of its own for allocations without
+ * any locking, the rest are shared by all the threads. Free chunks over the retained amount have
+ * their memory returned to the system, keeping only the address space for reuse. Optionally the
+ * slabs of large chunks are backed by transparent huge pages.
+ */
+class ChunkPool : protected boost::noncopyable {
+public:
+	static ChunkPool& get();
+
+	// Until configured, all the free chunks are retained and huge pages are not used
+	void configure(size_t retainBytes, bool hugePages);
+
+	// Returns NULL if no more memory could be mapped
+	char* allocate(size_t chunkSize);
+
+	// The chunk size has to be the one the chunk has been allocated for
+	void free(char* chunk, size_t chunkSize);
+
+	// Returns the memory of all the free chunks not kept by the threads to the system
+	void trim();
+
+	void getStats(ChunkPoolStats& stats) const;
+
+private:
+	ChunkPool();
+	~ChunkPool();
+
+	struct SizeClass {
+		SizeClass(size_t chunkSize) : _chunkSize(chunkSize), _slabs(0) {}
+
+		size_t _chunkSize;
+		deque<char*> _free; // Resident, reused most recently freed first
+		vector<char*> _released; // Memory returned to the system, faulted back in on use
+		size_t _slabs;
+	};
+
+	struct ThreadCache;
+
+	mutable boost::mutex _lock;
+	vector<SizeClass*> _classes;
+	size_t _retainBytes;
+	bool _hugePages;
+
+	// Following are guarded by the lock
+	size_t _mappedBytes;
+	size_t _freeBytes;
+	size_t _releasedBytes;
+	uint64_t _slabs;
+
+	boost::atomic<size_t> _threadCachedBytes;
+	boost::atomic<uint64_t> _allocations;
+	boost::atomic<uint64_t> _threadCacheHits;
+
+	boost::thread_specific_ptr<ThreadCache> _threadCache;
+
+	static void retireThreadCache(ThreadCache* cache);
+
+	// Following expect the lock to be held
+	SizeClass& getSizeClass(size_t chunkSize);
+	bool mapSlab(SizeClass& sizeClass);
+	char* allocateLocked(SizeClass& sizeClass);
+	void freeLocked(SizeClass& sizeClass, char* chunk);
+	void releaseLocked(size_t retainBytes);
+};
+
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include "chunk_reaper.h"
+#include "fs_connection.h"
+#include "fs_logger.h"
+#include "fs_options.h"
+#include "storage_backend.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <mongo/util/time_support.h>
+
+using namespace mgridfs;
+using namespace mongo;
+
+namespace {
+	// Chunks per second are removed in passes of this interval
+	const size_t REAP_INTERVAL_MILLIS = 1000;
+}
+
+FSChunkReaper::FSChunkReaper()
+	: _running(false) {
+	_stats._reapedChunks = 0;
+	_stats._passes = 0;
+	_stats._failed = 0;
+}
+
+FSChunkReaper::~FSChunkReaper() {
+	stop();
+}
+
+FSChunkReaper& FSChunkReaper::get() {
+	static FSChunkReaper instance;
+	return instance;
+}
+
+void FSChunkReaper::start() {
+	boost::mutex::scoped_lock lock(_lock);
+	if (_thread) {
+		return;
+	}
+
+	_running = true;
+	_thread.reset(new boost::thread(boost::bind(&FSChunkReaper::reapLoop, this)));
+	info() << "Started chunk reaper {delaySecs: " << globalFSOptions._gcDelaySecs << ", chunksPerSec: "
+		<< globalFSOptions._gcChunksPerSec << "}" << endl;
+}
+
+void FSChunkReaper::stop() {
+	boost::scoped_ptr<boost::thread> thread;
+	{
+		boost::mutex::scoped_lock lock(_lock);
+		if (!_thread) {
+			return;
+		}
+
+		_running = false;
+		_thread.swap(thread);
+		_wakeup.notify_one();
+	}
+
+	thread->join();
+	info() << "Stopped chunk reaper" << endl;
+}
+
+void FSChunkReaper::reapLoop() {
+	// Removals borrow connections in the same way as the work queue threads
+	FSConnectionManager::get().setAuxiliaryThread();
+
+	for (;;) {
+		{
+			boost::mutex::scoped_lock lock(_lock);
+			boost::system_time wakeupTime = boost::get_system_time() + boost::posix_time::milliseconds(REAP_INTERVAL_MILLIS);
+			while (_running && boost::get_system_time() < wakeupTime) {
+				_wakeup.timed_wait(lock, wakeupTime);
+			}
+
+			if (!_running) {
+				return;
+			}
+		}
+
+		reap();
+	}
+}
+
+int FSChunkReaper::reap() {
+	Date_t queuedBefore(jsTime().millis - (unsigned long long)globalFSOptions._gcDelaySecs * 1000);
+	int maxChunks = globalFSOptions._gcChunksPerSec * REAP_INTERVAL_MILLIS / 1000;
+
+	int reaped = 0;
+	try {
+		reaped = StorageBackend::get().reapChunks(queuedBefore, maxChunks);
+	} catch (DBException& e) {
+		// Queue is left as it was, the chunks are removed on a later pass
+		warn() << "Caught exception in removing queued chunks {code: " << e.getCode() << ", what: " << e.what() << "}" << endl;
+		boost::mutex::scoped_lock lock(_lock);
+		++_stats._failed;
+		return 0;
+	}
+
+	if (reaped) {
+		debug() << "Removed queued chunks {chunks: " << reaped << ", maxChunks: " << maxChunks << "}" << endl;
+		boost::mutex::scoped_lock lock(_lock);
+		_stats._reapedChunks += reaped;
+		++_stats._passes;
+	}
+	return reaped;
+}
+
+void FSChunkReaper::getStats(ChunkReaperStats& stats) const {
+	boost::mutex::scoped_lock lock(_lock);
+	stats = _stats;
+}
@@ -0,0 +1,57 @@
+#ifndef mgridfs_chunk_reaper_h
+#define mgridfs_chunk_reaper_h
+
+#include <stdint.h>
+
+#include <boost/utility.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace mgridfs {
+
+struct ChunkReaperStats {
+	uint64_t _reapedChunks;
+	uint64_t _passes; // Ones that found chunks to remove
+	uint64_t _failed;
+};
+
+/**
+ * Background removal of the chunks of the files unlinked and of the versions replaced by a flush.
+ *
+ * Removing a file only removes its document and queues its chunks on the server (see
+ * StorageBackend::reapChunks), so that unlinking large files neither blocks nor loads the server
+ * with deletes. Once a second the chunks queued for longer than --gcDelaySecs are removed, no
+ * more than --gcChunksPerSec of them. The delay lets the readers that found a file before it
+ * was removed or replaced finish fetching its chunks.
+ */
+class FSChunkReaper : protected boost::noncopyable {
+public:
+	static FSChunkReaper& get();
+
+	void start();
+	void stop();
+
+	// Runs a single pass on the calling thread, returns the chunks removed
+	int reap();
+
+	void getStats(ChunkReaperStats& stats) const;
+
+private:
+	FSChunkReaper();
+	~FSChunkReaper();
+
+	mutable boost::mutex _lock;
+	boost::condition_variable _wakeup;
+	boost::scoped_ptr<boost::thread> _thread;
+	bool _running;
+
+	ChunkReaperStats _stats;
+
+	void reapLoop();
+};
+
+}
+
+#endif
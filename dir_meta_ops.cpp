@@ -1,22 +1,29 @@
 #include "dir_meta_ops.h"
 #include "fs_logger.h"
 #include "fs_options.h"
+#include "storage_backend.h"
 #include "utils.h"
 #include "file_handle.h"
+#include "virtual_files.h"
 
 #include <errno.h>
 
+#include <vector>
 #include <iostream>
 
+#include <mongo/util/time_support.h>
+
+using namespace mongo;
+
 //TODO: change tyo integer return value for appropriate error code return value
-int mgridfs::mgridfs_create_directory(DBClientBase& dbc, const std::string& path, mode_t dirMode, uid_t dirUid, gid_t dirGid) {
+int mgridfs::mgridfs_create_directory(const std::string& path, mode_t dirMode, uid_t dirUid, gid_t dirGid) {
 	trace() << "-> requested mgridfs_create_directory{dir: " << path << ", mode: " << dirMode
 			<< ", uid: " << dirUid << ", gid: " << dirGid << "}" << std::endl;
 	dirMode |= S_IFDIR;
 
 	try {
-		GridFS gridFS(dbc, globalFSOptions._db, globalFSOptions._collPrefix);
-		BSONObj fileObj = gridFS.storeFile("", 0, path);
+		StorageBackend& backend = StorageBackend::get();
+		BSONObj fileObj = backend.storeFile("", 0, path);
 		if (!fileObj.isValid()) {
 			error() << "Failed to create a directory for {path: " << path << "}" << std::endl;
 			return -ENOENT;
@@ -26,13 +33,13 @@ int mgridfs::mgridfs_create_directory(DBClientBase& dbc, const std::string& path
 			<< "}" << std::endl;
 		BSONElement fileObjId = fileObj.getField("_id");
 
-		dbc.update(globalFSOptions._filesNS, BSON("_id" << fileObjId.OID()), BSON("$set" << BSON("metadata.type" << "directory"
+		backend.updateFileById(fileObjId, BSON("metadata.type" << "directory"
 						<< "metadata.filename" << mgridfs::getPathBasename(path)
 						<< "metadata.directory" << mgridfs::getPathDirname(path)
 						<< "metadata.lastUpdated" << jsTime()
 						<< "metadata.uid" << dirUid
 						<< "metadata.gid" << dirGid
-						<< "metadata.mode" << dirMode)));
+						<< "metadata.mode" << dirMode));
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
@@ -51,39 +58,34 @@ int mgridfs::mgridfs_create_directory(DBClientBase& dbc, const std::string& path
 int mgridfs::mgridfs_mkdir(const char *path, mode_t mode) {
 	trace() << "-> requested mgridfs_mkdir{dir: " << path << ", mode: " << std::oct << mode << "}" << endl;
 
-	try {
-		fuse_context* fuseContext = fuse_get_context();
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		int retValue = mgridfs_create_directory(dbc.conn(), path, mode, fuseContext->uid, fuseContext->gid);
-		dbc.done();
-		return retValue;
-	} catch (DBException& e) {
-		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
-			<< ", exception: " << e.toString() << "}" << endl;
-		return -EIO;
+	if (VirtualFiles::isVirtualPath(path)) {
+		return -EPERM;
 	}
 
-	return 0;
+	fuse_context* fuseContext = getRequestContext();
+	return mgridfs_create_directory(path, mode, fuseContext->uid, fuseContext->gid);
 }
 
 /** Remove a directory */
 int mgridfs::mgridfs_rmdir(const char *path) {
 	trace() << "-> requested mgridfs_rmdir{dir: " << path << "}" << endl;
 
+	if (VirtualFiles::isVirtualPath(path)) {
+		return -EPERM;
+	}
+
 	try {
 		// First check if there are any files under the directory and bail out if any 
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		auto_ptr<DBClientCursor> pCursor = dbc->query(globalFSOptions._filesNS, BSON("metadata.directory" << path));
-		if (pCursor->more()) {
+		StorageBackend& backend = StorageBackend::get();
+		vector<BSONObj> entries;
+		backend.listDirectory(path, entries, 1);
+		if (!entries.empty()) {
 			// There are entries under this directory and it cannot be deleted
 			trace() << "Found entries for specified directory." << endl;
 			return -ENOTEMPTY;
 		}
-		pCursor.reset(NULL); // Let the system free up the cursor held by this auto_ptr
 
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		gridFS.removeFile(path);
-		dbc.done();
+		backend.removeFile(path);
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
@@ -106,22 +108,18 @@ int mgridfs::mgridfs_rmdir(const char *path) {
 int mgridfs::mgridfs_opendir(const char *path, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_opendir{dir: " << path << "}" << endl;
 
-	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-
-		//TODO: Possible change the query to be only on the fs.files instead of doing
-		//a GridFile query that may be expensive in case on calls for large files with
-		//incorrect directory check causing DoS kind of scenario
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		GridFile gridFile = gridFS.findFile(path);
-		dbc.done();
+	if (VirtualFiles::isVirtualPath(path)) {
+		return VirtualFiles::get().opendir(path, ffinfo);
+	}
 
-		if (!gridFile.exists()) {
+	try {
+		BSONObj fileObj = StorageBackend::get().findFile(path);
+		if (fileObj.isEmpty()) {
 			debug() << "directory not found {path: " << path << "}" << endl;
 			return -ENOENT;
 		}
 
-		BSONObj fileMeta = gridFile.getMetadata();
+		BSONObj fileMeta = fileObj.getObjectField("metadata");
 		int mode = fileMeta.getIntField("mode");
 		if (!S_ISDIR(mode)) {
 			return -ENOTDIR;
@@ -133,8 +131,7 @@ int mgridfs::mgridfs_opendir(const char *path, struct fuse_file_info *ffinfo) {
 		return -EIO;
 	}
 
-	FileHandle fileHandle(path, 0);
-	ffinfo->fh = fileHandle.assignHandle();
+	ffinfo->fh = FileHandle::assign(path);
 	if (!ffinfo->fh) {
 		return -ENFILE;
 	}
@@ -167,27 +164,25 @@ int mgridfs::mgridfs_readdir(const char *path, void *dirlist, fuse_fill_dir_t ff
 	trace() << "-> requested mgridfs_readdir{dir: " << path << ", fh: " << ffinfo->fh << ", offset: " << offset << "}" << endl;
 
 	// Check for file handle for validity
-	FileHandle fileHandle(path, ffinfo->fh);
-	if (!fileHandle.isValid()) {
+	if (!FileHandle::lookup(ffinfo->fh)) {
 		return -EBADF;
 	}
 
+	if (VirtualFiles::isVirtualPath(path)) {
+		return VirtualFiles::get().readdir(path, dirlist, ffdir);
+	}
+
 	// Add meta directory links
 	ffdir(dirlist, ".", NULL, 0);
 	ffdir(dirlist, "..", NULL, 0);
 
 	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-
-		//TODO: Possible change the query to be only on the fs.files instead of doing
-		//a GridFile query that may be expensive in case on calls for large files with
-		//incorrect directory check causing DoS kind of scenario
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		auto_ptr<DBClientCursor> cursor = gridFS.list(BSON("metadata.directory" << path));
-		while (cursor->more()) {
+		vector<BSONObj> entries;
+		StorageBackend::get().listDirectory(path, entries);
+		for (vector<BSONObj>::const_iterator eIt = entries.begin(); eIt != entries.end(); ++eIt) {
 			// Catch for the AssertionException
 			try {
-				BSONObj obj = cursor->nextSafe();
+				const BSONObj& obj = *eIt;
 				BSONElement elem = obj.getFieldDotted("metadata.filename");
 				trace() << "iterating for directory {file: " << obj.getStringField("filename") << ", metadata.filename: "
 					<< elem.String() << endl;
@@ -201,8 +196,6 @@ int mgridfs::mgridfs_readdir(const char *path, void *dirlist, fuse_fill_dir_t ff
 					<< e.what() << " : " << e.toString() << "}" << endl;
 			}
 		}
-
-		dbc.done();
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
@@ -223,12 +216,10 @@ int mgridfs::mgridfs_releasedir(const char *path, struct fuse_file_info *ffinfo)
 	trace() << "-> requested mgridfs_releasedir{dir: " << path << ", fh: " << ffinfo->fh << "}" << endl;
 
 	// Check file handle
-	FileHandle fileHandle(path, ffinfo->fh);
-	if (!fileHandle.isValid()) {
+	if (!FileHandle::unassign(ffinfo->fh)) {
 		return -EBADF;
 	}
 
-	fileHandle.unassignHandle();
 	return 0;
 }
 
@@ -8,14 +8,9 @@
 
 #include <string>
 
-#include <mongo/client/gridfs.h>
-#include <mongo/client/connpool.h>
-
-using namespace mongo;
-
 namespace mgridfs {
 
-int mgridfs_create_directory(DBClientBase& dbc, const std::string& dirname, mode_t dirMode, uid_t dirUid, gid_t dirGid);
+int mgridfs_create_directory(const std::string& dirname, mode_t dirMode, uid_t dirUid, gid_t dirGid);
 
 /** Create a directory 
  *
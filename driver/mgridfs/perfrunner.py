@@ -3,6 +3,11 @@ import os
 import stat
 import time
 import io
+import random
+import threading
+import multiprocessing
+import subprocess
+import Queue
 
 import datetime
 from datetime import datetime
@@ -25,12 +30,26 @@ fs = gridfs.GridFS(db)
 
 fs.put("Hello World")
 fs.put("Hello World", filename="hello-ji-file.txt", otherprop="ThisisOtherProp", metadata={})
-fs.put("Hello World", filename="hello-ji-file-metadata.txt", otherprop="ThisisPropMeta", 
+fs.put("Hello World", filename="hello-ji-file-metadata.txt", otherprop="ThisisPropMeta",
 		metadata={"directory": "/sample/directory/final", "owner": 123, "group": 564, "permission": 0644})
 """
 
 #mgridfs -s --host=localhost --port=27017 --db=rest --collprefix=ls --logfile=fs.log --loglevel=trace --memChunkSize=1024 --maxMemFileChunks=100 dummy
 
+"""
+Every runner goes through the configured phases over the same workload, one phase at a time with
+--concurrency workers (threads or processes) running it. Phases are:
+- write: every worker writes every file of its own
+- cold-read: every worker reads its files once, after dropping the page cache with --dropcaches
+- warm-read: every worker reads its files --loopcnt times
+- mixed: every worker does --opcount reads or rewrites of its files, --readratio of them reads
+Per phase the runners report throughput along with the p50/p95/p99 latencies of the operations.
+With --run=both a comparison report shows the overhead of mgridfs over GridFS for every phase.
+"""
+
+PHASES = ["write", "cold-read", "warm-read", "mixed"]
+IO_BLOCK_SIZE = 4096 * 1024
+
 def getArgumentParser():
 	p = argparse.ArgumentParser()
 
@@ -38,7 +57,7 @@ def getArgumentParser():
 	GridFSPerfRunner.buildArgParser(p)
 	FSOverGridFSPerfRunner.buildArgParser(p)
 	return p
-	
+
 def run(p):
 	runners = [];
 	# Add MGridFS runner for read/write via mgridfs mounted file system
@@ -58,7 +77,7 @@ def run(p):
 			return -1
 
 		runners.append(runner)
-	
+
 	if (len(runners) == 0):
 		#TODO: use standard logging library
 		print >> sys.stderr, "ERROR: no runners configured, will abort."
@@ -70,14 +89,131 @@ def run(p):
 		print "Running runner: ", runner
 		try:
 			if (runner.run()):
-				++completed;
+				completed += 1
 		except Exception, e:
 			print "ERROR: " + str(e)
 			traceback.print_exc()
-	
+
+	if (len(runners) == 2 and completed == 2):
+		printComparison(runners[0], runners[1], sys.stdout)
+
 	return (len(runners) - completed)
 
 
+def parseSize(value):
+	units = {"k": 1024, "m": 1024 * 1024, "g": 1024 * 1024 * 1024}
+	value = value.strip().lower()
+	if (value and value[-1] in units):
+		return int(value[:-1]) * units[value[-1]]
+
+	return int(value)
+
+
+def parseSizeDistribution(value):
+	"""Parses comma separated <size>[:<weight>] entries e.g. 4k:50,64k:30,1m:20 into a list of
+	(size, weight) tuples, the weight defaults to 1
+	"""
+	distribution = []
+	for entry in value.split(","):
+		parts = entry.split(":")
+		size = parseSize(parts[0])
+		weight = float(parts[1]) if (len(parts) > 1) else 1.0
+		if (size < 0 or weight <= 0):
+			raise ValueError("Invalid size distribution entry: " + entry)
+
+		distribution.append((size, weight))
+
+	return distribution
+
+
+def printComparison(fsRunner, gridFSRunner, out):
+	"""Prints the overhead of the mgridfs runner over the direct GridFS one for every phase run by
+	both, overhead is the extra time per operation relative to GridFS
+	"""
+	gridFSStats = dict([(stats.phase, stats) for stats in gridFSRunner.getPhaseStats()])
+	print >> out, ""
+	print >> out, "mgridfs overhead over GridFS"
+	print >> out, "\t".join(["phase", "mgridfs_ops/s", "gridfs_ops/s", "overhead_%",
+		"mgridfs_p50", "gridfs_p50", "mgridfs_p95", "gridfs_p95", "mgridfs_p99", "gridfs_p99"])
+
+	for fsStats in fsRunner.getPhaseStats():
+		if (fsStats.phase not in gridFSStats):
+			continue
+
+		otherStats = gridFSStats[fsStats.phase]
+		overhead = "n/a"
+		if (fsStats.opsPerSec() > 0 and otherStats.opsPerSec() > 0):
+			overhead = "%.1f" % ((otherStats.opsPerSec() / fsStats.opsPerSec() - 1) * 100)
+
+		print >> out, "\t".join(map(str, [fsStats.phase,
+			"%.1f" % fsStats.opsPerSec(), "%.1f" % otherStats.opsPerSec(), overhead,
+			"%.2f" % fsStats.percentile(50), "%.2f" % otherStats.percentile(50),
+			"%.2f" % fsStats.percentile(95), "%.2f" % otherStats.percentile(95),
+			"%.2f" % fsStats.percentile(99), "%.2f" % otherStats.percentile(99)]))
+
+
+class WorkFile(object):
+	"""File of the workload, content is the base block of its size with its name and version on
+	top so that no two writes store the same content
+	"""
+	def __init__(self, name, size, base):
+		self.name = name
+		self.size = size
+		self._base = base
+
+	def getContent(self, version):
+		header = "{0}.{1}.".format(self.name, version)[:self.size]
+		return header + self._base[len(header):]
+
+
+class PhaseStats(object):
+	"""Results of a phase over all the workers, latencies are in millisecs
+	"""
+	HEADERS = ["runner", "phase", "workers", "ops", "errors", "bytes", "elapsed (secs)", "ops/s", "MB/s",
+		"p50 (millisecs)", "p95 (millisecs)", "p99 (millisecs)"]
+
+	def __init__(self, phase, workers):
+		self.phase = phase
+		self.workers = workers
+		self.ops = 0
+		self.errors = 0
+		self.bytes = 0
+		self.elapsed = 0.0
+		self.latencies = []
+
+
+	def merge(self, result):
+		(ops, errors, transferred, latencies) = result
+		self.ops += ops
+		self.errors += errors
+		self.bytes += transferred
+		self.latencies.extend(latencies)
+
+
+	def opsPerSec(self):
+		return (self.ops / self.elapsed) if (self.elapsed > 0) else 0.0
+
+
+	def mbPerSec(self):
+		return (self.bytes / self.elapsed / (1024 * 1024)) if (self.elapsed > 0) else 0.0
+
+
+	def percentile(self, percent):
+		if (not self.latencies):
+			return 0.0
+
+		# Nearest rank
+		ordered = sorted(self.latencies)
+		rank = int(round(percent / 100.0 * (len(ordered) - 1)))
+		return ordered[rank]
+
+
+	def toRecord(self, runnerName):
+		return [runnerName, self.phase, self.workers, self.ops, self.errors, self.bytes, "%.3f" % self.elapsed,
+			"%.1f" % self.opsPerSec(), "%.2f" % self.mbPerSec(), "%.2f" % self.percentile(50),
+			"%.2f" % self.percentile(95), "%.2f" % self.percentile(99)]
+
+
 class Runner(object):
 	"""Perf runner base class that defines common behaviour amont the classes
 	"""
@@ -96,8 +232,19 @@ class Runner(object):
 		p.add_argument("--srcdir", help="source file directory from where to pick test files. Ideally this would be local file (not the mgridfs mounted one).",
 			default = ".")
 		p.add_argument("--files", help="comma separated list of files to be used for both reading and writing.")
+		p.add_argument("--sizes", help="file size distribution to generate the files from instead of --files, comma separated <size>[:<weight>] e.g. 4k:50,64k:30,1m:20")
+		p.add_argument("--filecount", help="files per worker generated from --sizes. By default set to 10.", type = int, default = 10)
 		p.add_argument("--outfile", help="dump statistics to the specified out file. By default prints to the standard out.");
-		p.add_argument("--loopcnt", help="loop count for each file run. By default set to 100.", type = int, default = 100);
+		p.add_argument("--loopcnt", help="times every worker reads its files in the warm-read phase. By default set to 10.", type = int, default = 10);
+
+		p.add_argument("--concurrency", help="workers running every phase. By default set to 1.", type = int, default = 1)
+		p.add_argument("--workertype", help="run the workers as threads or as processes.", choices=["thread", "process"], default = "thread")
+		p.add_argument("--phases", help="comma separated phases to run out of " + ", ".join(PHASES) + ". By default runs all of them.",
+			default = ",".join(PHASES))
+		p.add_argument("--readratio", help="fraction of reads in the mixed phase, rest are rewrites. By default set to 0.8.", type = float, default = 0.8)
+		p.add_argument("--opcount", help="operations of every worker in the mixed phase. By default set to 100.", type = int, default = 100)
+		p.add_argument("--dropcaches", help="drop the page cache before the cold-read phase (needs root).", action = "store_true")
+		p.add_argument("--seed", help="seed for the file sizes and the mixed operations.", type = int, default = 42)
 		pass
 
 
@@ -114,6 +261,17 @@ class Runner(object):
 			self._outFile = open("{0}.{1}".format(type(self).__name__, self._outFilename), "w")
 
 		self._loopCount = p.loopcnt
+		self._sizes = parseSizeDistribution(p.sizes) if (p.sizes) else None
+		self._fileCount = p.filecount
+		self._concurrency = p.concurrency
+		self._workerType = p.workertype
+		self._phases = p.phases.split(",")
+		self._readRatio = p.readratio
+		self._opCount = p.opcount
+		self._dropCaches = p.dropcaches
+		self._seed = p.seed
+		self._phaseStats = []
+		self._workload = None
 
 
 	def __str__(self):
@@ -121,8 +279,8 @@ class Runner(object):
 
 
 	def isRunnable(self):
-		if (len(self._files) <= 0):
-			print >> sys.stderr, "No files specified for the run."
+		if (len(self._files) <= 0 and not self._sizes):
+			print >> sys.stderr, "No files or sizes specified for the run."
 			return False
 
 		if (self._outFile == None):
@@ -134,6 +292,14 @@ class Runner(object):
 		if (not os.path.isdir(self._srcdir)):
 			return False
 
+		if (self._concurrency <= 0 or self._readRatio < 0 or self._readRatio > 1):
+			return False
+
+		for phase in self._phases:
+			if (phase not in PHASES):
+				print >> sys.stderr, "Unknown phase: ", phase
+				return False
+
 		return True
 
 
@@ -141,20 +307,218 @@ class Runner(object):
 		if (not self.isRunnable()):
 			return False
 
-		self.printStatHeader(["file", "op", "size", "repeat_count", "time (millisecs)"])
+		# Content is built upfront, workers only time the operations on the files
+		self._workload = self.buildWorkload()
+		if (self._workload == None):
+			return False
+
+		self.printStatHeader(PhaseStats.HEADERS)
+
+		self._phaseStats = []
+		for phase in self._phases:
+			if (phase == "cold-read" and self._dropCaches):
+				self.dropPageCache()
 
-		for filename in self._files:
-			if (not self.runFile(filename)):
-				print "ERROR: Failed to run for file: ", filename
-				continue
+			stats = self.runPhase(phase)
+			self._phaseStats.append(stats)
+			self.printStatRecord(stats.toRecord(type(self).__name__))
 
+		self.runPhase("cleanup")
 		self.printStatFooter([])
 		if (self._outFilename):
 			self._outFile.close()
 
+		return True
+
+
+	def getPhaseStats(self):
+		return self._phaseStats
+
+
+	def buildWorkload(self):
+		"""Returns the files of every worker, list of lists of WorkFile. Files are either of the
+		sizes drawn from the size distribution or a copy of every source file per worker.
+		"""
+		rand = random.Random(self._seed)
+		bases = {}
+		workload = []
+		for worker in range(self._concurrency):
+			workerFiles = []
+			if (self._sizes):
+				totalWeight = sum([weight for (size, weight) in self._sizes])
+				for i in range(self._fileCount):
+					pick = rand.uniform(0, totalWeight)
+					size = self._sizes[-1][0]
+					for (candidate, weight) in self._sizes:
+						pick -= weight
+						if (pick <= 0):
+							size = candidate
+							break
+
+					if (size not in bases):
+						bases[size] = os.urandom(size)
+
+					workerFiles.append(WorkFile("perf.w{0}.f{1}".format(worker, i), size, bases[size]))
+			else:
+				for filename in self._files:
+					fullSrcFilename = os.path.join(self._srcdir, filename)
+					if (not self.fileExists(fullSrcFilename)):
+						print "ERROR: Source file is not found [", fullSrcFilename, "]. will not proceed with this test."
+						return None
+
+					if (filename not in bases):
+						with open(fullSrcFilename, "rb") as fin:
+							bases[filename] = fin.read()
+
+					workerFiles.append(WorkFile("perf.w{0}.{1}".format(worker, os.path.basename(filename)),
+						len(bases[filename]), bases[filename]))
+
+			workload.append(workerFiles)
+
+		return workload
+
+
+	def runPhase(self, phase):
+		"""Runs the phase with all the workers started at once, the phase takes from the start until
+		the last worker is done with it
+		"""
+		if (self._workerType == "process"):
+			startEvent = multiprocessing.Event()
+			ready = multiprocessing.Queue()
+			results = multiprocessing.Queue()
+			workerClass = multiprocessing.Process
+		else:
+			startEvent = threading.Event()
+			ready = Queue.Queue()
+			results = Queue.Queue()
+			workerClass = threading.Thread
+
+		workers = []
+		for worker in range(self._concurrency):
+			workers.append(workerClass(target = self.runWorker, args = (phase, worker, startEvent, ready, results)))
+
+		for worker in workers:
+			worker.start()
+
+		# Workers are connected by now, otherwise their setup would be in the numbers
+		for worker in workers:
+			ready.get()
+
+		stats = PhaseStats(phase, self._concurrency)
+		start = time.time()
+		startEvent.set()
+
+		# Results are taken before joining, processes do not exit with data in the queue
+		for worker in workers:
+			stats.merge(results.get())
+
+		stats.elapsed = time.time() - start
+		for worker in workers:
+			worker.join()
+
+		return stats
+
+
+	def runWorker(self, phase, worker, startEvent, ready, results):
+		ops = 0
+		errors = 0
+		transferred = 0
+		latencies = []
+		context = None
+		try:
+			context = self.openWorker()
+			plan = self.buildPlan(phase, worker)
+		except Exception, e:
+			traceback.print_exc()
+			errors += 1
+			plan = []
+
+		ready.put(worker)
+		startEvent.wait()
+
+		version = 1
+		for (op, workFile) in plan:
+			start = time.time()
+			try:
+				if (op == "read"):
+					opLen = self.readFile(context, workFile)
+					if (opLen != workFile.size):
+						raise IOError("Bytes read != file size [file: {0}, size: {1}, read: {2}]".format(workFile.name, workFile.size, opLen))
+				elif (op == "write"):
+					version += 1
+					opLen = self.writeFile(context, workFile, workFile.getContent(version))
+				else:
+					opLen = 0
+					self.deleteFile(context, workFile)
+			except Exception, e:
+				errors += 1
+				if (errors <= 3):
+					print >> sys.stderr, "ERROR: Failed {0} of {1}: {2}".format(op, workFile.name, e)
+			else:
+				latencies.append((time.time() - start) * 1000)
+				transferred += opLen
+
+			ops += 1
+
+		try:
+			if (context != None):
+				self.closeWorker(context)
+		except Exception, e:
+			traceback.print_exc()
+
+		results.put((ops, errors, transferred, latencies))
 
-	def runFile(self):
-		raise NotImplementedError(__name__ + ".runFile not implemented")
+
+	def buildPlan(self, phase, worker):
+		files = self._workload[worker]
+		if (phase == "write"):
+			return [("write", workFile) for workFile in files]
+
+		if (phase == "cold-read"):
+			return [("read", workFile) for workFile in files]
+
+		if (phase == "warm-read"):
+			return [("read", workFile) for i in range(self._loopCount) for workFile in files]
+
+		if (phase == "mixed"):
+			rand = random.Random(self._seed + worker)
+			plan = []
+			for i in range(self._opCount):
+				op = "read" if (rand.random() < self._readRatio) else "write"
+				plan.append((op, rand.choice(files)))
+
+			return plan
+
+		return [("delete", workFile) for workFile in files]
+
+
+	def dropPageCache(self):
+		try:
+			subprocess.check_call(["sync"])
+			with open("/proc/sys/vm/drop_caches", "w") as f:
+				f.write("3\n")
+		except Exception, e:
+			print >> sys.stderr, "WARNING: Failed to drop the page cache, cold-read may be served from it: ", e
+
+
+	def openWorker(self):
+		return None
+
+
+	def closeWorker(self, context):
+		pass
+
+
+	def readFile(self, context, workFile):
+		raise NotImplementedError(__name__ + ".readFile not implemented")
+
+
+	def writeFile(self, context, workFile, content):
+		raise NotImplementedError(__name__ + ".writeFile not implemented")
+
+
+	def deleteFile(self, context, workFile):
+		raise NotImplementedError(__name__ + ".deleteFile not implemented")
 
 
 	def printStatHeader(self, headers):
@@ -169,6 +533,7 @@ class Runner(object):
 
 	def printStatRecord(self, stats):
 		print >> self._outFile, "\t".join(map(str, stats))
+		self._outFile.flush()
 
 	@staticmethod
 	def fileExists(filename):
@@ -178,7 +543,7 @@ class Runner(object):
 			return False
 
 		return True
-		
+
 
 class FSOverGridFSPerfRunner(Runner):
 	"""Class to run performance tests for MGridFS exported FS
@@ -195,7 +560,7 @@ class FSOverGridFSPerfRunner(Runner):
 
 		self._destdir = p.destdir
 
-	
+
 	def __str__(self):
 		return __name__ + ".FSOverGridFSPerfRunner"
 
@@ -213,82 +578,30 @@ class FSOverGridFSPerfRunner(Runner):
 		return True;
 
 
-	def runFile(self, filename):
-		if (not self.runFileWrite(filename)):
-			return False
-
-		if (not self.runFileRead(filename)):
-			return False
-
-		return True
-
-
-	def runFileRead(self, filename):
-		fullFilename = os.path.join(self._destdir, filename)
-		if (not self.fileExists(fullFilename)):
-			print "ERROR: File is not accessible [", filename, "]"
-			return False
-
-		for i in range(self._loopCount):
-			start = time.time()
-
-			try:
-				fileSize = 0
-				with open(fullFilename, "r") as f:
-					readBytes = f.read(4096 * 1024)
-					while (len(readBytes) > 0):
-						fileSize += len(readBytes)
-						readBytes = f.read(4096 * 1024)
-			except Exception, e:
-				traceback.print_exc()
-			else:
-				print "Completed read test for the file from system [loop: {0}, file: {1}]".format(i, fullFilename)
-				diffTime = (time.time() - start) * 1000
-				self.printStatRecord([type(self).__name__, filename, "read", fileSize, 1, diffTime])
-
-		return True
-
+	def readFile(self, context, workFile):
+		fileSize = 0
+		with open(os.path.join(self._destdir, workFile.name), "rb") as f:
+			readBytes = f.read(IO_BLOCK_SIZE)
+			while (len(readBytes) > 0):
+				fileSize += len(readBytes)
+				readBytes = f.read(IO_BLOCK_SIZE)
 
-	def runFileWrite(self, filename):
-		fullDestFilename = os.path.join(self._destdir, filename)
-		fullSrcFilename = os.path.join(self._srcdir, filename)
+		return fileSize
 
-		if (not self.fileExists(fullSrcFilename)):
-			print "ERROR: Source file is not found [", fullSrcFilename, "]. will not proceed with this test."
-			return False
 
-		for i in range(self._loopCount):
-			# Delete the target file before performing writes on it
-			self.deleteFile(fullDestFilename)
-			start = time.time()
+	def writeFile(self, context, workFile, content):
+		# Truncating open replaces the file the same way a copy over it does
+		with open(os.path.join(self._destdir, workFile.name), "wb") as fout:
+			for offset in range(0, len(content), IO_BLOCK_SIZE):
+				fout.write(content[offset:offset + IO_BLOCK_SIZE])
 
-			try:
-				fileSize = 0
-				with open(fullSrcFilename, "r") as fin:
-					with open(fullDestFilename, "w") as fout:
-						readBytes = fin.read(4096 * 1024)
-						while (len(readBytes) > 0):
-							fileSize += len(readBytes)
-							fout.write(readBytes)
-							readBytes = fin.read(4096 * 1024)
-			except Exception, e:
-				traceback.print_exc()
-			else:
-				print "Completed write test for the file from system {loop: ", i, ", srcfile: ", fullSrcFilename, ", destfile: ", fullDestFilename, "}"
-				diffTime = (time.time() - start) * 1000
-				self.printStatRecord([type(self).__name__, filename, "write", fileSize, 1, diffTime])
+		return len(content)
 
-		return True
 
-
-	def deleteFile(self, filename):
-		try:
-			fileStat = os.stat(fullSrcFilename)
-			os.unlink(filename)
-		except:
-			pass
-
-		return True
+	def deleteFile(self, context, workFile):
+		fullFilename = os.path.join(self._destdir, workFile.name)
+		if (self.fileExists(fullFilename)):
+			os.unlink(fullFilename)
 
 
 #########################################################
@@ -328,89 +641,41 @@ class GridFSPerfRunner(Runner):
 		return True;
 
 
-	def runFile(self, filename):
-		if (not self.runFileWrite(filename)):
-			return False
-
-		if (not self.runFileRead(filename)):
-			return False
-
-		return True
-
-
-	def runFileRead(self, filename):
-		gridFS = gridfs.GridFS(self.getDb(), self._collPrefix)
-		if (not gridFS.exists()):
-			print "File not found on GridFS, not performing read test for this file: ", filename
-			return True
-
-		for i in range(self._loopCount):
-			start = time.time()
-
-			try:
-				with gridFS.get_version(filename) as f:
-					fileSize = f.length
-					readBytes = f.read(4096 * 1024)
-					readLen = len(readBytes);
-					while (len(readBytes) > 0):
-						readBytes = f.read(4096 * 1024)
-						readLen += len(readBytes)
-
-					if (readLen != fileSize):
-						print "FATAL: Bytes read != file size [file: {0}, size: {1}, read: {2}]".format(filename, fileSize, readLen)
-
-			except Exception, e:
-				traceback.print_exc()
-			else:
-				print "Completed read test for the file from system [loop: {0}, file: {1}]".format(i, filename)
-				diffTime = (time.time() - start) * 1000
-				self.printStatRecord([type(self).__name__, filename, "read", fileSize, 1, diffTime])
-
-		return True
+	def openWorker(self):
+		# Client of its own for every worker, clients must not be shared across processes
+		dbc = pymongo.MongoClient(self._server,  self._port)
+		return (dbc, gridfs.GridFS(dbc[self._db], self._collPrefix))
 
 
-	def runFileWrite(self, filename):
-		fullSrcFilename = os.path.join(self._srcdir, filename)
-		if (not self.fileExists(fullSrcFilename)):
-			print "ERROR: Source file is not found [", fullSrcFilename, "]. will not proceed with this test."
-			return False
+	def closeWorker(self, context):
+		(dbc, gridFS) = context
+		dbc.close()
 
-		gridFS = gridfs.GridFS(self.getDb(), self._collPrefix)
-		for i in range(self._loopCount):
-			# Delete the target file before performing writes on it
-			self.deleteGridFile(filename, gridFS)
-			start = time.time()
 
-			try:
-				fileSize = 0
-				with open(fullSrcFilename, "r") as fin:
-					with gridFS.new_file(filename = filename) as fout:
-						readBytes = fin.read(4096 * 1024)
-						while (len(readBytes) > 0):
-							fileSize += len(readBytes)
-							fout.write(readBytes)
-							readBytes = fin.read(4096 * 1024)
-			except Exception, e:
-				traceback.print_exc()
-			else:
-				print "Completed write test for the file from system {loop: ", i, ", srcfile: ", fullSrcFilename, ", destfile: ", filename, "}"
-				diffTime = (time.time() - start) * 1000
-				self.printStatRecord([type(self).__name__, filename, "write", fileSize, 1, diffTime])
+	def readFile(self, context, workFile):
+		(dbc, gridFS) = context
+		readLen = 0
+		with gridFS.get_last_version(workFile.name) as f:
+			readBytes = f.read(IO_BLOCK_SIZE)
+			while (len(readBytes) > 0):
+				readLen += len(readBytes)
+				readBytes = f.read(IO_BLOCK_SIZE)
 
-		return True
+		return readLen
 
 
-	def getDb(self):
-		dbc = pymongo.MongoClient(self._server,  self._port)
-		return dbc[self._db]
+	def writeFile(self, context, workFile, content):
+		# Older versions are removed as part of the write, mgridfs replaces the file on flush too
+		(dbc, gridFS) = context
+		self.deleteFile(context, workFile)
+		with gridFS.new_file(filename = workFile.name) as fout:
+			for offset in range(0, len(content), IO_BLOCK_SIZE):
+				fout.write(content[offset:offset + IO_BLOCK_SIZE])
 
+		return len(content)
 
-	def deleteGridFile(self, filename, gridFS):
-		count = 0
-		while (gridFS.exists({"filename": filename})):
-			fin = gridFS.get_version(filename)
-			gridFS.delete(fin._id)
-			count += 1
 
-		if (count > 0):
-			print "Deleted {0} instance of '{1}'".format(count, filename)
+	def deleteFile(self, context, workFile):
+		(dbc, gridFS) = context
+		for fileObj in gridFS.find({"filename": workFile.name}):
+			gridFS.delete(fileObj._id)
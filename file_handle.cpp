@@ -3,97 +3,126 @@
 
 using namespace std;
 
-namespace {
-	uint64_t _MIN_FILE_HANDLE = 10;
-	uint64_t _FILE_HANDLE = 10;
-}
+struct mgridfs::FileHandle::Slot {
+	Slot() : _activeHandle(0), _generation(1) {}
+
+	// Handle currently assigned to the slot, 0 while the slot is on the free list
+	boost::atomic<uint64_t> _activeHandle;
+	uint32_t _generation;
+	FileHandle _fileHandle;
+};
+
+boost::atomic<mgridfs::FileHandle::Slot*> mgridfs::FileHandle::_pages[mgridfs::FileHandle::MAX_PAGES];
+boost::mutex mgridfs::FileHandle::_slotLock;
+vector<uint32_t> mgridfs::FileHandle::_freeSlots;
+uint32_t mgridfs::FileHandle::_slotCount = 0;
+boost::atomic<size_t> mgridfs::FileHandle::_activeCount(0);
+
+mgridfs::FileHandle::Slot* mgridfs::FileHandle::getSlot(uint64_t fh) {
+	uint32_t slotIndex = static_cast<uint32_t>(fh) - 1;
+	if (static_cast<uint32_t>(fh) == 0 || slotIndex / SLOTS_PER_PAGE >= MAX_PAGES) {
+		return NULL;
+	}
 
-mgridfs::FileHandle::FileHandleMap mgridfs::FileHandle::_fileHandles;
+	Slot* page = _pages[slotIndex / SLOTS_PER_PAGE].load(boost::memory_order_acquire);
+	if (!page) {
+		return NULL;
+	}
 
-mgridfs::FileHandle::FileHandle(const string& path, uint64_t fh)
-	: _filename(path), _fh(fh) {
+	return &page[slotIndex % SLOTS_PER_PAGE];
+}
 
-	if (_fh) {
-		FileHandleMap::left_map::const_iterator pIt = _fileHandles.left.find(_fh);
-		if (pIt == _fileHandles.left.end()) {
-			// Failed to find file for the corresponding file handle in the list of open files handles
-			_filename = "";
-		} else {
-			_filename = pIt->second;
-		}
+const mgridfs::FileHandle* mgridfs::FileHandle::lookup(uint64_t fh) {
+	Slot* slot = getSlot(fh);
+	if (!slot || slot->_activeHandle.load(boost::memory_order_acquire) != fh) {
+		return NULL;
 	}
+
+	return &slot->_fileHandle;
 }
 
-mgridfs::FileHandle::~FileHandle() {
-	// Nothing to be done here
+uint64_t mgridfs::FileHandle::assign(const string& filename, const LocalGridFilePtr& localGridFile) {
+	return assignSlot(filename, localGridFile, VirtualFilePtr(), mongo::BSONObj());
 }
 
-bool mgridfs::FileHandle::isValid() const {
-	return (_fileHandles.left.find(_fh) != _fileHandles.left.end());
+uint64_t mgridfs::FileHandle::assign(const string& filename, const VirtualFilePtr& virtualFile) {
+	return assignSlot(filename, LocalGridFilePtr(), virtualFile, mongo::BSONObj());
 }
 
-uint64_t mgridfs::FileHandle::assignHandle() {
-	if (_filename.empty()) {
-		warn() << "Encountered FileHandle::assignHandle for empty filename {filename: " << _filename << "}" << endl;
+uint64_t mgridfs::FileHandle::assign(const string& filename, const mongo::BSONObj& fileObj) {
+	return assignSlot(filename, LocalGridFilePtr(), VirtualFilePtr(), fileObj);
+}
+
+uint64_t mgridfs::FileHandle::assignSlot(const string& filename, const LocalGridFilePtr& localGridFile,
+	const VirtualFilePtr& virtualFile, const mongo::BSONObj& fileObj) {
+	if (filename.empty()) {
+		warn() << "Encountered FileHandle::assign for empty filename {filename: " << filename << "}" << endl;
 		return 0;
 	}
 
-	// There is no way for the function to know if duplicate assign is being made to generate a file
-	// handle. It is caller's flow responsibility to call assign / unassign in the correct
-	// order functionally and to manage the associated resource (file handle is one of system resource)
-	// correctly.
-	_fh = generateNextHandle(_filename);
-	if (_fh) {
-		_fileHandles.insert(FileHandleMap::value_type(_fh, _filename));
-		debug() << "Active file handle tracking {op: assignHandle, count: " << _fileHandles.size() << "}" << endl;
-	}
-	return _fh;
-}
+	boost::mutex::scoped_lock lock(_slotLock);
+	uint32_t slotIndex = 0;
+	if (!_freeSlots.empty()) {
+		slotIndex = _freeSlots.back();
+		_freeSlots.pop_back();
+	} else {
+		if (_slotCount >= SLOTS_PER_PAGE * MAX_PAGES) {
+			fatal() << "Ran out of file handles {activecount: " << _activeCount.load() << "}" << endl;
+			return 0;
+		}
 
-bool mgridfs::FileHandle::unassignHandle() {
-	if (_fh) {
-		_fileHandles.erase(FileHandleMap::value_type(_fh, _filename));
+		slotIndex = _slotCount;
+		if (slotIndex % SLOTS_PER_PAGE == 0) {
+			Slot* page = new (nothrow) Slot[SLOTS_PER_PAGE];
+			if (!page) {
+				error() << "Failed to allocate file handle page {slots: " << _slotCount << "}" << endl;
+				return 0;
+			}
+			_pages[slotIndex / SLOTS_PER_PAGE].store(page, boost::memory_order_release);
+		}
+		++_slotCount;
 	}
-	debug() << "Active file handle tracking {op: unassignHandle, count: " << _fileHandles.size() << "}" << endl;
-	return true;
-}
 
-bool mgridfs::FileHandle::unassignAllHandles(const string& filename) {
-	vector<uint64_t> fhList;
+	Slot& slot = _pages[slotIndex / SLOTS_PER_PAGE].load(boost::memory_order_relaxed)[slotIndex % SLOTS_PER_PAGE];
+	uint64_t fh = makeHandle(slot._generation, slotIndex);
+	slot._fileHandle._fh = fh;
+	slot._fileHandle._filename = filename;
+	slot._fileHandle._localGridFile = localGridFile;
+	slot._fileHandle._virtualFile = virtualFile;
+	slot._fileHandle._fileObj = fileObj;
+	slot._activeHandle.store(fh, boost::memory_order_release);
+
+	size_t activeCount = ++_activeCount;
+	debug() << "Active file handle tracking {op: assign, fh: " << fh << ", count: " << activeCount << "}" << endl;
+	return fh;
+}
 
-	// Since bimaps do not support erase by the iterator:
-	// 	1. Gather all the file handles for this file name
-	// 	2. Release all the handles by itertaing through list from step 1
-	for (FileHandleMap::right_map::const_iterator pIt = _fileHandles.right.find(filename);
-			pIt != _fileHandles.right.end();
-			++pIt) {
-		fhList.push_back(pIt->second);
+bool mgridfs::FileHandle::unassign(uint64_t fh) {
+	boost::mutex::scoped_lock lock(_slotLock);
+	Slot* slot = getSlot(fh);
+	if (!slot || slot->_activeHandle.load(boost::memory_order_relaxed) != fh) {
+		warn() << "Encountered FileHandle::unassign for a handle that is not assigned {fh: " << fh << "}" << endl;
+		return false;
 	}
 
-	debug() << "unsassignAllHandles {file: " << filename << ", foundToUnassign: " << fhList.size() << "}" << endl;
-	for (vector<uint64_t>::const_iterator pIt = fhList.begin(); pIt != fhList.end(); ++pIt) {
-		_fileHandles.erase(FileHandleMap::value_type(*pIt, filename));
+	slot->_activeHandle.store(0, boost::memory_order_release);
+	slot->_fileHandle._fh = 0;
+	slot->_fileHandle._filename.clear();
+	slot->_fileHandle._localGridFile.reset();
+	slot->_fileHandle._virtualFile.reset();
+	slot->_fileHandle._fileObj = mongo::BSONObj();
+
+	// Generation 0 is skipped only to keep handles easily distinguishable in the logs
+	if (++slot->_generation == 0) {
+		slot->_generation = 1;
 	}
+	_freeSlots.push_back(static_cast<uint32_t>(fh) - 1);
 
+	size_t activeCount = --_activeCount;
+	debug() << "Active file handle tracking {op: unassign, fh: " << fh << ", count: " << activeCount << "}" << endl;
 	return true;
 }
 
-uint64_t mgridfs::FileHandle::generateNextHandle(const string& filename) {
-	uint64_t origHandle = _FILE_HANDLE++;
-	for (; origHandle != _FILE_HANDLE; ++_FILE_HANDLE) {
-		if (_FILE_HANDLE >= 0 && _FILE_HANDLE <= _MIN_FILE_HANDLE) {
-			_FILE_HANDLE = _MIN_FILE_HANDLE;
-		}
-
-		if (_fileHandles.left.find(_FILE_HANDLE) == _fileHandles.left.end()) {
-			break;
-		}
-	}
-
-	if (origHandle == _FILE_HANDLE) {
-		fatal() << "Ran out of file handles {lookupstart: " << origHandle << ", activecount: " << _fileHandles.size() << "}" << endl;
-		return 0;
-	}
-
-	return _FILE_HANDLE;
+size_t mgridfs::FileHandle::getActiveCount() {
+	return _activeCount.load(boost::memory_order_relaxed);
 }
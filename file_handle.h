@@ -1,61 +1,105 @@
 #ifndef mgridfs_file_handle_h
 #define mgridfs_file_handle_h
 
+#include "local_gridfs.h"
+#include "virtual_files.h"
+
 #include <string>
-#include <stack>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
 
-#include <boost/bimap.hpp>
-#include <boost/bimap/multiset_of.hpp>
+#include <mongo/client/dbclient.h>
 
 using namespace std;
 
 namespace mgridfs {
 
-class FileHandle {
+/**
+ * State associated with a file handle given out to FUSE on open / opendir / create.
+ *
+ * Handles live in a slot table. A handle is the slot index (+1, so that 0 is never a valid
+ * handle) in the lower 32 bits combined with the generation of the slot in the upper 32 bits.
+ * The generation is bumped every time a slot is freed, so a stale handle never resolves to the
+ * entry that has re-used its slot.
+ *
+ * Lookups are lock-free and do not depend on the number of open handles. Assign / unassign
+ * pop / push the slot on a free list under a single lock, both being O(1).
+ *
+ * FUSE never issues an operation on a handle concurrently with or after the release for that
+ * handle, so the entry returned by lookup() stays valid for the duration of the operation.
+ */
+class FileHandle : protected boost::noncopyable {
 public:
-	// Path is ignored in case fh != 0 and there is a mapping for the file handle in the map
-	//
-	// For fh != 0:  _filename is set with the file assigned for the specified file handle. 
-	// For fh = 0: _filename is set with specified valid path. There is no other way of setting the path
-	//
-	FileHandle(const string& path = "", uint64_t fh = 0);
-	~FileHandle();
+	// Returns 0 in case there are no more free handles
+	static uint64_t assign(const string& filename, const LocalGridFilePtr& localGridFile = LocalGridFilePtr());
+	static uint64_t assign(const string& filename, const VirtualFilePtr& virtualFile);
+	static uint64_t assign(const string& filename, const mongo::BSONObj& fileObj);
+	static bool unassign(uint64_t fh);
 
-	bool isValid() const;
+	// Returns NULL in case the handle is not assigned (or has been unassigned since)
+	static const FileHandle* lookup(uint64_t fh);
 
-	uint64_t assignHandle();
-	bool unassignHandle();
+	static size_t getActiveCount();
 
 	inline uint64_t getHandle() const {
 		return _fh;
 	}
 
-	const string& getFilename() const {
+	inline const string& getFilename() const {
 		return _filename;
 	}
 
-	static bool unassignAllHandles(const string& filename);
+	// Local file backing this handle, empty for directories and files opened read-only from the server
+	inline const LocalGridFilePtr& getLocalGridFile() const {
+		return _localGridFile;
+	}
+
+	// Content snapshot for handles of the file system's own virtual files, empty otherwise
+	inline const VirtualFilePtr& getVirtualFile() const {
+		return _virtualFile;
+	}
+
+	// Document of the version of the file opened read-only from the server, empty otherwise. Reads
+	// go by it for the life of the handle so that a read never mixes the chunks of two versions.
+	inline const mongo::BSONObj& getFileObj() const {
+		return _fileObj;
+	}
 
 private:
-	// Since same filenames can have multiple file handles but same file handle cannot hanve multiple file
-	// association, the relation is as follows for the container:
-	// 		Set of file handles vs multiset of file names
-	typedef boost::bimap<uint64_t, boost::bimaps::multiset_of<string> > FileHandleMap;
+	FileHandle() : _fh(0) {}
 
-	static FileHandleMap _fileHandles;
+	uint64_t _fh;
+	string _filename;
+	LocalGridFilePtr _localGridFile;
+	VirtualFilePtr _virtualFile;
+	mongo::BSONObj _fileObj;
 
-	// Cache of recetly freed-up handles. This is useful specially in case of a sparse free handles so that assign does
-	// not need to go through cycle of used-up handles to find the next free handle. The worst case for getting a new handle
-	// should only be in case the handle space is sparse and there are no handles on the free list.
-	// TODO: make use of this structure
-	static stack<uint64_t> _freeHandles;
+	struct Slot;
 
-	static uint64_t generateNextHandle(const string& filename);
+	// Slots are allocated in pages that are never moved or freed, so a lock-free lookup can
+	// safely index into a page while another thread is adding pages to the table
+	static const uint32_t SLOTS_PER_PAGE = 1024;
+	static const uint32_t MAX_PAGES = 1024;
 
-	FileHandle() {}
+	static boost::atomic<Slot*> _pages[MAX_PAGES];
 
-	string _filename;
-	uint64_t _fh;
+	// Following are guarded by _slotLock
+	static boost::mutex _slotLock;
+	static vector<uint32_t> _freeSlots;
+	static uint32_t _slotCount;
+
+	static boost::atomic<size_t> _activeCount;
+
+	static inline uint64_t makeHandle(uint32_t generation, uint32_t slotIndex) {
+		return (static_cast<uint64_t>(generation) << 32) | (static_cast<uint64_t>(slotIndex) + 1);
+	}
+
+	static Slot* getSlot(uint64_t fh);
+	static uint64_t assignSlot(const string& filename, const LocalGridFilePtr& localGridFile, const VirtualFilePtr& virtualFile,
+		const mongo::BSONObj& fileObj);
 };
 
 }
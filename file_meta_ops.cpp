@@ -1,10 +1,16 @@
 #include "file_meta_ops.h"
 #include "fs_options.h"
+#include "storage_backend.h"
 #include "fs_logger.h"
 #include "utils.h"
 #include "file_handle.h"
 #include "local_gridfs.h"
 #include "local_grid_file.h"
+#include "grid_access.h"
+#include "virtual_files.h"
+#include "fs_stats.h"
+#include "fs_control.h"
+#include "fs_journal.h"
 
 #include <string.h>
 #include <errno.h>
@@ -12,8 +18,9 @@
 #include <algorithm>
 #include <iostream>
 
-#include <mongo/client/gridfs.h>
-#include <mongo/client/connpool.h>
+#include <boost/bind.hpp>
+
+#include <mongo/util/time_support.h>
 
 using namespace std;
 using namespace mongo;
@@ -21,6 +28,46 @@ using namespace mongo;
 namespace {
 	// All static definitions used by the meta-functions
 	const string METADATA_XATTR_PREFIX = "metadata.xattr.";
+
+	// Assigns the handle for an open backed by a local file, the reference taken on the local file
+	// is handed over to the handle and dropped again in case no handle could be assigned
+	int assignLocalFileHandle(const char* file, const mgridfs::LocalGridFilePtr& localGridFile, struct fuse_file_info* ffinfo) {
+		ffinfo->fh = mgridfs::FileHandle::assign(file, localGridFile);
+		if (!ffinfo->fh) {
+			// Failed to generate a file handle, most likely out of resource
+			mgridfs::LocalGridFS::get().releaseFile(localGridFile);
+			return -ENFILE;
+		}
+
+		return 0;
+	}
+
+	// Copies the fetched chunks overlapping a read request into the reader's buffer
+	class RemoteReadBuffer {
+	public:
+		RemoteReadBuffer(char* data, size_t len, off_t offset, int chunkSize)
+			: _data(data), _len(len), _offset(offset), _chunkSize(chunkSize), _bytesRead(0) {}
+
+		bool copyChunk(int chunkNum, const char* chunkData, int chunkLen) {
+			off_t chunkStart = (off_t)chunkNum * _chunkSize;
+			off_t copyStart = max(chunkStart, _offset);
+			off_t copyEnd = min(chunkStart + chunkLen, (off_t)(_offset + _len));
+			if (copyEnd > copyStart) {
+				memcpy(_data + (copyStart - _offset), chunkData + (copyStart - chunkStart), copyEnd - copyStart);
+				_bytesRead += (copyEnd - copyStart);
+			}
+			return true;
+		}
+
+		inline size_t getBytesRead() const { return _bytesRead; }
+
+	private:
+		char* _data;
+		size_t _len;
+		off_t _offset;
+		int _chunkSize;
+		size_t _bytesRead;
+	};
 }
 
 /** Get file attributes.
@@ -32,25 +79,26 @@ namespace {
 int mgridfs::mgridfs_getattr(const char* file, struct stat* file_stat) {
 	trace() << "-> requested mgridfs_getattr{file: " << file << "}" << endl;
 
-	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		GridFile gridFile = gridFS.findFile(BSON("filename" << file));
-		dbc.done();
+	if (VirtualFiles::isVirtualPath(file)) {
+		return VirtualFiles::get().getattr(file, file_stat);
+	}
 
-		if (!gridFile.exists()) {
+	try {
+		// Listings issue getattr for every entry in parallel, share the round trips among them
+		BSONObj fileObj = FileLookupBatcher::get().findFile(file);
+		if (fileObj.isEmpty()) {
 			debug() << "Requested file not found for attribute listing {file: " << file << "}" << endl;
 			return -ENOENT;
 		}
 
-		BSONObj fileMeta = gridFile.getMetadata();
+		BSONObj fileMeta = fileObj.getObjectField("metadata");
 
 		bzero(file_stat, sizeof(*file_stat));
 		file_stat->st_uid = fileMeta.hasField("uid") ? fileMeta.getIntField("uid") : 1;
 		file_stat->st_gid = fileMeta.hasField("gid") ? fileMeta.getIntField("gid") : 1;
 		file_stat->st_mode = fileMeta.hasField("mode") ? fileMeta.getIntField("mode") : 0555;
 
-		file_stat->st_ctime = gridFile.getUploadDate().toTimeT();
+		file_stat->st_ctime = fileObj.getField("uploadDate").Date().toTimeT();
 		if (fileMeta.hasField("lastUpdated")) {
 			file_stat->st_mtime = fileMeta.getField("lastUpdated").Date().toTimeT();
 		} else {
@@ -63,12 +111,16 @@ int mgridfs::mgridfs_getattr(const char* file, struct stat* file_stat) {
 			file_stat->st_size = fileMeta.objsize();
 			file_stat->st_blocks = get512BlockCount(file_stat->st_size);
 		} else if (S_ISREG(file_stat->st_mode)) {
-			LocalGridFile* localGridFile = LocalGridFS::get().findByName(file);
+			LocalGridFilePtr localGridFile = LocalGridFS::get().findByName(file);
+			size_t pendingSize = 0;
 			if (localGridFile) {
 				// Get local-file size in case the file has been opened and resides in-memory
 				file_stat->st_size = localGridFile->getSize();
+			} else if (FSJournal::get().getPendingSize(file, pendingSize)) {
+				// Closed with the content still on its way to the server
+				file_stat->st_size = pendingSize;
 			} else {
-				file_stat->st_size = gridFile.getContentLength();
+				file_stat->st_size = fileObj.getField("length").numberLong();
 			}
 			file_stat->st_blocks = get512BlockCount(file_stat->st_size);
 		} else if (S_ISLNK(file_stat->st_mode)) {
@@ -80,8 +132,8 @@ int mgridfs::mgridfs_getattr(const char* file, struct stat* file_stat) {
 				warn() << "Encountered a NULL target field for a link" << endl;
 			}
 		} else {
-			warn() << "Encountered unsupported file stat mode for the entry " << gridFile.getMetadata()
-				<< " -> {filename: " << gridFile.getFilename() << "}" << endl;
+			warn() << "Encountered unsupported file stat mode for the entry " << fileMeta
+				<< " -> {filename: " << fileObj.getStringField("filename") << "}" << endl;
 		}
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
@@ -107,12 +159,26 @@ int mgridfs::mgridfs_getattr(const char* file, struct stat* file_stat) {
 int mgridfs::mgridfs_fgetattr(const char *file, struct stat *stats, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_fgetattr{file: " << file << ", fh: " << ffinfo->fh << "}" << endl;
 
-	FileHandle fileHandle(file, ffinfo->fh);
-	if (!fileHandle.isValid()) {
+	const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+	if (!fileHandle) {
 		return -EBADF;
 	}
 
-	return mgridfs_getattr(fileHandle.getFilename().c_str(), stats);
+	// Local file follows renames of the file while it is open, the handle does not
+	const LocalGridFilePtr& localGridFile = fileHandle->getLocalGridFile();
+	if (localGridFile) {
+		return mgridfs_getattr(localGridFile->getFilename().c_str(), stats);
+	}
+
+	// Size of a virtual file is known only for its snapshot held by the handle
+	const VirtualFilePtr& virtualFile = fileHandle->getVirtualFile();
+	if (virtualFile) {
+		int retCode = VirtualFiles::get().getattr(fileHandle->getFilename().c_str(), stats);
+		stats->st_size = virtualFile->getSize();
+		return retCode;
+	}
+
+	return mgridfs_getattr(fileHandle->getFilename().c_str(), stats);
 }
 
 /** Create a file node
@@ -124,6 +190,10 @@ int mgridfs::mgridfs_fgetattr(const char *file, struct stat *stats, struct fuse_
 int mgridfs::mgridfs_mknod(const char *file, mode_t mode, dev_t dev) {
 	trace() << "-> requested mgridfs_mknod{file: " << file << ", mode: " << std::oct << mode << ", dev: " << std::dec << dev << "}" << endl;
 
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
+
 	// TODO: Implement this for some of the types like regular files / named-fifo etc.
 	// This won't be supported for any other special file / device type
 
@@ -140,22 +210,23 @@ int mgridfs::mgridfs_mknod(const char *file, mode_t mode, dev_t dev) {
  */
 int mgridfs::mgridfs_readlink(const char *file, char *link, size_t len) {
 	trace() << "-> requested mgridfs_readlink{file: " << file << ", len: " << len << "}" << endl;
+
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EINVAL;
+	}
+
 	if (len <= 0) {
 		return -EINVAL;
 	}
 
 	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		GridFile gridFile = gridFS.findFile(BSON("filename" << file));
-		dbc.done();
-
-		if (!gridFile.exists()) {
+		BSONObj fileObj = StorageBackend::get().findFile(file);
+		if (fileObj.isEmpty()) {
 			debug() << "Requested file not found for symlink listing {file: " << file << "}" << endl;
 			return -ENOENT;
 		}
 
-		BSONObj fileMeta = gridFile.getMetadata();
+		BSONObj fileMeta = fileObj.getObjectField("metadata");
 		const char* targetLink = fileMeta.getStringField("target");
 		if (targetLink) {
 			strncpy(link, targetLink, len - 1);
@@ -177,12 +248,20 @@ int mgridfs::mgridfs_readlink(const char *file, char *link, size_t len) {
 int mgridfs::mgridfs_unlink(const char *file) {
 	trace() << "-> requested mgridfs_unlink{file: " << file << "}" << endl;
 
-	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		gridFS.removeFile(file);
-		dbc.done();
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
 
+	// Handles still open keep the content of the local file but never flush it back, and a file
+	// created under the name later gets a local file of its own. Detaching waits for a flush in
+	// progress, any upload it left pending in the journal would bring the file back.
+	LocalGridFS::get().detachFile(file);
+	if (FSJournal::get().waitForFile(file)) {
+		return -EIO;
+	}
+
+	try {
+		StorageBackend::get().removeFile(file);
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
@@ -196,11 +275,14 @@ int mgridfs::mgridfs_unlink(const char *file) {
 int mgridfs::mgridfs_symlink(const char *srcfile, const char *destfile) {
 	trace() << "-> requested mgridfs_symlink{srcfile: " << srcfile << ", destfile: " << destfile << "}" << endl;
 
+	if (VirtualFiles::isVirtualPath(destfile)) {
+		return -EPERM;
+	}
+
 	try {
-		fuse_context* fuseContext = fuse_get_context();
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		BSONObj fileObj = gridFS.storeFile("", 0, destfile);
+		fuse_context* fuseContext = getRequestContext();
+		StorageBackend& backend = StorageBackend::get();
+		BSONObj fileObj = backend.storeFile("", 0, destfile);
 		if (!fileObj.isValid()) {
 			error() << "Failed to create link file {destfile: " << destfile << "}" << std::endl;
 			return -EIO;
@@ -211,15 +293,14 @@ int mgridfs::mgridfs_symlink(const char *srcfile, const char *destfile) {
 
 		mode_t linkMode = S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO;
 		BSONElement fileObjId = fileObj.getField("_id");
-		dbc->update(globalFSOptions._filesNS, BSON("_id" << fileObjId.OID()), BSON("$set" << BSON("metadata.type" << "slink"
+		backend.updateFileById(fileObjId, BSON("metadata.type" << "slink"
 						<< "metadata.target" << srcfile
 						<< "metadata.filename" << mgridfs::getPathBasename(destfile)
 						<< "metadata.directory" << mgridfs::getPathDirname(destfile)
 						<< "metadata.lastUpdated" << jsTime()
 						<< "metadata.uid" << fuseContext->uid
 						<< "metadata.gid" << fuseContext->gid
-						<< "metadata.mode" << linkMode)));
-		dbc.done();
+						<< "metadata.mode" << linkMode));
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
@@ -232,24 +313,65 @@ int mgridfs::mgridfs_symlink(const char *srcfile, const char *destfile) {
 /** Rename a file */
 int mgridfs::mgridfs_rename(const char *srcfile, const char *destfile) {
 	trace() << "-> requested mgridfs_rename{srcfie: " << srcfile << ", destfile: " << destfile << "}" << endl;
+
+	if (VirtualFiles::isVirtualPath(srcfile) || VirtualFiles::isVirtualPath(destfile)) {
+		return -EPERM;
+	}
+
+	// Uploads still pending from the journal are for the old names of the files, of the file or of
+	// everything below the directory renamed and of the file replaced
+	if (FSJournal::get().waitForTree(srcfile) || FSJournal::get().waitForTree(destfile)) {
+		return -EIO;
+	}
+
+	string srcPath = srcfile;
+	string destPath = destfile;
+	if (srcPath == destPath) {
+		return 0;
+	} else if (srcPath == "/" || !destPath.compare(0, srcPath.size() + 1, srcPath + "/")) {
+		// A directory can not be moved below itself
+		return -EINVAL;
+	}
+
 	// TODO: Look for work conditions for sharded gridfs and what should be done in that case
-	// TODO: Move out for handling recursive directory structure
 	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		dbc->update(globalFSOptions._filesNS, BSON("filename" << srcfile), 
-			BSON("$set" << BSON("filename" << destfile
-							<< "metadata.filename" << mgridfs::getPathBasename(destfile)
-							)
-					)
-			);
-		BSONObj errorDetail = dbc->getLastErrorDetailed();
-		dbc.done();
-
-		int n = errorDetail.getIntField("n");
+		StorageBackend& backend = StorageBackend::get();
+		BSONObj srcObj = backend.findFile(srcPath);
+		if (srcObj.isEmpty()) {
+			return -ENOENT;
+		}
+		bool isDirectory = !strcmp(srcObj.getObjectField("metadata").getStringField("type"), "directory");
+
+		// Replaces the destination the way rename(2) does, an empty directory only by a directory
+		BSONObj destObj = backend.findFile(destPath);
+		if (!destObj.isEmpty()) {
+			bool destIsDirectory = !strcmp(destObj.getObjectField("metadata").getStringField("type"), "directory");
+			if (destIsDirectory && !isDirectory) {
+				return -EISDIR;
+			} else if (!destIsDirectory && isDirectory) {
+				return -ENOTDIR;
+			} else if (destIsDirectory) {
+				vector<BSONObj> entries;
+				backend.listDirectory(destPath, entries, 1);
+				if (!entries.empty()) {
+					return -ENOTEMPTY;
+				}
+			}
+
+			backend.removeFile(destPath);
+		}
+
+		int n = backend.renamePath(srcPath, destPath, isDirectory);
 		if (n <= 0) {
 			debug() << "Failed to rename requested file {srcfile: " << srcfile << ", destfile: " << destfile << "}" << endl;
 			return -ENOENT;
 		}
+
+		// Local files open under the old names need to follow the files to their new names
+		LocalGridFS::get().renameFile(srcPath, destPath);
+		if (isDirectory) {
+			LocalGridFS::get().renameTree(srcPath, destPath);
+		}
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
@@ -269,13 +391,13 @@ int mgridfs::mgridfs_link(const char *srcfile, const char *destfile) {
 /** Change the permission bits of a file */
 int mgridfs::mgridfs_chmod(const char *file, mode_t mode) {
 	trace() << "-> requested mgridfs_chmod{file: " << file << ", mode: " << std::oct << mode << "}" << endl;
-	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		dbc->update(globalFSOptions._filesNS, BSON("filename" << file), BSON("$set" << BSON("metadata.mode" << mode)));
-		BSONObj errorDetail = dbc->getLastErrorDetailed();
-		dbc.done();
 
-		int n = errorDetail.getIntField("n");
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
+
+	try {
+		int n = StorageBackend::get().updateFile(file, BSON("metadata.mode" << mode));
 		if (n <= 0) {
 			debug() << "Failed to chmod requested file {file: " << file << "}" << endl;
 			return -ENOENT;
@@ -293,13 +415,12 @@ int mgridfs::mgridfs_chmod(const char *file, mode_t mode) {
 int mgridfs::mgridfs_chown(const char *file, uid_t uid, gid_t gid) {
 	trace() << "-> requested mgridfs_chown{file: " << file << ", uid: " << uid << ", gid: " << gid << "}" << endl;
 
-	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		dbc->update(globalFSOptions._filesNS, BSON("filename" << file), BSON("$set" << BSON("metadata.uid" << uid << "metadata.gid" << gid)));
-		BSONObj errorDetail = dbc->getLastErrorDetailed();
-		dbc.done();
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
 
-		int n = errorDetail.getIntField("n");
+	try {
+		int n = StorageBackend::get().updateFile(file, BSON("metadata.uid" << uid << "metadata.gid" << gid));
 		if (n <= 0) {
 			debug() << "Failed to chown requested file {file: " << file << "}" << endl;
 			return -ENOENT;
@@ -316,14 +437,24 @@ int mgridfs::mgridfs_chown(const char *file, uid_t uid, gid_t gid) {
 /** Change the size of a file */
 int mgridfs::mgridfs_truncate(const char *file, off_t len) {
 	trace() << "-> requested mgridfs_truncate{file: " << file << ", len: " << len << "}" << endl;
-	LocalGridFile* localGridFile = LocalGridFS::get().findByName(file);
+
+	if (VirtualFiles::isVirtualPath(file)) {
+		return VirtualFiles::get().truncate(file);
+	}
+
+	// Truncate by path can come in for a file that is not open, take a reference on the local file
+	// for the duration of the call. If this is the only reference, releasing it flushes the change.
+	int retCode = 0;
+	LocalGridFilePtr localGridFile = LocalGridFS::get().acquireFile(file, O_RDWR, retCode);
 	if (!localGridFile) {
-		error() << "Should have found a local file for truncate operation to happen on it {file: "
-			<< file << "}" << endl;
-		return -EBADF;
+		error() << "Failed to open local file for truncate operation to happen on it {file: "
+			<< file << ", retCode: " << retCode << "}" << endl;
+		return (retCode == -EBADF) ? -ENOENT : retCode;
 	}
 
-	if (!localGridFile->setSize(len)) {
+	bool sizeSet = localGridFile->setSize(len);
+	LocalGridFS::get().releaseFile(localGridFile);
+	if (!sizeSet) {
 		error() << "Failed to set specified size for the local file {file: " << file
 			<< ", offset: " << len << "}" << endl;
 		return -EIO;
@@ -339,6 +470,10 @@ int mgridfs::mgridfs_truncate(const char *file, off_t len) {
 int mgridfs::mgridfs_utime(const char *file, struct utimbuf *time) {
 	trace() << "-> requested mgridfs_utime{file: " << file << "}" << endl;
 
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
+
 	Date_t updateTime;
 	if (time) {
 		// Convert seconds to milli seconds
@@ -348,12 +483,7 @@ int mgridfs::mgridfs_utime(const char *file, struct utimbuf *time) {
 	}
 
 	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		dbc->update(globalFSOptions._filesNS, BSON("filename" << file), BSON("$set" << BSON("metadata.lastUpdated" << updateTime)));
-		BSONObj errorDetail = dbc->getLastErrorDetailed();
-		dbc.done();
-
-		int n = errorDetail.getIntField("n");
+		int n = StorageBackend::get().updateFile(file, BSON("metadata.lastUpdated" << updateTime));
 		if (n <= 0) {
 			debug() << "Failed to utime requested file {file: " << file << "}" << endl;
 			return -ENOENT;
@@ -387,79 +517,75 @@ int mgridfs::mgridfs_utime(const char *file, struct utimbuf *time) {
 int mgridfs::mgridfs_open(const char *file, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_open{file: " << file << ", fh: " << ffinfo->fh << ", flags: " << ffinfo->flags << "}" << endl;
 
-	// Assign a new file handle for this open
-	// TODO: check behaviour on the changing a read-only file descriptor to read-write descriptor
-	FileHandle fileHandle(file, 0);
-	ffinfo->fh = fileHandle.assignHandle();
-	if (!ffinfo->fh) {
-		// Failed to generate a file handle, most likely out of resource
-		return -ENFILE;
+	if (VirtualFiles::isVirtualPath(file)) {
+		return VirtualFiles::get().open(file, ffinfo);
 	}
 
 	// First check if this is one of the local files being written currently
-	// If so, it can be opened in read / write modes
-	// TODO: check for handling additional modes likes truncate / append etc
-	LocalGridFile* localGridFile = LocalGridFS::get().findByName(file);
+	// If so, it can be opened in read / write modes sharing the same local file
+	// TODO: check behaviour on the changing a read-only file descriptor to read-write descriptor
+	// TODO: check for handling additional modes likes append etc
+	LocalGridFilePtr localGridFile = LocalGridFS::get().acquireExistingFile(file);
 	if (localGridFile) {
-		return 0;
+		if ((ffinfo->flags & O_ACCMODE) != O_RDONLY && (ffinfo->flags & O_TRUNC) && !localGridFile->setSize(0)) {
+			error() << "Truncate file flag enabled and failed to set local file size to 0 {filename: "
+				<< file << ", truncEnabled: " << (ffinfo->flags & O_TRUNC) << "}" << endl;
+			LocalGridFS::get().releaseFile(localGridFile);
+			return -EIO;
+		}
+
+		return assignLocalFileHandle(file, localGridFile, ffinfo);
 	}
 
 	// For now, support in basic read-only mode to get started
 	debug() << "Flags {AccessFlags: " << (ffinfo->flags & O_ACCMODE) << ", ReadOnly: " <<  ((ffinfo->flags & O_ACCMODE) & O_RDONLY)
 			<< ", AccessMask: " << O_ACCMODE << ", ROMask: " << O_RDONLY << "}" << endl;
 	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		GridFile gridFile = gridFS.findFile(file);
-		dbc.done();
+		BSONObj fileObj = StorageBackend::get().findFile(file);
+		bool exists = !fileObj.isEmpty();
 
 		//TODO: do error checking for local file creation
-		if (gridFile.exists() && ((ffinfo->flags & O_ACCMODE) == O_RDONLY)) {
+		if (exists && ((ffinfo->flags & O_ACCMODE) == O_RDONLY)) {
 			// Do not need local file, read-only data should be read from the server directly until someone else on this
-			// server is writing data
-			return 0;
-		} else if (gridFile.exists() && ((ffinfo->flags & O_ACCMODE) != O_RDONLY)) {
-			// Create local file and let it open with data from the server in certain cases
-			LocalGridFile* localGridFile = LocalGridFS::get().createFile(file);
+			// server is writing data. Reads stay on the version opened, its chunks are kept for the gc delay once
+			// a flush has replaced it.
+			ffinfo->fh = FileHandle::assign(file, fileObj);
+			return ffinfo->fh ? 0 : -ENFILE;
+		} else if (exists && ((ffinfo->flags & O_ACCMODE) != O_RDONLY)) {
+			// Create local file and let it open with data from the server in certain cases. Concurrent
+			// openers of the same file share the local file and the single download of its content.
+			int retCode = 0;
+			localGridFile = LocalGridFS::get().acquireFile(file, ffinfo->flags, retCode);
 			if (!localGridFile) {
-				return -ENOMEM;
-			}
-
-			int retCode = localGridFile->openRemote(ffinfo->flags);
-			if (retCode != 0) {
-				LocalGridFS::get().releaseFile(file);
-				return -EIO;
+				return (retCode == -ENOMEM || retCode == -EROFS) ? retCode : -EIO;
 			}
 
 			if (ffinfo->flags & O_TRUNC && !localGridFile->setSize(0)) {
 				error() << "Truncate file flag enabled and failed to set local file size to 0 {filename: "
 					<< file << ", truncEnabled: " << (ffinfo->flags & O_TRUNC) << "}" << endl;
+				LocalGridFS::get().releaseFile(localGridFile);
 				return -EIO;
 			}
-			return 0;
-		} else if (!gridFile.exists() && (ffinfo->flags & O_CREAT)) {
-			// Create remote file and open local file for the same
-			fileHandle.unassignHandle(); // Unassign the handle since a new handle will be assigned in the create call
 
-			fuse_context* fuseContext = fuse_get_context();
+			return assignLocalFileHandle(file, localGridFile, ffinfo);
+		} else if (!exists && (ffinfo->flags & O_CREAT)) {
+			// Create remote file and open local file for the same
+			fuse_context* fuseContext = getRequestContext();
 			return mgridfs_create(file, fuseContext->umask, ffinfo);
 		} else {
 			// Following conditions are not met for it to be true:
 			// 	- Exists and requested in RO mode
 			// 	- Exists and requested in RW / WO mode
 			// 	- Not exists and requested to be created
-			fileHandle.unassignHandle();
 			return -ENOENT;
 		}
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
-		fileHandle.unassignHandle();
 		return -EIO;
 	}
 
 	//TODO: Support files in read/write mode as well for existing files in the GridFS
-	fileHandle.unassignHandle();
 	return -EACCES;
 }
 
@@ -481,12 +607,23 @@ int mgridfs::mgridfs_read(const char *file, char *data, size_t len, off_t offset
 		return 0;
 	}
 
-	FileHandle fileHandle(file, ffinfo->fh);
-	if (!fileHandle.isValid() || fileHandle.getFilename().empty()) {
+	const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+	if (!fileHandle) {
 		return -EBADF;
 	}
 
-	LocalGridFile* localGridFile = LocalGridFS::get().findByName(fileHandle.getFilename());
+	if (fileHandle->getVirtualFile()) {
+		return fileHandle->getVirtualFile()->read(data, len, offset);
+	}
+
+	// Handles opened read-only do not carry a local file, but should still see the data of a
+	// local file if someone else on this server has opened the file for writing since
+	LocalGridFilePtr localGridFile = fileHandle->getLocalGridFile();
+	if (!localGridFile) {
+		localGridFile = LocalGridFS::get().findByName(fileHandle->getFilename());
+	}
+
+	FSOpContext::recordCache(FSCACHE_LOCAL_FILE, localGridFile.get() != NULL);
 	if (localGridFile) {
 		return localGridFile->read(data, len, offset);
 	} else if ((ffinfo->flags & O_ACCMODE) != O_RDONLY) {
@@ -496,62 +633,43 @@ int mgridfs::mgridfs_read(const char *file, char *data, size_t len, off_t offset
 
 	// If there is no local grid file in the scope, read appropriate data from GridFS directly and copy the same to the specified buffer
 	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		GridFile gridFile = gridFS.findFile(BSON("filename" << file));
-		if (!gridFile.exists()) {
-			warn() << "Requested file not found for reading data {file: " << fileHandle.getFilename() << "}" << endl;
-			dbc.done();
+		BSONObj fileObj = fileHandle->getFileObj();
+		if (fileObj.isEmpty()) {
+			fileObj = FileLookupBatcher::get().findFile(file);
+		}
+
+		if (fileObj.isEmpty()) {
+			warn() << "Requested file not found for reading data {file: " << fileHandle->getFilename() << "}" << endl;
 			return -EBADF;
-		} else if (offset < 0 || offset >= (off_t)gridFile.getContentLength()) {
+		}
+
+		off_t contentLength = fileObj.getField("length").numberLong();
+		if (offset < 0 || offset >= contentLength) {
 			// TODO: Fix the offset logic
 			// EoF reached, return end-of-file 
-			trace() << "Reached end-of-file for the specified request {file: " << fileHandle.getFilename() 
+			trace() << "Reached end-of-file for the specified request {file: " << fileHandle->getFilename() 
 				<< ", offset: " << offset << "}" << endl;
-			dbc.done();
 			return 0;
 		}
 
-		// Else read the appropriate chunks from the server and copy into the buffer
-		unsigned int chunkSize = gridFile.getChunkSize();
-		unsigned int numChunks = gridFile.getNumChunks();
-		//TODO: Implement the file offset tracking for the file
-		//
-		/*
-		off_t startOffset = (offset < 0) ? offset + len : offset;
-		off_t endOffset = (offset < 0) ? 0 : offset;
-		*/
-		unsigned int activeChunkNum = offset / chunkSize;
-		size_t bytesRead = 0;
-		while (bytesRead < len && activeChunkNum < numChunks) {
-			GridFSChunk activeChunk = gridFile.getChunk(activeChunkNum);
-			int bytesToRead = 0;
-			int chunkLen = 0;
-			const char* chunkData = activeChunk.data(chunkLen);
-			if (!chunkData) {
-				warn() << "Encountered NULL chunk data while reading file from remote server {activeChunkNum: " << activeChunkNum 
-					<< "}, will return IO error to the reader." << endl;
-				dbc.done();
-				return -EIO;
-			}
+		// Else read all the chunks covering the request with a single query and copy into the buffer
+		int chunkSize = fileObj.getField("chunkSize").numberInt();
+		len = min(len, (size_t)(contentLength - offset));
+		int firstChunk = offset / chunkSize;
+		int endChunk = (offset + len + chunkSize - 1) / chunkSize;
 
-			if (bytesRead) {
-				// If we are in-between reading data, check on what data is left to be read
-				bytesToRead = min((size_t)chunkLen, (len - bytesRead));
-				memcpy(data + bytesRead, chunkData, bytesToRead);
-			} else {
-				// This is the first chunk we are reading and could be starting from in-between offset of the
-				// chunk that was previously read partially
-				bytesToRead = min((size_t)(chunkLen - (offset % chunkSize)), (size_t)(len - bytesRead));
-				memcpy(data + bytesRead, chunkData + (offset % chunkSize), bytesToRead);
-			}
+		RemoteReadBuffer readBuffer(data, len, offset, chunkSize);
+		int fetched = StorageBackend::get().fetchChunks(fileObj, firstChunk, endChunk,
+			boost::bind(&RemoteReadBuffer::copyChunk, &readBuffer, _1, _2, _3));
 
-			bytesRead += bytesToRead;
-			++activeChunkNum;
+		if (fetched != (endChunk - firstChunk)) {
+			warn() << "Encountered missing chunk data while reading file from remote server {file: " << fileHandle->getFilename()
+				<< ", chunks: [" << firstChunk << ", " << endChunk << "), fetched: " << fetched
+				<< "}, will return IO error to the reader." << endl;
+			return -EIO;
 		}
 
-		dbc.done();
-		return bytesRead;
+		return readBuffer.getBytesRead();
 
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
@@ -597,12 +715,16 @@ int mgridfs::mgridfs_read_buf(const char *file, struct fuse_bufvec **bufp, size_
 int mgridfs::mgridfs_write(const char *file, const char *data, size_t len, off_t offset, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_write{file: " << file << ", fh: " << ffinfo->fh << ", len: " << len << ", offset: " << offset << "}" << endl;
 
-	FileHandle fileHandle(file, ffinfo->fh);
-	if (!fileHandle.isValid()) {
+	const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+	if (!fileHandle) {
 		return -EBADF;
 	}
 
-	LocalGridFile* localGridFile = LocalGridFS::get().findByName(fileHandle.getFilename());
+	if (fileHandle->getVirtualFile()) {
+		return fileHandle->getVirtualFile()->write(data, len, offset);
+	}
+
+	const LocalGridFilePtr& localGridFile = fileHandle->getLocalGridFile();
 	if (!localGridFile) {
 		return -EBADF;
 	}
@@ -650,24 +772,23 @@ int mgridfs::mgridfs_write_buf(const char *file, struct fuse_bufvec *buf, off_t
 int mgridfs::mgridfs_flush(const char *file, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_flush{file: " << file << ", fh: " << ffinfo->fh << "}" << endl;
 
-	FileHandle fileHandle(file, ffinfo->fh);
-	if (!fileHandle.isValid()) {
+	const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+	if (!fileHandle) {
 		return -EBADF;
 	}
 
-	// If read-only mode file, this does not need to be flushed to the database and can be ignored safely
-	if ((ffinfo->flags & O_ACCMODE) == O_RDONLY) {
-		//Unassign the handle before returning
-		//fileHandle.unassignHandle();
+	// If read-only mode file or a virtual file, there is nothing to be flushed to the database
+	if ((ffinfo->flags & O_ACCMODE) == O_RDONLY || fileHandle->getVirtualFile()) {
 		return 0;
 	}
 
-	LocalGridFile* localGridFile = LocalGridFS::get().findByName(fileHandle.getFilename());
+	const LocalGridFilePtr& localGridFile = fileHandle->getLocalGridFile();
 	if (!localGridFile) {
 		return -EBADF;
 	}
 
-	return localGridFile->flush();
+	// Called on every close, through the journal if enabled
+	return localGridFile->flushAsync();
 }
 
 /** Release an open file
@@ -687,22 +808,16 @@ int mgridfs::mgridfs_flush(const char *file, struct fuse_file_info *ffinfo) {
 int mgridfs::mgridfs_release(const char *file, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_release{file: " << file << ", fh: " << ffinfo->fh << "}" << endl;
 
-	FileHandle fileHandle(file, ffinfo->fh);
-	if (fileHandle.isValid()) {
-		// If there is still an active file handle mapping, go through all open file handles for 
-		// the specified file name and make sure all the files are released / closed
-		LocalGridFile* localGridFile = LocalGridFS::get().findByName(fileHandle.getFilename());
+	const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+	if (fileHandle) {
+		// If the handle was backed by a local file, drop its reference. The last handle to release
+		// the file flushes it back to the server, data written through this handle has already been
+		// flushed by the flush() call preceding the release
+		LocalGridFilePtr localGridFile = fileHandle->getLocalGridFile();
+		FileHandle::unassign(ffinfo->fh);
 		if (localGridFile) {
-			if (localGridFile->isDirty()) {
-				localGridFile->flush();
-			}
-
-			LocalGridFS::get().releaseFile(fileHandle.getFilename());
+			LocalGridFS::get().releaseFile(localGridFile);
 		}
-
-		// Release all handles associated with this filename
-		//FileHandle::unassignAllHandles(fileHandle.getFilename());
-		fileHandle.unassignHandle();
 	}
 
 	return 0;
@@ -718,27 +833,34 @@ int mgridfs::mgridfs_release(const char *file, struct fuse_file_info *ffinfo) {
 int mgridfs::mgridfs_fsync(const char *file, int param, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_fsync{file: " << file << ", fh: " << ffinfo->fh << ", param: " << param << "}" << endl;
 
-	FileHandle fileHandle(file, ffinfo->fh);
-	if (!fileHandle.isValid()) {
+	const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+	if (!fileHandle) {
 		return -EBADF;
 	}
 
-	// If read-only mode file, this does not need to be flushed to the database and can be ignored safely
-	if ((ffinfo->flags & O_ACCMODE) == O_RDONLY) {
+	// If read-only mode file or a virtual file, there is nothing to be flushed to the database
+	if ((ffinfo->flags & O_ACCMODE) == O_RDONLY || fileHandle->getVirtualFile()) {
 		return 0;
 	}
 
-	LocalGridFile* localGridFile = LocalGridFS::get().findByName(fileHandle.getFilename());
+	const LocalGridFilePtr& localGridFile = fileHandle->getLocalGridFile();
 	if (!localGridFile) {
 		return -EBADF;
 	}
 
-	return localGridFile->flush();
+	// Content flushed on earlier closes has to be on the server as well, not only in the journal
+	int retCode = localGridFile->flush();
+	return retCode ? retCode : FSJournal::get().waitForFile(localGridFile->getFilename());
 }
 
 /** Set extended attributes */
 int mgridfs::mgridfs_setxattr(const char *file, const char *name, const char *value, size_t len, int flags) {
 	trace() << "-> requested mgridfs_setxattr{file: " << file << ", name: " << name << ", len: " << len << "}" << endl;
+
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
+
 	//TODO: change the implementation
 	return 0;
 }
@@ -746,6 +868,11 @@ int mgridfs::mgridfs_setxattr(const char *file, const char *name, const char *va
 /** Get extended attributes */
 int mgridfs::mgridfs_getxattr(const char *file, const char *name, char *value, size_t len) {
 	trace() << "-> requested mgridfs_getxattr{file: " << file << ", name: " << name << ", len: " << len << "}" << endl;
+
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -ENODATA;
+	}
+
 	//TODO: change the implementation
 	if (len > 0) {
 		value[0] = '\0';
@@ -756,6 +883,11 @@ int mgridfs::mgridfs_getxattr(const char *file, const char *name, char *value, s
 /** List extended attributes */
 int mgridfs::mgridfs_listxattr(const char *file, char *buffer, size_t len) {
 	trace() << "-> requested mgridfs_listxattr{file: " << file << ", buflen: " << len << "}" << endl;
+
+	if (VirtualFiles::isVirtualPath(file)) {
+		return 0;
+	}
+
 	//TODO: change the implementation
 	// for now, do nothing and don't support any additional attributes
 	if (len > 0) {
@@ -767,6 +899,11 @@ int mgridfs::mgridfs_listxattr(const char *file, char *buffer, size_t len) {
 /** Remove extended attributes */
 int mgridfs::mgridfs_removexattr(const char *file, const char *attr) {
 	trace() << "-> requested mgridfs_removexattr{file: " << file << ", attr: " << attr << "}" << endl;
+
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
+
 	if (globalFSOptions._metadataKeyMap.left.find(attr) == globalFSOptions._metadataKeyMap.left.end()) {
 		// It is not one of the core attributes of thr GridFS file and will go under metadata.xattr object
 		string xAttr = METADATA_XATTR_PREFIX + attr;
@@ -793,19 +930,22 @@ int mgridfs::mgridfs_removexattr(const char *file, const char *attr) {
  */
 int mgridfs::mgridfs_create(const char *file, mode_t fileMode, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_create{file: " << file << ", fh: " << ffinfo->fh << ", mode: " << std::oct << fileMode << "}" << endl;
+
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
+
 	// From man-page: creat() is equivalent to open() with flags equal to O_CREAT|O_WRONLY|O_TRUNC.
 	fileMode |= S_IFREG;
 
 	try {
-		fuse_context* fuseContext = fuse_get_context();
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
+		fuse_context* fuseContext = getRequestContext();
+		StorageBackend& backend = StorageBackend::get();
 
 		// Create an empty file to signify the file creation and open a local file for the same
-		BSONObj fileObj = gridFS.storeFile("", 0, file);
+		BSONObj fileObj = backend.storeFile("", 0, file);
 		if (!fileObj.isValid()) {
 			warn() << "Failed to create file for {path: " << file << "}" << std::endl;
-			dbc.done();
 			return -EBADF;
 		}
 
@@ -814,15 +954,13 @@ int mgridfs::mgridfs_create(const char *file, mode_t fileMode, struct fuse_file_
 			<< "}" << std::endl;
 		BSONElement fileObjId = fileObj.getField("_id");
 
-		dbc->update(globalFSOptions._filesNS, BSON("_id" << fileObjId.OID()), BSON("$set" << BSON("metadata.type" << "file"
+		backend.updateFileById(fileObjId, BSON("metadata.type" << "file"
 						<< "metadata.filename" << mgridfs::getPathBasename(file)
 						<< "metadata.directory" << mgridfs::getPathDirname(file)
 						<< "metadata.lastUpdated" << jsTime()
 						<< "metadata.uid" << fuseContext->uid
 						<< "metadata.gid" << fuseContext->gid
-						<< "metadata.mode" << fileMode)));
-		dbc.done();
-
+						<< "metadata.mode" << fileMode));
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 				<< ", exception: " << e.toString() << "}" << endl;
@@ -830,20 +968,12 @@ int mgridfs::mgridfs_create(const char *file, mode_t fileMode, struct fuse_file_
 	}
 
 	// Now since the file is created on MongoDB GridFS, create a local cache file to represent the remote file
-	FileHandle fileHandle(file, 0);
-	ffinfo->fh = fileHandle.assignHandle();
-	if (!ffinfo->fh) {
-		// Most likely failed to generate file handle because it ran out of it.
-		return -ENFILE;
-	}
-
-	LocalGridFile* localGridFile = LocalGridFS::get().createFile(file);
+	LocalGridFilePtr localGridFile = LocalGridFS::get().createFile(file);
 	if (!localGridFile) {
-		fileHandle.unassignHandle();
 		return -ENOMEM;
 	}
 
-	return 0;
+	return assignLocalFileHandle(file, localGridFile, ffinfo);
 }
 
 /**
@@ -860,12 +990,23 @@ int mgridfs::mgridfs_create(const char *file, mode_t fileMode, struct fuse_file_
  */
 int mgridfs::mgridfs_ftruncate(const char *file, off_t offset, struct fuse_file_info *ffinfo) {
 	trace() << "-> requested mgridfs_ftruncate{file: " << file << ", fh: " << ffinfo->fh << ", offset: " << offset << "}" << endl;
-	FileHandle fileHandle(file, ffinfo->fh);
-	if (!fileHandle.isValid()) {
+	const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+	if (!fileHandle) {
 		return -EBADF;
 	}
 
-	return mgridfs_truncate(fileHandle.getFilename().c_str(), offset);
+	const LocalGridFilePtr& localGridFile = fileHandle->getLocalGridFile();
+	if (!localGridFile) {
+		return mgridfs_truncate(fileHandle->getFilename().c_str(), offset);
+	}
+
+	if (!localGridFile->setSize(offset)) {
+		error() << "Failed to set specified size for the local file {file: " << fileHandle->getFilename()
+			<< ", offset: " << offset << "}" << endl;
+		return -EIO;
+	}
+
+	return 0;
 }
 
 /**
@@ -920,6 +1061,10 @@ int mgridfs::mgridfs_lock(const char *path, struct fuse_file_info *ffinfo, int c
 int mgridfs::mgridfs_utimens(const char *file, const struct timespec tv[2]) {
 	trace() << "-> requested mgridfs_utimens{file: " << file << "}" << endl;
 
+	if (VirtualFiles::isVirtualPath(file)) {
+		return -EPERM;
+	}
+
 	struct utimbuf tm = {};
 	if (!tv[1].tv_sec) {
 		tm.actime = tv[0].tv_sec;
@@ -961,7 +1106,70 @@ int mgridfs::mgridfs_bmap(const char *file, size_t blocksize, uint64_t *idx) {
 int mgridfs::mgridfs_ioctl(const char *file, int cmd, void *arg, struct fuse_file_info *ffinfo, unsigned int flags, void *data) {
 	trace() << "-> requested mgridfs_ioctl{file: " << file << ", fh: " << ffinfo->fh << ", cmd: " << cmd << "flags: " << flags << "}" << endl;
 
-	return -ENOTSUP;
+	if ((unsigned int)cmd == MGRIDFS_IOC_CONTROL) {
+		// Any file on the mount will do for the ioctl, unlike the control file its mode protects
+		// nothing, so only the user the file system runs as and root may control it
+		if (!isMountOwnerRequest()) {
+			warn() << "Rejected control request from another user {uid: " << getRequestContext()->uid << "}" << endl;
+			return -EPERM;
+		}
+
+		// Same commands as the control file, the response replaces the request in the buffer
+		mgridfs_control_request* request = (mgridfs_control_request*)data;
+		request->_request[sizeof(request->_request) - 1] = 0;
+
+		string response;
+		int retCode = FSControl::get().execute(request->_request, response);
+		strncpy(request->_request, response.c_str(), sizeof(request->_request) - 1);
+		request->_request[sizeof(request->_request) - 1] = 0;
+		return retCode;
+	}
+
+	if ((unsigned int)cmd == MGRIDFS_IOC_CLONE) {
+		mgridfs_clone_request* request = (mgridfs_clone_request*)data;
+		request->_srcPath[sizeof(request->_srcPath) - 1] = 0;
+		string srcPath = request->_srcPath;
+		if (VirtualFiles::isVirtualPath(file) || VirtualFiles::isVirtualPath(srcPath.c_str())) {
+			return -EPERM;
+		}
+
+		if ((ffinfo->flags & O_ACCMODE) == O_RDONLY) {
+			return -EBADF;
+		}
+
+		if (srcPath == file) {
+			return -EINVAL;
+		}
+
+		// Source is never opened by the kernel, so default_permissions has not checked it either
+		struct stat srcStat;
+		int retCode = mgridfs_getattr(srcPath.c_str(), &srcStat);
+		if (retCode) {
+			return retCode;
+		}
+		if (!hasRequestAccess(srcStat, R_OK)) {
+			return -EACCES;
+		}
+
+		// Server has to have the latest content of the source, unflushed writes to the source are
+		// part of the clone as they would be with FICLONE
+		LocalGridFilePtr srcGridFile = LocalGridFS::get().findByName(srcPath);
+		if (srcGridFile && srcGridFile->isDirty()) {
+			retCode = srcGridFile->flush();
+			if (retCode) {
+				return retCode;
+			}
+		}
+
+		const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+		LocalGridFilePtr localGridFile = fileHandle ? fileHandle->getLocalGridFile() : LocalGridFilePtr();
+		if (localGridFile) {
+			return localGridFile->cloneFrom(srcPath);
+		}
+		return LocalMemoryGridFile::cloneContent(srcPath, file);
+	}
+
+	return -ENOTTY;
 }
 
 /**
@@ -1027,12 +1235,12 @@ int mgridfs::mgridfs_fallocate(const char *file, int mode, off_t offset, off_t l
 	trace() << "-> requested mgridfs_fallocate{file: " << file << ", fh: " << ffinfo->fh << ", mode: " << std::oct << mode 
 			<< ", offset: " << offset << ", len: " << len << "}" << endl;
 
-	FileHandle fileHandle(file, ffinfo->fh);
-	if (!fileHandle.isValid()) {
+	const FileHandle* fileHandle = FileHandle::lookup(ffinfo->fh);
+	if (!fileHandle) {
 		return -EBADF;
 	}
 
-	LocalGridFile* localGridFile = LocalGridFS::get().findByName(fileHandle.getFilename());
+	const LocalGridFilePtr& localGridFile = fileHandle->getLocalGridFile();
 	if (!localGridFile) {
 		return -EBADF;
 	}
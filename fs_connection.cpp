@@ -0,0 +1,228 @@
+#include "fs_connection.h"
+#include "fs_options.h"
+#include "fs_logger.h"
+
+using namespace mgridfs;
+using namespace mongo;
+
+namespace {
+	// Error code used when the connection to the server cannot be (re-)established
+	const int CONNECT_FAILURE_CODE = 17900;
+}
+
+FSConnection::FSConnection()
+	: _lastUsed(0), _suspect(false) {
+}
+
+FSConnection::~FSConnection() {
+	// GridFS holds a reference to the connection, tear it down first
+	_gridFS.reset();
+	_conn.reset();
+}
+
+void FSConnection::connect() {
+	_gridFS.reset();
+	_conn.reset(new DBClientConnection(false, 0, 0));
+
+	string errmsg;
+	if (!_conn->connect(globalFSOptions._connectString, errmsg)) {
+		error() << "Failed to connect to server {server: " << globalFSOptions._connectString
+			<< ", error: " << errmsg << "}" << endl;
+		_conn.reset();
+		uasserted(CONNECT_FAILURE_CODE, "mgridfs failed to connect to " + globalFSOptions._connectString + ": " + errmsg);
+	}
+
+	// Namespaces and the GridFS context (including the index check it does on construction) are
+	// prepared once per connection rather than once per operation
+	_gridFS.reset(new GridFS(*_conn, globalFSOptions._db, globalFSOptions._collPrefix));
+	_suspect = false;
+	_lastUsed = time(NULL);
+	debug() << "Established connection to server {server: " << globalFSOptions._connectString << "}" << endl;
+}
+
+void FSConnection::ensureHealthy() {
+	if (!_conn || !_gridFS) {
+		connect();
+		return;
+	}
+
+	if (_conn->isFailed()) {
+		info() << "Connection to server found failed, reconnecting {server: " << globalFSOptions._connectString << "}" << endl;
+		connect();
+		return;
+	}
+
+	// Only verify with the server in case the connection has been idle long enough to have been
+	// dropped from the other end, or was abandoned in the middle of an operation
+	time_t now = time(NULL);
+	if (!_suspect && (now - _lastUsed) < (time_t)globalFSOptions._connHealthCheckInterval) {
+		return;
+	}
+
+	bool healthy = _conn->isStillConnected();
+	if (healthy && _suspect) {
+		try {
+			BSONObj info;
+			healthy = _conn->runCommand("admin", BSON("ping" << 1), info);
+		} catch (DBException& e) {
+			debug() << "Ping failed on suspect connection {code: " << e.getCode() << ", what: " << e.what() << "}" << endl;
+			healthy = false;
+		}
+	}
+
+	if (!healthy) {
+		info() << "Connection to server is not healthy, reconnecting {server: " << globalFSOptions._connectString
+			<< ", idleSecs: " << (now - _lastUsed) << ", suspect: " << _suspect << "}" << endl;
+		connect();
+		return;
+	}
+
+	_suspect = false;
+}
+
+FSConnectionManager::ThreadState::~ThreadState() {
+	// Called on thread exit. Owned connections of worker threads go away with the thread, borrowed
+	// connections are always returned by the time the thread is done with its operation.
+	if (!_auxiliary && _connection) {
+		delete _connection;
+		_connection = NULL;
+		FSConnectionManager::get().threadConnectionClosed();
+	}
+}
+
+FSConnectionManager::FSConnectionManager()
+	: _auxConnectionCount(0), _threadConnectionCount(0) {
+}
+
+FSConnectionManager::~FSConnectionManager() {
+	boost::mutex::scoped_lock lock(_poolLock);
+	for (vector<FSConnection*>::iterator pIt = _idleAuxConnections.begin(); pIt != _idleAuxConnections.end(); ++pIt) {
+		delete *pIt;
+	}
+	_idleAuxConnections.clear();
+}
+
+FSConnectionManager& FSConnectionManager::get() {
+	static FSConnectionManager instance;
+	return instance;
+}
+
+FSConnectionManager::ThreadState& FSConnectionManager::getThreadState() {
+	ThreadState* threadState = _threadState.get();
+	if (!threadState) {
+		threadState = new ThreadState();
+		_threadState.reset(threadState);
+	}
+	return *threadState;
+}
+
+void FSConnectionManager::setAuxiliaryThread() {
+	ThreadState& threadState = getThreadState();
+	if (!threadState._auxiliary && threadState._connection) {
+		// Give up the owned connection, from now on this thread borrows from the pool
+		delete threadState._connection;
+		threadState._connection = NULL;
+		threadConnectionClosed();
+	}
+	threadState._auxiliary = true;
+}
+
+FSConnection* FSConnectionManager::acquire() {
+	ThreadState& threadState = getThreadState();
+	if (threadState._connection) {
+		++threadState._depth;
+		return threadState._connection;
+	}
+
+	if (threadState._auxiliary) {
+		threadState._connection = borrowAuxConnection();
+	} else {
+		threadState._connection = new FSConnection();
+		boost::mutex::scoped_lock lock(_poolLock);
+		++_threadConnectionCount;
+		debug() << "Created thread connection {threadConnections: " << _threadConnectionCount << "}" << endl;
+	}
+
+	threadState._depth = 1;
+	return threadState._connection;
+}
+
+void FSConnectionManager::release(FSConnection* connection, bool healthy) {
+	if (!healthy) {
+		connection->markSuspect();
+	}
+	connection->markUsed();
+
+	ThreadState& threadState = getThreadState();
+	if (--threadState._depth > 0 || !threadState._auxiliary) {
+		return;
+	}
+
+	threadState._connection = NULL;
+	returnAuxConnection(connection, healthy);
+}
+
+FSConnection* FSConnectionManager::borrowAuxConnection() {
+	boost::mutex::scoped_lock lock(_poolLock);
+	for (;;) {
+		if (!_idleAuxConnections.empty()) {
+			FSConnection* connection = _idleAuxConnections.back();
+			_idleAuxConnections.pop_back();
+			return connection;
+		}
+
+		if (_auxConnectionCount < globalFSOptions._auxConnPoolSize) {
+			++_auxConnectionCount;
+			debug() << "Created auxiliary connection {auxConnections: " << _auxConnectionCount
+				<< ", max: " << globalFSOptions._auxConnPoolSize << "}" << endl;
+			return new FSConnection();
+		}
+
+		_poolAvailable.wait(lock);
+	}
+}
+
+void FSConnectionManager::returnAuxConnection(FSConnection* connection, bool healthy) {
+	boost::mutex::scoped_lock lock(_poolLock);
+	if (_auxConnectionCount > globalFSOptions._auxConnPoolSize) {
+		// Pool ceiling has been lowered since the connection was created
+		--_auxConnectionCount;
+		delete connection;
+	} else {
+		_idleAuxConnections.push_back(connection);
+	}
+	_poolAvailable.notify_one();
+}
+
+void FSConnectionManager::threadConnectionClosed() {
+	boost::mutex::scoped_lock lock(_poolLock);
+	--_threadConnectionCount;
+}
+
+size_t FSConnectionManager::getThreadConnectionCount() const {
+	boost::mutex::scoped_lock lock(_poolLock);
+	return _threadConnectionCount;
+}
+
+size_t FSConnectionManager::getAuxConnectionCount() const {
+	boost::mutex::scoped_lock lock(_poolLock);
+	return _auxConnectionCount;
+}
+
+ScopedFSConnection::ScopedFSConnection()
+	: _connection(FSConnectionManager::get().acquire()), _done(false) {
+	try {
+		_connection->ensureHealthy();
+	} catch (...) {
+		FSConnectionManager::get().release(_connection, false);
+		throw;
+	}
+}
+
+ScopedFSConnection::~ScopedFSConnection() {
+	FSConnectionManager::get().release(_connection, _done);
+}
+
+void ScopedFSConnection::done() {
+	_done = true;
+}
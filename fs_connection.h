@@ -0,0 +1,124 @@
+#ifndef mgridfs_fs_connection_h
+#define mgridfs_fs_connection_h
+
+#include <ctime>
+#include <vector>
+
+#include <boost/utility.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <mongo/client/dbclient.h>
+#include <mongo/client/gridfs.h>
+
+using namespace std;
+
+namespace mgridfs {
+
+/**
+ * Long-lived connection to the server along with the GridFS context prepared for it.
+ *
+ * Each FUSE worker thread owns one of these for its lifetime, auxiliary threads (background
+ * flush, prefetch etc.) borrow one from a bounded pool. A connection is checked before being
+ * handed out and transparently re-established if it has failed.
+ */
+class FSConnection : protected boost::noncopyable {
+public:
+	FSConnection();
+	~FSConnection();
+
+	// Makes sure the connection is usable, reconnecting if required. Throws DBException in case the
+	// server cannot be reached.
+	void ensureHealthy();
+
+	inline mongo::DBClientConnection& conn() { return *_conn; }
+	inline mongo::GridFS& gridFS() { return *_gridFS; }
+
+	// Connection was given up in the middle of an operation (e.g. on an exception) and needs to be
+	// verified with the server before next use
+	inline void markSuspect() { _suspect = true; }
+	inline void markUsed() { _lastUsed = time(NULL); }
+
+private:
+	boost::scoped_ptr<mongo::DBClientConnection> _conn;
+	boost::scoped_ptr<mongo::GridFS> _gridFS;
+	time_t _lastUsed;
+	bool _suspect;
+
+	void connect();
+};
+
+class FSConnectionManager : protected boost::noncopyable {
+public:
+	static FSConnectionManager& get();
+
+	// Marks the calling thread as an auxiliary thread that borrows connections from the bounded
+	// pool for the duration of each operation, instead of owning a connection
+	void setAuxiliaryThread();
+
+	// Returns connection for the calling thread, a nested acquire on the same thread returns the
+	// same connection. Blocks for auxiliary threads in case the pool is at its ceiling.
+	FSConnection* acquire();
+	void release(FSConnection* connection, bool healthy);
+
+	size_t getThreadConnectionCount() const;
+	size_t getAuxConnectionCount() const;
+
+private:
+	FSConnectionManager();
+	~FSConnectionManager();
+
+	struct ThreadState {
+		ThreadState() : _connection(NULL), _auxiliary(false), _depth(0) {}
+		~ThreadState();
+
+		FSConnection* _connection;
+		bool _auxiliary;
+		int _depth;
+	};
+
+	boost::thread_specific_ptr<ThreadState> _threadState;
+
+	ThreadState& getThreadState();
+
+	// Following are guarded by _poolLock
+	mutable boost::mutex _poolLock;
+	boost::condition_variable _poolAvailable;
+	vector<FSConnection*> _idleAuxConnections;
+	size_t _auxConnectionCount;
+	size_t _threadConnectionCount;
+
+	FSConnection* borrowAuxConnection();
+	void returnAuxConnection(FSConnection* connection, bool healthy);
+	void threadConnectionClosed();
+};
+
+/**
+ * Drop-in replacement for ScopedDbConnection on the file system operations path. Uses the
+ * connection of the calling thread instead of going through the global connection pool and
+ * gives access to a GridFS instance prepared for the connection.
+ *
+ * As with ScopedDbConnection, done() should be called once the connection has been used
+ * successfully. Otherwise the connection is verified with the server before its next use.
+ */
+class ScopedFSConnection : protected boost::noncopyable {
+public:
+	ScopedFSConnection();
+	~ScopedFSConnection();
+
+	inline mongo::DBClientBase& conn() { return _connection->conn(); }
+	inline mongo::DBClientBase* operator->() { return &_connection->conn(); }
+	inline mongo::GridFS& gridFS() { return _connection->gridFS(); }
+
+	void done();
+
+private:
+	FSConnection* _connection;
+	bool _done;
+};
+
+}
+
+#endif
@@ -0,0 +1,442 @@
+#include "fs_control.h"
+#include "file_meta_ops.h"
+#include "fs_options.h"
+#include "fs_logger.h"
+#include "fs_stats.h"
+#include "buffer_budget.h"
+#include "chunk_pool.h"
+#include "fs_journal.h"
+#include "local_gridfs.h"
+#include "storage_backend.h"
+#include "virtual_files.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <malloc.h>
+
+#include <boost/bind.hpp>
+
+using namespace mgridfs;
+using namespace mongo;
+
+namespace {
+	// Checks the caller may remove the directory as rmdir would once emptied and the entries in
+	// it, by the attributes getattr reports: search on every ancestor, write and search on the
+	// parent and on the directory itself. Files further down are not checked.
+	int checkRemoveTreeAccess(const string& path, string& response) {
+		for (size_t pos = 0; pos != string::npos; pos = path.find('/', pos + 1)) {
+			string ancestor = pos ? path.substr(0, pos) : "/";
+			bool isParent = path.find('/', pos + 1) == string::npos;
+			struct stat ancestorStat;
+			int retCode = mgridfs_getattr(ancestor.c_str(), &ancestorStat);
+			if (retCode) {
+				response = "failed to check the access to: " + ancestor;
+				return retCode;
+			}
+
+			if (!hasRequestAccess(ancestorStat, isParent ? (W_OK | X_OK) : X_OK)) {
+				response = "permission denied: " + ancestor;
+				return -EACCES;
+			}
+		}
+
+		struct stat dirStat;
+		int retCode = mgridfs_getattr(path.c_str(), &dirStat);
+		if (retCode) {
+			response = "failed to check the access to: " + path;
+			return retCode;
+		}
+
+		if (!hasRequestAccess(dirStat, W_OK | X_OK)) {
+			response = "permission denied: " + path;
+			return -EACCES;
+		}
+		return 0;
+	}
+
+	string toString(size_t value) {
+		ostringstream os;
+		os << value;
+		return os.str();
+	}
+
+	// Parses a positive number, the whole value has to be numeric
+	bool parseCount(const string& value, size_t& count) {
+		char* end = NULL;
+		unsigned long parsed = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end || !parsed) {
+			return false;
+		}
+
+		count = parsed;
+		return true;
+	}
+
+	bool setLogLevel(const string& value) {
+		string upperValue = value;
+		LogLevel logLevel = FSLogManager::get().stringToLogLevel(toUpper(&upperValue[0]));
+		if (logLevel == LL_INVALID) {
+			return false;
+		}
+
+		globalFSOptions._logLevel = logLevel;
+		FSLogManager::get().setLogLevel(logLevel);
+		return true;
+	}
+
+	string getLogLevel() {
+		return FSLogManager::get().logLevelToString(FSLogManager::get().getLogLevel());
+	}
+
+	bool setMemChunkSize(const string& value) {
+		size_t chunkSizeKB = 0;
+		if (!parseCount(value, chunkSizeKB)) {
+			return false;
+		}
+
+		globalFSOptions._memChunkSize = chunkSizeKB * 1024;
+		globalFSOptions._maxMemFileSize = globalFSOptions._memChunkSize * globalFSOptions._maxMemFileChunks;
+		return true;
+	}
+
+	string getMemChunkSize() {
+		return toString(globalFSOptions._memChunkSize / 1024);
+	}
+
+	bool setMaxMemFileChunks(const string& value) {
+		size_t maxChunks = 0;
+		if (!parseCount(value, maxChunks)) {
+			return false;
+		}
+
+		globalFSOptions._maxMemFileChunks = maxChunks;
+		globalFSOptions._maxMemFileSize = globalFSOptions._memChunkSize * globalFSOptions._maxMemFileChunks;
+		return true;
+	}
+
+	string getMaxMemFileChunks() {
+		return toString(globalFSOptions._maxMemFileChunks);
+	}
+
+	void configureBufferBudget() {
+		BufferBudget::get().configure(globalFSOptions._memBudget, globalFSOptions._memHighWatermark,
+			globalFSOptions._memLowWatermark, globalFSOptions._memThrottleMillis);
+	}
+
+	bool setMemBudgetMB(const string& value) {
+		size_t budgetMB = 0;
+		if (!parseCount(value, budgetMB)) {
+			return false;
+		}
+
+		globalFSOptions._memBudget = budgetMB * 1024 * 1024;
+		configureBufferBudget();
+		return true;
+	}
+
+	string getMemBudgetMB() {
+		return toString(globalFSOptions._memBudget / (1024 * 1024));
+	}
+
+	bool setMemThrottleMillis(const string& value) {
+		if (!parseCount(value, globalFSOptions._memThrottleMillis)) {
+			return false;
+		}
+
+		configureBufferBudget();
+		return true;
+	}
+
+	string getMemThrottleMillis() {
+		return toString(globalFSOptions._memThrottleMillis);
+	}
+
+	bool setDirtyExpireSecs(const string& value) {
+		return parseCount(value, globalFSOptions._dirtyExpireSecs);
+	}
+
+	string getDirtyExpireSecs() {
+		return toString(globalFSOptions._dirtyExpireSecs);
+	}
+
+	bool setDirtyRatio(const string& value) {
+		size_t dirtyRatio = 0;
+		if (!parseCount(value, dirtyRatio) || dirtyRatio > 100) {
+			return false;
+		}
+
+		globalFSOptions._dirtyRatio = dirtyRatio;
+		return true;
+	}
+
+	string getDirtyRatio() {
+		return toString(globalFSOptions._dirtyRatio);
+	}
+
+	bool setGCDelaySecs(const string& value) {
+		return parseCount(value, globalFSOptions._gcDelaySecs);
+	}
+
+	string getGCDelaySecs() {
+		return toString(globalFSOptions._gcDelaySecs);
+	}
+
+	bool setGCChunksPerSec(const string& value) {
+		size_t gcChunksPerSec = 0;
+		if (!parseCount(value, gcChunksPerSec) || !gcChunksPerSec) {
+			return false;
+		}
+
+		globalFSOptions._gcChunksPerSec = gcChunksPerSec;
+		return true;
+	}
+
+	string getGCChunksPerSec() {
+		return toString(globalFSOptions._gcChunksPerSec);
+	}
+
+	bool setAuxConnPoolSize(const string& value) {
+		return parseCount(value, globalFSOptions._auxConnPoolSize);
+	}
+
+	string getAuxConnPoolSize() {
+		return toString(globalFSOptions._auxConnPoolSize);
+	}
+
+	bool setConnHealthCheckSecs(const string& value) {
+		return parseCount(value, globalFSOptions._connHealthCheckInterval);
+	}
+
+	string getConnHealthCheckSecs() {
+		return toString(globalFSOptions._connHealthCheckInterval);
+	}
+
+	bool setSlowOpMillis(const string& value) {
+		if (!parseCount(value, globalFSOptions._slowOpMillis)) {
+			return false;
+		}
+
+		FSStats::setSlowOpThreshold(globalFSOptions._slowOpMillis * 1000);
+		return true;
+	}
+
+	string getSlowOpMillis() {
+		return toString(globalFSOptions._slowOpMillis);
+	}
+
+	// Settings that can be changed live, named as the command-line options setting them
+	struct FSSetting {
+		const char* _name;
+		bool (*_set)(const string& value);
+		string (*_get)();
+	};
+
+	const FSSetting SETTINGS[] = {
+		{ "logLevel", setLogLevel, getLogLevel },
+		{ "memChunkSize", setMemChunkSize, getMemChunkSize },
+		{ "maxMemFileChunks", setMaxMemFileChunks, getMaxMemFileChunks },
+		{ "memBudgetMB", setMemBudgetMB, getMemBudgetMB },
+		{ "memThrottleMillis", setMemThrottleMillis, getMemThrottleMillis },
+		{ "dirtyExpireSecs", setDirtyExpireSecs, getDirtyExpireSecs },
+		{ "dirtyRatio", setDirtyRatio, getDirtyRatio },
+		{ "gcDelaySecs", setGCDelaySecs, getGCDelaySecs },
+		{ "gcChunksPerSec", setGCChunksPerSec, getGCChunksPerSec },
+		{ "auxConnPoolSize", setAuxConnPoolSize, getAuxConnPoolSize },
+		{ "connHealthCheckSecs", setConnHealthCheckSecs, getConnHealthCheckSecs },
+		{ "slowOpMillis", setSlowOpMillis, getSlowOpMillis },
+	};
+
+	const size_t SETTING_COUNT = sizeof(SETTINGS) / sizeof(SETTINGS[0]);
+
+	string trim(const string& value) {
+		size_t first = value.find_first_not_of(" \t\r\n");
+		if (first == string::npos) {
+			return "";
+		}
+
+		return value.substr(first, value.find_last_not_of(" \t\r\n") - first + 1);
+	}
+}
+
+FSControl::FSControl() {
+}
+
+FSControl& FSControl::get() {
+	static FSControl instance;
+	return instance;
+}
+
+int FSControl::execute(const string& command, string& response) {
+	string request = trim(command);
+	size_t nameEnd = request.find_first_of(" \t");
+	string name = request.substr(0, nameEnd);
+	string argument = (nameEnd == string::npos) ? "" : trim(request.substr(nameEnd));
+
+	int retCode = 0;
+	if (name == "flush" && argument.empty()) {
+		retCode = flush(response);
+	} else if (name == "dropcaches" && argument.empty()) {
+		retCode = dropCaches(response);
+	} else if (name == "set" && !argument.empty()) {
+		retCode = set(argument, response);
+	} else if (name == "rmtree" && !argument.empty()) {
+		retCode = removeTree(argument, response);
+	} else {
+		response = "unknown command, expected one of flush, dropcaches, set <name>=<value>, rmtree <dir>";
+		retCode = -EINVAL;
+	}
+
+	info() << "Executed control command {command: " << request << ", retCode: " << retCode << ", response: " << response << "}" << endl;
+	return retCode;
+}
+
+string FSControl::getSettings() const {
+	ostringstream os;
+	for (size_t i = 0; i < SETTING_COUNT; ++i) {
+		os << SETTINGS[i]._name << ": " << SETTINGS[i]._get() << "\n";
+	}
+	return os.str();
+}
+
+string FSControl::getStatus() const {
+	ostringstream os;
+	os << getSettings();
+
+	boost::mutex::scoped_lock lock(_lock);
+	for (map<string, int>::const_iterator rIt = _treeRemovals.begin(); rIt != _treeRemovals.end(); ++rIt) {
+		os << "rmtree " << rIt->first << ": removed " << rIt->second << "\n";
+	}
+	return os.str();
+}
+
+int FSControl::flush(string& response) {
+	size_t flushed = 0;
+	size_t failed = 0;
+	LocalGridFS::get().flushAllFiles(flushed, failed);
+
+	ostringstream os;
+	os << "flushed: " << flushed << ", failed: " << failed;
+	response = os.str();
+	return failed ? -EIO : 0;
+}
+
+int FSControl::dropCaches(string& response) {
+	// Content of the open files is all there is cached locally. The buffers of the files not in use
+	// are freed and reloaded on their next access, the freed memory is returned to the system.
+	int retCode = flush(response);
+	size_t released = LocalGridFS::get().reclaimBuffers((size_t)-1);
+	ChunkPool::get().trim();
+	malloc_trim(0);
+
+	ostringstream os;
+	os << ", released: " << released << ", trimmed: true";
+	response += os.str();
+	return retCode;
+}
+
+int FSControl::set(const string& assignment, string& response) {
+	size_t equalsPos = assignment.find('=');
+	string name = trim(assignment.substr(0, equalsPos));
+	string value = (equalsPos == string::npos) ? "" : trim(assignment.substr(equalsPos + 1));
+
+	for (size_t i = 0; i < SETTING_COUNT; ++i) {
+		if (name != SETTINGS[i]._name) {
+			continue;
+		}
+
+		string oldValue = SETTINGS[i]._get();
+		if (value.empty() || !SETTINGS[i]._set(value)) {
+			response = "invalid value for " + name + ": " + value;
+			return -EINVAL;
+		}
+
+		response = name + ": " + oldValue + " -> " + SETTINGS[i]._get();
+		return 0;
+	}
+
+	response = "unknown setting: " + name;
+	return -EINVAL;
+}
+
+int FSControl::removeTree(const string& directory, string& response) {
+	string path = directory;
+	while (path.size() > 1 && path[path.size() - 1] == '/') {
+		path.erase(path.size() - 1);
+	}
+
+	if (path.empty() || path[0] != '/' || path == "/" || VirtualFiles::isVirtualPath(path.c_str())) {
+		response = "invalid directory: " + directory;
+		return -EINVAL;
+	}
+
+	// The whole subtree goes without the per-file checks of rm -rf, only the user the file system
+	// is mounted by and root may do that whichever way the command came in
+	if (!isMountOwnerRequest()) {
+		response = "permission denied: only the mount owner may remove trees";
+		return -EPERM;
+	}
+
+	// Uploads still pending from the journal would bring the files back
+	if (FSJournal::get().waitForTree(path)) {
+		response = "failed to upload the files closed through the journal";
+		return -EIO;
+	}
+
+	int retCode = 0;
+	bool registered = false;
+	try {
+		StorageBackend& backend = StorageBackend::get();
+		BSONObj dirObj = backend.findFile(path);
+		if (dirObj.isEmpty()) {
+			response = "no such directory: " + path;
+			return -ENOENT;
+		} else if (strcmp(dirObj.getObjectField("metadata").getStringField("type"), "directory")) {
+			response = "not a directory: " + path;
+			return -ENOTDIR;
+		}
+
+		retCode = checkRemoveTreeAccess(path, response);
+		if (retCode) {
+			return retCode;
+		}
+
+		{
+			boost::mutex::scoped_lock lock(_lock);
+			if (!_treeRemovals.insert(make_pair(path, 0)).second) {
+				response = "already being removed: " + path;
+				return -EBUSY;
+			}
+			registered = true;
+		}
+
+		// Files open below the directory must not be flushed back once removed
+		size_t detached = LocalGridFS::get().detachTree(path);
+		int removed = backend.removeTree(path, boost::bind(&FSControl::recordRemoveProgress, this, path, _1));
+
+		ostringstream os;
+		os << "removed: " << removed << ", detached: " << detached;
+		response = os.str();
+	} catch (DBException& e) {
+		// Files removed so far stay removed, running the command again removes the rest
+		error() << "Caught exception in removing directory tree {dir: " << path << ", code: " << e.getCode()
+			<< ", what: " << e.what() << "}" << endl;
+		response = string("failed to remove: ") + e.what();
+		retCode = -EIO;
+	}
+
+	if (registered) {
+		boost::mutex::scoped_lock lock(_lock);
+		_treeRemovals.erase(path);
+	}
+	return retCode;
+}
+
+void FSControl::recordRemoveProgress(const string& directory, int removed) {
+	info() << "Removing directory tree {dir: " << directory << ", removed: " << removed << "}" << endl;
+	boost::mutex::scoped_lock lock(_lock);
+	_treeRemovals[directory] = removed;
+}
@@ -0,0 +1,90 @@
+#ifndef mgridfs_fs_control_h
+#define mgridfs_fs_control_h
+
+#include <map>
+#include <string>
+#include <sys/ioctl.h>
+
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+
+using namespace std;
+
+/**
+ * Control requests through ioctl on any file open on the mount (including the control file),
+ * e.g. for tools that prefer a single call over writing to the control file. Only the user the
+ * file system is mounted by and root may issue them, EPERM for the others. The command is
+ * passed in _request, the same text as written to the control file, and the response is
+ * returned in the same buffer, truncated to fit.
+ */
+#define MGRIDFS_CONTROL_BUFFER_SIZE 4096
+
+struct mgridfs_control_request {
+	char _request[MGRIDFS_CONTROL_BUFFER_SIZE];
+};
+
+#define MGRIDFS_IOC_CONTROL _IOWR('M', 1, struct mgridfs_control_request)
+
+/**
+ * Clones a file in the manner of FICLONE: issued on the destination file open for writing, it
+ * replaces the content of the destination by that of the source, sharing the chunks of the
+ * source on the server instead of copying them. Either file is stored in chunks of its own again
+ * once written and flushed. The source is passed by its path on the mount (e.g. "/dir/file"),
+ * file descriptors of the caller mean nothing to the file system. The caller has to have read
+ * access to the source, EACCES otherwise.
+ */
+struct mgridfs_clone_request {
+	char _srcPath[MGRIDFS_CONTROL_BUFFER_SIZE];
+};
+
+#define MGRIDFS_IOC_CLONE _IOW('M', 2, struct mgridfs_clone_request)
+
+namespace mgridfs {
+
+/**
+ * Commands changing the running file system, accepted one per line through writes to
+ * VIRTUAL_DIR/control and through MGRIDFS_IOC_CONTROL:
+ * - flush: writes back every dirty open file
+ * - dropcaches: flushes and frees the buffers of the files not in use, returning the memory
+ *   to the system
+ * - set <name>=<value>: changes a setting, e.g. "set logLevel=debug"
+ * - rmtree <dir>: removes the directory and everything below it on the server, without the
+ *   lookups and round trips per file of rm -rf. Chunks are removed in the background. Only the
+ *   mount owner and root may, with write access to the directory and its parent.
+ *
+ * Settings changed live only apply to what starts afterwards, e.g. a new chunk size applies
+ * to the files opened from then on. Reading the control file lists the current settings, and
+ * the progress of the subtree removals in progress.
+ *
+ * Entries the kernel has cached for the removed files expire with the attr / entry timeouts of
+ * the mount, as FUSE 2.6 has no invalidation.
+ */
+class FSControl : protected boost::noncopyable {
+public:
+	static FSControl& get();
+
+	// Returns 0 or -errno, with the outcome of the command in the response either way
+	int execute(const string& command, string& response);
+
+	// Current settings, one "name: value" per line
+	string getSettings() const;
+
+	// Settings followed by the commands in progress
+	string getStatus() const;
+
+private:
+	FSControl();
+
+	int flush(string& response);
+	int dropCaches(string& response);
+	int set(const string& assignment, string& response);
+	int removeTree(const string& directory, string& response);
+
+	mutable boost::mutex _lock;
+	map<string, int> _treeRemovals; // Files removed so far by directory
+	void recordRemoveProgress(const string& directory, int removed);
+};
+
+}
+
+#endif
@@ -0,0 +1,486 @@
+#include "fs_journal.h"
+#include "buffer_budget.h"
+#include "fs_connection.h"
+#include "fs_logger.h"
+#include "local_grid_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/crc.hpp>
+#include <boost/thread/thread_time.hpp>
+
+using namespace mgridfs;
+
+namespace {
+	const uint32_t JOURNAL_MAGIC = 0x4a47474d; // "MGGJ"
+	const char* JOURNAL_FILENAME = "mgridfs.journal";
+
+	// Content found in the journal on replay, read again from the journal for the upload
+	struct ContentRecord {
+		uint64_t _seq;
+		uint64_t _dataOffset;
+		uint64_t _dataLen;
+		string _filename;
+	};
+
+	// Longest path accepted when reading the journal back, anything longer is a corrupt header
+	const uint32_t MAX_JOURNAL_PATH = 64 * 1024;
+
+	// Delay between the retries of a failed upload, doubled up to the max on every failure
+	const size_t MIN_RETRY_MILLIS = 1000;
+	const size_t MAX_RETRY_MILLIS = 30000;
+
+	typedef enum {
+		JR_CONTENT = 1, // Full content of a file to be uploaded
+		JR_UPLOADED = 2, // Content entry of the same seq has been uploaded
+	} JournalRecordType;
+
+	struct FSJournalRecordHeader {
+		uint32_t _magic;
+		uint32_t _type;
+		uint64_t _seq;
+		uint64_t _dataLen;
+		uint32_t _nameLen;
+		uint32_t _checksum; // CRC-32 of the header with the checksum as 0, the name and the data
+	};
+
+	bool writeFully(int fd, const char* data, size_t len) {
+		while (len > 0) {
+			ssize_t written = write(fd, data, len);
+			if (written < 0 && errno == EINTR) {
+				continue;
+			} else if (written <= 0) {
+				return false;
+			}
+
+			data += written;
+			len -= written;
+		}
+		return true;
+	}
+
+	bool readFully(int fd, char* data, size_t len, uint64_t offset) {
+		while (len > 0) {
+			ssize_t bytesRead = pread(fd, data, len, offset);
+			if (bytesRead < 0 && errno == EINTR) {
+				continue;
+			} else if (bytesRead <= 0) {
+				return false;
+			}
+
+			data += bytesRead;
+			len -= bytesRead;
+			offset += bytesRead;
+		}
+		return true;
+	}
+}
+
+FSJournal::FSJournal()
+	: _running(false), _abandoned(false), _fd(-1), _nextSeq(1), _uploadedSeq(0), _writeOffset(0),
+	_syncedOffset(0), _syncing(false), _generation(0) {
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+FSJournal::~FSJournal() {
+	stop();
+	if (_fd >= 0) {
+		close(_fd);
+	}
+}
+
+FSJournal& FSJournal::get() {
+	static FSJournal instance;
+	return instance;
+}
+
+bool FSJournal::open(const string& directory) {
+	_path = directory + "/" + JOURNAL_FILENAME;
+	_fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (_fd < 0) {
+		error() << "Failed to open journal {file: " << _path << ", errno: " << errno << "}" << endl;
+		return false;
+	}
+
+	if (!replay()) {
+		close(_fd);
+		_fd = -1;
+		return false;
+	}
+
+	info() << "Opened journal {file: " << _path << ", replayed: " << _stats._replayed << "}" << endl;
+	return true;
+}
+
+bool FSJournal::replay() {
+	// Uploads are only known once the whole journal has been read, so find the content first
+	vector<ContentRecord> contents;
+	set<uint64_t> uploaded;
+	uint64_t offset = 0;
+	uint64_t maxSeq = 0;
+	vector<char> buffer(64 * 1024);
+	for (;;) {
+		FSJournalRecordHeader header;
+		if (!readFully(_fd, (char*)&header, sizeof(header), offset)) {
+			break;
+		}
+
+		if (header._magic != JOURNAL_MAGIC || header._nameLen > MAX_JOURNAL_PATH) {
+			warn() << "Ignoring corrupt journal tail {file: " << _path << ", offset: " << offset << "}" << endl;
+			break;
+		}
+
+		string filename(header._nameLen, '\0');
+		if (header._nameLen && !readFully(_fd, &filename[0], header._nameLen, offset + sizeof(header))) {
+			break;
+		}
+
+		uint32_t checksum = header._checksum;
+		header._checksum = 0;
+		boost::crc_32_type crc;
+		crc.process_bytes(&header, sizeof(header));
+		crc.process_bytes(filename.data(), filename.size());
+
+		uint64_t dataOffset = offset + sizeof(header) + header._nameLen;
+		bool complete = true;
+		for (uint64_t done = 0; done < header._dataLen && complete; ) {
+			size_t len = (size_t)min((uint64_t)buffer.size(), header._dataLen - done);
+			complete = readFully(_fd, &buffer[0], len, dataOffset + done);
+			crc.process_bytes(&buffer[0], len);
+			done += len;
+		}
+
+		if (!complete || crc.checksum() != checksum) {
+			// Append of this record never returned, nothing after it has been written either
+			warn() << "Ignoring torn journal record {file: " << _path << ", offset: " << offset
+				<< ", seq: " << header._seq << ", filename: " << filename << "}" << endl;
+			break;
+		}
+
+		if (header._type == JR_CONTENT) {
+			ContentRecord record;
+			record._seq = header._seq;
+			record._dataOffset = dataOffset;
+			record._dataLen = header._dataLen;
+			record._filename = filename;
+			contents.push_back(record);
+		} else if (header._type == JR_UPLOADED) {
+			uploaded.insert(header._seq);
+		}
+
+		maxSeq = max(maxSeq, header._seq);
+		offset = dataOffset + header._dataLen;
+	}
+
+	for (vector<ContentRecord>::const_iterator cIt = contents.begin(); cIt != contents.end(); ++cIt) {
+		if (uploaded.count(cIt->_seq)) {
+			continue;
+		}
+
+		boost::shared_array<char> content(new (nothrow) char[cIt->_dataLen ? cIt->_dataLen : 1]);
+		if (!content.get() || !readFully(_fd, content.get(), cIt->_dataLen, cIt->_dataOffset)) {
+			error() << "Failed to read journal entry for replay {file: " << _path << ", seq: " << cIt->_seq
+				<< ", filename: " << cIt->_filename << ", len: " << cIt->_dataLen << "}" << endl;
+			return false;
+		}
+
+		int retCode = LocalMemoryGridFile::uploadContent(cIt->_filename, content.get(), cIt->_dataLen);
+		if (retCode == -EIO) {
+			error() << "Failed to replay journal entry, will not mount {file: " << _path << ", seq: " << cIt->_seq
+				<< ", filename: " << cIt->_filename << "}" << endl;
+			return false;
+		}
+
+		info() << "Replayed journal entry {seq: " << cIt->_seq << ", filename: " << cIt->_filename << ", len: "
+			<< cIt->_dataLen << ", retCode: " << retCode << "}" << endl;
+		++_stats._replayed;
+	}
+
+	// Also drops a torn tail, which would hide the records appended after it
+	if (ftruncate(_fd, 0) || fdatasync(_fd)) {
+		error() << "Failed to truncate journal after replay {file: " << _path << ", errno: " << errno << "}" << endl;
+		return false;
+	}
+
+	_nextSeq = maxSeq + 1;
+	_uploadedSeq = maxSeq;
+	return true;
+}
+
+void FSJournal::start() {
+	boost::mutex::scoped_lock lock(_lock);
+	if (_fd < 0 || _uploader) {
+		return;
+	}
+
+	_running = true;
+	_abandoned = false;
+	_uploader.reset(new boost::thread(boost::bind(&FSJournal::uploadLoop, this)));
+}
+
+void FSJournal::stop() {
+	boost::scoped_ptr<boost::thread> uploader;
+	{
+		boost::mutex::scoped_lock lock(_lock);
+		if (!_uploader) {
+			return;
+		}
+
+		_running = false;
+		_uploader.swap(uploader);
+		_changed.notify_all();
+	}
+
+	uploader->join();
+	info() << "Stopped journal uploader {pending: " << _pending.size() << "}" << endl;
+}
+
+int FSJournal::writeRecord(uint32_t type, uint64_t seq, const string& filename, const char* data, size_t len) {
+	FSJournalRecordHeader header;
+	header._magic = JOURNAL_MAGIC;
+	header._type = type;
+	header._seq = seq;
+	header._dataLen = len;
+	header._nameLen = filename.size();
+	header._checksum = 0;
+
+	boost::crc_32_type crc;
+	crc.process_bytes(&header, sizeof(header));
+	crc.process_bytes(filename.data(), filename.size());
+	crc.process_bytes(data, len);
+	header._checksum = crc.checksum();
+
+	if (!writeFully(_fd, (const char*)&header, sizeof(header)) || !writeFully(_fd, filename.data(), filename.size())
+			|| !writeFully(_fd, data, len)) {
+		int retCode = errno ? -errno : -EIO;
+		error() << "Failed to write journal record {file: " << _path << ", seq: " << seq << ", type: " << type
+			<< ", errno: " << -retCode << "}" << endl;
+
+		// A torn record would hide all the records appended after it on replay
+		if (ftruncate(_fd, _writeOffset)) {
+			error() << "Failed to truncate torn journal record {file: " << _path << ", errno: " << errno << "}" << endl;
+		}
+		return retCode;
+	}
+
+	boost::mutex::scoped_lock lock(_lock);
+	_writeOffset += sizeof(header) + filename.size() + len;
+	return 0;
+}
+
+int FSJournal::syncTo(boost::mutex::scoped_lock& lock, uint64_t offset) {
+	// Whoever finds no sync in progress syncs everything written so far on behalf of all the waiters.
+	// The journal may have been truncated meanwhile, in which case the records have been uploaded.
+	uint64_t generation = _generation;
+	while (_generation == generation && _syncedOffset < offset) {
+		if (_syncing) {
+			_changed.wait(lock);
+			continue;
+		}
+
+		_syncing = true;
+		uint64_t target = _writeOffset;
+		lock.unlock();
+		int retCode = fdatasync(_fd) ? -errno : 0;
+		lock.lock();
+		_syncing = false;
+		_changed.notify_all();
+
+		if (retCode) {
+			error() << "Failed to sync journal {file: " << _path << ", errno: " << -retCode << "}" << endl;
+			return retCode;
+		}
+		if (_generation == generation) {
+			_syncedOffset = max(_syncedOffset, target);
+		}
+	}
+
+	return 0;
+}
+
+int FSJournal::append(const string& filename, const boost::shared_array<char>& content, size_t len) {
+	if (!BufferBudget::get().reserve(len)) {
+		return -ENOMEM;
+	}
+
+	// Appends are written one at a time in the order of their seq, and queued before the next one is
+	// written so that the uploader never truncates the journal under a record not queued yet
+	boost::mutex::scoped_lock appendLock(_appendLock);
+	uint64_t seq = 0;
+	{
+		boost::mutex::scoped_lock lock(_lock);
+		seq = _running ? _nextSeq++ : 0;
+	}
+
+	int retCode = seq ? writeRecord(JR_CONTENT, seq, filename, content.get(), len) : -EAGAIN;
+	if (retCode) {
+		appendLock.unlock();
+		BufferBudget::get().release(len);
+		return retCode;
+	}
+
+	boost::mutex::scoped_lock lock(_lock);
+	appendLock.unlock();
+
+	Entry entry;
+	entry._seq = seq;
+	entry._filename = filename;
+	entry._content = content;
+	entry._len = len;
+	_pending.push_back(entry);
+
+	PendingFile& pendingFile = _pendingFiles[filename];
+	pendingFile._seq = entry._seq;
+	pendingFile._len = len;
+
+	++_stats._appended;
+	_stats._appendedBytes += len;
+	_changed.notify_all();
+
+	// Queued irrespective of the sync, a failed sync makes the caller upload the content itself
+	// after this entry, which only costs an extra upload of the same content
+	return syncTo(lock, _writeOffset);
+}
+
+void FSJournal::uploadLoop() {
+	// Uploads borrow connections in the same way as the work queue threads
+	FSConnectionManager::get().setAuxiliaryThread();
+
+	size_t retryMillis = MIN_RETRY_MILLIS;
+	boost::mutex::scoped_lock lock(_lock);
+	for (;;) {
+		while (_running && _pending.empty()) {
+			_changed.wait(lock);
+		}
+
+		if (_pending.empty()) {
+			break;
+		}
+
+		Entry entry = _pending.front();
+		lock.unlock();
+		int retCode = LocalMemoryGridFile::uploadContent(entry._filename, entry._content.get(), entry._len);
+		int recordCode = -EIO;
+		if (retCode != -EIO) {
+			boost::mutex::scoped_lock appendLock(_appendLock);
+			recordCode = writeRecord(JR_UPLOADED, entry._seq, entry._filename, NULL, 0);
+		}
+		lock.lock();
+
+		if (retCode == -EIO) {
+			++_stats._uploadFailures;
+			if (!_running) {
+				warn() << "Leaving journal entries for the next run {file: " << _path << ", pending: " << _pending.size() << "}" << endl;
+				_abandoned = true;
+				_changed.notify_all();
+				break;
+			}
+
+			warn() << "Failed to upload journal entry, will retry {seq: " << entry._seq << ", filename: " << entry._filename
+				<< ", retryMillis: " << retryMillis << "}" << endl;
+			_changed.timed_wait(lock, boost::get_system_time() + boost::posix_time::milliseconds(retryMillis));
+			retryMillis = min(retryMillis * 2, MAX_RETRY_MILLIS);
+			continue;
+		} else if (retCode) {
+			// The file is gone from the server, there is nothing left to upload the content to
+			warn() << "Dropping journal entry {seq: " << entry._seq << ", filename: " << entry._filename
+				<< ", retCode: " << retCode << "}" << endl;
+		}
+
+		// Synced before the waiters are let go, for a replay never to upload content over what has
+		// changed on the server since
+		if (!recordCode) {
+			syncTo(lock, _writeOffset);
+		}
+
+		retryMillis = MIN_RETRY_MILLIS;
+		_pending.pop_front();
+		_uploadedSeq = entry._seq;
+		map<string, PendingFile>::iterator pIt = _pendingFiles.find(entry._filename);
+		if (pIt != _pendingFiles.end() && pIt->second._seq == entry._seq) {
+			_pendingFiles.erase(pIt);
+		}
+		++_stats._uploaded;
+
+		if (_pending.empty() && !_syncing) {
+			// An append writing its record in the meantime leaves the truncation to a later upload
+			boost::mutex::scoped_lock appendLock(_appendLock, boost::try_to_lock);
+			if (!appendLock.owns_lock()) {
+				debug() << "Skipping journal truncation while appending {file: " << _path << "}" << endl;
+			} else if (ftruncate(_fd, 0)) {
+				warn() << "Failed to truncate journal {file: " << _path << ", errno: " << errno << "}" << endl;
+			} else {
+				_writeOffset = _syncedOffset = 0;
+				++_generation;
+			}
+		}
+
+		_changed.notify_all();
+		lock.unlock();
+		BufferBudget::get().release(entry._len);
+		lock.lock();
+	}
+}
+
+int FSJournal::waitForSeq(boost::mutex::scoped_lock& lock, uint64_t seq) {
+	while (_uploadedSeq < seq && !_abandoned) {
+		_changed.wait(lock);
+	}
+
+	return (_uploadedSeq >= seq) ? 0 : -EIO;
+}
+
+int FSJournal::waitForFile(const string& filename) {
+	boost::mutex::scoped_lock lock(_lock);
+	map<string, PendingFile>::const_iterator pIt = _pendingFiles.find(filename);
+	if (pIt == _pendingFiles.end()) {
+		return 0;
+	}
+
+	return waitForSeq(lock, pIt->second._seq);
+}
+
+int FSJournal::waitForTree(const string& path) {
+	string prefix = (path == "/") ? path : path + "/";
+	boost::mutex::scoped_lock lock(_lock);
+	uint64_t seq = 0;
+	map<string, PendingFile>::const_iterator pIt = _pendingFiles.find(path);
+	if (pIt != _pendingFiles.end()) {
+		seq = pIt->second._seq;
+	}
+
+	// Entries are uploaded in order, waiting for the latest one below the path covers the rest
+	for (pIt = _pendingFiles.lower_bound(prefix); pIt != _pendingFiles.end() && !pIt->first.compare(0, prefix.size(), prefix); ++pIt) {
+		seq = max(seq, pIt->second._seq);
+	}
+
+	return seq ? waitForSeq(lock, seq) : 0;
+}
+
+bool FSJournal::getPendingSize(const string& filename, size_t& size) const {
+	boost::mutex::scoped_lock lock(_lock);
+	map<string, PendingFile>::const_iterator pIt = _pendingFiles.find(filename);
+	if (pIt == _pendingFiles.end()) {
+		return false;
+	}
+
+	size = pIt->second._len;
+	return true;
+}
+
+void FSJournal::getStats(FSJournalStats& stats) const {
+	boost::mutex::scoped_lock lock(_lock);
+	stats = _stats;
+	stats._pending = _pending.size();
+	stats._pendingBytes = 0;
+	for (deque<Entry>::const_iterator eIt = _pending.begin(); eIt != _pending.end(); ++eIt) {
+		stats._pendingBytes += eIt->_len;
+	}
+}
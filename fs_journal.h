@@ -0,0 +1,128 @@
+#ifndef mgridfs_fs_journal_h
+#define mgridfs_fs_journal_h
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include <boost/utility.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+using namespace std;
+
+namespace mgridfs {
+
+struct FSJournalStats {
+	uint64_t _appended;
+	uint64_t _appendedBytes;
+	uint64_t _uploaded;
+	uint64_t _uploadFailures; // Retried later
+	uint64_t _replayed; // Left over by the previous run and uploaded on start
+	size_t _pending;
+	size_t _pendingBytes;
+};
+
+/**
+ * Local on-disk journal of the content of the files closed but not uploaded yet, for close to
+ * return without waiting for the upload (enabled with --journalDir).
+ *
+ * Every entry holds the full content of a file and is checksummed and fsync'd before append
+ * returns, concurrent appends share the fsync. A single uploader thread uploads the entries in
+ * the order they were appended, retrying on failures, and records their completion in the
+ * journal. The journal is truncated whenever there is nothing left to upload. Entries left over
+ * by a previous run are uploaded on open, before the file system is mounted; a torn entry at
+ * the end of the journal is one whose append never returned, and is ignored.
+ *
+ * Operations depending on the server having the latest content of a file (open, unlink,
+ * rename, fsync and the flushes of newer content) wait for the pending entries first.
+ */
+class FSJournal : protected boost::noncopyable {
+public:
+	static FSJournal& get();
+
+	// Uploads the entries left over in the directory, returns false if any of them could not be
+	bool open(const string& directory);
+
+	inline bool isEnabled() const {
+		return _fd >= 0;
+	}
+
+	void start();
+
+	// Uploads what is pending, entries that fail to upload are kept for the next run
+	void stop();
+
+	// Returns once the content is durable in the journal, 0 or -errno. The content is kept in
+	// memory until uploaded and accounted against the buffer budget.
+	int append(const string& filename, const boost::shared_array<char>& content, size_t len);
+
+	// Wait for the entries appended so far for the file / for the file or directory at the path
+	// and every file below it to be uploaded. Return -EIO if the uploader has given up on them,
+	// i.e. they are left for the next run.
+	int waitForFile(const string& filename);
+	int waitForTree(const string& path);
+
+	// Size of the latest content of the file waiting to be uploaded
+	bool getPendingSize(const string& filename, size_t& size) const;
+
+	void getStats(FSJournalStats& stats) const;
+
+private:
+	FSJournal();
+	~FSJournal();
+
+	struct Entry {
+		uint64_t _seq;
+		string _filename;
+		boost::shared_array<char> _content;
+		size_t _len;
+	};
+
+	struct PendingFile {
+		uint64_t _seq; // Latest entry of the file
+		size_t _len;
+	};
+
+	// Records are written to the journal file under the append lock alone, so that a large append
+	// holds up neither the lookups of the pending files nor the uploader. Locked before _lock.
+	boost::mutex _appendLock;
+
+	mutable boost::mutex _lock;
+	boost::condition_variable _changed;
+	boost::scoped_ptr<boost::thread> _uploader;
+	bool _running;
+	bool _abandoned; // Uploader has exited with entries left
+
+	int _fd;
+	string _path;
+	uint64_t _nextSeq;
+	uint64_t _uploadedSeq; // All the entries up to this one have been uploaded
+	uint64_t _writeOffset; // Updated holding both locks
+	uint64_t _syncedOffset;
+	bool _syncing;
+	uint64_t _generation; // Bumped on every truncation, offsets of the older generations are meaningless
+
+	deque<Entry> _pending;
+	map<string, PendingFile> _pendingFiles;
+	FSJournalStats _stats;
+
+	void uploadLoop();
+	bool replay();
+
+	// Expects the append lock to be held and the lock not to be
+	int writeRecord(uint32_t type, uint64_t seq, const string& filename, const char* data, size_t len);
+
+	// Expect the lock to be held, sync releases it while the fsync is in progress
+	int syncTo(boost::mutex::scoped_lock& lock, uint64_t offset);
+	int waitForSeq(boost::mutex::scoped_lock& lock, uint64_t seq);
+};
+
+}
+
+#endif
@@ -1,13 +1,17 @@
 #include "fs_logger.h"
 
-#include <sstream>
 #include <fstream>
 #include <iostream>
 #include <cctype>
+#include <cstring>
+#include <ctime>
 #include <algorithm>
 
+#include <pthread.h>
+
 #include <boost/bimap.hpp>
-#include <mongo/util/time_support.h>
+#include <boost/bind.hpp>
+#include <boost/thread/tss.hpp>
 
 using namespace std;
 using namespace mgridfs;
@@ -18,10 +22,73 @@ namespace {
 	LogLevelToStringMap logLevelToStringMap;
 
 	const string LL_INVALID_STR = "INVALID";
+
+	// Indexed by LogLevel, used for the message prefix to avoid the map lookup on every message
+	const char* const LOG_LEVEL_PREFIXES[] = {"INVALID", "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL", "NONE"};
+
+	// Per-thread ring size for the messages pending to be written out by the log writer thread
+	const size_t LOG_RING_CAPACITY = 64 * 1024;
+
+	// Interval at which the log writer drains the rings and flushes the destination
+	const long LOG_WRITER_INTERVAL_MS = 50;
+
+	// Typical message size, buffers are grown beyond this as required
+	const size_t LOG_MESSAGE_RESERVE = 1024;
 }
 
+/*
+ * Formatting state of a logging thread, reused across the messages logged by the thread
+ */
+struct mgridfs::FSLogThreadState {
+	FSLogThreadState()
+		: _os(&_buffer), _inUse(false), _cachedSecond(0) {
+		_timestamp[0] = 0;
+	}
+
+	~FSLogThreadState() {
+		if (_ring) {
+			_ring->close();
+		}
+	}
+
+	// Timestamps are formatted at most once a second for every thread
+	const char* timestamp() {
+		time_t now = time(NULL);
+		if (now != _cachedSecond) {
+			char buffer[32];
+			ctime_r(&now, buffer);
+			buffer[19] = 0; // Drop the year and new-line
+			strcpy(_timestamp, buffer);
+			_cachedSecond = now;
+		}
+		return _timestamp;
+	}
+
+	FSLogBuffer _buffer;
+	std::ostream _os;
+	bool _inUse;
+	boost::shared_ptr<FSLogRing> _ring;
+	time_t _cachedSecond;
+	char _timestamp[32];
+};
+
+namespace {
+	boost::thread_specific_ptr<FSLogThreadState> logThreadState;
+
+	FSLogThreadState* getLogThreadState() {
+		FSLogThreadState* threadState = logThreadState.get();
+		if (!threadState) {
+			threadState = new FSLogThreadState();
+			logThreadState.reset(threadState);
+		}
+		return threadState;
+	}
+}
+
+boost::atomic<int> FSLogManager::_enabledLevel(LL_TRACE);
+
 FSLogManager::FSLogManager()
-	: _ll(LL_TRACE), _logDestination(NULL) {
+	: _logDestination(NULL), _writerRunning(false), _drainPasses(0) {
 
 	logLevelToStringMap.insert(LogLevelToStringMap::value_type(LL_INVALID, LL_INVALID_STR));
 	logLevelToStringMap.insert(LogLevelToStringMap::value_type(LL_TRACE, "TRACE"));
@@ -34,6 +101,7 @@ FSLogManager::FSLogManager()
 }
 
 FSLogManager::~FSLogManager() {
+	stopAsyncWriter();
 	if (_logDestination) {
 		delete _logDestination;
 		_logDestination = NULL;
@@ -61,21 +129,181 @@ LogLevel FSLogManager::stringToLogLevel(const string& logLevel) const {
 	return LL_INVALID;
 }
 
-bool FSLogManager::logAll(LogLevel ll, const string& logMessage) {
-	if (ll >= _ll) {
-		if (_logDestination) {
-			_logDestination->logAll(ll, logMessage);
-		} else {
-			cout << logMessage << flush;
+bool FSLogManager::logAll(LogLevel ll, const char* logMessage, size_t len) {
+	if (!isEnabled(ll)) {
+		return true;
+	}
+
+	if (_writerRunning.load(boost::memory_order_acquire) && boost::this_thread::get_id() != _writerThreadId) {
+		FSLogThreadState* threadState = getLogThreadState();
+		if (!threadState->_ring) {
+			threadState->_ring = createRing();
+		}
+
+		// Messages larger than the ring itself are rare enough to be written synchronously
+		while (len + sizeof(uint64_t) <= threadState->_ring->getCapacity()) {
+			if (threadState->_ring->push(ll, logMessage, len)) {
+				if (ll >= LL_FATAL) {
+					waitForDrain();
+				}
+				return true;
+			}
+
+			if (!_writerRunning.load(boost::memory_order_acquire)) {
+				break;
+			}
+
+			// Ring is full, block the logging thread until the writer catches up rather than losing messages
+			_writerWakeup.notify_one();
+			boost::this_thread::sleep(boost::posix_time::milliseconds(1));
 		}
 	}
+
+	writeSync(ll, logMessage, len);
 	return true;
 }
 
+void FSLogManager::writeSync(LogLevel ll, const char* logMessage, size_t len) {
+	boost::shared_lock<boost::shared_mutex> lock(_destinationLock);
+	if (_logDestination) {
+		_logDestination->logAll(ll, logMessage, len);
+		_logDestination->flush();
+	} else {
+		boost::mutex::scoped_lock consoleLock(_consoleLock);
+		cout.write(logMessage, len);
+		cout.flush();
+	}
+}
+
+boost::shared_ptr<FSLogRing> FSLogManager::createRing() {
+	boost::shared_ptr<FSLogRing> ring(new FSLogRing(LOG_RING_CAPACITY));
+	boost::mutex::scoped_lock lock(_ringsLock);
+	_rings.push_back(ring);
+	return ring;
+}
+
+void FSLogManager::startAsyncWriter() {
+	boost::mutex::scoped_lock lock(_writerLock);
+	if (_writerThread) {
+		return;
+	}
+
+	_writerRunning.store(true, boost::memory_order_release);
+	_writerThread.reset(new boost::thread(boost::bind(&FSLogManager::writerLoop, this)));
+	_writerThreadId = _writerThread->get_id();
+}
+
+void FSLogManager::stopAsyncWriter() {
+	boost::scoped_ptr<boost::thread> writerThread;
+	{
+		boost::mutex::scoped_lock lock(_writerLock);
+		if (!_writerThread) {
+			return;
+		}
+
+		_writerRunning.store(false, boost::memory_order_release);
+		_writerThread.swap(writerThread);
+		_writerWakeup.notify_one();
+	}
+
+	writerThread->join();
+
+	// Pick up whatever was logged while the writer was on its way out
+	vector<char> logMessage;
+	drainRings(logMessage);
+}
+
+void FSLogManager::waitForDrain() {
+	boost::mutex::scoped_lock lock(_writerLock);
+	if (!_writerRunning.load(boost::memory_order_acquire) || boost::this_thread::get_id() == _writerThreadId) {
+		return;
+	}
+
+	// A pass already in progress might have missed the messages of the calling thread
+	unsigned long long targetPasses = _drainPasses + 2;
+	while (_writerRunning.load(boost::memory_order_acquire) && _drainPasses < targetPasses) {
+		_writerWakeup.notify_one();
+		_drained.wait(lock);
+	}
+}
+
+void FSLogManager::writerLoop() {
+	vector<char> logMessage;
+	logMessage.reserve(LOG_MESSAGE_RESERVE);
+
+	boost::mutex::scoped_lock lock(_writerLock);
+	for (;;) {
+		bool running = _writerRunning.load(boost::memory_order_acquire);
+
+		lock.unlock();
+		drainRings(logMessage);
+		lock.lock();
+
+		++_drainPasses;
+		_drained.notify_all();
+		if (!running) {
+			break;
+		}
+
+		_writerWakeup.timed_wait(lock, boost::posix_time::milliseconds(LOG_WRITER_INTERVAL_MS));
+	}
+}
+
+void FSLogManager::drainRings(vector<char>& logMessage) {
+	vector<boost::shared_ptr<FSLogRing> > rings;
+	{
+		boost::mutex::scoped_lock lock(_ringsLock);
+		rings = _rings;
+	}
+
+	{
+		boost::shared_lock<boost::shared_mutex> lock(_destinationLock);
+		bool written = false;
+		LogLevel ll = LL_INVALID;
+		for (vector<boost::shared_ptr<FSLogRing> >::const_iterator rIt = rings.begin(); rIt != rings.end(); ++rIt) {
+			while ((*rIt)->pop(ll, logMessage)) {
+				written = true;
+				if (_logDestination) {
+					_logDestination->logAll(ll, logMessage.empty() ? "" : &logMessage[0], logMessage.size());
+				} else {
+					boost::mutex::scoped_lock consoleLock(_consoleLock);
+					cout.write(logMessage.empty() ? "" : &logMessage[0], logMessage.size());
+				}
+			}
+		}
+
+		// Flush once for all the messages drained in this pass
+		if (written) {
+			if (_logDestination) {
+				_logDestination->flush();
+			} else {
+				boost::mutex::scoped_lock consoleLock(_consoleLock);
+				cout.flush();
+			}
+		}
+	}
+
+	// Discard the rings of the threads that have exited, once they have been drained
+	boost::mutex::scoped_lock lock(_ringsLock);
+	for (vector<boost::shared_ptr<FSLogRing> >::iterator rIt = _rings.begin(); rIt != _rings.end(); ) {
+		if ((*rIt)->isClosed() && (*rIt)->isEmpty()) {
+			rIt = _rings.erase(rIt);
+		} else {
+			++rIt;
+		}
+	}
+}
+
 bool FSLogManager::registerDestination(FSLogDestination* logDestination) {
-	// TODO: Make thread-safe if need to be enabled for multi-threaded
-	FSLogDestination* temp = _logDestination;
-	_logDestination = logDestination;
+	FSLogDestination* temp = NULL;
+	{
+		// Swap under exclusive lock so that no thread is in the middle of writing to the
+		// destination being replaced
+		boost::unique_lock<boost::shared_mutex> lock(_destinationLock);
+		temp = _logDestination;
+		_logDestination = logDestination;
+	}
+
 	if (temp) {
 		delete temp;
 	}
@@ -95,35 +323,150 @@ FSLogFile::~FSLogFile() {
 	}
 }
 
-bool FSLogFile::logAll(LogLevel ll, const string& logMessage) {
-	_logFile << logMessage << flush;
+bool FSLogFile::logAll(LogLevel ll, const char* logMessage, size_t len) {
+	boost::mutex::scoped_lock lock(_logFileLock);
+	_logFile.write(logMessage, len);
+	return true;
+}
+
+void FSLogFile::flush() {
+	boost::mutex::scoped_lock lock(_logFileLock);
+	_logFile.flush();
+}
+
+FSLogRing::FSLogRing(size_t capacity)
+	: _buffer(NULL), _capacity(1), _head(0), _tail(0), _closed(false) {
+	while (_capacity < capacity) {
+		_capacity <<= 1;
+	}
+	_buffer = new char[_capacity];
+}
+
+FSLogRing::~FSLogRing() {
+	delete [] _buffer;
+}
+
+bool FSLogRing::push(LogLevel ll, const char* logMessage, size_t len) {
+	size_t head = _head.load(boost::memory_order_relaxed);
+	size_t tail = _tail.load(boost::memory_order_acquire);
+	size_t recordLen = sizeof(RecordHeader) + len;
+	if (_capacity - (head - tail) < recordLen) {
+		return false;
+	}
+
+	RecordHeader header;
+	header._len = len;
+	header._ll = ll;
+	copyIn(head, (const char*)&header, sizeof(header));
+	copyIn(head + sizeof(header), logMessage, len);
+	_head.store(head + recordLen, boost::memory_order_release);
+	return true;
+}
+
+bool FSLogRing::pop(LogLevel& ll, vector<char>& logMessage) {
+	size_t tail = _tail.load(boost::memory_order_relaxed);
+	size_t head = _head.load(boost::memory_order_acquire);
+	if (tail == head) {
+		return false;
+	}
+
+	RecordHeader header;
+	copyOut(tail, (char*)&header, sizeof(header));
+	logMessage.resize(header._len);
+	if (header._len) {
+		copyOut(tail + sizeof(header), &logMessage[0], header._len);
+	}
+	ll = (LogLevel)header._ll;
+	_tail.store(tail + sizeof(header) + header._len, boost::memory_order_release);
 	return true;
 }
 
+void FSLogRing::copyIn(size_t pos, const char* data, size_t len) {
+	size_t offset = pos & (_capacity - 1);
+	size_t firstLen = min(len, _capacity - offset);
+	memcpy(_buffer + offset, data, firstLen);
+	if (firstLen < len) {
+		memcpy(_buffer, data + firstLen, len - firstLen);
+	}
+}
+
+void FSLogRing::copyOut(size_t pos, char* data, size_t len) const {
+	size_t offset = pos & (_capacity - 1);
+	size_t firstLen = min(len, _capacity - offset);
+	memcpy(data, _buffer + offset, firstLen);
+	if (firstLen < len) {
+		memcpy(data + firstLen, _buffer, len - firstLen);
+	}
+}
+
+FSLogBuffer::FSLogBuffer() {
+	_buffer.reserve(LOG_MESSAGE_RESERVE);
+}
+
+FSLogBuffer::int_type FSLogBuffer::overflow(int_type c) {
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		_buffer.push_back(traits_type::to_char_type(c));
+	}
+	return traits_type::not_eof(c);
+}
+
+std::streamsize FSLogBuffer::xsputn(const char* s, std::streamsize n) {
+	_buffer.insert(_buffer.end(), s, s + n);
+	return n;
+}
+
 FSLogStream::FSLogStream(LogLevel ll)
-	: _ll(ll), _enabledLL(FSLogManager::get().getLogLevel()), _dirty(false), _os(NULL) {
+	: _ll(ll), _enabledLL(FSLogManager::get().getLogLevel()), _dirty(false), _threadState(NULL), _os(NULL),
+	_nestedBuffer(NULL) {
 }
 
 FSLogStream::FSLogStream(const FSLogStream& fsLogStream)
-	: _ll(fsLogStream._ll), _enabledLL(fsLogStream._enabledLL), _dirty(false), _os(NULL) {
+	: _ll(fsLogStream._ll), _enabledLL(fsLogStream._enabledLL), _dirty(false), _threadState(NULL), _os(NULL),
+	_nestedBuffer(NULL) {
 }
 
 FSLogStream::~FSLogStream() {
-	if (_os) {
-		if (_ll >= _enabledLL && _dirty) {
-			FSLogManager::get().logAll(_ll, _os->str());
-		}
+	if (!_os) {
+		return;
+	}
+
+	if (_ll >= _enabledLL && _dirty) {
+		const FSLogBuffer& buffer = _nestedBuffer ? *_nestedBuffer : _threadState->_buffer;
+		FSLogManager::get().logAll(_ll, buffer.data(), buffer.size());
+	}
+
+	if (_nestedBuffer) {
 		delete _os;
-		_os = NULL;
+		delete _nestedBuffer;
+	} else {
+		_threadState->_inUse = false;
 	}
+	_os = NULL;
 }
 
-ostringstream& FSLogStream::stream() {
+std::ostream& FSLogStream::stream() {
 	if (_os) {
 		return *_os;
 	}
 
-	_os = new ostringstream();
-	*_os << dateToCtimeString(mongo::jsTime()) << " [thread-" << pthread_self() << "] " << FSLogManager::get().logLevelToString(_ll) << " ";
+	_threadState = getLogThreadState();
+	if (!_threadState->_inUse) {
+		_threadState->_inUse = true;
+		_threadState->_buffer.reset();
+		_os = &_threadState->_os;
+
+		// Undo any formatting left behind by the previous message
+		_os->clear();
+		_os->flags(std::ios_base::skipws | std::ios_base::dec);
+		_os->precision(6);
+		_os->width(0);
+		_os->fill(' ');
+	} else {
+		_nestedBuffer = new FSLogBuffer();
+		_os = new std::ostream(_nestedBuffer);
+	}
+
+	*_os << _threadState->timestamp() << " [thread-" << pthread_self() << "] "
+		<< LOG_LEVEL_PREFIXES[(_ll >= LL_INVALID && _ll <= LL_NONE) ? _ll : LL_INVALID] << " ";
 	return *_os;
 }
@@ -1,10 +1,21 @@
 #ifndef mgridfs_fs_logger_h
 #define mgridfs_fs_logger_h
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 #include <fstream>
-#include <sstream>
+#include <ostream>
+#include <streambuf>
 #include <boost/utility.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
 
 using namespace std;
 
@@ -25,33 +36,131 @@ typedef enum {
 class FSLogDestination : protected boost::noncopyable {
 public:
 	FSLogDestination() { }
-	~FSLogDestination() { }
+	virtual ~FSLogDestination() { }
 
-	virtual bool logAll(LogLevel ll, const string& logMessage) = 0;
+	virtual bool logAll(LogLevel ll, const char* logMessage, size_t len) = 0;
+	virtual void flush() = 0;
+};
+
+/**
+ * Single producer / single consumer ring of log records owned by one logging thread and
+ * drained by the log writer thread
+ */
+class FSLogRing : protected boost::noncopyable {
+public:
+	FSLogRing(size_t capacity);
+	~FSLogRing();
+
+	// Called by the owning thread only, fails if there isn't enough space for the record
+	bool push(LogLevel ll, const char* logMessage, size_t len);
+
+	// Called by the log writer thread only, replaces the contents of the message buffer
+	bool pop(LogLevel& ll, vector<char>& logMessage);
+
+	inline size_t getCapacity() const { return _capacity; }
+	inline bool isEmpty() const { return _head.load(boost::memory_order_acquire) == _tail.load(boost::memory_order_acquire); }
+
+	// Set once the owning thread has exited, the ring is discarded after it has been drained
+	inline void close() { _closed.store(true, boost::memory_order_release); }
+	inline bool isClosed() const { return _closed.load(boost::memory_order_acquire); }
+
+private:
+	struct RecordHeader {
+		uint32_t _len;
+		uint32_t _ll;
+	};
+
+	char* _buffer;
+	size_t _capacity; // Power of 2 so that the positions can be masked instead of wrapped
+	boost::atomic<size_t> _head; // Next write position, advanced by the producer
+	boost::atomic<size_t> _tail; // Next read position, advanced by the consumer
+	boost::atomic<bool> _closed;
+
+	void copyIn(size_t pos, const char* data, size_t len);
+	void copyOut(size_t pos, char* data, size_t len) const;
 };
 
 class FSLogManager : protected boost::noncopyable {
 public:
 	static FSLogManager& get();
 
-	LogLevel getLogLevel() const { return _ll; }
-	void setLogLevel(LogLevel ll) { _ll = ll; }
+	LogLevel getLogLevel() const { return (LogLevel)_enabledLevel.load(boost::memory_order_relaxed); }
+	void setLogLevel(LogLevel ll) { _enabledLevel.store(ll, boost::memory_order_relaxed); }
+
+	// Checked before evaluating any of the arguments of trace() / debug() messages
+	static inline bool isEnabled(LogLevel ll) { return ll >= _enabledLevel.load(boost::memory_order_relaxed); }
 
 	const string& logLevelToString(LogLevel ll) const;
 	LogLevel stringToLogLevel(const string& logLevel) const;
 
-	bool logAll(LogLevel ll, const string& logMessage);
+	bool logAll(LogLevel ll, const char* logMessage, size_t len);
 
 	bool registerDestination(FSLogDestination* logDestination);
 
+	// Messages are written synchronously by the logging threads until the writer has been started.
+	// The writer is started only after fuse has daemonized as threads do not survive the fork
+	void startAsyncWriter();
+	void stopAsyncWriter();
+
+	// Blocks until everything logged so far has been written out to the destination
+	void waitForDrain();
+
+	// Ring for the calling thread, registered for draining by the writer thread
+	boost::shared_ptr<FSLogRing> createRing();
+
 private:
 	FSLogManager();
 	~FSLogManager();
 
-	LogLevel _ll; // Default log level at the process level
+	static boost::atomic<int> _enabledLevel; // Default log level at the process level
 	FSLogDestination* _logDestination; // Should be possible to extend to multiple log facilities
+
+	// Guards _logDestination, shared by the logging threads and held exclusively only while
+	// a destination is being (re-)registered
+	boost::shared_mutex _destinationLock;
+
+	// Serializes messages written to stdout when no destination has been registered yet
+	boost::mutex _consoleLock;
+
+	// Rings of all the threads that have logged since the writer was started
+	boost::mutex _ringsLock;
+	vector<boost::shared_ptr<FSLogRing> > _rings;
+
+	boost::mutex _writerLock;
+	boost::condition_variable _writerWakeup;
+	boost::condition_variable _drained;
+	boost::atomic<bool> _writerRunning;
+	boost::scoped_ptr<boost::thread> _writerThread;
+	boost::thread::id _writerThreadId;
+	unsigned long long _drainPasses;
+
+	void writeSync(LogLevel ll, const char* logMessage, size_t len);
+	void writerLoop();
+	void drainRings(vector<char>& logMessage);
 };
 
+/**
+ * Stream buffer appending into a reusable buffer, so that formatting a message does not
+ * allocate once the buffer has grown to the size of the messages being logged
+ */
+class FSLogBuffer : public std::streambuf {
+public:
+	FSLogBuffer();
+
+	inline void reset() { _buffer.clear(); }
+	inline const char* data() const { return _buffer.empty() ? "" : &_buffer[0]; }
+	inline size_t size() const { return _buffer.size(); }
+
+protected:
+	virtual int_type overflow(int_type c);
+	virtual std::streamsize xsputn(const char* s, std::streamsize n);
+
+private:
+	vector<char> _buffer;
+};
+
+struct FSLogThreadState;
+
 class FSLogStream {
 public:
 	FSLogStream(LogLevel ll = LL_INFO);
@@ -182,11 +291,13 @@ public:
 private:
 	LogLevel _ll, _enabledLL;
 	bool _dirty;
-	ostringstream* _os;
+	FSLogThreadState* _threadState;
+	std::ostream* _os;
+	FSLogBuffer* _nestedBuffer; // Only for messages logged while formatting another message on the same thread
 
 	FSLogStream& operator=(const FSLogStream&);
 
-	ostringstream& stream();
+	std::ostream& stream();
 };
 
 template<>
@@ -204,11 +315,23 @@ inline FSLogStream& FSLogStream::operator<< <char*>(char* s) {
 }
 
 
+/*
+ * Turns a log statement into a void expression, for the disabled levels to skip the
+ * whole statement including the evaluation of its arguments
+ */
+struct FSLogVoidify {
+	inline void operator&(FSLogStream&) { }
+};
+
+#define MGRIDFS_LOG_IF_ENABLED(ll) \
+	!mgridfs::FSLogManager::isEnabled(ll) ? (void)0 : mgridfs::FSLogVoidify() & mgridfs::FSLogStream(ll)
+
 /* 
- * define various log level stream utility functions
+ * define various log level stream utility functions. trace() and debug() are macros as they are
+ * used on hot paths and disabled in production, the others are always expected to be enabled
 */
-inline FSLogStream trace() { return FSLogStream(LL_TRACE); }
-inline FSLogStream debug() { return FSLogStream(LL_DEBUG); }
+#define trace() MGRIDFS_LOG_IF_ENABLED(mgridfs::LL_TRACE)
+#define debug() MGRIDFS_LOG_IF_ENABLED(mgridfs::LL_DEBUG)
 inline FSLogStream info() { return FSLogStream(LL_INFO); }
 inline FSLogStream warn() { return FSLogStream(LL_WARN); }
 inline FSLogStream error() { return FSLogStream(LL_ERROR); }
@@ -219,11 +342,13 @@ public:
 	FSLogFile(const string& filename);
 	~FSLogFile();
 
-	virtual bool logAll(LogLevel ll, const string& logMessage);
+	virtual bool logAll(LogLevel ll, const char* logMessage, size_t len);
+	virtual void flush();
 
 private:
 	string _filename;
 	ofstream _logFile;
+	boost::mutex _logFileLock;
 };
 
 }
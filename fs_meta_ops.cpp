@@ -1,11 +1,17 @@
 #include "fs_meta_ops.h"
 #include "fs_options.h"
+#include "storage_backend.h"
 #include "fs_logger.h"
 #include "dir_meta_ops.h"
-
+#include "work_queue.h"
+#include "fs_trace.h"
+#include "local_gridfs.h"
+#include "write_back.h"
+#include "fs_journal.h"
+#include "chunk_reaper.h"
+
+#include <string.h>
 #include <iostream>
-#include <mongo/client/gridfs.h>
-#include <mongo/client/connpool.h>
 
 using namespace std;
 using namespace mongo;
@@ -13,37 +19,40 @@ using namespace mongo;
 int mgridfs::mgridfs_load_or_create_root() {
 
 	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-
-		info() << "Connection to mongodb succeeded {ConnId: " << dbc.conn().getConnectionId() 
-			<< ", WireVersion: {Min: " << dbc.conn().getMinWireVersion() << ", Max: " << dbc.conn().getMaxWireVersion() << "}"
-			<< ", IsConnected: " << dbc.conn().isStillConnected() << ", SO-timeout: " << dbc.conn().getSoTimeout()
-			<< ", Type: " << (long)dbc.conn().type() << "}" << std::endl;
+		StorageBackend& backend = StorageBackend::get();
+		backend.initialize();
 
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		GridFile gridFile = gridFS.findFile(BSON("filename" << "/" << "metadata.type" << "directory"));
+		// Directories are found where they were moved to, not half-way
+		int resumed = backend.resumeRenames();
+		if (resumed) {
+			info() << "Completed directory renames interrupted by the previous run {renames: " << resumed << "}" << endl;
+		}
 
-		debug() << "GridFile from query {Filename: " << gridFile.getFilename() << ", metadata: " << gridFile.getMetadata() << std::endl;
-		if (!gridFile.exists()) {
+		BSONObj rootObj = backend.findFile("/");
+		debug() << "Root directory from query {file: " << rootObj << "}" << std::endl;
+		if (rootObj.isEmpty()) {
 			info() << "Root directory not found for mounting, will try to create one now with following credentials: "
 				<< "{UID: " << geteuid() << ", GID: " << getegid() << ", mode: 700" << "}"
 				<< std::endl;
-			int retValue = mgridfs_create_directory(dbc.conn(), "/", 0700, geteuid(), getegid());
+			int retValue = mgridfs_create_directory("/", 0700, geteuid(), getegid());
 			if (retValue) {
-				error() << "Failed to create root for the mounted filesystem in MongoDB" << std::endl;
-				dbc.done();
+				error() << "Failed to create root for the mounted filesystem in " << backend.getName() << std::endl;
 				return -EIO;
 			}
 
-			GridFile gridFile1 = gridFS.findFile(BSON("filename" << "/" << "metadata.type" << "directory"));
-			if (!gridFile1.exists()) {
+			rootObj = backend.findFile("/");
+			if (rootObj.isEmpty()) {
 				error() << "Tried creating and failed to create the root directory, will not proceed further with file system mount"
 					<< std::endl;
-				dbc.done();
 				return -ENOENT;
 			}
 		}
-		dbc.done();
+
+		if (strcmp(rootObj.getObjectField("metadata").getStringField("type"), "directory")) {
+			error() << "Root of the file system is not a directory, will not proceed further with file system mount {root: "
+				<< rootObj << "}" << std::endl;
+			return -ENOTDIR;
+		}
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
@@ -62,6 +71,13 @@ int mgridfs::mgridfs_load_or_create_root() {
  */
 void* mgridfs::mgridfs_init(struct fuse_conn_info* conn) {
 	trace() << "-> requested mgridfs_init(fuse_conn_info)" << endl;
+
+	// Threads are started here rather than in main as fuse forks when daemonizing
+	FSLogManager::get().startAsyncWriter();
+	FSWorkQueue::get().start(globalFSOptions._workerThreads, globalFSOptions._workQueueSize);
+	FSWriteBack::get().start();
+	FSJournal::get().start();
+	FSChunkReaper::get().start();
 	return NULL;
 }
 
@@ -72,6 +88,15 @@ void* mgridfs::mgridfs_init(struct fuse_conn_info* conn) {
  */
 void mgridfs::mgridfs_destroy(void* data) {
 	trace() << "-> requested mgridfs_destroy(fuse_conn_info)" << endl;
+
+	// Files still open at unmount (e.g. by a process that was killed) would lose their dirty data
+	FSWriteBack::get().stop();
+	LocalGridFS::get().releaseAllFiles(true);
+	FSJournal::get().stop();
+	FSChunkReaper::get().stop();
+	FSWorkQueue::get().stop();
+	FSTrace::get().stop();
+	FSLogManager::get().stopAsyncWriter();
 }
 
 /** Get file system statistics
@@ -87,13 +112,7 @@ int mgridfs::mgridfs_statfs(const char *file, struct statvfs *statEntry) {
 	BSONObj retInfo;
 
 	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		if (!dbc->runCommand(globalFSOptions._db, BSON("dbstats" << 1), retInfo)) {
-			fatal() << "Failed to get db.stats from server " << retInfo << endl;
-			return -EIO;
-		}
-
-		dbc.done();
+		retInfo = StorageBackend::get().getStats();
 	} catch (DBException& e) {
 		error() << "Caught exception in processing {code: " << e.getCode() << ", what: " << e.what()
 			<< ", exception: " << e.toString() << "}" << endl;
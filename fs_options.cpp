@@ -1,6 +1,12 @@
 #include "fs_options.h"
 #include "fs_logger.h"
 #include "fs_meta_ops.h"
+#include "storage_backend.h"
+#include "fs_trace.h"
+#include "fs_stats.h"
+#include "buffer_budget.h"
+#include "chunk_pool.h"
+#include "fs_journal.h"
 #include "utils.h"
 
 #include <iostream>
@@ -12,6 +18,22 @@ namespace { // Anonymous namespace
 
 const size_t DEFAULT_MEMORY_GRID_FILE_CHUNK_SIZE = 128;
 const size_t DEFAULT_MAX_MEMORY_FILE_CHUNKS = 64 * 1024 / 128;
+const size_t DEFAULT_AUX_CONN_POOL_SIZE = 4;
+const size_t DEFAULT_CONN_HEALTH_CHECK_SECS = 30;
+const size_t DEFAULT_WORKER_THREADS = 4;
+const size_t DEFAULT_WORK_QUEUE_SIZE = 256;
+const char* DEFAULT_STORAGE_BACKEND = "mongo";
+const size_t DEFAULT_SLOW_OP_MILLIS = 1000;
+const size_t DEFAULT_MEM_BUDGET_MB = 1024;
+const size_t DEFAULT_MEM_HIGH_WATERMARK = 80;
+const size_t DEFAULT_MEM_LOW_WATERMARK = 60;
+const size_t DEFAULT_MEM_THROTTLE_MILLIS = 10000;
+const size_t DEFAULT_MEM_POOL_RETAIN_MB = 64;
+const size_t DEFAULT_WRITE_BACK_SECS = 5;
+const size_t DEFAULT_DIRTY_EXPIRE_SECS = 30;
+const size_t DEFAULT_DIRTY_RATIO = 20;
+const size_t DEFAULT_GC_DELAY_SECS = 60;
+const size_t DEFAULT_GC_CHUNKS_PER_SEC = 1000;
 
 /*
  * Temporary storage for parsing the arguments using fuse api
@@ -26,6 +48,44 @@ struct _ParsedFuseOptions {
 	unsigned int _memChunkSize;
 	unsigned int _maxMemFileChunks;
 
+	/* Memory of all the local files together */
+	unsigned int _memBudgetMB;
+	unsigned int _memHighWatermark;
+	unsigned int _memLowWatermark;
+	unsigned int _memThrottleMillis;
+	unsigned int _memPoolRetainMB;
+
+	/* Background write-back of the dirty files */
+	unsigned int _writeBackSecs;
+	unsigned int _dirtyExpireSecs;
+	unsigned int _dirtyRatio;
+
+	/* Background removal of the chunks of the files removed */
+	unsigned int _gcDelaySecs;
+	unsigned int _gcChunksPerSec;
+
+	/* Connections to the server */
+	unsigned int _auxConnPoolSize;
+	unsigned int _connHealthCheckSecs;
+
+	/* Background work queue */
+	unsigned int _workerThreads;
+	unsigned int _workQueueSize;
+
+	/* Storage backend and the network emulated by the in-memory backend */
+	const char* _backend;
+	unsigned int _backendLatencyMicros;
+	unsigned int _backendBandwidthKB;
+
+	/* Recording of the FUSE calls for replay */
+	const char* _traceFile;
+
+	/* Local journal for closing files without waiting for the upload */
+	const char* _journalDir;
+
+	/* Operations logged with their mongo calls */
+	unsigned int _slowOpMillis;
+
 	char* _logFile;
 	char* _logLevel;
 };
@@ -37,6 +97,9 @@ static struct _ParsedFuseOptions _parsedFuseOptions;
 enum MGRIDFS_KEYS {
 	KEY_NONE,
 	KEY_ENABLE_DYN_MEM_CHUNK,
+	KEY_MEM_HUGE_PAGES,
+	KEY_DEDUP,
+	KEY_COMPRESS,
 	KEY_HELP,
 	KEY_VERSION,
 };
@@ -53,6 +116,35 @@ struct fuse_opt mgridfsOptions[] = {
 	MGRIDFS_OPT_KEY("--maxMemFileChunks=%d", _maxMemFileChunks, 0),
 	FUSE_OPT_KEY("--enableDynMemChunk", KEY_ENABLE_DYN_MEM_CHUNK),
 
+	MGRIDFS_OPT_KEY("--memBudgetMB=%d", _memBudgetMB, 0),
+	MGRIDFS_OPT_KEY("--memHighWatermark=%d", _memHighWatermark, 0),
+	MGRIDFS_OPT_KEY("--memLowWatermark=%d", _memLowWatermark, 0),
+	MGRIDFS_OPT_KEY("--memThrottleMillis=%d", _memThrottleMillis, 0),
+	MGRIDFS_OPT_KEY("--memPoolRetainMB=%d", _memPoolRetainMB, 0),
+	FUSE_OPT_KEY("--memHugePages", KEY_MEM_HUGE_PAGES),
+
+	MGRIDFS_OPT_KEY("--writeBackSecs=%d", _writeBackSecs, 0),
+	MGRIDFS_OPT_KEY("--dirtyExpireSecs=%d", _dirtyExpireSecs, 0),
+	MGRIDFS_OPT_KEY("--dirtyRatio=%d", _dirtyRatio, 0),
+	MGRIDFS_OPT_KEY("--gcDelaySecs=%d", _gcDelaySecs, 0),
+	MGRIDFS_OPT_KEY("--gcChunksPerSec=%d", _gcChunksPerSec, 0),
+	FUSE_OPT_KEY("--dedup", KEY_DEDUP),
+	FUSE_OPT_KEY("--compress", KEY_COMPRESS),
+
+	MGRIDFS_OPT_KEY("--auxConnPoolSize=%d", _auxConnPoolSize, 0),
+	MGRIDFS_OPT_KEY("--connHealthCheckSecs=%d", _connHealthCheckSecs, 0),
+
+	MGRIDFS_OPT_KEY("--workerThreads=%d", _workerThreads, 0),
+	MGRIDFS_OPT_KEY("--workQueueSize=%d", _workQueueSize, 0),
+
+	MGRIDFS_OPT_KEY("--backend=%s", _backend, 0),
+	MGRIDFS_OPT_KEY("--backendLatencyMicros=%d", _backendLatencyMicros, 0),
+	MGRIDFS_OPT_KEY("--backendBandwidthKB=%d", _backendBandwidthKB, 0),
+
+	MGRIDFS_OPT_KEY("--traceFile=%s", _traceFile, 0),
+	MGRIDFS_OPT_KEY("--slowOpMillis=%d", _slowOpMillis, 0),
+	MGRIDFS_OPT_KEY("--journalDir=%s", _journalDir, 0),
+
 	FUSE_OPT_KEY("--help", KEY_HELP),
 	FUSE_OPT_KEY("--version", KEY_VERSION),
 	{NULL}
@@ -77,6 +169,50 @@ void printHelp(int exitCode) {
 			<< " --enableDynMemChunk        Enable chunk size to be variable across files for it to be " << endl
 			<< "                            modified to be in-line with GridFile chunk size when opening " << endl
 			<< "                            file in R/W mode." << endl
+			<< " --memBudgetMB=<num>        Memory for the buffers of all the open files together, in MB," << endl
+			<< "                            defaults to " << DEFAULT_MEM_BUDGET_MB << endl
+			<< " --memHighWatermark=<num>   Percent of --memBudgetMB over which the largest idle files are flushed" << endl
+			<< "                            and their buffers freed, defaults to " << DEFAULT_MEM_HIGH_WATERMARK << endl
+			<< " --memLowWatermark=<num>    Percent of --memBudgetMB the usage is brought down to once over the high" << endl
+			<< "                            watermark, defaults to " << DEFAULT_MEM_LOW_WATERMARK << endl
+			<< " --memThrottleMillis=<num>  Max time writes wait for memory once the budget is used up before" << endl
+			<< "                            failing with ENOMEM, defaults to " << DEFAULT_MEM_THROTTLE_MILLIS << endl
+			<< " --memPoolRetainMB=<num>    Free chunk buffers kept for reuse, in MB, the memory of the rest is" << endl
+			<< "                            returned to the system, defaults to " << DEFAULT_MEM_POOL_RETAIN_MB << endl
+			<< " --memHugePages             Back the buffers of chunks of 1MB or more with transparent huge pages" << endl
+			<< " --writeBackSecs=<num>      Interval in seconds at which dirty files are checked for write-back," << endl
+			<< "                            defaults to " << DEFAULT_WRITE_BACK_SECS << endl
+			<< " --dirtyExpireSecs=<num>    Files dirty for longer than these many seconds are written back without" << endl
+			<< "                            waiting for close, defaults to " << DEFAULT_DIRTY_EXPIRE_SECS << endl
+			<< " --dirtyRatio=<num>         Percent of --memBudgetMB over which the dirty files are written back," << endl
+			<< "                            oldest first, defaults to " << DEFAULT_DIRTY_RATIO << endl
+			<< " --gcDelaySecs=<num>        Seconds the chunks of the files removed or overwritten are kept for the" << endl
+			<< "                            readers still fetching them, defaults to " << DEFAULT_GC_DELAY_SECS << endl
+			<< " --gcChunksPerSec=<num>     Max chunks of the files removed or overwritten deleted per second in the" << endl
+			<< "                            background, defaults to " << DEFAULT_GC_CHUNKS_PER_SEC << endl
+			<< " --dedup                    Store the files flushed as manifests of content-addressed chunks shared" << endl
+			<< "                            by all the files, uploading only the chunks the server does not have" << endl
+			<< " --compress                 Store the chunks of the files flushed compressed with zlib, except the" << endl
+			<< "                            chunks that do not compress" << endl
+			<< " --auxConnPoolSize=<num>    Max connections to mongodb shared by auxiliary (background) threads," << endl
+			<< "                            defaults to " << DEFAULT_AUX_CONN_POOL_SIZE << ". Each FUSE worker thread keeps its own connection." << endl
+			<< " --connHealthCheckSecs=<num> Idle time in seconds after which a connection is verified before use," << endl
+			<< "                            defaults to " << DEFAULT_CONN_HEALTH_CHECK_SECS << endl
+			<< " --workerThreads=<num>      Worker threads for parallel chunk transfers and background work," << endl
+			<< "                            defaults to " << DEFAULT_WORKER_THREADS << endl
+			<< " --workQueueSize=<num>      Max pending requests for the worker threads before callers block," << endl
+			<< "                            defaults to " << DEFAULT_WORK_QUEUE_SIZE << endl
+			<< " --backend=<name>           Storage for the files, mongo (GridFS) or memory (in-process emulator" << endl
+			<< "                            for benchmarks, content is lost on unmount), defaults to " << DEFAULT_STORAGE_BACKEND << endl
+			<< " --backendLatencyMicros=<num> Round trip latency injected by the memory backend, defaults to 0" << endl
+			<< " --backendBandwidthKB=<num> Bandwidth in KB/s of the link emulated by the memory backend," << endl
+			<< "                            defaults to 0 (unlimited)" << endl
+			<< " --traceFile=<file>         Record every FUSE call into a binary trace for mgridfs_replay," << endl
+			<< "                            disabled by default" << endl
+			<< " --slowOpMillis=<num>       FUSE calls taking at least these many milliseconds are logged along" << endl
+			<< "                            with the mongo calls they made, defaults to " << DEFAULT_SLOW_OP_MILLIS << endl
+			<< " --journalDir=<dir>         Return from close once the content is in a journal in this directory," << endl
+			<< "                            uploading it in the background, disabled by default" << endl
 			<< " --help                     diplay help for command options" << endl
 			<< " --version                  display mgridfs version information" << endl
 			<< endl 
@@ -111,6 +247,21 @@ int fuseOptionCallback(void* data, const char* arg, int key, struct fuse_args* o
 		return -1;
 	}
 
+	if (key == KEY_MEM_HUGE_PAGES) {
+		globalFSOptions._memHugePages = true;
+		return -1;
+	}
+
+	if (key == KEY_DEDUP) {
+		globalFSOptions._dedup = true;
+		return -1;
+	}
+
+	if (key == KEY_COMPRESS) {
+		globalFSOptions._compress = true;
+		return -1;
+	}
+
 	return 1;
 }
 
@@ -142,7 +293,25 @@ bool mgridfs::FSOptions::fromCommandLine(struct fuse_args& fuseArgs) {
 			<< " logging: {file: " << (_parsedFuseOptions._logFile ? _parsedFuseOptions._logFile : "") 
 			<< ", level: " << (_parsedFuseOptions._logLevel ? _parsedFuseOptions._logLevel : "") << "}, " << endl
 			<< " memfile: {chunkSize: " << _parsedFuseOptions._memChunkSize << ", maxChunks: " << _parsedFuseOptions._maxMemFileChunks
-				<< ", dynChunkSize: " << globalFSOptions._enableDynMemChunk << "}" << endl
+				<< ", dynChunkSize: " << globalFSOptions._enableDynMemChunk << "}, " << endl
+			<< " memBudget: {MB: " << _parsedFuseOptions._memBudgetMB << ", highWatermark: " << _parsedFuseOptions._memHighWatermark
+				<< ", lowWatermark: " << _parsedFuseOptions._memLowWatermark
+				<< ", throttleMillis: " << _parsedFuseOptions._memThrottleMillis << "}, " << endl
+			<< " memPool: {retainMB: " << _parsedFuseOptions._memPoolRetainMB << ", hugePages: " << globalFSOptions._memHugePages << "}, " << endl
+			<< " writeBack: {secs: " << _parsedFuseOptions._writeBackSecs << ", dirtyExpireSecs: " << _parsedFuseOptions._dirtyExpireSecs
+				<< ", dirtyRatio: " << _parsedFuseOptions._dirtyRatio << "}, " << endl
+			<< " gc: {delaySecs: " << _parsedFuseOptions._gcDelaySecs << ", chunksPerSec: " << _parsedFuseOptions._gcChunksPerSec << "}, " << endl
+			<< " dedup: " << globalFSOptions._dedup << ", compress: " << globalFSOptions._compress << ", " << endl
+			<< " connections: {auxPoolSize: " << _parsedFuseOptions._auxConnPoolSize
+				<< ", healthCheckSecs: " << _parsedFuseOptions._connHealthCheckSecs << "}, " << endl
+			<< " workQueue: {workers: " << _parsedFuseOptions._workerThreads
+				<< ", size: " << _parsedFuseOptions._workQueueSize << "}, " << endl
+			<< " backend: {name: " << (_parsedFuseOptions._backend ? _parsedFuseOptions._backend : "")
+				<< ", latencyMicros: " << _parsedFuseOptions._backendLatencyMicros
+				<< ", bandwidthKB: " << _parsedFuseOptions._backendBandwidthKB << "}, " << endl
+			<< " trace: {file: " << (_parsedFuseOptions._traceFile ? _parsedFuseOptions._traceFile : "") << "}, " << endl
+			<< " slowOps: {millis: " << _parsedFuseOptions._slowOpMillis << "}, " << endl
+			<< " journal: {dir: " << (_parsedFuseOptions._journalDir ? _parsedFuseOptions._journalDir : "") << "}" << endl
 			<< "}" << endl
 		;
 
@@ -179,6 +348,95 @@ bool mgridfs::FSOptions::fromCommandLine(struct fuse_args& fuseArgs) {
 		info() << "Setting memfile chunks / file -> " << _parsedFuseOptions._maxMemFileChunks << endl;
 	}
 
+	if (!_parsedFuseOptions._memBudgetMB) {
+		_parsedFuseOptions._memBudgetMB = DEFAULT_MEM_BUDGET_MB;
+		info() << "Setting memory budget -> " << _parsedFuseOptions._memBudgetMB << endl;
+	}
+
+	if (!_parsedFuseOptions._memHighWatermark) {
+		_parsedFuseOptions._memHighWatermark = DEFAULT_MEM_HIGH_WATERMARK;
+		info() << "Setting memory high watermark -> " << _parsedFuseOptions._memHighWatermark << endl;
+	}
+
+	if (!_parsedFuseOptions._memLowWatermark) {
+		_parsedFuseOptions._memLowWatermark = DEFAULT_MEM_LOW_WATERMARK;
+		info() << "Setting memory low watermark -> " << _parsedFuseOptions._memLowWatermark << endl;
+	}
+
+	if (_parsedFuseOptions._memLowWatermark >= _parsedFuseOptions._memHighWatermark || _parsedFuseOptions._memHighWatermark > 100) {
+		fatal() << "Memory watermarks have to be percents with low < high: found to be {low: "
+			<< _parsedFuseOptions._memLowWatermark << ", high: " << _parsedFuseOptions._memHighWatermark << "}" << endl;
+		return false;
+	}
+
+	if (!_parsedFuseOptions._memThrottleMillis) {
+		_parsedFuseOptions._memThrottleMillis = DEFAULT_MEM_THROTTLE_MILLIS;
+		info() << "Setting memory throttle time -> " << _parsedFuseOptions._memThrottleMillis << endl;
+	}
+
+	if (!_parsedFuseOptions._memPoolRetainMB) {
+		_parsedFuseOptions._memPoolRetainMB = DEFAULT_MEM_POOL_RETAIN_MB;
+		info() << "Setting memory pool retained size -> " << _parsedFuseOptions._memPoolRetainMB << endl;
+	}
+
+	if (!_parsedFuseOptions._writeBackSecs) {
+		_parsedFuseOptions._writeBackSecs = DEFAULT_WRITE_BACK_SECS;
+		info() << "Setting write-back interval -> " << _parsedFuseOptions._writeBackSecs << endl;
+	}
+
+	if (!_parsedFuseOptions._dirtyExpireSecs) {
+		_parsedFuseOptions._dirtyExpireSecs = DEFAULT_DIRTY_EXPIRE_SECS;
+		info() << "Setting dirty expire time -> " << _parsedFuseOptions._dirtyExpireSecs << endl;
+	}
+
+	if (!_parsedFuseOptions._dirtyRatio) {
+		_parsedFuseOptions._dirtyRatio = DEFAULT_DIRTY_RATIO;
+		info() << "Setting dirty ratio -> " << _parsedFuseOptions._dirtyRatio << endl;
+	} else if (_parsedFuseOptions._dirtyRatio > 100) {
+		fatal() << "Dirty ratio has to be a percent: found to be " << _parsedFuseOptions._dirtyRatio << endl;
+		return false;
+	}
+
+	if (!_parsedFuseOptions._gcDelaySecs) {
+		_parsedFuseOptions._gcDelaySecs = DEFAULT_GC_DELAY_SECS;
+		info() << "Setting chunk removal delay -> " << _parsedFuseOptions._gcDelaySecs << endl;
+	}
+
+	if (!_parsedFuseOptions._gcChunksPerSec) {
+		_parsedFuseOptions._gcChunksPerSec = DEFAULT_GC_CHUNKS_PER_SEC;
+		info() << "Setting chunk removal rate -> " << _parsedFuseOptions._gcChunksPerSec << endl;
+	}
+
+	if (!_parsedFuseOptions._auxConnPoolSize) {
+		_parsedFuseOptions._auxConnPoolSize = DEFAULT_AUX_CONN_POOL_SIZE;
+		info() << "Setting auxiliary connection pool size -> " << _parsedFuseOptions._auxConnPoolSize << endl;
+	}
+
+	if (!_parsedFuseOptions._connHealthCheckSecs) {
+		_parsedFuseOptions._connHealthCheckSecs = DEFAULT_CONN_HEALTH_CHECK_SECS;
+		info() << "Setting connection health check interval -> " << _parsedFuseOptions._connHealthCheckSecs << endl;
+	}
+
+	if (!_parsedFuseOptions._workerThreads) {
+		_parsedFuseOptions._workerThreads = DEFAULT_WORKER_THREADS;
+		info() << "Setting work queue worker threads -> " << _parsedFuseOptions._workerThreads << endl;
+	}
+
+	if (!_parsedFuseOptions._workQueueSize) {
+		_parsedFuseOptions._workQueueSize = DEFAULT_WORK_QUEUE_SIZE;
+		info() << "Setting work queue size -> " << _parsedFuseOptions._workQueueSize << endl;
+	}
+
+	if (!_parsedFuseOptions._backend) {
+		_parsedFuseOptions._backend = DEFAULT_STORAGE_BACKEND;
+		info() << "Setting storage backend -> " << _parsedFuseOptions._backend << endl;
+	}
+
+	if (!_parsedFuseOptions._slowOpMillis) {
+		_parsedFuseOptions._slowOpMillis = DEFAULT_SLOW_OP_MILLIS;
+		info() << "Setting slow operation threshold -> " << _parsedFuseOptions._slowOpMillis << endl;
+	}
+
 	stringstream ss;
 	ss << _parsedFuseOptions._host << ":" << _parsedFuseOptions._port;
 
@@ -191,6 +449,28 @@ bool mgridfs::FSOptions::fromCommandLine(struct fuse_args& fuseArgs) {
 	globalFSOptions._maxMemFileChunks = _parsedFuseOptions._maxMemFileChunks;
 	globalFSOptions._maxMemFileSize = globalFSOptions._memChunkSize * globalFSOptions._maxMemFileChunks;
 	info() << "Max memory file size {size: " << globalFSOptions._maxMemFileSize << "}" << endl;
+	globalFSOptions._memBudget = (size_t)_parsedFuseOptions._memBudgetMB * 1024 * 1024;
+	globalFSOptions._memHighWatermark = _parsedFuseOptions._memHighWatermark;
+	globalFSOptions._memLowWatermark = _parsedFuseOptions._memLowWatermark;
+	globalFSOptions._memThrottleMillis = _parsedFuseOptions._memThrottleMillis;
+	BufferBudget::get().configure(globalFSOptions._memBudget, globalFSOptions._memHighWatermark,
+		globalFSOptions._memLowWatermark, globalFSOptions._memThrottleMillis);
+	globalFSOptions._memPoolRetain = (size_t)_parsedFuseOptions._memPoolRetainMB * 1024 * 1024;
+	ChunkPool::get().configure(globalFSOptions._memPoolRetain, globalFSOptions._memHugePages);
+	globalFSOptions._writeBackSecs = _parsedFuseOptions._writeBackSecs;
+	globalFSOptions._dirtyExpireSecs = _parsedFuseOptions._dirtyExpireSecs;
+	globalFSOptions._dirtyRatio = _parsedFuseOptions._dirtyRatio;
+	globalFSOptions._gcDelaySecs = _parsedFuseOptions._gcDelaySecs;
+	globalFSOptions._gcChunksPerSec = _parsedFuseOptions._gcChunksPerSec;
+	globalFSOptions._auxConnPoolSize = _parsedFuseOptions._auxConnPoolSize;
+	globalFSOptions._connHealthCheckInterval = _parsedFuseOptions._connHealthCheckSecs;
+	globalFSOptions._workerThreads = _parsedFuseOptions._workerThreads;
+	globalFSOptions._workQueueSize = _parsedFuseOptions._workQueueSize;
+	globalFSOptions._backend = _parsedFuseOptions._backend;
+	globalFSOptions._backendLatencyMicros = _parsedFuseOptions._backendLatencyMicros;
+	globalFSOptions._backendBandwidthKB = _parsedFuseOptions._backendBandwidthKB;
+	globalFSOptions._slowOpMillis = _parsedFuseOptions._slowOpMillis;
+	FSStats::setSlowOpThreshold(globalFSOptions._slowOpMillis * 1000);
 
 	if (_parsedFuseOptions._logLevel) {
 		globalFSOptions._logLevel = FSLogManager::get().stringToLogLevel(toUpper(_parsedFuseOptions._logLevel));
@@ -206,15 +486,40 @@ bool mgridfs::FSOptions::fromCommandLine(struct fuse_args& fuseArgs) {
 
 	globalFSOptions._filesNS = _parsedFuseOptions._db + string(".") + _parsedFuseOptions._collPrefix + string(".files");
 	globalFSOptions._chunksNS = _parsedFuseOptions._db + string(".") + _parsedFuseOptions._collPrefix + string(".chunks");
+	globalFSOptions._gcNS = _parsedFuseOptions._db + string(".") + _parsedFuseOptions._collPrefix + string(".gc");
+	globalFSOptions._renamesNS = _parsedFuseOptions._db + string(".") + _parsedFuseOptions._collPrefix + string(".renames");
+	globalFSOptions._blobsNS = _parsedFuseOptions._db + string(".") + _parsedFuseOptions._collPrefix + string(".blobs");
 	info() << "Collection namespaces {Files: " << globalFSOptions._filesNS
-			<< ", Chunks: " << globalFSOptions._chunksNS << "}"
+			<< ", Chunks: " << globalFSOptions._chunksNS << ", GC: " << globalFSOptions._gcNS
+			<< ", Renames: " << globalFSOptions._renamesNS << ", Blobs: " << globalFSOptions._blobsNS << "}"
 			<< endl;
 
 	globalFSOptions._hostAndPort = mongo::HostAndPort(_parsedFuseOptions._host, _parsedFuseOptions._port);
+	if (!StorageBackend::create(globalFSOptions._backend)) {
+		return false;
+	}
+
 	if (mgridfs::mgridfs_load_or_create_root()) {
 		return false;
 	}
 
+	// Content left in the journal by the previous run has to be on the server before anything is
+	// served. Opened before fuse daemonizes for a relative path to be relative to the working directory.
+	if (_parsedFuseOptions._journalDir) {
+		globalFSOptions._journalDir = _parsedFuseOptions._journalDir;
+		if (!FSJournal::get().open(globalFSOptions._journalDir)) {
+			return false;
+		}
+	}
+
+	// Opened before fuse daemonizes, so that a relative path is relative to the working directory
+	if (_parsedFuseOptions._traceFile) {
+		globalFSOptions._traceFile = _parsedFuseOptions._traceFile;
+		if (!FSTrace::get().start(globalFSOptions._traceFile)) {
+			return false;
+		}
+	}
+
 	if (_parsedFuseOptions._logFile) {
 		globalFSOptions._logFile = _parsedFuseOptions._logFile;
 		FSLogFile* fsLogFile = new FSLogFile(_parsedFuseOptions._logFile);
@@ -38,12 +38,47 @@ struct FSOptions {
 	mongo::HostAndPort _hostAndPort;
 	std::string _filesNS;
 	std::string _chunksNS;
+	std::string _gcNS;
+	std::string _renamesNS;
+	std::string _blobsNS; // Content-addressed chunks of the files stored with --dedup
 
 	size_t _memChunkSize;
 	size_t _maxMemFileChunks;
 	size_t _maxMemFileSize;
 	bool _enableDynMemChunk;
 
+	size_t _memBudget;
+	size_t _memHighWatermark;
+	size_t _memLowWatermark;
+	size_t _memThrottleMillis;
+	size_t _memPoolRetain;
+	bool _memHugePages;
+
+	size_t _writeBackSecs;
+	size_t _dirtyExpireSecs;
+	size_t _dirtyRatio;
+
+	size_t _gcDelaySecs;
+	size_t _gcChunksPerSec;
+
+	bool _dedup;
+	bool _compress;
+
+	size_t _auxConnPoolSize;
+	size_t _connHealthCheckInterval;
+
+	size_t _workerThreads;
+	size_t _workQueueSize;
+
+	string _backend;
+	size_t _backendLatencyMicros;
+	size_t _backendBandwidthKB;
+
+	string _traceFile;
+	string _journalDir;
+
+	size_t _slowOpMillis;
+
 	boost::bimap<string, string> _metadataKeyMap;
 };
 
@@ -0,0 +1,655 @@
+#include "fs_stats.h"
+#include "fs_logger.h"
+#include "file_handle.h"
+#include "fs_connection.h"
+#include "work_queue.h"
+#include "fs_options.h"
+#include "buffer_budget.h"
+#include "chunk_pool.h"
+#include "write_back.h"
+#include "fs_journal.h"
+#include "chunk_reaper.h"
+#include "chunk_codec.h"
+
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread/tss.hpp>
+
+using namespace mgridfs;
+
+namespace {
+	const char* const OPERATION_NAMES[] = {
+		"statfs", "getattr", "fgetattr", "setxattr", "getxattr", "listxattr", "removexattr", "chmod", "chown",
+		"utime", "utimens", "mknod", "mkdir", "rmdir", "opendir", "readdir", "releasedir", "fsyncdir", "readlink",
+		"unlink", "symlink", "create", "open", "read", "write", "flush", "release", "rename", "truncate",
+		"ftruncate", "fsync", "lock", "bmap", "ioctl", "poll", "flock", "fallocate",
+	};
+
+	const char* const MONGO_CALL_NAMES[] = {
+		"findFile", "getChunk", "storeFile", "update", "removeFile", "list", "dbstats",
+	};
+
+	const char* const CACHE_NAMES[] = {
+		"localFile", "fileLookup",
+	};
+
+	BOOST_STATIC_ASSERT(sizeof(OPERATION_NAMES) / sizeof(OPERATION_NAMES[0]) == FSOP_COUNT);
+	BOOST_STATIC_ASSERT(sizeof(MONGO_CALL_NAMES) / sizeof(MONGO_CALL_NAMES[0]) == MCT_COUNT);
+	BOOST_STATIC_ASSERT(sizeof(CACHE_NAMES) / sizeof(CACHE_NAMES[0]) == FSCACHE_COUNT);
+
+	// Operation context of the thread, owned by the FSOpScope on its stack (no-op cleanup)
+	void noCleanup(FSOpContext*) {}
+	boost::thread_specific_ptr<FSOpContext> currentContext(noCleanup);
+
+	// Orders the calls of a slow operation by their start
+	bool compareCallStart(const FSOpMongoCall* left, const FSOpMongoCall* right) {
+		return left->_startMicros < right->_startMicros;
+	}
+
+	// Coarse bucket boundaries for the prometheus histograms (microseconds)
+	const uint64_t PROMETHEUS_BOUNDS[] = {
+		50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+		1000000, 2500000, 5000000, 10000000,
+	};
+
+	inline void add(boost::atomic<uint64_t>& counter, uint64_t value) {
+		// Single writer per block, so a plain load / store is enough and avoids the locked instruction
+		counter.store(counter.load(boost::memory_order_relaxed) + value, boost::memory_order_relaxed);
+	}
+
+	inline double toSeconds(uint64_t micros) {
+		return micros / 1000000.0;
+	}
+}
+
+/*
+ * Counters recorded by a single thread, read concurrently by the snapshots
+ */
+struct mgridfs::FSStatsThreadBlock {
+	struct Counters {
+		Counters() {
+			_count.store(0);
+			_errors.store(0);
+			_bytes.store(0);
+			_totalMicros.store(0);
+			_maxMicros.store(0);
+			for (size_t i = 0; i < LatencyBuckets::BUCKET_COUNT; ++i) {
+				_buckets[i].store(0);
+			}
+			for (size_t i = 0; i < FSStatsCounters::MAX_TRACKED_ERRNO; ++i) {
+				_errnos[i].store(0);
+			}
+		}
+
+		void record(uint64_t micros, bool failed, size_t bytes) {
+			add(_count, 1);
+			add(_totalMicros, micros);
+			add(_buckets[LatencyBuckets::bucketFor(micros)], 1);
+			if (micros > _maxMicros.load(boost::memory_order_relaxed)) {
+				_maxMicros.store(micros, boost::memory_order_relaxed);
+			}
+			if (failed) {
+				add(_errors, 1);
+			}
+			if (bytes) {
+				add(_bytes, bytes);
+			}
+		}
+
+		void addTo(FSStatsCounters& counters) const {
+			counters._count += _count.load(boost::memory_order_relaxed);
+			counters._errors += _errors.load(boost::memory_order_relaxed);
+			counters._bytes += _bytes.load(boost::memory_order_relaxed);
+			counters._totalMicros += _totalMicros.load(boost::memory_order_relaxed);
+			counters._maxMicros = max(counters._maxMicros, (uint64_t)_maxMicros.load(boost::memory_order_relaxed));
+			for (size_t i = 0; i < LatencyBuckets::BUCKET_COUNT; ++i) {
+				counters._buckets[i] += _buckets[i].load(boost::memory_order_relaxed);
+			}
+			for (size_t i = 0; i < FSStatsCounters::MAX_TRACKED_ERRNO; ++i) {
+				counters._errnos[i] += _errnos[i].load(boost::memory_order_relaxed);
+			}
+		}
+
+		void merge(const Counters& other) {
+			add(_count, other._count.load(boost::memory_order_relaxed));
+			add(_errors, other._errors.load(boost::memory_order_relaxed));
+			add(_bytes, other._bytes.load(boost::memory_order_relaxed));
+			add(_totalMicros, other._totalMicros.load(boost::memory_order_relaxed));
+			_maxMicros.store(max(_maxMicros.load(boost::memory_order_relaxed), other._maxMicros.load(boost::memory_order_relaxed)),
+				boost::memory_order_relaxed);
+			for (size_t i = 0; i < LatencyBuckets::BUCKET_COUNT; ++i) {
+				add(_buckets[i], other._buckets[i].load(boost::memory_order_relaxed));
+			}
+			for (size_t i = 0; i < FSStatsCounters::MAX_TRACKED_ERRNO; ++i) {
+				add(_errnos[i], other._errnos[i].load(boost::memory_order_relaxed));
+			}
+		}
+
+		boost::atomic<uint64_t> _count;
+		boost::atomic<uint64_t> _errors;
+		boost::atomic<uint64_t> _bytes;
+		boost::atomic<uint64_t> _totalMicros;
+		boost::atomic<uint64_t> _maxMicros;
+		boost::atomic<uint64_t> _buckets[LatencyBuckets::BUCKET_COUNT];
+		boost::atomic<uint64_t> _errnos[FSStatsCounters::MAX_TRACKED_ERRNO];
+	};
+
+	Counters _operations[FSOP_COUNT];
+	Counters _mongoCalls[MCT_COUNT];
+};
+
+size_t LatencyBuckets::bucketFor(uint64_t micros) {
+	if (micros < SUB_BUCKETS) {
+		return micros;
+	}
+
+	size_t exponent = 63 - __builtin_clzll(micros);
+	if (exponent > MAX_EXPONENT) {
+		return BUCKET_COUNT - 1;
+	}
+
+	size_t subBucket = (micros >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+	return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + subBucket;
+}
+
+uint64_t LatencyBuckets::bucketUpperBound(size_t bucket) {
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+
+	size_t exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+	size_t subBucket = bucket % SUB_BUCKETS;
+	uint64_t width = (uint64_t)1 << (exponent - SUB_BUCKET_BITS);
+	return ((SUB_BUCKETS + subBucket) * width) + width - 1;
+}
+
+FSStatsCounters::FSStatsCounters()
+	: _count(0), _errors(0), _bytes(0), _totalMicros(0), _maxMicros(0) {
+	fill(_buckets, _buckets + LatencyBuckets::BUCKET_COUNT, 0);
+	fill(_errnos, _errnos + MAX_TRACKED_ERRNO, 0);
+}
+
+uint64_t FSStatsCounters::getPercentile(double fraction) const {
+	if (!_count) {
+		return 0;
+	}
+
+	uint64_t target = (uint64_t)(fraction * _count);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < LatencyBuckets::BUCKET_COUNT; ++i) {
+		seen += _buckets[i];
+		if (seen > target) {
+			return min(LatencyBuckets::bucketUpperBound(i), _maxMicros);
+		}
+	}
+	return _maxMicros;
+}
+
+FSOpContext::FSOpContext(uint64_t startMicros)
+	: _startMicros(startMicros), _thread(pthread_self()), _previous(currentContext.get()) {
+	_callCount.store(0, boost::memory_order_relaxed);
+	_cacheHits.store(0, boost::memory_order_relaxed);
+	_cacheMisses.store(0, boost::memory_order_relaxed);
+	currentContext.reset(this);
+}
+
+FSOpContext::~FSOpContext() {
+	currentContext.reset(_previous);
+}
+
+FSOpContext* FSOpContext::current() {
+	return currentContext.get();
+}
+
+void FSOpContext::addMongoCall(const FSOpMongoCall& call) {
+	uint32_t slot = _callCount.fetch_add(1, boost::memory_order_relaxed);
+	if (slot < MAX_CALLS) {
+		_calls[slot] = call;
+		_calls[slot]._worker = !pthread_equal(_thread, pthread_self());
+	}
+}
+
+void FSOpContext::recordCache(FSCacheType cacheType, bool hit) {
+	FSOpContext* context = current();
+	if (context) {
+		(hit ? context->_cacheHits : context->_cacheMisses).fetch_or(1 << cacheType, boost::memory_order_relaxed);
+	}
+}
+
+FSOpContext::Adopt::Adopt(FSOpContext* context)
+	: _previous(currentContext.get()) {
+	currentContext.reset(context);
+}
+
+FSOpContext::Adopt::~Adopt() {
+	currentContext.reset(_previous);
+}
+
+uint64_t FSStats::_slowOpThresholdMicros = 0;
+
+FSStats::FSStats()
+	: _startTime(time(NULL)), _retired(new FSStatsThreadBlock()), _threadBlock(&FSStats::retireThreadBlock) {
+	_slowOperations.store(0);
+}
+
+FSStats::~FSStats() {
+}
+
+FSStats& FSStats::get() {
+	static FSStats instance;
+	return instance;
+}
+
+const char* FSStats::getOperationName(FSOperation op) {
+	return (op >= 0 && op < FSOP_COUNT) ? OPERATION_NAMES[op] : "unknown";
+}
+
+const char* FSStats::getMongoCallName(MongoCallType callType) {
+	return (callType >= 0 && callType < MCT_COUNT) ? MONGO_CALL_NAMES[callType] : "unknown";
+}
+
+FSStatsThreadBlock* FSStats::getThreadBlock() {
+	FSStatsThreadBlock* block = _threadBlock.get();
+	if (!block) {
+		block = new FSStatsThreadBlock();
+		_threadBlock.reset(block);
+
+		boost::mutex::scoped_lock lock(_blocksLock);
+		_blocks.push_back(block);
+	}
+	return block;
+}
+
+void FSStats::retireThreadBlock(FSStatsThreadBlock* block) {
+	FSStats& stats = FSStats::get();
+	boost::mutex::scoped_lock lock(stats._blocksLock);
+	for (size_t i = 0; i < FSOP_COUNT; ++i) {
+		stats._retired->_operations[i].merge(block->_operations[i]);
+	}
+	for (size_t i = 0; i < MCT_COUNT; ++i) {
+		stats._retired->_mongoCalls[i].merge(block->_mongoCalls[i]);
+	}
+
+	stats._blocks.erase(std::remove(stats._blocks.begin(), stats._blocks.end(), block), stats._blocks.end());
+	delete block;
+}
+
+void FSStats::recordOperation(FSOperation op, uint64_t micros, int retCode, size_t bytes) {
+	FSStatsThreadBlock::Counters& counters = getThreadBlock()->_operations[op];
+	counters.record(micros, retCode < 0, bytes);
+	if (retCode < 0 && (size_t)-retCode < FSStatsCounters::MAX_TRACKED_ERRNO) {
+		add(counters._errnos[-retCode], 1);
+	}
+}
+
+void FSStats::recordMongoCall(MongoCallType callType, uint64_t micros, bool failed) {
+	getThreadBlock()->_mongoCalls[callType].record(micros, failed, 0);
+}
+
+void FSStats::setSlowOpThreshold(uint64_t micros) {
+	_slowOpThresholdMicros = micros;
+}
+
+void FSStats::logSlowOperation(FSOperation op, uint64_t micros, int retCode, const FSTraceArgs& args, const FSOpContext& context) {
+	_slowOperations.fetch_add(1, boost::memory_order_relaxed);
+
+	// Calls of the work queue threads complete out of order with the ones of the operation thread
+	vector<const FSOpMongoCall*> calls;
+	for (size_t i = 0; i < context.getCallCount(); ++i) {
+		calls.push_back(&context.getCall(i));
+	}
+	std::stable_sort(calls.begin(), calls.end(), compareCallStart);
+
+	uint64_t mongoMicros = 0;
+	ostringstream os;
+	os << "[";
+	for (size_t i = 0; i < calls.size(); ++i) {
+		const FSOpMongoCall& call = *calls[i];
+		mongoMicros += call._micros;
+		os << (i ? ", " : "") << "{call: " << MONGO_CALL_NAMES[call._callType] << ", ns: ";
+		if (call._callType == MCT_GET_CHUNK) {
+			os << globalFSOptions._chunksNS;
+		} else if (call._callType == MCT_DBSTATS) {
+			os << globalFSOptions._db;
+		} else {
+			os << globalFSOptions._filesNS;
+		}
+
+		os << ", query: ";
+		for (const char* c = call._query; *c; ++c) {
+			if (*c == '$' && (c[1] == '1' || c[1] == '2')) {
+				os << call._args[*++c - '1'];
+			} else {
+				os << *c;
+			}
+		}
+		os << ", docs: " << call._docs << ", bytes: " << call._bytes << ", atUs: " << call._startMicros
+			<< ", us: " << call._micros;
+		if (call._worker) {
+			os << ", worker: true";
+		}
+		if (call._failed) {
+			os << ", failed: true";
+		}
+		os << "}";
+	}
+	os << "]";
+
+	ostringstream cacheOs;
+	uint32_t hits = context.getCacheHits();
+	uint32_t misses = context.getCacheMisses();
+	for (size_t i = 0; i < FSCACHE_COUNT; ++i) {
+		uint32_t bit = 1 << i;
+		if ((hits | misses) & bit) {
+			cacheOs << (cacheOs.tellp() ? ", " : "") << CACHE_NAMES[i] << ": "
+				<< ((hits & bit) ? ((misses & bit) ? "partial" : "hit") : "miss");
+		}
+	}
+
+	warn() << "Slow operation {op: " << OPERATION_NAMES[op] << ", path: " << (args._path ? args._path : "")
+		<< (args._path2 ? ", path2: " : "") << (args._path2 ? args._path2 : "")
+		<< ", totalUs: " << micros << ", retCode: " << retCode << ", mongoUs: " << mongoMicros
+		<< ", cache: {" << cacheOs.str() << "}, mongoCalls: " << os.str()
+		<< ", droppedCalls: " << context.getDroppedCallCount() << "}" << endl;
+}
+
+void FSStats::addBlock(FSStatsSnapshot& snapshot, const FSStatsThreadBlock& block) {
+	for (size_t i = 0; i < FSOP_COUNT; ++i) {
+		block._operations[i].addTo(snapshot._operations[i]);
+	}
+	for (size_t i = 0; i < MCT_COUNT; ++i) {
+		block._mongoCalls[i].addTo(snapshot._mongoCalls[i]);
+	}
+}
+
+void FSStats::getSnapshot(FSStatsSnapshot& snapshot) {
+	snapshot._startTime = _startTime;
+	snapshot._snapshotTime = time(NULL);
+
+	boost::mutex::scoped_lock lock(_blocksLock);
+	addBlock(snapshot, *_retired);
+	for (vector<FSStatsThreadBlock*>::const_iterator bIt = _blocks.begin(); bIt != _blocks.end(); ++bIt) {
+		addBlock(snapshot, **bIt);
+	}
+}
+
+namespace {
+	void countersToJSON(ostream& os, const FSStatsCounters& counters, bool withErrnos) {
+		os << "{\"count\": " << counters._count
+			<< ", \"errors\": " << counters._errors;
+		if (withErrnos) {
+			os << ", \"bytes\": " << counters._bytes << ", \"errnos\": {";
+			bool first = true;
+			for (size_t i = 0; i < FSStatsCounters::MAX_TRACKED_ERRNO; ++i) {
+				if (counters._errnos[i]) {
+					os << (first ? "" : ", ") << "\"" << i << "\": " << counters._errnos[i];
+					first = false;
+				}
+			}
+			os << "}";
+		}
+
+		os << ", \"latencyUs\": {\"mean\": " << (counters._count ? counters._totalMicros / counters._count : 0)
+			<< ", \"p50\": " << counters.getPercentile(0.5)
+			<< ", \"p90\": " << counters.getPercentile(0.9)
+			<< ", \"p99\": " << counters.getPercentile(0.99)
+			<< ", \"p999\": " << counters.getPercentile(0.999)
+			<< ", \"max\": " << counters._maxMicros << "}}";
+	}
+
+	void countersToPrometheus(ostream& os, const string& metric, const string& label, const FSStatsCounters& counters) {
+		uint64_t cumulative = 0;
+		size_t bucket = 0;
+		for (size_t i = 0; i < sizeof(PROMETHEUS_BOUNDS) / sizeof(PROMETHEUS_BOUNDS[0]); ++i) {
+			while (bucket < LatencyBuckets::BUCKET_COUNT && LatencyBuckets::bucketUpperBound(bucket) <= PROMETHEUS_BOUNDS[i]) {
+				cumulative += counters._buckets[bucket++];
+			}
+			os << metric << "_bucket{" << label << ",le=\"" << toSeconds(PROMETHEUS_BOUNDS[i]) << "\"} " << cumulative << "\n";
+		}
+		os << metric << "_bucket{" << label << ",le=\"+Inf\"} " << counters._count << "\n";
+		os << metric << "_sum{" << label << "} " << toSeconds(counters._totalMicros) << "\n";
+		os << metric << "_count{" << label << "} " << counters._count << "\n";
+	}
+}
+
+string FSStats::toJSON() {
+	// Too large to be kept on the stack of a FUSE thread
+	boost::scoped_ptr<FSStatsSnapshot> snapshotPtr(new FSStatsSnapshot());
+	FSStatsSnapshot& snapshot = *snapshotPtr;
+	getSnapshot(snapshot);
+
+	ostringstream os;
+	os << "{\n\"uptimeSecs\": " << (snapshot._snapshotTime - snapshot._startTime) << ",\n"
+		<< "\"openHandles\": " << FileHandle::getActiveCount() << ",\n"
+		<< "\"connections\": {\"thread\": " << FSConnectionManager::get().getThreadConnectionCount()
+			<< ", \"auxiliary\": " << FSConnectionManager::get().getAuxConnectionCount() << "},\n"
+		<< "\"workQueuePending\": " << FSWorkQueue::get().getPendingCount() << ",\n"
+		<< "\"slowOperations\": " << _slowOperations.load() << ",\n";
+
+	BufferBudgetStats buffers;
+	BufferBudget::get().getStats(buffers);
+	os << "\"buffers\": {\"usedBytes\": " << buffers._usedBytes << ", \"limitBytes\": " << buffers._limitBytes
+		<< ", \"throttled\": " << buffers._throttled << ", \"throttleUs\": " << buffers._throttleMicros
+		<< ", \"failed\": " << buffers._failed << ", \"reclaims\": " << buffers._reclaims
+		<< ", \"reclaimedBytes\": " << buffers._reclaimedBytes << "},\n";
+
+	ChunkPoolStats pool;
+	ChunkPool::get().getStats(pool);
+	os << "\"chunkPool\": {\"mappedBytes\": " << pool._mappedBytes << ", \"inUseBytes\": " << pool._inUseBytes
+		<< ", \"freeBytes\": " << pool._freeBytes << ", \"threadCachedBytes\": " << pool._threadCachedBytes
+		<< ", \"releasedBytes\": " << pool._releasedBytes << ", \"slabs\": " << pool._slabs
+		<< ", \"allocations\": " << pool._allocations << ", \"threadCacheHits\": " << pool._threadCacheHits << "},\n";
+
+	WriteBackStats writeBack;
+	FSWriteBack::get().getStats(writeBack);
+	os << "\"writeBack\": {\"flushedByAge\": " << writeBack._flushedByAge << ", \"flushedByRatio\": " << writeBack._flushedByRatio
+		<< ", \"flushedBytes\": " << writeBack._flushedBytes << ", \"failed\": " << writeBack._failed << "},\n";
+
+	FSJournalStats journal;
+	FSJournal::get().getStats(journal);
+	os << "\"journal\": {\"enabled\": " << (FSJournal::get().isEnabled() ? "true" : "false")
+		<< ", \"appended\": " << journal._appended << ", \"appendedBytes\": " << journal._appendedBytes
+		<< ", \"uploaded\": " << journal._uploaded << ", \"uploadFailures\": " << journal._uploadFailures
+		<< ", \"replayed\": " << journal._replayed << ", \"pending\": " << journal._pending
+		<< ", \"pendingBytes\": " << journal._pendingBytes << "},\n";
+
+	ChunkReaperStats reaper;
+	FSChunkReaper::get().getStats(reaper);
+	os << "\"chunkReaper\": {\"reapedChunks\": " << reaper._reapedChunks << ", \"passes\": " << reaper._passes
+		<< ", \"failed\": " << reaper._failed << "},\n";
+
+	ChunkCodecStats codec;
+	ChunkCodec::get().getStats(codec);
+	os << "\"compression\": {\"compressedChunks\": " << codec._compressedChunks
+		<< ", \"probeSkippedChunks\": " << codec._probeSkippedChunks << ", \"incompressibleChunks\": " << codec._incompressibleChunks
+		<< ", \"rawBytes\": " << codec._rawBytes << ", \"storedBytes\": " << codec._storedBytes
+		<< ", \"decompressedChunks\": " << codec._decompressedChunks << ", \"failures\": " << codec._failures << "},\n";
+
+	os << "\"operations\": {\n";
+	for (size_t i = 0; i < FSOP_COUNT; ++i) {
+		os << "  \"" << OPERATION_NAMES[i] << "\": ";
+		countersToJSON(os, snapshot._operations[i], true);
+		os << ((i + 1 < FSOP_COUNT) ? ",\n" : "\n");
+	}
+	os << "},\n";
+
+	os << "\"mongo\": {\n";
+	for (size_t i = 0; i < MCT_COUNT; ++i) {
+		os << "  \"" << MONGO_CALL_NAMES[i] << "\": ";
+		countersToJSON(os, snapshot._mongoCalls[i], false);
+		os << ((i + 1 < MCT_COUNT) ? ",\n" : "\n");
+	}
+	os << "}\n}\n";
+
+	return os.str();
+}
+
+string FSStats::toPrometheus() {
+	// Too large to be kept on the stack of a FUSE thread
+	boost::scoped_ptr<FSStatsSnapshot> snapshotPtr(new FSStatsSnapshot());
+	FSStatsSnapshot& snapshot = *snapshotPtr;
+	getSnapshot(snapshot);
+
+	ostringstream os;
+	os << "# HELP mgridfs_uptime_seconds Time since the file system was mounted\n"
+		<< "# TYPE mgridfs_uptime_seconds gauge\n"
+		<< "mgridfs_uptime_seconds " << (snapshot._snapshotTime - snapshot._startTime) << "\n"
+		<< "# HELP mgridfs_open_handles File and directory handles currently open\n"
+		<< "# TYPE mgridfs_open_handles gauge\n"
+		<< "mgridfs_open_handles " << FileHandle::getActiveCount() << "\n"
+		<< "# HELP mgridfs_connections Connections to mongod\n"
+		<< "# TYPE mgridfs_connections gauge\n"
+		<< "mgridfs_connections{kind=\"thread\"} " << FSConnectionManager::get().getThreadConnectionCount() << "\n"
+		<< "mgridfs_connections{kind=\"auxiliary\"} " << FSConnectionManager::get().getAuxConnectionCount() << "\n"
+		<< "# HELP mgridfs_work_queue_pending Requests waiting for a worker thread\n"
+		<< "# TYPE mgridfs_work_queue_pending gauge\n"
+		<< "mgridfs_work_queue_pending " << FSWorkQueue::get().getPendingCount() << "\n"
+		<< "# HELP mgridfs_slow_operations_total FUSE operations over the slow operation threshold\n"
+		<< "# TYPE mgridfs_slow_operations_total counter\n"
+		<< "mgridfs_slow_operations_total " << _slowOperations.load() << "\n";
+
+	BufferBudgetStats buffers;
+	BufferBudget::get().getStats(buffers);
+	os << "# HELP mgridfs_buffer_bytes Memory held by the buffers of the open files\n"
+		<< "# TYPE mgridfs_buffer_bytes gauge\n"
+		<< "mgridfs_buffer_bytes " << buffers._usedBytes << "\n"
+		<< "# HELP mgridfs_buffer_limit_bytes Memory budget for the buffers of the open files\n"
+		<< "# TYPE mgridfs_buffer_limit_bytes gauge\n"
+		<< "mgridfs_buffer_limit_bytes " << buffers._limitBytes << "\n"
+		<< "# HELP mgridfs_buffer_throttled_total Buffer allocations that waited for memory\n"
+		<< "# TYPE mgridfs_buffer_throttled_total counter\n"
+		<< "mgridfs_buffer_throttled_total " << buffers._throttled << "\n"
+		<< "# HELP mgridfs_buffer_throttle_seconds_total Time buffer allocations waited for memory\n"
+		<< "# TYPE mgridfs_buffer_throttle_seconds_total counter\n"
+		<< "mgridfs_buffer_throttle_seconds_total " << toSeconds(buffers._throttleMicros) << "\n"
+		<< "# HELP mgridfs_buffer_failures_total Buffer allocations failed after waiting for memory\n"
+		<< "# TYPE mgridfs_buffer_failures_total counter\n"
+		<< "mgridfs_buffer_failures_total " << buffers._failed << "\n"
+		<< "# HELP mgridfs_buffer_reclaimed_bytes_total Buffer memory freed from idle files over the high watermark\n"
+		<< "# TYPE mgridfs_buffer_reclaimed_bytes_total counter\n"
+		<< "mgridfs_buffer_reclaimed_bytes_total " << buffers._reclaimedBytes << "\n";
+
+	ChunkPoolStats pool;
+	ChunkPool::get().getStats(pool);
+	os << "# HELP mgridfs_chunk_pool_bytes Memory of the chunk buffer pool, by state\n"
+		<< "# TYPE mgridfs_chunk_pool_bytes gauge\n"
+		<< "mgridfs_chunk_pool_bytes{state=\"inuse\"} " << pool._inUseBytes << "\n"
+		<< "mgridfs_chunk_pool_bytes{state=\"free\"} " << pool._freeBytes << "\n"
+		<< "mgridfs_chunk_pool_bytes{state=\"threadcached\"} " << pool._threadCachedBytes << "\n"
+		<< "mgridfs_chunk_pool_bytes{state=\"released\"} " << pool._releasedBytes << "\n"
+		<< "# HELP mgridfs_chunk_pool_allocations_total Chunk buffers allocated from the pool\n"
+		<< "# TYPE mgridfs_chunk_pool_allocations_total counter\n"
+		<< "mgridfs_chunk_pool_allocations_total " << pool._allocations << "\n"
+		<< "# HELP mgridfs_chunk_pool_thread_cache_hits_total Chunk buffer allocations served by the thread caches\n"
+		<< "# TYPE mgridfs_chunk_pool_thread_cache_hits_total counter\n"
+		<< "mgridfs_chunk_pool_thread_cache_hits_total " << pool._threadCacheHits << "\n";
+
+	WriteBackStats writeBack;
+	FSWriteBack::get().getStats(writeBack);
+	os << "# HELP mgridfs_write_back_files_total Dirty files written back without waiting for close, by reason\n"
+		<< "# TYPE mgridfs_write_back_files_total counter\n"
+		<< "mgridfs_write_back_files_total{reason=\"age\"} " << writeBack._flushedByAge << "\n"
+		<< "mgridfs_write_back_files_total{reason=\"ratio\"} " << writeBack._flushedByRatio << "\n"
+		<< "# HELP mgridfs_write_back_bytes_total Bytes of the files written back without waiting for close\n"
+		<< "# TYPE mgridfs_write_back_bytes_total counter\n"
+		<< "mgridfs_write_back_bytes_total " << writeBack._flushedBytes << "\n"
+		<< "# HELP mgridfs_write_back_failures_total Failed write-backs of dirty files\n"
+		<< "# TYPE mgridfs_write_back_failures_total counter\n"
+		<< "mgridfs_write_back_failures_total " << writeBack._failed << "\n";
+
+	FSJournalStats journal;
+	FSJournal::get().getStats(journal);
+	os << "# HELP mgridfs_journal_appended_total Files closed through the journal\n"
+		<< "# TYPE mgridfs_journal_appended_total counter\n"
+		<< "mgridfs_journal_appended_total " << journal._appended << "\n"
+		<< "# HELP mgridfs_journal_appended_bytes_total Bytes of the files closed through the journal\n"
+		<< "# TYPE mgridfs_journal_appended_bytes_total counter\n"
+		<< "mgridfs_journal_appended_bytes_total " << journal._appendedBytes << "\n"
+		<< "# HELP mgridfs_journal_uploaded_total Journal entries uploaded to the server\n"
+		<< "# TYPE mgridfs_journal_uploaded_total counter\n"
+		<< "mgridfs_journal_uploaded_total " << journal._uploaded << "\n"
+		<< "# HELP mgridfs_journal_upload_failures_total Failed uploads of journal entries, retried later\n"
+		<< "# TYPE mgridfs_journal_upload_failures_total counter\n"
+		<< "mgridfs_journal_upload_failures_total " << journal._uploadFailures << "\n"
+		<< "# HELP mgridfs_journal_replayed_total Journal entries left over by the previous run and uploaded on start\n"
+		<< "# TYPE mgridfs_journal_replayed_total counter\n"
+		<< "mgridfs_journal_replayed_total " << journal._replayed << "\n"
+		<< "# HELP mgridfs_journal_pending Journal entries waiting to be uploaded\n"
+		<< "# TYPE mgridfs_journal_pending gauge\n"
+		<< "mgridfs_journal_pending " << journal._pending << "\n"
+		<< "# HELP mgridfs_journal_pending_bytes Bytes of the journal entries waiting to be uploaded\n"
+		<< "# TYPE mgridfs_journal_pending_bytes gauge\n"
+		<< "mgridfs_journal_pending_bytes " << journal._pendingBytes << "\n";
+
+	ChunkReaperStats reaper;
+	FSChunkReaper::get().getStats(reaper);
+	os << "# HELP mgridfs_chunk_reaper_chunks_total Chunks of the files removed or overwritten deleted in the background\n"
+		<< "# TYPE mgridfs_chunk_reaper_chunks_total counter\n"
+		<< "mgridfs_chunk_reaper_chunks_total " << reaper._reapedChunks << "\n"
+		<< "# HELP mgridfs_chunk_reaper_failures_total Failed passes of the chunk reaper\n"
+		<< "# TYPE mgridfs_chunk_reaper_failures_total counter\n"
+		<< "mgridfs_chunk_reaper_failures_total " << reaper._failed << "\n";
+
+	ChunkCodecStats codec;
+	ChunkCodec::get().getStats(codec);
+	os << "# HELP mgridfs_compression_chunks_total Chunks stored, by how compression went\n"
+		<< "# TYPE mgridfs_compression_chunks_total counter\n"
+		<< "mgridfs_compression_chunks_total{outcome=\"compressed\"} " << codec._compressedChunks << "\n"
+		<< "mgridfs_compression_chunks_total{outcome=\"probe_skipped\"} " << codec._probeSkippedChunks << "\n"
+		<< "mgridfs_compression_chunks_total{outcome=\"incompressible\"} " << codec._incompressibleChunks << "\n"
+		<< "# HELP mgridfs_compression_raw_bytes_total Bytes of the chunks stored compressed, before compression\n"
+		<< "# TYPE mgridfs_compression_raw_bytes_total counter\n"
+		<< "mgridfs_compression_raw_bytes_total " << codec._rawBytes << "\n"
+		<< "# HELP mgridfs_compression_stored_bytes_total Bytes of the chunks stored compressed, after compression\n"
+		<< "# TYPE mgridfs_compression_stored_bytes_total counter\n"
+		<< "mgridfs_compression_stored_bytes_total " << codec._storedBytes << "\n"
+		<< "# HELP mgridfs_compression_decompressed_chunks_total Compressed chunks read back\n"
+		<< "# TYPE mgridfs_compression_decompressed_chunks_total counter\n"
+		<< "mgridfs_compression_decompressed_chunks_total " << codec._decompressedChunks << "\n"
+		<< "# HELP mgridfs_compression_failures_total Chunks that failed to compress or decompress\n"
+		<< "# TYPE mgridfs_compression_failures_total counter\n"
+		<< "mgridfs_compression_failures_total " << codec._failures << "\n";
+
+	os << "# HELP mgridfs_op_latency_seconds Latency of the FUSE operations\n"
+		<< "# TYPE mgridfs_op_latency_seconds histogram\n";
+	for (size_t i = 0; i < FSOP_COUNT; ++i) {
+		countersToPrometheus(os, "mgridfs_op_latency_seconds", string("op=\"") + OPERATION_NAMES[i] + "\"", snapshot._operations[i]);
+	}
+
+	os << "# HELP mgridfs_op_errors_total FUSE operations failed, by errno\n"
+		<< "# TYPE mgridfs_op_errors_total counter\n";
+	for (size_t i = 0; i < FSOP_COUNT; ++i) {
+		for (size_t e = 0; e < FSStatsCounters::MAX_TRACKED_ERRNO; ++e) {
+			if (snapshot._operations[i]._errnos[e]) {
+				os << "mgridfs_op_errors_total{op=\"" << OPERATION_NAMES[i] << "\",errno=\"" << e << "\"} "
+					<< snapshot._operations[i]._errnos[e] << "\n";
+			}
+		}
+	}
+
+	os << "# HELP mgridfs_op_bytes_total Bytes transferred by the FUSE operations\n"
+		<< "# TYPE mgridfs_op_bytes_total counter\n";
+	for (size_t i = 0; i < FSOP_COUNT; ++i) {
+		if (snapshot._operations[i]._bytes) {
+			os << "mgridfs_op_bytes_total{op=\"" << OPERATION_NAMES[i] << "\"} " << snapshot._operations[i]._bytes << "\n";
+		}
+	}
+
+	os << "# HELP mgridfs_mongo_call_latency_seconds Latency of the calls made to mongod\n"
+		<< "# TYPE mgridfs_mongo_call_latency_seconds histogram\n";
+	for (size_t i = 0; i < MCT_COUNT; ++i) {
+		countersToPrometheus(os, "mgridfs_mongo_call_latency_seconds", string("call=\"") + MONGO_CALL_NAMES[i] + "\"", snapshot._mongoCalls[i]);
+	}
+
+	os << "# HELP mgridfs_mongo_call_errors_total Calls to mongod that failed with an exception\n"
+		<< "# TYPE mgridfs_mongo_call_errors_total counter\n";
+	for (size_t i = 0; i < MCT_COUNT; ++i) {
+		os << "mgridfs_mongo_call_errors_total{call=\"" << MONGO_CALL_NAMES[i] << "\"} " << snapshot._mongoCalls[i]._errors << "\n";
+	}
+
+	return os.str();
+}
@@ -0,0 +1,358 @@
+#ifndef mgridfs_fs_stats_h
+#define mgridfs_fs_stats_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+
+#include <boost/utility.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include "fs_trace.h"
+
+using namespace std;
+
+namespace mgridfs {
+
+// FUSE callbacks tracked by the stats, keep in sync with the names in fs_stats.cpp
+typedef enum {
+	FSOP_STATFS,
+	FSOP_GETATTR,
+	FSOP_FGETATTR,
+	FSOP_SETXATTR,
+	FSOP_GETXATTR,
+	FSOP_LISTXATTR,
+	FSOP_REMOVEXATTR,
+	FSOP_CHMOD,
+	FSOP_CHOWN,
+	FSOP_UTIME,
+	FSOP_UTIMENS,
+	FSOP_MKNOD,
+	FSOP_MKDIR,
+	FSOP_RMDIR,
+	FSOP_OPENDIR,
+	FSOP_READDIR,
+	FSOP_RELEASEDIR,
+	FSOP_FSYNCDIR,
+	FSOP_READLINK,
+	FSOP_UNLINK,
+	FSOP_SYMLINK,
+	FSOP_CREATE,
+	FSOP_OPEN,
+	FSOP_READ,
+	FSOP_WRITE,
+	FSOP_FLUSH,
+	FSOP_RELEASE,
+	FSOP_RENAME,
+	FSOP_TRUNCATE,
+	FSOP_FTRUNCATE,
+	FSOP_FSYNC,
+	FSOP_LOCK,
+	FSOP_BMAP,
+	FSOP_IOCTL,
+	FSOP_POLL,
+	FSOP_FLOCK,
+	FSOP_FALLOCATE,
+	FSOP_COUNT,
+} FSOperation;
+
+// Categories of calls made to mongod, keep in sync with the names in fs_stats.cpp
+typedef enum {
+	MCT_FIND_FILE,
+	MCT_GET_CHUNK,
+	MCT_STORE_FILE,
+	MCT_UPDATE,
+	MCT_REMOVE_FILE,
+	MCT_LIST,
+	MCT_DBSTATS,
+	MCT_COUNT,
+} MongoCallType;
+
+// Caches consulted by the FUSE operations, reported along with the slow operations
+typedef enum {
+	FSCACHE_LOCAL_FILE, // Content of an open file, already downloaded into its local file
+	FSCACHE_FILE_LOOKUP, // File document lookups, hit when answered by a batch another thread sent
+	FSCACHE_COUNT,
+} FSCacheType;
+
+/**
+ * Log-linear latency buckets over microseconds, exact up to 8us and within 12.5% above
+ * that (8 sub-buckets per power of 2) up to ~2^40us.
+ */
+struct LatencyBuckets {
+	static const size_t SUB_BUCKET_BITS = 3;
+	static const size_t SUB_BUCKETS = (1 << SUB_BUCKET_BITS);
+	static const size_t MAX_EXPONENT = 40;
+	static const size_t BUCKET_COUNT = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+	static size_t bucketFor(uint64_t micros);
+	static uint64_t bucketUpperBound(size_t bucket);
+};
+
+// Counters for one FUSE operation or mongo call category, values accumulated from all threads
+struct FSStatsCounters {
+	static const size_t MAX_TRACKED_ERRNO = 128;
+
+	FSStatsCounters();
+
+	uint64_t _count;
+	uint64_t _errors;
+	uint64_t _bytes;
+	uint64_t _totalMicros;
+	uint64_t _maxMicros;
+	uint64_t _buckets[LatencyBuckets::BUCKET_COUNT];
+	uint64_t _errnos[MAX_TRACKED_ERRNO]; // Tracked only for the FUSE operations
+
+	// Latency below which the specified fraction of the calls completed, upper bound of the bucket
+	uint64_t getPercentile(double fraction) const;
+};
+
+struct FSStatsSnapshot {
+	time_t _startTime;
+	time_t _snapshotTime;
+	FSStatsCounters _operations[FSOP_COUNT];
+	FSStatsCounters _mongoCalls[MCT_COUNT];
+};
+
+struct FSStatsThreadBlock;
+class FSOpContext;
+
+/**
+ * Per-operation counts, bytes, errors and latency histograms for the FUSE callbacks and the
+ * calls made to mongod.
+ *
+ * Every thread records into a block of its own without any locking or shared cache lines,
+ * blocks are only summed up when a snapshot is taken. Blocks of exited threads are folded into
+ * a retired block so that short-lived FUSE threads do not lose their counts.
+ */
+class FSStats : protected boost::noncopyable {
+public:
+	static FSStats& get();
+
+	static const char* getOperationName(FSOperation op);
+	static const char* getMongoCallName(MongoCallType callType);
+
+	void recordOperation(FSOperation op, uint64_t micros, int retCode, size_t bytes);
+	void recordMongoCall(MongoCallType callType, uint64_t micros, bool failed);
+
+	void getSnapshot(FSStatsSnapshot& snapshot);
+
+	// Operations taking at least the threshold are logged with the mongo calls they made, 0 disables
+	static inline uint64_t getSlowOpThreshold() {
+		return _slowOpThresholdMicros;
+	}
+
+	static void setSlowOpThreshold(uint64_t micros);
+
+	void logSlowOperation(FSOperation op, uint64_t micros, int retCode, const FSTraceArgs& args, const FSOpContext& context);
+
+	string toJSON();
+	string toPrometheus();
+
+	static inline uint64_t nowMicros() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+private:
+	FSStats();
+	~FSStats();
+
+	static uint64_t _slowOpThresholdMicros;
+
+	time_t _startTime;
+	boost::atomic<uint64_t> _slowOperations;
+
+	// Guards the list of live blocks and the retired block
+	boost::mutex _blocksLock;
+	vector<FSStatsThreadBlock*> _blocks;
+	FSStatsThreadBlock* _retired;
+
+	boost::thread_specific_ptr<FSStatsThreadBlock> _threadBlock;
+
+	FSStatsThreadBlock* getThreadBlock();
+	static void retireThreadBlock(FSStatsThreadBlock* block);
+	static void addBlock(FSStatsSnapshot& snapshot, const FSStatsThreadBlock& block);
+};
+
+// Call made to mongod on behalf of a FUSE operation
+struct FSOpMongoCall {
+	MongoCallType _callType;
+	const char* _query; // Shape of the query, static string with ? for the values left out and $1 / $2 for the args
+	int64_t _args[2]; // Values worth reporting, e.g. the chunk range
+	uint32_t _docs; // Documents returned or updated
+	uint64_t _bytes; // Bytes returned or sent
+	uint32_t _startMicros; // Since the start of the operation
+	uint32_t _micros;
+	bool _failed;
+	bool _worker; // Made by a work queue thread
+};
+
+/**
+ * Calls made to mongod and caches consulted by the FUSE operation running on the thread, kept
+ * for the slow operation log. Constructing a context makes it the current one of the thread
+ * until it is destroyed. Work submitted to the work queue by the operation records into the
+ * context of the operation.
+ *
+ * Recording is lock-free, calls claim their slot with an atomic increment and only the first
+ * MAX_CALLS of them are kept.
+ */
+class FSOpContext : protected boost::noncopyable {
+public:
+	static const size_t MAX_CALLS = 32;
+
+	FSOpContext(uint64_t startMicros);
+	~FSOpContext();
+
+	static FSOpContext* current();
+
+	void addMongoCall(const FSOpMongoCall& call);
+
+	// Records into the current context of the thread, if there is one
+	static void recordCache(FSCacheType cacheType, bool hit);
+
+	inline uint64_t getStartMicros() const { return _startMicros; }
+	inline size_t getCallCount() const { return min((size_t)_callCount.load(), MAX_CALLS); }
+	inline size_t getDroppedCallCount() const { return _callCount.load() - getCallCount(); }
+	inline const FSOpMongoCall& getCall(size_t index) const { return _calls[index]; }
+
+	// Bit (1 << FSCacheType) is set for the caches hit / missed
+	inline uint32_t getCacheHits() const { return _cacheHits.load(); }
+	inline uint32_t getCacheMisses() const { return _cacheMisses.load(); }
+
+	/**
+	 * Makes the context current on a work queue thread for the duration of a unit of work
+	 */
+	class Adopt : protected boost::noncopyable {
+	public:
+		Adopt(FSOpContext* context);
+		~Adopt();
+
+	private:
+		FSOpContext* _previous;
+	};
+
+private:
+	uint64_t _startMicros;
+	pthread_t _thread;
+	FSOpContext* _previous;
+	boost::atomic<uint32_t> _callCount;
+	boost::atomic<uint32_t> _cacheHits;
+	boost::atomic<uint32_t> _cacheMisses;
+	FSOpMongoCall _calls[MAX_CALLS];
+};
+
+/**
+ * Times a FUSE callback from construction to destruction, for the instrumented callbacks
+ * to record the outcome as "return scope.done(mgridfs_xxx(...));". Arguments set with the
+ * traceXxx() calls end up in the trace, when one is being recorded, and in the slow
+ * operation log.
+ */
+class FSOpScope : protected boost::noncopyable {
+public:
+	FSOpScope(FSOperation op, const char* path = NULL)
+		: _op(op), _startMicros(FSStats::nowMicros()), _retCode(-EINTR), _bytes(0), _context(_startMicros) {
+		_traceArgs._path = path;
+	}
+
+	~FSOpScope() {
+		uint64_t endMicros = FSStats::nowMicros();
+		FSStats::get().recordOperation(_op, endMicros - _startMicros, _retCode, _bytes);
+		if (FSTrace::isEnabled()) {
+			FSTrace::get().record(_op, _startMicros, endMicros, _retCode, _traceArgs);
+		}
+
+		uint64_t slowOpThreshold = FSStats::getSlowOpThreshold();
+		if (slowOpThreshold && endMicros - _startMicros >= slowOpThreshold) {
+			FSStats::get().logSlowOperation(_op, endMicros - _startMicros, _retCode, _traceArgs, _context);
+		}
+	}
+
+	inline int done(int retCode) {
+		_retCode = retCode;
+		return retCode;
+	}
+
+	// Data transfer calls return the number of bytes transferred
+	inline int doneTransfer(int retCode) {
+		_bytes = (retCode > 0) ? retCode : 0;
+		return done(retCode);
+	}
+
+	// File info is read once the call is done, for the handle assigned by open / create
+	inline void traceFile(struct fuse_file_info* ffinfo) { _traceArgs._ffinfo = ffinfo; }
+	inline void tracePath2(const char* path2) { _traceArgs._path2 = path2; }
+	inline void traceRange(int64_t offset, uint32_t length) { _traceArgs._offset = offset; _traceArgs._length = length; }
+	inline void traceFlags(uint32_t flags) { _traceArgs._flags = flags; }
+	inline void traceMode(uint32_t mode) { _traceArgs._mode = mode; }
+
+private:
+	FSOperation _op;
+	uint64_t _startMicros;
+	int _retCode;
+	size_t _bytes;
+	FSTraceArgs _traceArgs;
+	FSOpContext _context;
+};
+
+/**
+ * Times a call to mongod, the call is counted as failed unless done() is called after it
+ * returned (i.e. mongo client threw an exception). The query shape is only reported by the
+ * slow operation log.
+ */
+class MongoCallTimer : protected boost::noncopyable {
+public:
+	MongoCallTimer(MongoCallType callType, const char* query, int64_t arg1 = 0, int64_t arg2 = 0)
+		: _startMicros(FSStats::nowMicros()), _done(false) {
+		_call._callType = callType;
+		_call._query = query;
+		_call._args[0] = arg1;
+		_call._args[1] = arg2;
+		_call._docs = 0;
+		_call._bytes = 0;
+	}
+
+	~MongoCallTimer() {
+		if (!_done) {
+			record(true);
+		}
+	}
+
+	inline void done(uint32_t docs = 0, uint64_t bytes = 0) {
+		if (!_done) {
+			_done = true;
+			_call._docs = docs;
+			_call._bytes = bytes;
+			record(false);
+		}
+	}
+
+private:
+	FSOpMongoCall _call;
+	uint64_t _startMicros;
+	bool _done;
+
+	inline void record(bool failed) {
+		uint64_t micros = FSStats::nowMicros() - _startMicros;
+		FSStats::get().recordMongoCall(_call._callType, micros, failed);
+
+		FSOpContext* context = FSOpContext::current();
+		if (context) {
+			_call._startMicros = (uint32_t)(_startMicros - min(_startMicros, context->getStartMicros()));
+			_call._micros = (uint32_t)micros;
+			_call._failed = failed;
+			context->addMongoCall(_call);
+		}
+	}
+};
+
+}
+
+#endif
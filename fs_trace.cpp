@@ -0,0 +1,304 @@
+#include "fs_trace.h"
+#include "fs_stats.h"
+#include "fs_logger.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include <fuse.h>
+
+#include <boost/unordered_set.hpp>
+#include <boost/static_assert.hpp>
+
+using namespace mgridfs;
+
+namespace {
+	const char FSTRACE_MAGIC[8] = { 'M', 'G', 'F', 'S', 'T', 'R', 'C', '\0' };
+
+	// Records are written out once a thread has buffered these many of them
+	const size_t MAX_BUFFERED_RECORDS = 4096;
+
+	// Threads forget the paths they have defined beyond these many, forgotten paths are
+	// defined again with their next use
+	const size_t MAX_KNOWN_PATHS = 64 * 1024;
+
+	BOOST_STATIC_ASSERT(sizeof(FSTraceRecord) == 64);
+
+	bool compareStart(const FSTraceRecord& left, const FSTraceRecord& right) {
+		return left._startMicros < right._startMicros;
+	}
+}
+
+/*
+ * Records of a single thread, the lock is taken by other threads only when the trace is stopped
+ */
+struct mgridfs::FSTraceThreadBlock {
+	FSTraceThreadBlock(uint16_t thread)
+		: _thread(thread), _pathCount(0) {
+		_records.reserve(MAX_BUFFERED_RECORDS);
+	}
+
+	uint64_t definePath(const char* path) {
+		if (!path) {
+			return 0;
+		}
+
+		uint64_t pathId = FSTrace::getPathId(path);
+		if (_knownPaths.size() >= MAX_KNOWN_PATHS) {
+			_knownPaths.clear();
+		}
+
+		if (_knownPaths.insert(pathId).second) {
+			FSTracePathHeader pathHeader;
+			pathHeader._pathId = pathId;
+			pathHeader._length = strlen(path);
+			pathHeader._reserved = 0;
+			_paths.append((const char*)&pathHeader, sizeof(pathHeader));
+			_paths.append(path, pathHeader._length);
+			++_pathCount;
+		}
+
+		return pathId;
+	}
+
+	boost::mutex _lock;
+	uint16_t _thread;
+	vector<FSTraceRecord> _records;
+	string _paths; // Definitions to be written with the next block
+	uint32_t _pathCount;
+	boost::unordered_set<uint64_t> _knownPaths;
+};
+
+bool FSTrace::_enabled = false;
+
+FSTrace::FSTrace()
+	: _file(NULL), _startMicros(0), _droppedRecords(0), _nextThread(0), _threadBlock(&FSTrace::retireThreadBlock) {
+}
+
+FSTrace::~FSTrace() {
+}
+
+FSTrace& FSTrace::get() {
+	static FSTrace instance;
+	return instance;
+}
+
+uint64_t FSTrace::getPathId(const char* path) {
+	if (!path) {
+		return 0;
+	}
+
+	// FNV-1a, 0 is reserved for no path
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char* c = path; *c; ++c) {
+		hash ^= (unsigned char)*c;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash ? hash : 1;
+}
+
+bool FSTrace::start(const string& filename) {
+	boost::mutex::scoped_lock lock(_fileLock);
+	if (_file) {
+		error() << "Trace is already being recorded {file: " << filename << "}" << endl;
+		return false;
+	}
+
+	_file = fopen(filename.c_str(), "wb");
+	if (!_file) {
+		error() << "Failed to open trace file {file: " << filename << ", errno: " << errno << "}" << endl;
+		return false;
+	}
+
+	FSTraceFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header._magic, FSTRACE_MAGIC, sizeof(header._magic));
+	header._version = FSTRACE_VERSION;
+	header._recordSize = sizeof(FSTraceRecord);
+	header._startTime = time(NULL);
+	if (fwrite(&header, sizeof(header), 1, _file) != 1) {
+		error() << "Failed to write trace file header {file: " << filename << "}" << endl;
+		fclose(_file);
+		_file = NULL;
+		return false;
+	}
+
+	// Blocks left over from an earlier trace have defined their paths in that one
+	{
+		boost::mutex::scoped_lock blocksLock(_blocksLock);
+		for (vector<FSTraceThreadBlock*>::iterator bIt = _blocks.begin(); bIt != _blocks.end(); ++bIt) {
+			boost::mutex::scoped_lock blockLock((*bIt)->_lock);
+			(*bIt)->_records.clear();
+			(*bIt)->_paths.clear();
+			(*bIt)->_pathCount = 0;
+			(*bIt)->_knownPaths.clear();
+		}
+	}
+
+	_startMicros = FSStats::nowMicros();
+	_droppedRecords = 0;
+	_enabled = true;
+	info() << "Started recording trace {file: " << filename << "}" << endl;
+	return true;
+}
+
+void FSTrace::stop() {
+	if (!_enabled) {
+		return;
+	}
+	_enabled = false;
+
+	{
+		boost::mutex::scoped_lock lock(_blocksLock);
+		for (vector<FSTraceThreadBlock*>::iterator bIt = _blocks.begin(); bIt != _blocks.end(); ++bIt) {
+			boost::mutex::scoped_lock blockLock((*bIt)->_lock);
+			writeBlock(**bIt);
+		}
+	}
+
+	boost::mutex::scoped_lock lock(_fileLock);
+	if (_file) {
+		fclose(_file);
+		_file = NULL;
+	}
+	info() << "Stopped recording trace {droppedRecords: " << _droppedRecords << "}" << endl;
+}
+
+FSTraceThreadBlock* FSTrace::getThreadBlock() {
+	FSTraceThreadBlock* block = _threadBlock.get();
+	if (!block) {
+		boost::mutex::scoped_lock lock(_blocksLock);
+		block = new FSTraceThreadBlock(_nextThread++);
+		_blocks.push_back(block);
+		_threadBlock.reset(block);
+	}
+	return block;
+}
+
+void FSTrace::retireThreadBlock(FSTraceThreadBlock* block) {
+	FSTrace& trace = FSTrace::get();
+	boost::mutex::scoped_lock lock(trace._blocksLock);
+	{
+		boost::mutex::scoped_lock blockLock(block->_lock);
+		trace.writeBlock(*block);
+	}
+
+	trace._blocks.erase(std::remove(trace._blocks.begin(), trace._blocks.end(), block), trace._blocks.end());
+	delete block;
+}
+
+void FSTrace::record(uint16_t op, uint64_t startMicros, uint64_t endMicros, int retCode, const FSTraceArgs& args) {
+	FSTraceThreadBlock* block = getThreadBlock();
+	boost::mutex::scoped_lock lock(block->_lock);
+
+	FSTraceRecord record;
+	record._startMicros = (startMicros > _startMicros) ? startMicros - _startMicros : 0;
+	record._pathId = block->definePath(args._path);
+	record._path2Id = block->definePath(args._path2);
+	record._fileHandle = args._ffinfo ? args._ffinfo->fh : 0;
+	record._offset = args._offset;
+	record._length = args._length;
+	record._durationMicros = (uint32_t)min(endMicros - startMicros, (uint64_t)0xFFFFFFFFULL);
+	record._flags = args._flags;
+	record._mode = args._mode;
+	record._retCode = retCode;
+	record._op = op;
+	record._thread = block->_thread;
+	block->_records.push_back(record);
+
+	if (block->_records.size() >= MAX_BUFFERED_RECORDS) {
+		writeBlock(*block);
+	}
+}
+
+void FSTrace::writeBlock(FSTraceThreadBlock& block) {
+	if (block._records.empty() && !block._pathCount) {
+		return;
+	}
+
+	FSTraceBlockHeader header;
+	header._pathCount = block._pathCount;
+	header._recordCount = block._records.size();
+
+	{
+		boost::mutex::scoped_lock lock(_fileLock);
+		if (!_file
+				|| fwrite(&header, sizeof(header), 1, _file) != 1
+				|| (!block._paths.empty() && fwrite(block._paths.data(), block._paths.size(), 1, _file) != 1)
+				|| (!block._records.empty() && fwrite(&block._records[0], sizeof(FSTraceRecord), block._records.size(), _file) != block._records.size())
+				|| fflush(_file)) {
+			_droppedRecords += block._records.size();
+		}
+	}
+
+	block._records.clear();
+	block._paths.clear();
+	block._pathCount = 0;
+}
+
+FSTraceReader::FSTraceReader()
+	: _startTime(0) {
+}
+
+bool FSTraceReader::load(const string& filename) {
+	FILE* file = fopen(filename.c_str(), "rb");
+	if (!file) {
+		error() << "Failed to open trace file {file: " << filename << ", errno: " << errno << "}" << endl;
+		return false;
+	}
+
+	FSTraceFileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header._magic, FSTRACE_MAGIC, sizeof(header._magic))
+			|| header._version != FSTRACE_VERSION || header._recordSize != sizeof(FSTraceRecord)) {
+		error() << "Not a trace file of a supported version {file: " << filename << "}" << endl;
+		fclose(file);
+		return false;
+	}
+	_startTime = header._startTime;
+
+	// A block cut short by a crash ends the trace
+	FSTraceBlockHeader blockHeader;
+	bool truncated = false;
+	while (!truncated && fread(&blockHeader, sizeof(blockHeader), 1, file) == 1) {
+		for (uint32_t p = 0; p < blockHeader._pathCount && !truncated; ++p) {
+			FSTracePathHeader pathHeader;
+			if (fread(&pathHeader, sizeof(pathHeader), 1, file) != 1) {
+				truncated = true;
+				break;
+			}
+
+			string path(pathHeader._length, '\0');
+			if (pathHeader._length && fread(&path[0], pathHeader._length, 1, file) != 1) {
+				truncated = true;
+				break;
+			}
+			_paths[pathHeader._pathId] = path;
+		}
+
+		if (truncated) {
+			break;
+		}
+
+		size_t recordsBefore = _records.size();
+		_records.resize(recordsBefore + blockHeader._recordCount);
+		if (blockHeader._recordCount && fread(&_records[recordsBefore], sizeof(FSTraceRecord), blockHeader._recordCount, file)
+				!= blockHeader._recordCount) {
+			_records.resize(recordsBefore);
+			truncated = true;
+		}
+	}
+	fclose(file);
+
+	if (truncated) {
+		warn() << "Trace file is truncated, using the records up to the last complete block {file: " << filename << "}" << endl;
+	}
+
+	std::stable_sort(_records.begin(), _records.end(), compareStart);
+	return true;
+}
+
+const string& FSTraceReader::getPath(uint64_t pathId) const {
+	map<uint64_t, string>::const_iterator pIt = _paths.find(pathId);
+	return (pIt != _paths.end()) ? pIt->second : _noPath;
+}
@@ -0,0 +1,154 @@
+#ifndef mgridfs_fs_trace_h
+#define mgridfs_fs_trace_h
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <stdint.h>
+
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+using namespace std;
+
+struct fuse_file_info;
+
+namespace mgridfs {
+
+/**
+ * Layout of a trace file. The file header is followed by blocks, every one of them written by
+ * one thread at once: the block header, the paths first seen by the thread since its previous
+ * block and then the records. Paths are referred to by their 64-bit hash in the records.
+ * Blocks of different threads interleave, so the records are in order only within a thread.
+ * Fields are in the byte order of the recording host.
+ */
+const uint32_t FSTRACE_VERSION = 1;
+
+struct FSTraceFileHeader {
+	char _magic[8];
+	uint32_t _version;
+	uint32_t _recordSize;
+	int64_t _startTime; // Wall clock time at the start of the trace, in seconds
+};
+
+struct FSTraceBlockHeader {
+	uint32_t _pathCount;
+	uint32_t _recordCount;
+};
+
+// Followed by the bytes of the path, not terminated
+struct FSTracePathHeader {
+	uint64_t _pathId;
+	uint32_t _length;
+	uint32_t _reserved;
+};
+
+struct FSTraceRecord {
+	uint64_t _startMicros; // Since the start of the trace
+	uint64_t _pathId; // 0 if the call has no path
+	uint64_t _path2Id; // Destination of rename, path of the link for symlink
+	uint64_t _fileHandle; // Handle of the open file or directory, after the call for open / create / opendir
+	int64_t _offset; // Offset of read / write / readdir / fallocate, size for truncate, uid for chown
+	uint32_t _length; // Bytes of read / write / fallocate, buffer size of readlink and xattr, gid for chown
+	uint32_t _durationMicros;
+	uint32_t _flags; // Open flags of open / create, datasync of fsync, command of ioctl
+	uint32_t _mode; // Mode of mkdir / mknod / create / chmod / fallocate
+	int32_t _retCode;
+	uint16_t _op; // FSOperation
+	uint16_t _thread; // Index of the recording thread
+};
+
+// Arguments of a FUSE call to be traced, filled in by the instrumented callbacks
+struct FSTraceArgs {
+	FSTraceArgs()
+		: _path(NULL), _path2(NULL), _ffinfo(NULL), _offset(0), _length(0), _flags(0), _mode(0) {
+	}
+
+	const char* _path;
+	const char* _path2;
+	struct fuse_file_info* _ffinfo;
+	int64_t _offset;
+	uint32_t _length;
+	uint32_t _flags;
+	uint32_t _mode;
+};
+
+struct FSTraceThreadBlock;
+
+/**
+ * Recorder of the FUSE calls into a compact binary trace, for the calls to be replayed later by
+ * mgridfs_replay.
+ *
+ * Disabled unless started, the instrumented callbacks check isEnabled() before anything else.
+ * Every thread buffers its records and writes them in blocks, so the file lock is taken once
+ * every few thousand calls. Records still buffered are lost if the process crashes.
+ */
+class FSTrace : protected boost::noncopyable {
+public:
+	static FSTrace& get();
+
+	static inline bool isEnabled() {
+		return _enabled;
+	}
+
+	// Returns 0 for a NULL path
+	static uint64_t getPathId(const char* path);
+
+	bool start(const string& filename);
+	void stop();
+
+	void record(uint16_t op, uint64_t startMicros, uint64_t endMicros, int retCode, const FSTraceArgs& args);
+
+private:
+	FSTrace();
+	~FSTrace();
+
+	// Set only while no FUSE threads are running, before the mount and on destroy
+	static bool _enabled;
+
+	boost::mutex _fileLock;
+	FILE* _file;
+	uint64_t _startMicros;
+	uint64_t _droppedRecords;
+
+	// Guards the list of live blocks and the thread index
+	boost::mutex _blocksLock;
+	vector<FSTraceThreadBlock*> _blocks;
+	uint16_t _nextThread;
+
+	boost::thread_specific_ptr<FSTraceThreadBlock> _threadBlock;
+
+	FSTraceThreadBlock* getThreadBlock();
+	static void retireThreadBlock(FSTraceThreadBlock* block);
+
+	// Expects the block lock to be held by the caller
+	void writeBlock(FSTraceThreadBlock& block);
+};
+
+/**
+ * Reads back a trace file, with the records of all the threads ordered by their start time
+ */
+class FSTraceReader : protected boost::noncopyable {
+public:
+	FSTraceReader();
+
+	bool load(const string& filename);
+
+	const vector<FSTraceRecord>& getRecords() const { return _records; }
+	int64_t getStartTime() const { return _startTime; }
+
+	// Path of the id, empty for 0 or for a path not defined in the trace
+	const string& getPath(uint64_t pathId) const;
+
+private:
+	int64_t _startTime;
+	vector<FSTraceRecord> _records;
+	map<uint64_t, string> _paths;
+	string _noPath;
+};
+
+}
+
+#endif
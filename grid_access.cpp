@@ -0,0 +1,112 @@
+#include "grid_access.h"
+#include "storage_backend.h"
+#include "fs_logger.h"
+#include "fs_stats.h"
+
+#include <map>
+#include <algorithm>
+
+using namespace mongo;
+using namespace mgridfs;
+
+namespace {
+	// Lookups being sent concurrently before new ones are queued up for batching
+	const size_t MAX_INFLIGHT_LOOKUPS = 4;
+	// Limits the size of the $in list for a single lookup query
+	const size_t MAX_LOOKUP_BATCH = 256;
+}
+
+FileLookupBatcher::FileLookupBatcher()
+	: _inFlight(0) {
+}
+
+FileLookupBatcher& FileLookupBatcher::get() {
+	static FileLookupBatcher instance;
+	return instance;
+}
+
+BSONObj FileLookupBatcher::findFile(const string& filename) {
+	Request request(filename);
+	bool sentBatch = false;
+
+	boost::mutex::scoped_lock lock(_lock);
+	_pending.push_back(&request);
+	while (!request._done) {
+		if (_pending.empty() || _inFlight >= MAX_INFLIGHT_LOOKUPS) {
+			// Our request is either part of a batch in progress or will be taken up by the next free slot
+			_completed.wait(lock);
+			continue;
+		}
+
+		// Send whatever has been queued up so far, which may or may not include our own request
+		vector<Request*> batch;
+		if (_pending.size() > MAX_LOOKUP_BATCH) {
+			batch.assign(_pending.begin(), _pending.begin() + MAX_LOOKUP_BATCH);
+			_pending.erase(_pending.begin(), _pending.begin() + MAX_LOOKUP_BATCH);
+		} else {
+			batch.swap(_pending);
+		}
+		++_inFlight;
+
+		lock.unlock();
+		runBatch(batch);
+		lock.lock();
+
+		if (find(batch.begin(), batch.end(), &request) != batch.end()) {
+			sentBatch = true;
+		}
+
+		--_inFlight;
+		for (vector<Request*>::iterator rIt = batch.begin(); rIt != batch.end(); ++rIt) {
+			(*rIt)->_done = true;
+		}
+		_completed.notify_all();
+	}
+	lock.unlock();
+
+	FSOpContext::recordCache(FSCACHE_FILE_LOOKUP, !sentBatch);
+	if (request._failed) {
+		uasserted(request._errorCode, request._errorMessage);
+	}
+	return request._result;
+}
+
+void FileLookupBatcher::runBatch(vector<Request*>& batch) {
+	try {
+		StorageBackend& backend = StorageBackend::get();
+		if (batch.size() == 1) {
+			batch[0]->_result = backend.findFile(batch[0]->_filename);
+		} else {
+			vector<string> filenames;
+			for (vector<Request*>::iterator rIt = batch.begin(); rIt != batch.end(); ++rIt) {
+				filenames.push_back((*rIt)->_filename);
+			}
+
+			vector<BSONObj> files;
+			backend.findFiles(filenames, files);
+
+			// Same file might be looked up by multiple threads, keep the first match as findFile does
+			map<string, BSONObj> results;
+			for (vector<BSONObj>::const_iterator fIt = files.begin(); fIt != files.end(); ++fIt) {
+				results.insert(make_pair(string(fIt->getStringField("filename")), *fIt));
+			}
+
+			for (vector<Request*>::iterator rIt = batch.begin(); rIt != batch.end(); ++rIt) {
+				map<string, BSONObj>::const_iterator fIt = results.find((*rIt)->_filename);
+				if (fIt != results.end()) {
+					(*rIt)->_result = fIt->second;
+				}
+			}
+
+			trace() << "Completed batched file lookup {batchSize: " << batch.size() << ", found: " << results.size() << "}" << endl;
+		}
+	} catch (DBException& e) {
+		error() << "Caught exception in batched file lookup {batchSize: " << batch.size() << ", code: " << e.getCode()
+			<< ", what: " << e.what() << "}" << endl;
+		for (vector<Request*>::iterator rIt = batch.begin(); rIt != batch.end(); ++rIt) {
+			(*rIt)->_failed = true;
+			(*rIt)->_errorCode = e.getCode();
+			(*rIt)->_errorMessage = e.what();
+		}
+	}
+}
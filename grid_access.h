@@ -0,0 +1,58 @@
+#ifndef mgridfs_grid_access_h
+#define mgridfs_grid_access_h
+
+#include <string>
+#include <vector>
+
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <mongo/client/dbclient.h>
+
+using namespace std;
+
+namespace mgridfs {
+
+/**
+ * Coalesces concurrent lookups of file documents by name into one lookup on the storage backend, so that e.g. the getattr calls issued in parallel for a directory listing share
+ * their round trips.
+ *
+ * A lookup is sent immediately if there is a free query slot, otherwise it is queued and sent
+ * along with all the other lookups that arrived in the meantime, so batching only kicks in
+ * under load and never adds latency to an idle file system.
+ */
+class FileLookupBatcher : protected boost::noncopyable {
+public:
+	static FileLookupBatcher& get();
+
+	// Returns the files collection document, or an empty object if there is no such file.
+	// Throws DBException if the lookup failed
+	mongo::BSONObj findFile(const string& filename);
+
+private:
+	FileLookupBatcher();
+
+	struct Request {
+		Request(const string& filename)
+			: _filename(filename), _done(false), _failed(false), _errorCode(0) {}
+
+		string _filename;
+		mongo::BSONObj _result;
+		bool _done;
+		bool _failed;
+		int _errorCode;
+		string _errorMessage;
+	};
+
+	boost::mutex _lock;
+	boost::condition_variable _completed;
+	vector<Request*> _pending;
+	size_t _inFlight;
+
+	void runBatch(vector<Request*>& batch);
+};
+
+}
+
+#endif
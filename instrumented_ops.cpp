@@ -0,0 +1,236 @@
+#include "instrumented_ops.h"
+#include "fs_meta_ops.h"
+#include "file_meta_ops.h"
+#include "dir_meta_ops.h"
+#include "fs_stats.h"
+
+using namespace mgridfs;
+
+int mgridfs::instrumented::mgridfs_statfs(const char* file, struct statvfs* statEntry) {
+	FSOpScope scope(FSOP_STATFS, file);
+	return scope.done(mgridfs::mgridfs_statfs(file, statEntry));
+}
+
+int mgridfs::instrumented::mgridfs_getattr(const char* file, struct stat* fileStat) {
+	FSOpScope scope(FSOP_GETATTR, file);
+	return scope.done(mgridfs::mgridfs_getattr(file, fileStat));
+}
+
+int mgridfs::instrumented::mgridfs_fgetattr(const char* file, struct stat* fileStat, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_FGETATTR, file);
+	scope.traceFile(ffinfo);
+	return scope.done(mgridfs::mgridfs_fgetattr(file, fileStat, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_setxattr(const char* file, const char* name, const char* value, size_t size, int flags) {
+	FSOpScope scope(FSOP_SETXATTR, file);
+	scope.traceRange(0, size);
+	scope.traceFlags(flags);
+	return scope.done(mgridfs::mgridfs_setxattr(file, name, value, size, flags));
+}
+
+int mgridfs::instrumented::mgridfs_getxattr(const char* file, const char* name, char* value, size_t size) {
+	FSOpScope scope(FSOP_GETXATTR, file);
+	scope.traceRange(0, size);
+	return scope.done(mgridfs::mgridfs_getxattr(file, name, value, size));
+}
+
+int mgridfs::instrumented::mgridfs_listxattr(const char* file, char* list, size_t size) {
+	FSOpScope scope(FSOP_LISTXATTR, file);
+	scope.traceRange(0, size);
+	return scope.done(mgridfs::mgridfs_listxattr(file, list, size));
+}
+
+int mgridfs::instrumented::mgridfs_removexattr(const char* file, const char* name) {
+	FSOpScope scope(FSOP_REMOVEXATTR, file);
+	return scope.done(mgridfs::mgridfs_removexattr(file, name));
+}
+
+int mgridfs::instrumented::mgridfs_chmod(const char* file, mode_t mode) {
+	FSOpScope scope(FSOP_CHMOD, file);
+	scope.traceMode(mode);
+	return scope.done(mgridfs::mgridfs_chmod(file, mode));
+}
+
+int mgridfs::instrumented::mgridfs_chown(const char* file, uid_t uid, gid_t gid) {
+	FSOpScope scope(FSOP_CHOWN, file);
+	scope.traceRange(uid, gid);
+	return scope.done(mgridfs::mgridfs_chown(file, uid, gid));
+}
+
+int mgridfs::instrumented::mgridfs_utime(const char* file, struct utimbuf* times) {
+	FSOpScope scope(FSOP_UTIME, file);
+	return scope.done(mgridfs::mgridfs_utime(file, times));
+}
+
+int mgridfs::instrumented::mgridfs_utimens(const char* file, const struct timespec tv[2]) {
+	FSOpScope scope(FSOP_UTIMENS, file);
+	return scope.done(mgridfs::mgridfs_utimens(file, tv));
+}
+
+int mgridfs::instrumented::mgridfs_mknod(const char* file, mode_t mode, dev_t dev) {
+	FSOpScope scope(FSOP_MKNOD, file);
+	scope.traceMode(mode);
+	return scope.done(mgridfs::mgridfs_mknod(file, mode, dev));
+}
+
+int mgridfs::instrumented::mgridfs_mkdir(const char* path, mode_t mode) {
+	FSOpScope scope(FSOP_MKDIR, path);
+	scope.traceMode(mode);
+	return scope.done(mgridfs::mgridfs_mkdir(path, mode));
+}
+
+int mgridfs::instrumented::mgridfs_rmdir(const char* path) {
+	FSOpScope scope(FSOP_RMDIR, path);
+	return scope.done(mgridfs::mgridfs_rmdir(path));
+}
+
+int mgridfs::instrumented::mgridfs_opendir(const char* path, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_OPENDIR, path);
+	scope.traceFile(ffinfo);
+	return scope.done(mgridfs::mgridfs_opendir(path, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_readdir(const char* path, void* dirlist, fuse_fill_dir_t ffdir, off_t offset, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_READDIR, path);
+	scope.traceFile(ffinfo);
+	scope.traceRange(offset, 0);
+	return scope.done(mgridfs::mgridfs_readdir(path, dirlist, ffdir, offset, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_releasedir(const char* path, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_RELEASEDIR, path);
+	scope.traceFile(ffinfo);
+	return scope.done(mgridfs::mgridfs_releasedir(path, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_fsyncdir(const char* path, int param, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_FSYNCDIR, path);
+	scope.traceFile(ffinfo);
+	scope.traceFlags(param);
+	return scope.done(mgridfs::mgridfs_fsyncdir(path, param, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_readlink(const char* file, char* link, size_t len) {
+	FSOpScope scope(FSOP_READLINK, file);
+	scope.traceRange(0, len);
+	return scope.done(mgridfs::mgridfs_readlink(file, link, len));
+}
+
+int mgridfs::instrumented::mgridfs_unlink(const char* file) {
+	FSOpScope scope(FSOP_UNLINK, file);
+	return scope.done(mgridfs::mgridfs_unlink(file));
+}
+
+int mgridfs::instrumented::mgridfs_symlink(const char* srcfile, const char* destfile) {
+	FSOpScope scope(FSOP_SYMLINK, srcfile);
+	scope.tracePath2(destfile);
+	return scope.done(mgridfs::mgridfs_symlink(srcfile, destfile));
+}
+
+int mgridfs::instrumented::mgridfs_create(const char* file, mode_t mode, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_CREATE, file);
+	scope.traceFile(ffinfo);
+	scope.traceFlags(ffinfo->flags);
+	scope.traceMode(mode);
+	return scope.done(mgridfs::mgridfs_create(file, mode, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_open(const char* file, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_OPEN, file);
+	scope.traceFile(ffinfo);
+	scope.traceFlags(ffinfo->flags);
+	return scope.done(mgridfs::mgridfs_open(file, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_read(const char* file, char* data, size_t len, off_t offset, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_READ, file);
+	scope.traceFile(ffinfo);
+	scope.traceRange(offset, len);
+	return scope.doneTransfer(mgridfs::mgridfs_read(file, data, len, offset, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_write(const char* file, const char* data, size_t len, off_t offset, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_WRITE, file);
+	scope.traceFile(ffinfo);
+	scope.traceRange(offset, len);
+	return scope.doneTransfer(mgridfs::mgridfs_write(file, data, len, offset, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_flush(const char* file, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_FLUSH, file);
+	scope.traceFile(ffinfo);
+	return scope.done(mgridfs::mgridfs_flush(file, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_release(const char* file, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_RELEASE, file);
+	scope.traceFile(ffinfo);
+	return scope.done(mgridfs::mgridfs_release(file, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_rename(const char* srcfile, const char* destfile) {
+	FSOpScope scope(FSOP_RENAME, srcfile);
+	scope.tracePath2(destfile);
+	return scope.done(mgridfs::mgridfs_rename(srcfile, destfile));
+}
+
+int mgridfs::instrumented::mgridfs_truncate(const char* file, off_t size) {
+	FSOpScope scope(FSOP_TRUNCATE, file);
+	scope.traceRange(size, 0);
+	return scope.done(mgridfs::mgridfs_truncate(file, size));
+}
+
+int mgridfs::instrumented::mgridfs_ftruncate(const char* file, off_t size, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_FTRUNCATE, file);
+	scope.traceFile(ffinfo);
+	scope.traceRange(size, 0);
+	return scope.done(mgridfs::mgridfs_ftruncate(file, size, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_fsync(const char* file, int datasync, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_FSYNC, file);
+	scope.traceFile(ffinfo);
+	scope.traceFlags(datasync);
+	return scope.done(mgridfs::mgridfs_fsync(file, datasync, ffinfo));
+}
+
+int mgridfs::instrumented::mgridfs_lock(const char* file, struct fuse_file_info* ffinfo, int cmd, struct flock* lock) {
+	FSOpScope scope(FSOP_LOCK, file);
+	scope.traceFile(ffinfo);
+	scope.traceFlags(cmd);
+	return scope.done(mgridfs::mgridfs_lock(file, ffinfo, cmd, lock));
+}
+
+int mgridfs::instrumented::mgridfs_bmap(const char* file, size_t blocksize, uint64_t* idx) {
+	FSOpScope scope(FSOP_BMAP, file);
+	return scope.done(mgridfs::mgridfs_bmap(file, blocksize, idx));
+}
+
+int mgridfs::instrumented::mgridfs_ioctl(const char* file, int cmd, void* arg, struct fuse_file_info* ffinfo, unsigned int flags, void* data) {
+	FSOpScope scope(FSOP_IOCTL, file);
+	scope.traceFile(ffinfo);
+	scope.traceFlags(cmd);
+	return scope.done(mgridfs::mgridfs_ioctl(file, cmd, arg, ffinfo, flags, data));
+}
+
+int mgridfs::instrumented::mgridfs_poll(const char* file, struct fuse_file_info* ffinfo, struct fuse_pollhandle* ph, unsigned* reventsp) {
+	FSOpScope scope(FSOP_POLL, file);
+	scope.traceFile(ffinfo);
+	return scope.done(mgridfs::mgridfs_poll(file, ffinfo, ph, reventsp));
+}
+
+int mgridfs::instrumented::mgridfs_flock(const char* file, struct fuse_file_info* ffinfo, int op) {
+	FSOpScope scope(FSOP_FLOCK, file);
+	scope.traceFile(ffinfo);
+	scope.traceFlags(op);
+	return scope.done(mgridfs::mgridfs_flock(file, ffinfo, op));
+}
+
+int mgridfs::instrumented::mgridfs_fallocate(const char* file, int mode, off_t offset, off_t len, struct fuse_file_info* ffinfo) {
+	FSOpScope scope(FSOP_FALLOCATE, file);
+	scope.traceFile(ffinfo);
+	scope.traceRange(offset, len);
+	scope.traceMode(mode);
+	return scope.done(mgridfs::mgridfs_fallocate(file, mode, offset, len, ffinfo));
+}
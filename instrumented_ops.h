@@ -0,0 +1,63 @@
+#ifndef mgridfs_instrumented_ops_h
+#define mgridfs_instrumented_ops_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <stdint.h>
+#include <fuse.h>
+
+namespace mgridfs {
+
+/**
+ * FUSE callbacks registered with fuse, each one times the corresponding mgridfs_xxx callback
+ * and records its outcome with FSStats, along with its arguments into the trace when one is
+ * being recorded (see FSTrace). Callbacks calling each other internally (e.g. fgetattr
+ * falling back to getattr) are not wrapped, so every FUSE request is accounted for exactly once.
+ */
+namespace instrumented {
+
+int mgridfs_statfs(const char* file, struct statvfs* statEntry);
+int mgridfs_getattr(const char* file, struct stat* fileStat);
+int mgridfs_fgetattr(const char* file, struct stat* fileStat, struct fuse_file_info* ffinfo);
+int mgridfs_setxattr(const char* file, const char* name, const char* value, size_t size, int flags);
+int mgridfs_getxattr(const char* file, const char* name, char* value, size_t size);
+int mgridfs_listxattr(const char* file, char* list, size_t size);
+int mgridfs_removexattr(const char* file, const char* name);
+int mgridfs_chmod(const char* file, mode_t mode);
+int mgridfs_chown(const char* file, uid_t uid, gid_t gid);
+int mgridfs_utime(const char* file, struct utimbuf* times);
+int mgridfs_utimens(const char* file, const struct timespec tv[2]);
+int mgridfs_mknod(const char* file, mode_t mode, dev_t dev);
+int mgridfs_mkdir(const char* path, mode_t mode);
+int mgridfs_rmdir(const char* path);
+int mgridfs_opendir(const char* path, struct fuse_file_info* ffinfo);
+int mgridfs_readdir(const char* path, void* dirlist, fuse_fill_dir_t ffdir, off_t offset, struct fuse_file_info* ffinfo);
+int mgridfs_releasedir(const char* path, struct fuse_file_info* ffinfo);
+int mgridfs_fsyncdir(const char* path, int param, struct fuse_file_info* ffinfo);
+int mgridfs_readlink(const char* file, char* link, size_t len);
+int mgridfs_unlink(const char* file);
+int mgridfs_symlink(const char* srcfile, const char* destfile);
+int mgridfs_create(const char* file, mode_t mode, struct fuse_file_info* ffinfo);
+int mgridfs_open(const char* file, struct fuse_file_info* ffinfo);
+int mgridfs_read(const char* file, char* data, size_t len, off_t offset, struct fuse_file_info* ffinfo);
+int mgridfs_write(const char* file, const char* data, size_t len, off_t offset, struct fuse_file_info* ffinfo);
+int mgridfs_flush(const char* file, struct fuse_file_info* ffinfo);
+int mgridfs_release(const char* file, struct fuse_file_info* ffinfo);
+int mgridfs_rename(const char* srcfile, const char* destfile);
+int mgridfs_truncate(const char* file, off_t size);
+int mgridfs_ftruncate(const char* file, off_t size, struct fuse_file_info* ffinfo);
+int mgridfs_fsync(const char* file, int datasync, struct fuse_file_info* ffinfo);
+int mgridfs_lock(const char* file, struct fuse_file_info* ffinfo, int cmd, struct flock* lock);
+int mgridfs_bmap(const char* file, size_t blocksize, uint64_t* idx);
+int mgridfs_ioctl(const char* file, int cmd, void* arg, struct fuse_file_info* ffinfo, unsigned int flags, void* data);
+int mgridfs_poll(const char* file, struct fuse_file_info* ffinfo, struct fuse_pollhandle* ph, unsigned* reventsp);
+int mgridfs_flock(const char* file, struct fuse_file_info* ffinfo, int op);
+int mgridfs_fallocate(const char* file, int mode, off_t offset, off_t len, struct fuse_file_info* ffinfo);
+
+}
+
+}
+
+#endif
@@ -1,35 +1,49 @@
 #include "local_grid_file.h"
+#include "buffer_budget.h"
+#include "chunk_pool.h"
+#include "fs_journal.h"
 #include "fs_logger.h"
 #include "fs_options.h"
+#include "storage_backend.h"
 #include "utils.h"
+#include "work_queue.h"
 
 #include <cerrno>
 #include <cstring>
+#include <fcntl.h>
 
-#include <mongo/client/gridfs.h>
-#include <mongo/client/connpool.h>
+#include <boost/bind.hpp>
+
+#include <mongo/util/time_support.h>
 
 using namespace mongo;
 using namespace mgridfs;
 using namespace std;
 
+namespace {
+	// Chunks fetched by a single query when downloading a file over multiple connections
+	const int MIN_CHUNKS_PER_FETCH = 16;
+}
+
 LocalGridFile::LocalGridFile()
-	: _size(0), _capacity(0), _readOnly(false), _dirty(false), _filename("") {
+	: _size(0), _capacity(0), _readOnly(false), _dirty(false), _dirtySince(0), _detached(false),
+	_openState(OS_PENDING), _openStatus(0), _filename("") {
 }
 
 LocalGridFile::LocalGridFile(const string& filename)
-	: _size(0), _capacity(0), _readOnly(false), _dirty(false), _filename(filename) {
+	: _size(0), _capacity(0), _readOnly(false), _dirty(false), _dirtySince(0), _detached(false),
+	_openState(OS_PENDING), _openStatus(0), _filename(filename) {
 }
 
 LocalGridFile::~LocalGridFile() {
 }
 
 LocalMemoryGridFile::LocalMemoryGridFile()
-	: _chunkSize(globalFSOptions._memChunkSize) {
+	: _chunkSize(globalFSOptions._memChunkSize), _buffersReleased(false) {
 }
 
 LocalMemoryGridFile::LocalMemoryGridFile(const string& filename)
-	: LocalGridFile(filename), _chunkSize(globalFSOptions._memChunkSize) {
+	: LocalGridFile(filename), _chunkSize(globalFSOptions._memChunkSize), _buffersReleased(false) {
 }
 
 LocalMemoryGridFile::~LocalMemoryGridFile() {
@@ -45,17 +59,29 @@ LocalMemoryGridFile::~LocalMemoryGridFile() {
 		flush();
 	}
 
-	if (_chunks.size()) {
-		// If chunks contain data elements, delete those memory blocks as well
-		for (vector<char*>::iterator pIt = _chunks.begin(); pIt != _chunks.end(); ++pIt) {
-			delete[] (*pIt);
-		}
+	freeChunks();
+}
+
+void LocalMemoryGridFile::freeChunks() {
+	for (vector<char*>::iterator pIt = _chunks.begin(); pIt != _chunks.end(); ++pIt) {
+		ChunkPool::get().free(*pIt, _chunkSize);
 	}
+
+	BufferBudget::get().release(_chunks.size() * _chunkSize);
+	_chunks.clear();
+	_capacity = 0;
 }
 
 void LocalMemoryGridFile::setDirty(bool flag) {
-	if (!_readOnly) {
-		_dirty = flag;
+	WriteLock lock(_fileLock);
+	if (_readOnly) {
+		return;
+	}
+
+	if (flag) {
+		markDirty();
+	} else {
+		_dirty = false;
 	}
 }
 
@@ -67,6 +93,11 @@ bool LocalMemoryGridFile::setCapacity(size_t capacity) {
 }
 
 bool LocalMemoryGridFile::setSize(size_t size) {
+	WriteLock lock(_fileLock);
+	return !reloadBuffers() && _setSize(size);
+}
+
+bool LocalMemoryGridFile::_setSize(size_t size) {
 	trace() << " -> LocalMemoryGridFile::setSize {file: " << _filename << ", size: {old: " << _size
 		<< ", new: " << size << "} }" << endl;
 
@@ -74,16 +105,16 @@ bool LocalMemoryGridFile::setSize(size_t size) {
 	if (size <= _size) {
 		// The file is being truncated to smaller / equal size
 		_size = size;
-		_dirty = true;
+		markDirty();
 		return true;
 	}
 
 	// The file is being expanded to larger size
-	if (size < _capacity) {
+	if (size <= _capacity) {
 		// Size requested is within the allocated capacity, so nothing extra
 		// to do
 		_size = size;
-		_dirty = true;
+		markDirty();
 		return true;
 	}
 
@@ -106,19 +137,26 @@ bool LocalMemoryGridFile::setSize(size_t size) {
 	}
 
 	size_t diffChunks = newChunks - currentChunks;
+	if (!BufferBudget::get().reserve(diffChunks * _chunkSize)) {
+		error() << "Out of memory for local file buffers {filename: " << _filename << ", size: " << _size
+			<< ", requested-size: " << size << "}, will not increase the capacity." << endl;
+		return false;
+	}
+
 	for (size_t i = 0; i < diffChunks; ++i) {
-		char* tempData = new (nothrow) char[_chunkSize];
+		char* tempData = ChunkPool::get().allocate(_chunkSize);
 		if (!tempData) {
 			error() << "Failed to allocate memory {filename: " << _filename << ", chunkSize: " << _chunkSize
 				<< ", diffChunks: " << diffChunks << ", AllocatedChunks: " << i 
 				<< "}, will not continue further." << endl;
+			BufferBudget::get().release((diffChunks - i) * _chunkSize);
 			return false;
 		}
 
 		_chunks.push_back(tempData);
 		_capacity += _chunkSize;
 		_size = (_capacity < size) ? _capacity : size;
-		_dirty = true;
+		markDirty();
 		trace() << "Added chunk {total: " << _chunks.size() << ", capacity: " << _capacity
 			<< ", size: " << _size << ", requested-size: " << size << "}" << endl;
 	}
@@ -127,6 +165,7 @@ bool LocalMemoryGridFile::setSize(size_t size) {
 }
 
 bool LocalMemoryGridFile::setReadOnly() {
+	WriteLock lock(_fileLock);
 	trace() << " -> LocalMemoryGridFile::setReadonly {file: " << _filename << "}" << endl;
 	if (_dirty) {
 		return false;
@@ -137,6 +176,7 @@ bool LocalMemoryGridFile::setReadOnly() {
 }
 
 bool LocalMemoryGridFile::setFilename(const string& filename) {
+	WriteLock lock(_fileLock);
 	trace() << " -> LocalMemoryGridFile::setFilename {old: " << _filename << ", new: " << filename << "}" << endl;
 	//TODO: check for invalid instances
 	if (!_filename.empty() || _dirty) {
@@ -152,34 +192,79 @@ bool LocalMemoryGridFile::setFilename(const string& filename) {
 	return true;
 }
 
+void LocalMemoryGridFile::rename(const string& filename) {
+	WriteLock lock(_fileLock);
+	trace() << " -> LocalMemoryGridFile::rename {old: " << _filename << ", new: " << filename << "}" << endl;
+	_filename = filename;
+}
+
+void LocalMemoryGridFile::detach() {
+	WriteLock lock(_fileLock);
+	trace() << " -> LocalMemoryGridFile::detach {file: " << _filename << ", dirty: " << _dirty << "}" << endl;
+	_detached = true;
+	_dirty = false;
+}
+
+void LocalMemoryGridFile::markOpened() {
+	WriteLock lock(_fileLock);
+	if (_openState == OS_PENDING) {
+		_openState = OS_OPENED;
+	}
+}
+
 int LocalMemoryGridFile::openRemote(int fileFlags) {
 	trace() << " -> LocalMemoryGridFile::openRemote {fileFlags: " << fileFlags << "}" << endl;
-	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		GridFile origGridFile = gridFS.findFile(BSON("filename" << _filename));
 
-		if (!origGridFile.exists()) {
-			dbc.done();
+	// Hold the file exclusively while the content is being downloaded, so that any other thread
+	// sharing this file waits for the local buffers to be populated
+	WriteLock lock(_fileLock);
+	if (_openState == OS_OPENED) {
+		return 0;
+	} else if (_openState == OS_FAILED) {
+		return _openStatus;
+	}
+
+	_openStatus = _openRemote(fileFlags);
+	if (_openStatus) {
+		// Never flush back the partially populated buffers
+		_openState = OS_FAILED;
+		_dirty = false;
+	} else {
+		_openState = OS_OPENED;
+	}
+
+	return _openStatus;
+}
+
+int LocalMemoryGridFile::_openRemote(int fileFlags) {
+	// Content of the file closed last may still be on its way to the server
+	int retCode = FSJournal::get().waitForFile(_filename);
+	if (retCode) {
+		return retCode;
+	}
+
+	try {
+		BSONObj origFileObj = StorageBackend::get().findFile(_filename);
+		if (origFileObj.isEmpty()) {
 			error() << "Requested file not found for opening from remote {file: " << _filename << "}" << endl;
 			return -EBADF;
 		}
 
-		if (origGridFile.getContentLength() > globalFSOptions._maxMemFileSize) {
+		size_t contentLength = origFileObj.getField("length").numberLong();
+		if (contentLength > globalFSOptions._maxMemFileSize) {
 			// Don't support opening files of size > MAX_MEMORY_FILE_CAPACITY in R/W mode
 			error() << "Requested file length is beyond supported length for in-memory files {file: " 
-				<< _filename << ", length: {requested: " << origGridFile.getContentLength()
+				<< _filename << ", length: {requested: " << contentLength
 				<< ", max-supported: " << globalFSOptions._maxMemFileSize << "} }" << endl;
 			return -EROFS;
 		}
 
-		if (!initLocalBuffers(origGridFile)) {
+		if (!initLocalBuffers(origFileObj)) {
 			error() << "Failed to initialize local buffers {file: " << _filename << "}" << endl;
 			return -EIO;
 		}
 
 		_dirty = false;
-		dbc.done();
 	} catch (DBException& e) {
 		// Something failed in getting the file from GridFS
 		error() << "Caught exception in getting remote file for flush {filename: " << _filename
@@ -193,6 +278,7 @@ int LocalMemoryGridFile::openRemote(int fileFlags) {
 
 int LocalMemoryGridFile::write(const char *data, size_t len, off_t offset) {
 	trace() << " -> LocalMemoryGridFile::write {len: " << len << ", offset: " << offset << "}" << endl;
+	WriteLock lock(_fileLock);
 	if (_readOnly) {
 		debug() << "Encountered write call on a _readOnly file" << endl;
 		return -EROFS;
@@ -202,12 +288,17 @@ int LocalMemoryGridFile::write(const char *data, size_t len, off_t offset) {
 		return 0;
 	}
 
+	int retCode = reloadBuffers();
+	if (retCode) {
+		return retCode;
+	}
+
 	size_t updatedSize = (offset + len);
 	if (_capacity > updatedSize) {
 		// Nothing to be done, the size remains as it was before this 
 		// Change size only if it is expanding
 		_size = (updatedSize > _size) ? updatedSize : _size;
-	} else if (!setSize(updatedSize)) {
+	} else if (!_setSize(updatedSize)) {
 		return -ENOMEM;
 	}
 
@@ -215,9 +306,15 @@ int LocalMemoryGridFile::write(const char *data, size_t len, off_t offset) {
 }
 
 int LocalMemoryGridFile::_write(const char *data, size_t len, off_t offset) {
+	copyIn(data, len, offset);
+	markDirty();
+	return len;
+}
+
+void LocalMemoryGridFile::copyIn(const char *data, size_t len, off_t offset) {
 	// Assumes the appropriate space is available and theh chunks have been allocated
 	// appropriately
-	size_t whichChunk = (offset + 1) / _chunkSize;
+	size_t whichChunk = offset / _chunkSize;
 	size_t offsetInChunk = offset % _chunkSize;
 	size_t bytesWritten = 0;
 	char* dest = NULL;
@@ -237,32 +334,39 @@ int LocalMemoryGridFile::_write(const char *data, size_t len, off_t offset) {
 		offsetInChunk = 0;
 		++whichChunk;
 	}
-
-	_dirty = true;
-	return len;
 }
 
-int LocalMemoryGridFile::read(char *data, size_t len, off_t offset) const {
+int LocalMemoryGridFile::read(char *data, size_t len, off_t offset) {
 	trace() << " -> LocalMemoryGridFile::read {len: " << len << ", offset: " << offset << "}" << endl;
-	if (offset >= (off_t)_size) {
-		return -EOF;
+	ReadLock lock(_fileLock);
+	while (_buffersReleased) {
+		// Reload exclusively, the buffers may get released again before the read lock is re-taken
+		lock.unlock();
+		{
+			WriteLock writeLock(_fileLock);
+			int retCode = reloadBuffers();
+			if (retCode) {
+				return retCode;
+			}
+		}
+		lock.lock();
 	}
 
-	if (len == 0) {
+	if (offset >= (off_t)_size || len == 0) {
+		// Reads at or beyond the end of file return no data
 		return 0;
 	}
 
-	// Read from the chunks of in-memory grid file to buffer
-	unsigned int numChunks = (_size + 1) / _chunkSize;
+	// Never return the stale bytes between the end of file and the end of the last chunk
+	if (len > _size - offset) {
+		len = _size - offset;
+	}
 
 	//TODO: Implement the file offset tracking for the file
-	unsigned int activeChunkNum = offset / _chunkSize;
+	size_t activeChunkNum = offset / _chunkSize;
+	size_t offsetInChunk = offset % _chunkSize;
 	size_t bytesRead = 0;
-	while (bytesRead < len && activeChunkNum < numChunks) {
-		int bytesToRead = 0;
-
-		//TODO: Change the chunkLen to be correct length in case of last chunk
-		int chunkLen = _chunkSize;
+	while (bytesRead < len) {
 		const char* chunkData = _chunks[activeChunkNum];
 		if (!chunkData) {
 			warn() << "Encountered NULL chunk data while reading in-memory chunk {activeChunkNum: " << activeChunkNum 
@@ -270,18 +374,12 @@ int LocalMemoryGridFile::read(char *data, size_t len, off_t offset) const {
 			return -EIO;
 		}
 
-		if (bytesRead) {
-			// If we are in-between reading data, check on what data is left to be read
-			bytesToRead = min((size_t)chunkLen, (len - bytesRead));
-			memcpy(data + bytesRead, chunkData, bytesToRead);
-		} else {
-			// This is the first chunk we are reading and could be starting from in-between offset of the
-			// chunk that was previously read partially
-			bytesToRead = min((size_t)(chunkLen - (offset % _chunkSize)), (size_t)(len - bytesRead));
-			memcpy(data + bytesRead, chunkData + (offset % _chunkSize), bytesToRead);
-		}
+		// Only the first chunk read can start from in-between the chunk
+		size_t bytesToRead = min(_chunkSize - offsetInChunk, len - bytesRead);
+		memcpy(data + bytesRead, chunkData + offsetInChunk, bytesToRead);
 
 		bytesRead += bytesToRead;
+		offsetInChunk = 0;
 		++activeChunkNum;
 	}
 
@@ -289,7 +387,19 @@ int LocalMemoryGridFile::read(char *data, size_t len, off_t offset) const {
 }
 
 int LocalMemoryGridFile::flush() {
+	// Flush holds the file exclusively for the duration of the upload so that no writes land in
+	// the buffers between creating the flush buffer and marking the file clean
+	WriteLock lock(_fileLock);
+	return _flush();
+}
+
+int LocalMemoryGridFile::_flush() {
 	trace() << " -> LocalMemoryGridFile::flush {file: " << _filename << "}" << endl;
+	if (_detached) {
+		debug() << "Skipping flush for detached file {filename: " << _filename << "}" << endl;
+		return 0;
+	}
+
 	if (!_dirty) {
 		// Since, there are no dirty chunks, this does not need a flush
 		info() << "buffers are not dirty.. need not flush {filename: " << _filename << "}" << endl;
@@ -303,16 +413,51 @@ int LocalMemoryGridFile::flush() {
 		return -ENOMEM;
 	}
 
-	// Get the existing gridfile from GridFS to get metadata and delete the
-	// file from the system
-	try {
-		ScopedDbConnection dbc(globalFSOptions._connectString);
-		GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-		GridFile origGridFile = gridFS.findFile(BSON("filename" << _filename));
+	// Content flushed through the journal before has to reach the server before this one
+	int retCode = FSJournal::get().waitForFile(_filename);
+	if (!retCode) {
+		retCode = uploadContent(_filename, buffer.get(), bufferLen);
+	}
+
+	if (retCode) {
+		return retCode;
+	}
+
+	_dirty = false;
+	debug() << "Completed flushing the file content to GridFS {file: " << _filename << "}" << endl;
+	return 0;
+}
+
+int LocalMemoryGridFile::flushAsync() {
+	WriteLock lock(_fileLock);
+	if (!FSJournal::get().isEnabled() || _detached || !_dirty) {
+		return _flush();
+	}
+
+	size_t bufferLen = 0;
+	boost::shared_array<char> buffer = createFlushBuffer(bufferLen);
+	if (!buffer.get() && bufferLen > 0) {
+		return -ENOMEM;
+	}
+
+	int retCode = FSJournal::get().append(_filename, buffer, bufferLen);
+	if (retCode) {
+		warn() << "Failed to append file to the journal, will flush it synchronously {file: " << _filename
+			<< ", retCode: " << retCode << "}" << endl;
+		return _flush();
+	}
+
+	_dirty = false;
+	debug() << "Completed flushing the file content to the journal {file: " << _filename << ", size: " << bufferLen << "}" << endl;
+	return 0;
+}
 
-		if (!origGridFile.exists()) {
-			dbc.done();
-			warn() << "Requested file not found for flushing back data {file: " << _filename << "}" << endl;
+int LocalMemoryGridFile::uploadContent(const string& filename, const char* data, size_t len) {
+	try {
+		StorageBackend& backend = StorageBackend::get();
+		BSONObj origFileObj = backend.findFile(filename);
+		if (origFileObj.isEmpty()) {
+			warn() << "Requested file not found for flushing back data {file: " << filename << "}" << endl;
 			return -EBADF;
 		}
 
@@ -320,56 +465,161 @@ int LocalMemoryGridFile::flush() {
 		//i.e. do not update anything that is not a Regular File
 		//Check what happens in case of a link
 
-		gridFS.removeFile(_filename);
-		trace() << "Removing the current file from GridFS {file: " << _filename << "}" << endl;
-		//TODO: Check for remove status if that was successfull or not
-		//TODO: Rather have an update along with active / passive flag for the
-		//file
+		// Readers keep finding the current version until the new one is stored in full
+		trace() << "Storing new version of the file to GridFS {file: " << filename << "}" << endl;
+		BSONObj fileObj = backend.storeFileVersion(data, len, filename, getNextVersionFields(filename, origFileObj));
 
 		try {
-			GridFS gridFS(dbc.conn(), globalFSOptions._db, globalFSOptions._collPrefix);
-
-			// Create an empty file to signify the file creation and open a local file for the same
-			trace() << "Adding new file to GridFS {file: " << _filename << "}" << endl;
-			BSONObj fileObj = gridFS.storeFile(buffer.get(), bufferLen, _filename);
-			if (!fileObj.isValid()) {
-				warn() << "Failed to save file object in data flush {file: " << _filename << "}" << std::endl;
-				dbc.done();
-				return -EBADF;
-			}
-
-			// Update the last updated date for the document
-			BSONObj metadata = origGridFile.getMetadata();
-			BSONElement fileObjId = fileObj.getField("_id");
-			dbc->update(globalFSOptions._filesNS, BSON("_id" << fileObjId.OID()), 
-					BSON("$set" << BSON(
-								"uploadDate" << origGridFile.getUploadDate() 
-								<< "metadata.type" << "file"
-								<< "metadata.filename" << mgridfs::getPathBasename(_filename)
-								<< "metadata.directory" << mgridfs::getPathDirname(_filename)
-								<< "metadata.lastUpdated" << jsTime()
-								<< "metadata.uid" << metadata["uid"]
-								<< "metadata.gid" << metadata["gid"]
-								<< "metadata.mode" << metadata["mode"]
-							)
-						)
-					);
+			backend.removeStaleVersions(filename, StorageBackend::getVersion(fileObj));
+		} catch (DBException& e) {
+			// Content is safe, the older versions are only wasting space and are removed on the next flush
+			warn() << "Caught exception in removing stale versions in flush {file: " << filename << ", code: " << e.getCode()
+				<< ", what: " << e.what() << "}" << endl;
+		}
 	} catch (DBException& e) {
-			error() << "Caught exception in saving remote file in flush {code: " << e.getCode() << ", what: " << e.what()
-				<< ", exception: " << e.toString() << "}" << endl;
-			return -EIO;
+		error() << "Caught exception in saving remote file in flush {file: " << filename << ", code: " << e.getCode()
+			<< ", what: " << e.what() << ", exception: " << e.toString() << "}" << endl;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int LocalMemoryGridFile::cloneContent(const string& srcFilename, const string& filename) {
+	// Neither file may have content on its way to the server, it would overwrite / miss the clone
+	int retCode = FSJournal::get().waitForFile(srcFilename);
+	if (!retCode) {
+		retCode = FSJournal::get().waitForFile(filename);
+	}
+	if (retCode) {
+		return retCode;
+	}
+
+	try {
+		StorageBackend& backend = StorageBackend::get();
+		BSONObj srcFileObj = backend.findFile(srcFilename);
+		BSONObj origFileObj = backend.findFile(filename);
+		if (srcFileObj.isEmpty() || origFileObj.isEmpty()) {
+			warn() << "Requested file not found for cloning {src: " << srcFilename << ", file: " << filename << "}" << endl;
+			return -ENOENT;
 		}
 
-		dbc.done();
+		if (strcmp(srcFileObj.getObjectField("metadata").getStringField("type"), "file")) {
+			return -EINVAL;
+		}
+
+		trace() << "Storing new version of the file as a clone {src: " << srcFilename << ", file: " << filename << "}" << endl;
+		BSONObj fileObj = backend.cloneFileVersion(srcFileObj, filename, getNextVersionFields(filename, origFileObj));
+
+		try {
+			backend.removeStaleVersions(filename, StorageBackend::getVersion(fileObj));
+		} catch (DBException& e) {
+			warn() << "Caught exception in removing stale versions in clone {file: " << filename << ", code: " << e.getCode()
+				<< ", what: " << e.what() << "}" << endl;
+		}
 	} catch (DBException& e) {
-		// Something failed in getting the file from GridFS
-		error() << "Caught exception in getting remote file for flush {code: " << e.getCode() << ", what: " << e.what()
-			<< ", exception: " << e.toString() << "}" << endl;
+		error() << "Caught exception in cloning remote file {src: " << srcFilename << ", file: " << filename
+			<< ", code: " << e.getCode() << ", what: " << e.what() << ", exception: " << e.toString() << "}" << endl;
 		return -EIO;
 	}
 
+	return 0;
+}
+
+BSONObj LocalMemoryGridFile::getNextVersionFields(const string& filename, const BSONObj& origFileObj) {
+	// Metadata (ownership, mode, xattrs...) carries over to the new version as it is, compression
+	// is up to the backend storing it
+	BSONObjBuilder metadataBuilder;
+	BSONObjIterator mIt(origFileObj.getObjectField("metadata"));
+	while (mIt.more()) {
+		BSONElement elem = mIt.next();
+		string fieldName = elem.fieldName();
+		if (fieldName != "type" && fieldName != "filename" && fieldName != "directory"
+				&& fieldName != "lastUpdated" && fieldName != "version" && fieldName != "compression") {
+			metadataBuilder.append(elem);
+		}
+	}
+	metadataBuilder << "type" << "file"
+		<< "filename" << mgridfs::getPathBasename(filename)
+		<< "directory" << mgridfs::getPathDirname(filename)
+		<< "lastUpdated" << jsTime()
+		<< "version" << StorageBackend::getVersion(origFileObj) + 1;
+
+	return BSON("uploadDate" << origFileObj.getField("uploadDate").Date() << "metadata" << metadataBuilder.obj());
+}
+
+int LocalMemoryGridFile::cloneFrom(const string& srcFilename) {
+	WriteLock lock(_fileLock);
+	if (_readOnly || _detached) {
+		return -EBADF;
+	}
+
+	int retCode = cloneContent(srcFilename, _filename);
+	if (retCode) {
+		return retCode;
+	}
+
+	// Local content is that of the replaced version, it is reloaded from the clone in the same way
+	// as released buffers
+	freeChunks();
+	_buffersReleased = true;
 	_dirty = false;
-	debug() << "Completed flushing the file content to GridFS {file: " << _filename << "}" << endl;
+	debug() << "Cloned file content on the server {src: " << srcFilename << ", file: " << _filename << "}" << endl;
+	return reloadBuffers();
+}
+
+size_t LocalMemoryGridFile::getReclaimableBytes() const {
+	ReadLock lock(_fileLock, boost::try_to_lock);
+	if (!lock.owns_lock() || _openState != OS_OPENED || _detached) {
+		return 0;
+	}
+
+	return _capacity;
+}
+
+size_t LocalMemoryGridFile::releaseBuffers() {
+	// The user of a file in use may well be the one waiting for the memory, never wait for it
+	WriteLock lock(_fileLock, boost::try_to_lock);
+	if (!lock.owns_lock() || _openState != OS_OPENED || _detached || _chunks.empty()) {
+		return 0;
+	}
+
+	if (_dirty && _flush()) {
+		warn() << "Failed to flush file for releasing its buffers {file: " << _filename << "}" << endl;
+		return 0;
+	}
+
+	size_t released = _capacity;
+	freeChunks();
+	_buffersReleased = true;
+	debug() << "Released local file buffers {file: " << _filename << ", size: " << _size
+		<< ", released: " << released << "}" << endl;
+	return released;
+}
+
+int LocalMemoryGridFile::reloadBuffers() {
+	if (!_buffersReleased) {
+		return 0;
+	}
+
+	if (_detached) {
+		// The remote file the content was flushed to has been replaced since
+		warn() << "Cannot reload released buffers of detached file {file: " << _filename << "}" << endl;
+		return -ESTALE;
+	}
+
+	// The content has been flushed before the release, the remote file has the same content
+	size_t releasedSize = _size;
+	_size = 0;
+	int retCode = _openRemote(O_RDWR);
+	if (retCode) {
+		freeChunks();
+		_size = releasedSize;
+		return retCode;
+	}
+
+	_buffersReleased = false;
+	debug() << "Reloaded released local file buffers {file: " << _filename << ", size: " << _size << "}" << endl;
 	return 0;
 }
 
@@ -404,29 +654,75 @@ boost::shared_array<char> LocalMemoryGridFile::createFlushBuffer(size_t& bufferL
 	return tempBuffer;
 }
 
-bool LocalMemoryGridFile::initLocalBuffers(GridFile& gridFile) {
-	if (!setSize(gridFile.getContentLength())) {
+bool LocalMemoryGridFile::initLocalBuffers(const BSONObj& fileObj) {
+	size_t contentLength = fileObj.getField("length").numberLong();
+	if (!_setSize(contentLength)) {
 		return false;
 	}
 
-	//TODO: Check for size compared to the content length that was specified for consistency
+	int gridChunkSize = fileObj.getField("chunkSize").numberInt();
+	if (!contentLength || gridChunkSize <= 0) {
+		return true;
+	}
+	int chunkCount = (contentLength + gridChunkSize - 1) / gridChunkSize;
 
-	off_t offset = 0;
-	int chunkCount = gridFile.getNumChunks();
-	for (int i = 0; i < chunkCount; ++i) {
-		//TODO: Error checking or getChunk and related handling
-		GridFSChunk chunk = gridFile.getChunk(i);
-		int chunkLen = 0;
-		const char* data = chunk.data(chunkLen);
-		if (!data) {
-			error() << "Failed to get data from expected chunk {file: " << _filename
-				<< ", chunkOffset: " << i << ", totalChunks: " << chunkCount
-				<< "}, will stop in-between and return error." << endl;
-			return false;
+	// Owned copy of the file document for the fetches running on the worker threads
+	BSONObj ownedFileObj = fileObj.getOwned();
+
+	// Split the chunks into ranges fetched in parallel, the first one on this thread. Small files
+	// are fetched with a single query without involving the work queue at all
+	int rangeCount = (chunkCount + MIN_CHUNKS_PER_FETCH - 1) / MIN_CHUNKS_PER_FETCH;
+	if (rangeCount > (int)globalFSOptions._workerThreads + 1) {
+		rangeCount = globalFSOptions._workerThreads + 1;
+	}
+	int chunksPerRange = (chunkCount + rangeCount - 1) / rangeCount;
+
+	vector<FSFuture> pendingFetches;
+	for (int first = chunksPerRange; first < chunkCount; first += chunksPerRange) {
+		int end = min(first + chunksPerRange, chunkCount);
+		pendingFetches.push_back(FSWorkQueue::get().submit(boost::bind(&LocalMemoryGridFile::fetchRange, this,
+			ownedFileObj, first, end, gridChunkSize)));
+	}
+
+	int retCode = fetchRange(ownedFileObj, 0, min(chunksPerRange, chunkCount), gridChunkSize);
+
+	// Wait for all of them irrespective of failures as they write into our buffers
+	for (vector<FSFuture>::const_iterator fIt = pendingFetches.begin(); fIt != pendingFetches.end(); ++fIt) {
+		int fetchRetCode = fIt->wait();
+		retCode = retCode ? retCode : fetchRetCode;
+	}
+
+	return retCode == 0;
+}
+
+int LocalMemoryGridFile::fetchRange(const BSONObj& fileObj, int firstChunk, int endChunk, int gridChunkSize) {
+	try {
+		int fetched = StorageBackend::get().fetchChunks(fileObj, firstChunk, endChunk,
+			boost::bind(&LocalMemoryGridFile::storeChunk, this, gridChunkSize, _1, _2, _3));
+
+		if (fetched != (endChunk - firstChunk)) {
+			error() << "Failed to get data from expected chunks {file: " << _filename
+				<< ", chunks: [" << firstChunk << ", " << endChunk << "), fetched: " << fetched << "}" << endl;
+			return -EIO;
 		}
-		_write(data, chunkLen, offset);
-		offset += chunkLen;
+	} catch (DBException& e) {
+		error() << "Caught exception in fetching chunks {file: " << _filename << ", chunks: [" << firstChunk << ", "
+			<< endChunk << "), code: " << e.getCode() << ", what: " << e.what() << "}" << endl;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+bool LocalMemoryGridFile::storeChunk(int gridChunkSize, int chunkNum, const char* data, int len) {
+	// All GridFS chunks other than the last one are of the full chunk size
+	size_t offset = (size_t)chunkNum * gridChunkSize;
+	if (offset + len > _size) {
+		error() << "Encountered chunk beyond the file length {file: " << _filename << ", chunk: " << chunkNum
+			<< ", len: " << len << ", fileSize: " << _size << "}" << endl;
+		return false;
 	}
 
+	copyIn(data, len, offset);
 	return true;
 }
@@ -2,17 +2,20 @@
 #define mgridfs_local_grid_file_h
 
 #include <fuse.h>
+#include <ctime>
 
 #include <vector>
 #include <string>
 #include <memory>
 #include <boost/utility.hpp>
 #include <boost/smart_ptr/shared_array.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
 
 using namespace std;
 
 namespace mongo {
-	class GridFile;
+	class BSONObj;
 }
 
 namespace mgridfs {
@@ -23,10 +26,10 @@ public:
 	LocalGridFile(const string& filename);
 	virtual ~LocalGridFile();
 
-	virtual inline size_t getCapacity() const { return _capacity; }
-	virtual inline size_t getSize() const { return _size; }
-	virtual inline bool isReadOnly() const { return _readOnly; }
-	virtual inline const string& getFilename() const { return _filename; }
+	virtual inline size_t getCapacity() const { ReadLock lock(_fileLock); return _capacity; }
+	virtual inline size_t getSize() const { ReadLock lock(_fileLock); return _size; }
+	virtual inline bool isReadOnly() const { ReadLock lock(_fileLock); return _readOnly; }
+	virtual inline string getFilename() const { ReadLock lock(_fileLock); return _filename; }
 
 	virtual bool setCapacity(size_t size) = 0;
 	virtual bool setSize(size_t size) = 0;
@@ -34,18 +37,73 @@ public:
 	virtual bool setFilename(const string& filename) = 0;
 	virtual void setDirty(bool flag) = 0;
 
+	// Follows the remote file being renamed while the file is open
+	virtual void rename(const string& filename) = 0;
+
+	// Disconnects the local file from the remote file, e.g. when the remote file has been replaced.
+	// The content stays readable / writable for the handles still open but is never flushed back.
+	virtual void detach() = 0;
+
+	// Populates the local file from the server. Only the first call does so, later calls wait for
+	// and return the result of the first one. markOpened() is for files created empty locally.
 	virtual int openRemote(int fileFlags) = 0;
+	virtual void markOpened() = 0;
+
+	// Reads may have to reload the buffers released in the meantime, so are not const
 	virtual int write(const char *data, size_t len, off_t offset) = 0;
-	virtual int read(char *data, size_t len, off_t offset) const = 0;
+	virtual int read(char *data, size_t len, off_t offset) = 0;
 	virtual int flush() = 0;
 
-	virtual inline bool isDirty() const { return _dirty; }
+	// Flush on close, returns once the content is durable in the journal if enabled (see FSJournal),
+	// otherwise the same as flush()
+	virtual int flushAsync() = 0;
+
+	// Replaces the content of the file by a clone of the source file on the server, see
+	// LocalMemoryGridFile::cloneContent. Writes not flushed yet are discarded.
+	virtual int cloneFrom(const string& srcFilename) = 0;
+
+	virtual inline bool isDirty() const { ReadLock lock(_fileLock); return _dirty; }
+
+	// Time the file has become dirty since it was last flushed, 0 if it is not dirty
+	virtual inline time_t getDirtySince() const { ReadLock lock(_fileLock); return _dirty ? _dirtySince : 0; }
+
+	// Memory that releaseBuffers() would free, 0 for the files in use at the time of the call
+	virtual size_t getReclaimableBytes() const = 0;
+
+	// Flushes the file if dirty and frees its buffers, which are reloaded from the server on the next
+	// access. Never waits for the file, the files in use are skipped. Returns the bytes freed.
+	virtual size_t releaseBuffers() = 0;
 
 protected:
+	// Reads of the file content / state share the file lock, anything that modifies the buffers
+	// or the state of the file (write, resize, flush, open) holds it exclusively
+	typedef boost::shared_lock<boost::shared_mutex> ReadLock;
+	typedef boost::unique_lock<boost::shared_mutex> WriteLock;
+
+	mutable boost::shared_mutex _fileLock;
+
+	// Expects the file lock to be held exclusively
+	inline void markDirty() {
+		if (!_dirty) {
+			_dirty = true;
+			_dirtySince = time(NULL);
+		}
+	}
+
+	typedef enum {
+		OS_PENDING,
+		OS_OPENED,
+		OS_FAILED,
+	} OpenState;
+
 	size_t _size;
 	size_t _capacity;
 	bool _readOnly;
 	bool _dirty;
+	time_t _dirtySince;
+	bool _detached;
+	OpenState _openState;
+	int _openStatus; // Result of openRemote in case of OS_FAILED
 	string _filename;
 };
 
@@ -66,22 +124,58 @@ public:
 	virtual bool setFilename(const string& filename);
 	virtual void setDirty(bool flag);
 
+	virtual void rename(const string& filename);
+	virtual void detach();
+
 	virtual int openRemote(int fileFlags);
+	virtual void markOpened();
 	virtual int write(const char *data, size_t len, off_t offset);
-	virtual int read(char *data, size_t len, off_t offset) const;
+	virtual int read(char *data, size_t len, off_t offset);
 	virtual int flush();
+	virtual int flushAsync();
+	virtual int cloneFrom(const string& srcFilename);
+
+	virtual size_t getReclaimableBytes() const;
+	virtual size_t releaseBuffers();
+
+	// Replaces the content of the file on the server keeping its metadata, 0 or -errno with -EBADF
+	// if the file does not exist and -EIO if the server could not be reached
+	static int uploadContent(const string& filename, const char* data, size_t len);
+
+	// Replaces the content of the file on the server by that of the source file, sharing its chunks
+	// rather than copying them. Keeps the metadata of the file in the same way as uploadContent,
+	// 0 or -errno with -ENOENT if either file does not exist and -EINVAL if the source is not a file.
+	static int cloneContent(const string& srcFilename, const string& filename);
 
 protected:
+	// Following expect the file lock to be held exclusively by the caller
 	virtual int _write(const char *data, size_t len, off_t offset);
+	virtual bool _setSize(size_t size);
+	virtual int _openRemote(int fileFlags);
+	virtual int _flush();
 
 private:
+	// Drives the buffer layer directly, including the flush buffer, for mgridfs_bench
+	friend class LocalGridFileBench;
+
 	size_t _chunkSize;
 	vector<char*> _chunks;
-	//boost::thread::mutex _fileLock;
+	bool _buffersReleased; // Freed by releaseBuffers(), _size is still the size of the file
 
+	// Following expect the file lock to be held exclusively by the caller
+	int reloadBuffers();
+	void freeChunks();
 
 	boost::shared_array<char> createFlushBuffer(size_t& bufferLen) const;
-	bool initLocalBuffers(mongo::GridFile& gridFile);
+
+	// Fields of the next version of the file: the metadata of the current one with a bumped version
+	static mongo::BSONObj getNextVersionFields(const string& filename, const mongo::BSONObj& origFileObj);
+	bool initLocalBuffers(const mongo::BSONObj& fileObj);
+
+	// Following are run concurrently for disjoint ranges of the file while initLocalBuffers holds the file lock
+	int fetchRange(const mongo::BSONObj& fileObj, int firstChunk, int endChunk, int gridChunkSize);
+	bool storeChunk(int gridChunkSize, int chunkNum, const char* data, int len);
+	void copyIn(const char *data, size_t len, off_t offset);
 };
 
 }
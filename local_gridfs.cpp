@@ -1,10 +1,15 @@
 #include "local_gridfs.h"
 #include "local_grid_file.h"
 #include "fs_logger.h"
+#include "fs_stats.h"
 
-using namespace mgridfs;
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+
+#include <boost/functional/hash.hpp>
 
-map<string, LocalGridFile*> mgridfs::LocalGridFS::_localGridFileMap;
+using namespace mgridfs;
 
 LocalGridFS::LocalGridFS() {
 }
@@ -17,50 +22,333 @@ LocalGridFS& LocalGridFS::get() {
 	return localGridFS;
 }
 
-LocalGridFile* LocalGridFS::findByName(const string& filename) {
-	LocalGridFileMap::const_iterator pIt = _localGridFileMap.find(filename);
-	if (pIt == _localGridFileMap.end()) {
-		return NULL;
+size_t LocalGridFS::getShardIndex(const string& filename) const {
+	return boost::hash<string>()(filename) % SHARD_COUNT;
+}
+
+LocalGridFilePtr LocalGridFS::findByName(const string& filename) {
+	Shard& shard = _shards[getShardIndex(filename)];
+	boost::mutex::scoped_lock lock(shard._lock);
+	LocalGridFileMap::const_iterator pIt = shard._localGridFileMap.find(filename);
+	if (pIt == shard._localGridFileMap.end()) {
+		return LocalGridFilePtr();
 	}
 
-	return pIt->second;
+	return pIt->second._localGridFile;
 }
 
-LocalGridFile* LocalGridFS::createFile(const string& filename) {
+LocalGridFilePtr LocalGridFS::acquireLocked(Shard& shard, const string& filename, bool& created) {
+	created = false;
+	LocalGridFileMap::iterator pIt = shard._localGridFileMap.find(filename);
+	if (pIt != shard._localGridFileMap.end()) {
+		++pIt->second._openCount;
+		return pIt->second._localGridFile;
+	}
+
 	// Enhance further to include local on-disk and hybrid approach for managing files more
 	// efficiently without high RAM usage on the system
-	LocalGridFile* localGridFile = new (nothrow) LocalMemoryGridFile(filename);
+	LocalGridFilePtr localGridFile(new (nothrow) LocalMemoryGridFile(filename));
 	if (localGridFile) {
 		// If the local file was allocated, add the specified filename to the map as well
-		_localGridFileMap.insert(LocalGridFileMap::value_type(filename, localGridFile));
+		pIt = shard._localGridFileMap.insert(LocalGridFileMap::value_type(filename, LocalGridFileEntry(localGridFile))).first;
+		++pIt->second._openCount;
+		created = true;
+	}
+
+	return localGridFile;
+}
+
+bool LocalGridFS::detachLocked(Shard& shard, const string& filename, const char* reason) {
+	LocalGridFileMap::iterator pIt = shard._localGridFileMap.find(filename);
+	if (pIt == shard._localGridFileMap.end()) {
+		return false;
+	}
+
+	// Released later by whoever has it open, as a file not found
+	info() << "Detaching local file " << reason << " {file: " << filename << ", openCount: "
+		<< pIt->second._openCount << "}" << endl;
+	pIt->second._localGridFile->detach();
+	shard._localGridFileMap.erase(pIt);
+	return true;
+}
+
+LocalGridFilePtr LocalGridFS::acquireFile(const string& filename, int fileFlags, int& retCode) {
+	LocalGridFilePtr localGridFile;
+	bool created = false;
+	{
+		Shard& shard = _shards[getShardIndex(filename)];
+		boost::mutex::scoped_lock lock(shard._lock);
+		localGridFile = acquireLocked(shard, filename, created);
+	}
+
+	if (!localGridFile) {
+		retCode = -ENOMEM;
+		return localGridFile;
+	}
+
+	// Populate outside of the shard lock. Only the first caller actually downloads the content,
+	// everyone else sharing the file waits on the file lock for it to complete.
+	debug() << "Acquired local file {file: " << filename << ", created: " << created << "}" << endl;
+	FSOpContext::recordCache(FSCACHE_LOCAL_FILE, !created);
+	retCode = localGridFile->openRemote(fileFlags);
+	if (retCode != 0) {
+		releaseFile(localGridFile);
+		return LocalGridFilePtr();
 	}
 
 	return localGridFile;
 }
 
-bool LocalGridFS::releaseFile(const string& filename) {
-	LocalGridFileMap::const_iterator pIt = _localGridFileMap.find(filename);
-	if (pIt == _localGridFileMap.end()) {
-		warn() << "File not found for releaseFile {file: " << filename << "}" << endl;
-		return true; // Although file is not found, it is not really an error
+LocalGridFilePtr LocalGridFS::acquireExistingFile(const string& filename) {
+	Shard& shard = _shards[getShardIndex(filename)];
+	boost::mutex::scoped_lock lock(shard._lock);
+	LocalGridFileMap::iterator pIt = shard._localGridFileMap.find(filename);
+	if (pIt == shard._localGridFileMap.end()) {
+		return LocalGridFilePtr();
+	}
+
+	++pIt->second._openCount;
+	return pIt->second._localGridFile;
+}
+
+LocalGridFilePtr LocalGridFS::createFile(const string& filename) {
+	LocalGridFilePtr localGridFile;
+	bool created = false;
+	{
+		// Content of a local file still open under the name is not that of the file just created
+		Shard& shard = _shards[getShardIndex(filename)];
+		boost::mutex::scoped_lock lock(shard._lock);
+		detachLocked(shard, filename, "replaced by create");
+		localGridFile = acquireLocked(shard, filename, created);
 	}
 
-	LocalGridFile* localGridFile = pIt->second;
-	_localGridFileMap.erase(filename);
+	if (localGridFile) {
+		// Nothing to download for a file that has just been created
+		localGridFile->markOpened();
+	}
+
+	return localGridFile;
+}
+
+bool LocalGridFS::detachFile(const string& filename) {
+	Shard& shard = _shards[getShardIndex(filename)];
+	boost::mutex::scoped_lock lock(shard._lock);
+	return detachLocked(shard, filename, "removed");
+}
+
+bool LocalGridFS::releaseFile(const LocalGridFilePtr& localGridFile) {
 	if (!localGridFile) {
-		error() << "Encountered NULL file entry in releaseFile {file: " << filename << "}" << endl;
+		error() << "Encountered NULL file entry in releaseFile" << endl;
 		return false;
 	}
 
+	// The file may get renamed concurrently, in which case it needs to be looked up again under the
+	// new name. Rename updates the name of the file while holding the shard lock of both names.
+	for (;;) {
+		string filename = localGridFile->getFilename();
+		Shard& shard = _shards[getShardIndex(filename)];
+		boost::mutex::scoped_lock lock(shard._lock);
+		LocalGridFileMap::iterator pIt = shard._localGridFileMap.find(filename);
+		if (pIt == shard._localGridFileMap.end() || pIt->second._localGridFile != localGridFile) {
+			if (localGridFile->getFilename() != filename) {
+				continue;
+			}
+
+			warn() << "File not found for releaseFile {file: " << filename << "}" << endl;
+			return true; // Although file is not found, it is not really an error
+		}
+
+		if (--pIt->second._openCount > 0) {
+			debug() << "Released local file reference {file: " << filename << ", openCount: "
+				<< pIt->second._openCount << "}" << endl;
+			return true;
+		}
+
+		++pIt->second._closingCount;
+		break;
+	}
+
+	// Final release, flush outside of the shard lock. The file stays registered until the flush is
+	// done, opens in the meantime take a reference on it again and wait on the file lock for the
+	// flush. Other threads still holding a pointer to the file (e.g. lookups through findByName)
+	// keep it alive until they are done with it.
 	if (localGridFile->flush()) {
-		warn() << "Failed to flush before deletion in releaseFile {file: " << filename << "}, may result in corrupt file data." 
-			<< endl;
+		warn() << "Failed to flush before deletion in releaseFile {file: " << localGridFile->getFilename()
+			<< "}, may result in corrupt file data." << endl;
 	}
 
-	delete localGridFile;
+	for (;;) {
+		string filename = localGridFile->getFilename();
+		Shard& shard = _shards[getShardIndex(filename)];
+		boost::mutex::scoped_lock lock(shard._lock);
+		LocalGridFileMap::iterator pIt = shard._localGridFileMap.find(filename);
+		if (pIt == shard._localGridFileMap.end() || pIt->second._localGridFile != localGridFile) {
+			if (localGridFile->getFilename() != filename) {
+				continue;
+			}
+
+			// Detached during the flush
+			return true;
+		}
+
+		if (--pIt->second._closingCount == 0 && pIt->second._openCount == 0) {
+			shard._localGridFileMap.erase(pIt);
+		}
+		return true;
+	}
+}
+
+bool LocalGridFS::renameFile(const string& srcFilename, const string& destFilename) {
+	size_t srcIndex = getShardIndex(srcFilename);
+	size_t destIndex = getShardIndex(destFilename);
+
+	// Always lock the shards in the same order to avoid dead-locks between concurrent renames
+	boost::mutex::scoped_lock firstLock(_shards[min(srcIndex, destIndex)]._lock);
+	boost::mutex::scoped_lock secondLock(_shards[max(srcIndex, destIndex)]._lock, boost::defer_lock);
+	if (srcIndex != destIndex) {
+		secondLock.lock();
+	}
+
+	LocalGridFileMap& srcMap = _shards[srcIndex]._localGridFileMap;
+	LocalGridFileMap& destMap = _shards[destIndex]._localGridFileMap;
+
+	detachLocked(_shards[destIndex], destFilename, "replaced by rename");
+
+	LocalGridFileMap::iterator srcIt = srcMap.find(srcFilename);
+	if (srcIt == srcMap.end()) {
+		return true;
+	}
+
+	LocalGridFileEntry entry = srcIt->second;
+	srcMap.erase(srcIt);
+	entry._localGridFile->rename(destFilename);
+	destMap.insert(LocalGridFileMap::value_type(destFilename, entry));
+
+	debug() << "Re-keyed local file on rename {src: " << srcFilename << ", dest: " << destFilename
+		<< ", openCount: " << entry._openCount << "}" << endl;
 	return true;
 }
 
+void LocalGridFS::renameTree(const string& srcDirectory, const string& destDirectory) {
+	string srcPrefix = srcDirectory + "/";
+	vector<string> srcFilenames;
+	for (size_t i = 0; i < SHARD_COUNT; ++i) {
+		boost::mutex::scoped_lock lock(_shards[i]._lock);
+		LocalGridFileMap& fileMap = _shards[i]._localGridFileMap;
+		for (LocalGridFileMap::const_iterator pIt = fileMap.begin(); pIt != fileMap.end(); ++pIt) {
+			if (!pIt->first.compare(0, srcPrefix.size(), srcPrefix)) {
+				srcFilenames.push_back(pIt->first);
+			}
+		}
+	}
+
+	for (vector<string>::const_iterator fIt = srcFilenames.begin(); fIt != srcFilenames.end(); ++fIt) {
+		renameFile(*fIt, destDirectory + fIt->substr(srcDirectory.size()));
+	}
+}
+
+size_t LocalGridFS::detachTree(const string& directory) {
+	string prefix = directory + "/";
+	size_t detached = 0;
+	for (size_t i = 0; i < SHARD_COUNT; ++i) {
+		boost::mutex::scoped_lock lock(_shards[i]._lock);
+		LocalGridFileMap& fileMap = _shards[i]._localGridFileMap;
+		for (LocalGridFileMap::iterator pIt = fileMap.begin(); pIt != fileMap.end(); ) {
+			if (pIt->first.compare(0, prefix.size(), prefix)) {
+				++pIt;
+				continue;
+			}
+
+			// Released later by whoever has it open, as a file not found
+			pIt->second._localGridFile->detach();
+			fileMap.erase(pIt++);
+			++detached;
+		}
+	}
+
+	return detached;
+}
+
+void LocalGridFS::getAllFiles(vector<LocalGridFilePtr>& localGridFiles) {
+	for (size_t i = 0; i < SHARD_COUNT; ++i) {
+		boost::mutex::scoped_lock lock(_shards[i]._lock);
+		LocalGridFileMap& fileMap = _shards[i]._localGridFileMap;
+		for (LocalGridFileMap::const_iterator pIt = fileMap.begin(); pIt != fileMap.end(); ++pIt) {
+			localGridFiles.push_back(pIt->second._localGridFile);
+		}
+	}
+}
+
+void LocalGridFS::flushAllFiles(size_t& flushed, size_t& failed) {
+	// Flushed outside of the shard locks, the pointers keep the files alive in the meantime
+	vector<LocalGridFilePtr> localGridFiles;
+	getAllFiles(localGridFiles);
+
+	flushed = failed = 0;
+	for (vector<LocalGridFilePtr>::const_iterator fIt = localGridFiles.begin(); fIt != localGridFiles.end(); ++fIt) {
+		if (!(*fIt)->isDirty()) {
+			continue;
+		}
+
+		if ((*fIt)->flush()) {
+			warn() << "Failed to flush local file {file: " << (*fIt)->getFilename() << "}" << endl;
+			++failed;
+		} else {
+			++flushed;
+		}
+	}
+
+	info() << "Flushed all local files {files: " << localGridFiles.size() << ", flushed: " << flushed
+		<< ", failed: " << failed << "}" << endl;
+}
+
+size_t LocalGridFS::reclaimBuffers(size_t bytes) {
+	vector<LocalGridFilePtr> localGridFiles;
+	getAllFiles(localGridFiles);
+
+	// Largest first, for the fewest files to be flushed and reloaded later
+	vector<pair<size_t, LocalGridFilePtr> > candidates;
+	for (vector<LocalGridFilePtr>::const_iterator fIt = localGridFiles.begin(); fIt != localGridFiles.end(); ++fIt) {
+		size_t reclaimable = (*fIt)->getReclaimableBytes();
+		if (reclaimable) {
+			candidates.push_back(make_pair(reclaimable, *fIt));
+		}
+	}
+	sort(candidates.begin(), candidates.end(), greater<pair<size_t, LocalGridFilePtr> >());
+
+	size_t reclaimed = 0;
+	size_t files = 0;
+	for (size_t i = 0; i < candidates.size() && reclaimed < bytes; ++i) {
+		size_t released = candidates[i].second->releaseBuffers();
+		reclaimed += released;
+		files += released ? 1 : 0;
+	}
+
+	debug() << "Reclaimed buffers of local files {files: " << files << ", candidates: " << candidates.size()
+		<< ", requested: " << bytes << ", reclaimed: " << reclaimed << "}" << endl;
+	return reclaimed;
+}
+
 bool LocalGridFS::releaseAllFiles(bool flushAll) {
-	return false;
+	vector<LocalGridFilePtr> localGridFiles;
+	for (size_t i = 0; i < SHARD_COUNT; ++i) {
+		boost::mutex::scoped_lock lock(_shards[i]._lock);
+		LocalGridFileMap& fileMap = _shards[i]._localGridFileMap;
+		for (LocalGridFileMap::const_iterator pIt = fileMap.begin(); pIt != fileMap.end(); ++pIt) {
+			localGridFiles.push_back(pIt->second._localGridFile);
+		}
+		fileMap.clear();
+	}
+
+	size_t failed = 0;
+	for (vector<LocalGridFilePtr>::const_iterator fIt = localGridFiles.begin(); fIt != localGridFiles.end(); ++fIt) {
+		if (flushAll && (*fIt)->isDirty() && (*fIt)->flush()) {
+			error() << "Failed to flush local file on release {file: " << (*fIt)->getFilename() << "}" << endl;
+			++failed;
+		}
+	}
+
+	info() << "Released all local files {files: " << localGridFiles.size() << ", flushAll: " << flushAll
+		<< ", failed: " << failed << "}" << endl;
+	return failed == 0;
 }
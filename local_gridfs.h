@@ -3,31 +3,111 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <boost/utility.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 using namespace std;
 
 namespace mgridfs {
 
 class LocalGridFile;
+typedef boost::shared_ptr<LocalGridFile> LocalGridFilePtr;
 
+/**
+ * Registry of the local files open on this server.
+ *
+ * There is at most one local file per filename and all the handles opening the same file share
+ * it, so the content is downloaded only once. Every acquire / create is counted against the
+ * file and has to be matched with a releaseFile(), the last release flushes the file and drops
+ * it from the registry. The file stays registered while it is being flushed, so that opens in
+ * the meantime share it rather than reading the version the flush is replacing.
+ */
 class LocalGridFS : protected boost::noncopyable {
 public:
-	typedef map<string, LocalGridFile*> LocalGridFileMap;
+	struct LocalGridFileEntry {
+		LocalGridFileEntry(const LocalGridFilePtr& localGridFile)
+			: _localGridFile(localGridFile), _openCount(0), _closingCount(0) {}
+
+		LocalGridFilePtr _localGridFile;
+		size_t _openCount;
+		size_t _closingCount; // Final releases still flushing the file
+	};
+
+	typedef map<string, LocalGridFileEntry> LocalGridFileMap;
 
 	static LocalGridFS& get();
 
-	LocalGridFile* findByName(const string& filename);
-	LocalGridFile* createFile(const string& filename);
-	bool releaseFile(const string& filename);
+	// Lookup without taking a reference on the file, for callers only interested in the local state
+	LocalGridFilePtr findByName(const string& filename);
+
+	// Takes a reference on the local file for the filename, creating and populating it from the
+	// server if it is not open yet. Concurrent callers for the same file wait for the one download.
+	// On failure returns NULL with retCode set and no reference held.
+	LocalGridFilePtr acquireFile(const string& filename, int fileFlags, int& retCode);
+
+	// Takes a reference on the local file only if it is already open, NULL otherwise
+	LocalGridFilePtr acquireExistingFile(const string& filename);
+
+	// Takes a reference on a new local file for a file that has just been created empty on the
+	// server. A local file still open under the same name is detached, it is of the file replaced.
+	LocalGridFilePtr createFile(const string& filename);
+
+	// Drops the reference, the final release flushes the file and removes it from the registry
+	// unless it has been opened again in the meantime
+	bool releaseFile(const LocalGridFilePtr& localGridFile);
+
+	// Re-keys an open local file after the remote file has been renamed. A local file open under
+	// the destination name is detached, since the file it represents has been replaced.
+	bool renameFile(const string& srcFilename, const string& destFilename);
+
+	// Detaches the local file open under the filename, if any, so that it is never flushed back
+	// and later opens of the name get a file of their own. For files about to be removed.
+	bool detachFile(const string& filename);
+
+	// Re-keys the local files open below a directory after the remote directory has been renamed
+	void renameTree(const string& srcDirectory, const string& destDirectory);
 
+	// Detaches the local files open below a directory that has been removed, so that they are
+	// never flushed back. Returns the number of files detached.
+	size_t detachTree(const string& directory);
+
+	// Local files open at the time of the call
+	void getAllFiles(vector<LocalGridFilePtr>& localGridFiles);
+
+	// Writes back every dirty local file, the files stay open
+	void flushAllFiles(size_t& flushed, size_t& failed);
+
+	// Flushes the largest local files not in use and frees their buffers, until at least the given
+	// bytes are freed or there are no more files to take them from. Returns the bytes freed.
+	size_t reclaimBuffers(size_t bytes);
+
+	// Drops all the local files irrespective of their references, flushing the dirty ones first if
+	// flushAll is set. Only for when no more operations are coming in, i.e. the file system is
+	// being unmounted. Returns false if any of the flushes failed.
 	bool releaseAllFiles(bool flushAll);
 
 private:
 	LocalGridFS();
 	~LocalGridFS();
 
-	static LocalGridFileMap _localGridFileMap;
+	// Local files are spread over fixed number of independently locked shards by the filename
+	// hash so that operations on different files do not serialize on a single map lock
+	static const size_t SHARD_COUNT = 16;
+
+	struct Shard {
+		boost::mutex _lock;
+		LocalGridFileMap _localGridFileMap;
+	};
+
+	size_t getShardIndex(const string& filename) const;
+
+	// Following expect the shard lock to be held
+	LocalGridFilePtr acquireLocked(Shard& shard, const string& filename, bool& created);
+	bool detachLocked(Shard& shard, const string& filename, const char* reason);
+
+	Shard _shards[SHARD_COUNT];
 };
 
 }
@@ -2,6 +2,7 @@
 #include "fs_meta_ops.h"
 #include "file_meta_ops.h"
 #include "dir_meta_ops.h"
+#include "instrumented_ops.h"
 #include "fs_logger.h"
 
 #include <unistd.h>
@@ -15,60 +16,63 @@ namespace {
 }
 
 int main(int argc, char* argv[], char* arge[]) {
+	// All the operations other than init / destroy are registered through their instrumented
+	// wrappers so that their latencies show up in the stats
+
 	// File-system meta / setup / cleanup functions
 	mgridfsOps.init = mgridfs::mgridfs_init;
 	mgridfsOps.destroy = mgridfs::mgridfs_destroy;
-	mgridfsOps.statfs = mgridfs::mgridfs_statfs;
+	mgridfsOps.statfs = mgridfs::instrumented::mgridfs_statfs;
 
 	// File/Directory attribute management functionality
-	mgridfsOps.getattr = mgridfs::mgridfs_getattr;
-	mgridfsOps.fgetattr = mgridfs::mgridfs_fgetattr;
+	mgridfsOps.getattr = mgridfs::instrumented::mgridfs_getattr;
+	mgridfsOps.fgetattr = mgridfs::instrumented::mgridfs_fgetattr;
 	mgridfsOps.access = NULL; // optional, un-implemented functionality
-	mgridfsOps.setxattr = mgridfs::mgridfs_setxattr;
-	mgridfsOps.getxattr = mgridfs::mgridfs_getxattr;
-	mgridfsOps.listxattr = mgridfs::mgridfs_listxattr;
-	mgridfsOps.removexattr = mgridfs::mgridfs_removexattr;
-	mgridfsOps.chmod = mgridfs::mgridfs_chmod;
-	mgridfsOps.chown = mgridfs::mgridfs_chown;
-	mgridfsOps.utime = mgridfs::mgridfs_utime;
-	mgridfsOps.utimens = mgridfs::mgridfs_utimens;
+	mgridfsOps.setxattr = mgridfs::instrumented::mgridfs_setxattr;
+	mgridfsOps.getxattr = mgridfs::instrumented::mgridfs_getxattr;
+	mgridfsOps.listxattr = mgridfs::instrumented::mgridfs_listxattr;
+	mgridfsOps.removexattr = mgridfs::instrumented::mgridfs_removexattr;
+	mgridfsOps.chmod = mgridfs::instrumented::mgridfs_chmod;
+	mgridfsOps.chown = mgridfs::instrumented::mgridfs_chown;
+	mgridfsOps.utime = mgridfs::instrumented::mgridfs_utime;
+	mgridfsOps.utimens = mgridfs::instrumented::mgridfs_utimens;
 
-	mgridfsOps.mknod = mgridfs::mgridfs_mknod;
+	mgridfsOps.mknod = mgridfs::instrumented::mgridfs_mknod;
 
 	// Directory functionality
-	mgridfsOps.mkdir = mgridfs::mgridfs_mkdir;
-	mgridfsOps.rmdir = mgridfs::mgridfs_rmdir;
-	mgridfsOps.opendir = mgridfs::mgridfs_opendir;
-	mgridfsOps.readdir = mgridfs::mgridfs_readdir;
-	mgridfsOps.releasedir = mgridfs::mgridfs_releasedir;
-	mgridfsOps.fsyncdir = mgridfs::mgridfs_fsyncdir;
+	mgridfsOps.mkdir = mgridfs::instrumented::mgridfs_mkdir;
+	mgridfsOps.rmdir = mgridfs::instrumented::mgridfs_rmdir;
+	mgridfsOps.opendir = mgridfs::instrumented::mgridfs_opendir;
+	mgridfsOps.readdir = mgridfs::instrumented::mgridfs_readdir;
+	mgridfsOps.releasedir = mgridfs::instrumented::mgridfs_releasedir;
+	mgridfsOps.fsyncdir = mgridfs::instrumented::mgridfs_fsyncdir;
 
 	// File linking functionality functions
 	mgridfsOps.link = NULL; // Hard-links are not supported
-	mgridfsOps.readlink = mgridfs::mgridfs_readlink;
-	mgridfsOps.unlink = mgridfs::mgridfs_unlink;
-	mgridfsOps.symlink = mgridfs::mgridfs_symlink;
+	mgridfsOps.readlink = mgridfs::instrumented::mgridfs_readlink;
+	mgridfsOps.unlink = mgridfs::instrumented::mgridfs_unlink;
+	mgridfsOps.symlink = mgridfs::instrumented::mgridfs_symlink;
 
 	// Normal file related operations
-	mgridfsOps.create = mgridfs::mgridfs_create;
-	mgridfsOps.open = mgridfs::mgridfs_open;
-	mgridfsOps.read = mgridfs::mgridfs_read;
-	//mgridfsOps.read_buf = mgridfs::mgridfs_read_buf; // read function should be able to handle all read requests
-	mgridfsOps.write = mgridfs::mgridfs_write;
-	//mgridfsOps.write_buf = mgridfs::mgridfs_write_buf; // write function should be able to handle all write requests
-	mgridfsOps.flush = mgridfs::mgridfs_flush;
-	mgridfsOps.release = mgridfs::mgridfs_release;
+	mgridfsOps.create = mgridfs::instrumented::mgridfs_create;
+	mgridfsOps.open = mgridfs::instrumented::mgridfs_open;
+	mgridfsOps.read = mgridfs::instrumented::mgridfs_read;
+	//mgridfsOps.read_buf = mgridfs::instrumented::mgridfs_read_buf; // read function should be able to handle all read requests
+	mgridfsOps.write = mgridfs::instrumented::mgridfs_write;
+	//mgridfsOps.write_buf = mgridfs::instrumented::mgridfs_write_buf; // write function should be able to handle all write requests
+	mgridfsOps.flush = mgridfs::instrumented::mgridfs_flush;
+	mgridfsOps.release = mgridfs::instrumented::mgridfs_release;
 
-	mgridfsOps.rename = mgridfs::mgridfs_rename;
-	mgridfsOps.truncate = mgridfs::mgridfs_truncate;
-	mgridfsOps.ftruncate = mgridfs::mgridfs_ftruncate;
-	mgridfsOps.fsync = mgridfs::mgridfs_fsync;
-	mgridfsOps.lock = mgridfs::mgridfs_lock;
-	mgridfsOps.bmap = mgridfs::mgridfs_bmap;
-	mgridfsOps.ioctl = mgridfs::mgridfs_ioctl;
-	mgridfsOps.poll = mgridfs::mgridfs_poll;
-	mgridfsOps.flock = mgridfs::mgridfs_flock;
-	mgridfsOps.fallocate = mgridfs::mgridfs_fallocate;
+	mgridfsOps.rename = mgridfs::instrumented::mgridfs_rename;
+	mgridfsOps.truncate = mgridfs::instrumented::mgridfs_truncate;
+	mgridfsOps.ftruncate = mgridfs::instrumented::mgridfs_ftruncate;
+	mgridfsOps.fsync = mgridfs::instrumented::mgridfs_fsync;
+	mgridfsOps.lock = mgridfs::instrumented::mgridfs_lock;
+	mgridfsOps.bmap = mgridfs::instrumented::mgridfs_bmap;
+	mgridfsOps.ioctl = mgridfs::instrumented::mgridfs_ioctl;
+	mgridfsOps.poll = mgridfs::instrumented::mgridfs_poll;
+	mgridfsOps.flock = mgridfs::instrumented::mgridfs_flock;
+	mgridfsOps.fallocate = mgridfs::instrumented::mgridfs_fallocate;
 
 	struct fuse_args fuseArgs = FUSE_ARGS_INIT(argc, argv);
 	if (!mgridfs::globalFSOptions.fromCommandLine(fuseArgs)) {
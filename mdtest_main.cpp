@@ -0,0 +1,554 @@
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+using namespace std;
+
+/**
+ * Metadata benchmark in the spirit of mdtest that drives a mounted mgridfs with plain syscalls,
+ * so that the numbers are not dominated by the shell and fork as with the loops of the driver.
+ * Every client thread builds its own directory tree of the configured depth and width under the
+ * target path and goes through the mkdir, create, stat, readdir, rename, unlink and rmdir phases
+ * over it. All the threads start a phase together and the phase lasts until the last of them is
+ * done with it.
+ */
+
+namespace {
+	typedef enum {
+		PH_MKDIR,
+		PH_CREATE,
+		PH_STAT,
+		PH_READDIR,
+		PH_RENAME,
+		PH_UNLINK,
+		PH_RMDIR,
+		PH_COUNT,
+	} Phase;
+
+	typedef enum {
+		OF_TABLE,
+		OF_JSON,
+	} OutputFormat;
+
+	struct MDTestOptions {
+		MDTestOptions() : _threads(4), _depth(2), _width(4), _files(16), _fileSize(0), _iterations(1),
+			_format(OF_TABLE) {}
+
+		string _dir;
+		size_t _threads;
+		size_t _depth;
+		size_t _width;
+		size_t _files; // Per leaf directory
+		size_t _fileSize; // In bytes
+		size_t _iterations;
+		OutputFormat _format;
+		string _label;
+	};
+
+	struct PhaseResult {
+		PhaseResult() : _ops(0), _errors(0), _elapsedNanos(0) {}
+
+		void merge(const PhaseResult& other) {
+			_ops += other._ops;
+			_errors += other._errors;
+			_latencies.insert(_latencies.end(), other._latencies.begin(), other._latencies.end());
+		}
+
+		uint64_t _ops;
+		uint64_t _errors;
+		uint64_t _elapsedNanos;
+		vector<uint64_t> _latencies; // In nanos, one per operation
+	};
+
+	const char* phaseToString(Phase phase) {
+		switch (phase) {
+			case PH_MKDIR: return "mkdir";
+			case PH_CREATE: return "create";
+			case PH_STAT: return "stat";
+			case PH_READDIR: return "readdir";
+			case PH_RENAME: return "rename";
+			case PH_UNLINK: return "unlink";
+			case PH_RMDIR: return "rmdir";
+			case PH_COUNT: break;
+		}
+
+		return "unknown";
+	}
+
+	uint64_t nowNanos() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	string childPath(const string& parent, const char* prefix, size_t index) {
+		stringstream ss;
+		ss << parent << "/" << prefix << index;
+		return ss.str();
+	}
+
+	// Returns 0 on success and -errno otherwise, as the file system ops do
+	int syscallStatus(int rc) {
+		return rc ? -errno : 0;
+	}
+
+	/**
+	 * Tree of a single client thread. Directories are kept parents first and the files only go
+	 * into the leaf directories, as with the nested directories of the shell based tests.
+	 */
+	class ClientTree {
+	public:
+		ClientTree(const MDTestOptions& options, const string& root)
+			: _options(options), _root(root), _firstLeaf(0), _fileBuffer(options._fileSize, 'm') {
+			vector<string> level(1, root);
+			for (size_t depth = 0; depth < options._depth; ++depth) {
+				vector<string> nextLevel;
+				for (size_t p = 0; p < level.size(); ++p) {
+					for (size_t w = 0; w < options._width; ++w) {
+						nextLevel.push_back(childPath(level[p], "d", w));
+					}
+				}
+
+				_firstLeaf = _dirs.size();
+				_dirs.insert(_dirs.end(), nextLevel.begin(), nextLevel.end());
+				level.swap(nextLevel);
+			}
+
+			for (size_t l = 0; l < level.size(); ++l) {
+				for (size_t f = 0; f < options._files; ++f) {
+					_files.push_back(childPath(level[l], "f", f));
+				}
+			}
+		}
+
+		const string& getRoot() const { return _root; }
+
+		void run(Phase phase, PhaseResult& result) {
+			switch (phase) {
+				case PH_MKDIR:
+					for (size_t i = 0; i < _dirs.size(); ++i) {
+						uint64_t start = nowNanos();
+						int rc = syscallStatus(mkdir(_dirs[i].c_str(), 0755));
+						record(result, phase, _dirs[i], rc, start);
+					}
+					break;
+				case PH_CREATE:
+					for (size_t i = 0; i < _files.size(); ++i) {
+						uint64_t start = nowNanos();
+						int rc = createFile(_files[i]);
+						record(result, phase, _files[i], rc, start);
+					}
+					break;
+				case PH_STAT:
+					for (size_t i = 0; i < _dirs.size(); ++i) {
+						timeStat(result, _dirs[i], S_IFDIR);
+					}
+
+					for (size_t i = 0; i < _files.size(); ++i) {
+						timeStat(result, _files[i], S_IFREG);
+					}
+					break;
+				case PH_READDIR:
+					timeReaddir(result, _root, _options._depth ? _options._width : _options._files);
+					for (size_t i = 0; i < _dirs.size(); ++i) {
+						timeReaddir(result, _dirs[i], i >= _firstLeaf ? _options._files : _options._width);
+					}
+					break;
+				case PH_RENAME:
+					for (size_t i = 0; i < _files.size(); ++i) {
+						string renamed = _files[i] + ".r";
+						uint64_t start = nowNanos();
+						int rc = syscallStatus(rename(_files[i].c_str(), renamed.c_str()));
+						record(result, phase, _files[i], rc, start);
+					}
+					break;
+				case PH_UNLINK:
+					for (size_t i = 0; i < _files.size(); ++i) {
+						string renamed = _files[i] + ".r";
+						uint64_t start = nowNanos();
+						int rc = syscallStatus(unlink(renamed.c_str()));
+						record(result, phase, renamed, rc, start);
+					}
+					break;
+				case PH_RMDIR:
+					// Children go before their parents
+					for (size_t i = _dirs.size(); i > 0; --i) {
+						uint64_t start = nowNanos();
+						int rc = syscallStatus(rmdir(_dirs[i - 1].c_str()));
+						record(result, phase, _dirs[i - 1], rc, start);
+					}
+					break;
+				case PH_COUNT:
+					break;
+			}
+		}
+
+	private:
+		void record(PhaseResult& result, Phase phase, const string& path, int rc, uint64_t start) {
+			result._latencies.push_back(nowNanos() - start);
+			++result._ops;
+			if (rc) {
+				// Only the first few, a broken mount would flood the output otherwise
+				if (result._errors++ < 10) {
+					cerr << "Operation failed {phase: " << phaseToString(phase) << ", path: " << path
+						<< ", rc: " << rc << "}" << endl;
+				}
+			}
+		}
+
+		// Create includes writing the content and the close, that is where mgridfs flushes
+		int createFile(const string& path) {
+			int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+			if (fd < 0) {
+				return -errno;
+			}
+
+			int rc = 0;
+			if (!_fileBuffer.empty() && write(fd, &_fileBuffer[0], _fileBuffer.size()) != (ssize_t)_fileBuffer.size()) {
+				rc = errno ? -errno : -EIO;
+			}
+
+			if (close(fd) && !rc) {
+				rc = -errno;
+			}
+
+			return rc;
+		}
+
+		void timeStat(PhaseResult& result, const string& path, mode_t type) {
+			struct stat st;
+			uint64_t start = nowNanos();
+			int rc = syscallStatus(stat(path.c_str(), &st));
+			if (!rc && ((st.st_mode & S_IFMT) != type || (type == S_IFREG && (size_t)st.st_size != _options._fileSize))) {
+				rc = -EINVAL;
+			}
+			record(result, PH_STAT, path, rc, start);
+		}
+
+		// Every operation lists the full directory and checks the number of entries in it
+		void timeReaddir(PhaseResult& result, const string& path, size_t expected) {
+			uint64_t start = nowNanos();
+			int rc = 0;
+			DIR* dir = opendir(path.c_str());
+			if (!dir) {
+				rc = -errno;
+			} else {
+				size_t entries = 0;
+				struct dirent* entry = NULL;
+				while ((entry = readdir(dir)) != NULL) {
+					if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+						++entries;
+					}
+				}
+				closedir(dir);
+
+				if (entries != expected) {
+					rc = -EINVAL;
+				}
+			}
+			record(result, PH_READDIR, path, rc, start);
+		}
+
+		const MDTestOptions& _options;
+		string _root;
+		size_t _firstLeaf;
+		vector<string> _dirs;
+		vector<string> _files;
+		vector<char> _fileBuffer;
+	};
+
+	/**
+	 * Runs the phases over the trees of all the clients. Client threads and the coordinating
+	 * thread meet at the barrier at the start and at the end of every phase, which gives the
+	 * wall clock time of the phase across all the clients.
+	 */
+	class MDTestRun {
+	public:
+		MDTestRun(const MDTestOptions& options, const string& runDir)
+			: _barrier(options._threads + 1), _results(options._threads) {
+			for (size_t t = 0; t < options._threads; ++t) {
+				_trees.push_back(new ClientTree(options, childPath(runDir, "client.", t)));
+			}
+		}
+
+		~MDTestRun() {
+			for (size_t t = 0; t < _trees.size(); ++t) {
+				delete _trees[t];
+			}
+		}
+
+		bool createRoots() {
+			for (size_t t = 0; t < _trees.size(); ++t) {
+				if (mkdir(_trees[t]->getRoot().c_str(), 0755)) {
+					cerr << "Failed to create client directory {path: " << _trees[t]->getRoot() << ", rc: " << -errno << "}" << endl;
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		void removeRoots() {
+			for (size_t t = 0; t < _trees.size(); ++t) {
+				rmdir(_trees[t]->getRoot().c_str());
+			}
+		}
+
+		// Adds the results of every phase to the specified ones, indexed by the phase
+		void run(vector<PhaseResult>& phaseResults) {
+			boost::thread_group clients;
+			for (size_t t = 0; t < _trees.size(); ++t) {
+				clients.create_thread(boost::bind(&MDTestRun::runClient, this, t));
+			}
+
+			for (int phase = 0; phase < PH_COUNT; ++phase) {
+				_barrier.wait();
+				uint64_t start = nowNanos();
+				_barrier.wait();
+				phaseResults[phase]._elapsedNanos += nowNanos() - start;
+
+				for (size_t t = 0; t < _results.size(); ++t) {
+					phaseResults[phase].merge(_results[t]);
+					_results[t] = PhaseResult();
+				}
+
+				// Clients wait for the results to be collected before reusing them
+				_barrier.wait();
+			}
+
+			clients.join_all();
+		}
+
+	private:
+		void runClient(size_t client) {
+			for (int phase = 0; phase < PH_COUNT; ++phase) {
+				_barrier.wait();
+				_trees[client]->run((Phase)phase, _results[client]);
+				_barrier.wait();
+				_barrier.wait();
+			}
+		}
+
+		boost::barrier _barrier;
+		vector<ClientTree*> _trees;
+		vector<PhaseResult> _results; // Of the current phase, one per client
+	};
+
+	double percentileMicros(const vector<uint64_t>& sorted, double percentile) {
+		if (sorted.empty()) {
+			return 0;
+		}
+
+		size_t index = (size_t)(percentile * (sorted.size() - 1) + 0.5);
+		return sorted[index] / 1000.0;
+	}
+
+	string jsonEscape(const string& value) {
+		string escaped;
+		for (size_t i = 0; i < value.size(); ++i) {
+			char c = value[i];
+			if (c == '"' || c == '\\') {
+				escaped += '\\';
+				escaped += c;
+			} else if ((unsigned char)c < 0x20) {
+				escaped += ' ';
+			} else {
+				escaped += c;
+			}
+		}
+
+		return escaped;
+	}
+
+	void printHeader(const MDTestOptions& options) {
+		if (options._format != OF_TABLE) {
+			return;
+		}
+
+		cout << left << setw(9) << "phase" << right << setw(9) << "threads" << setw(10) << "ops" << setw(8) << "errors"
+			<< setw(12) << "ops/s" << setw(11) << "p50(us)" << setw(11) << "p99(us)" << setw(11) << "p999(us)"
+			<< setw(11) << "max(us)" << endl;
+	}
+
+	// Tables are meant to be read, JSON lines to be collected and compared across runs
+	void printResult(const MDTestOptions& options, Phase phase, PhaseResult& result, time_t startTime) {
+		sort(result._latencies.begin(), result._latencies.end());
+		double seconds = result._elapsedNanos / 1e9;
+		double opsPerSec = seconds > 0 ? result._ops / seconds : 0;
+		double maxMicros = result._latencies.empty() ? 0 : result._latencies.back() / 1000.0;
+
+		if (options._format == OF_JSON) {
+			cout << fixed << setprecision(2)
+				<< "{\"label\": \"" << jsonEscape(options._label) << "\""
+				<< ", \"startTime\": " << (long long)startTime
+				<< ", \"phase\": \"" << phaseToString(phase) << "\""
+				<< ", \"threads\": " << options._threads
+				<< ", \"depth\": " << options._depth
+				<< ", \"width\": " << options._width
+				<< ", \"files\": " << options._files
+				<< ", \"fileSize\": " << options._fileSize
+				<< ", \"iterations\": " << options._iterations
+				<< ", \"ops\": " << result._ops
+				<< ", \"errors\": " << result._errors
+				<< ", \"seconds\": " << setprecision(6) << seconds
+				<< ", \"opsPerSec\": " << setprecision(2) << opsPerSec
+				<< ", \"p50Micros\": " << percentileMicros(result._latencies, 0.50)
+				<< ", \"p99Micros\": " << percentileMicros(result._latencies, 0.99)
+				<< ", \"p999Micros\": " << percentileMicros(result._latencies, 0.999)
+				<< ", \"maxMicros\": " << maxMicros << "}" << endl;
+			return;
+		}
+
+		cout << left << setw(9) << phaseToString(phase) << right << setw(9) << options._threads
+			<< setw(10) << result._ops << setw(8) << result._errors
+			<< fixed << setprecision(0) << setw(12) << opsPerSec
+			<< setprecision(1) << setw(11) << percentileMicros(result._latencies, 0.50)
+			<< setw(11) << percentileMicros(result._latencies, 0.99)
+			<< setw(11) << percentileMicros(result._latencies, 0.999)
+			<< setw(11) << maxMicros << endl;
+	}
+
+	bool parseCount(const string& value, size_t& count, bool allowZero) {
+		char* end = NULL;
+		unsigned long parsed = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end || (!parsed && !allowZero)) {
+			return false;
+		}
+
+		count = parsed;
+		return true;
+	}
+
+	void printHelp(const char* program) {
+		cout << "usage: " << program << " --dir=<path> [options]" << endl
+			<< endl
+			<< "Metadata benchmark that runs mkdir, create, stat, readdir, rename, unlink and rmdir phases" << endl
+			<< "against a mounted file system." << endl
+			<< endl
+			<< "Options:" << endl
+			<< " --dir=<path>               Directory on the mount to run in, required" << endl
+			<< " --threads=<num>            Client threads, each with its own tree, defaults to 4" << endl
+			<< " --depth=<num>              Levels of directories in every tree, defaults to 2" << endl
+			<< " --width=<num>              Sub-directories of every directory, defaults to 4" << endl
+			<< " --files=<num>              Files in every leaf directory, defaults to 16" << endl
+			<< " --fileSize=<bytes>         Bytes written to every file on create, defaults to 0" << endl
+			<< " --iterations=<num>         Times the phases are repeated, defaults to 1" << endl
+			<< " --format=<table|json>      Output as a table or as one JSON object per phase, defaults to table" << endl
+			<< " --label=<text>             Label included in the JSON output to tell runs apart" << endl
+			<< " --help                     Prints this help" << endl;
+	}
+
+	bool parseOptions(int argc, char* argv[], MDTestOptions& options) {
+		for (int i = 1; i < argc; ++i) {
+			string arg = argv[i];
+			size_t pos = arg.find('=');
+			string name = arg.substr(0, pos);
+			string value = (pos == string::npos) ? "" : arg.substr(pos + 1);
+
+			bool valid = true;
+			if (name == "--dir") {
+				options._dir = value;
+				valid = !value.empty();
+			} else if (name == "--threads") {
+				valid = parseCount(value, options._threads, false);
+			} else if (name == "--depth") {
+				valid = parseCount(value, options._depth, true);
+			} else if (name == "--width") {
+				valid = parseCount(value, options._width, false);
+			} else if (name == "--files") {
+				valid = parseCount(value, options._files, true);
+			} else if (name == "--fileSize") {
+				valid = parseCount(value, options._fileSize, true);
+			} else if (name == "--iterations") {
+				valid = parseCount(value, options._iterations, false);
+			} else if (name == "--format") {
+				if (value == "table") {
+					options._format = OF_TABLE;
+				} else if (value == "json") {
+					options._format = OF_JSON;
+				} else {
+					valid = false;
+				}
+			} else if (name == "--label") {
+				options._label = value;
+			} else {
+				valid = false;
+			}
+
+			if (!valid) {
+				cerr << "Invalid option {option: " << arg << "}" << endl;
+				return false;
+			}
+		}
+
+		if (options._dir.empty()) {
+			cerr << "Missing --dir" << endl;
+			return false;
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char* argv[], char* arge[]) {
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+			printHelp(argv[0]);
+			return 0;
+		}
+	}
+
+	MDTestOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printHelp(argv[0]);
+		return 1;
+	}
+
+	// Every run gets a directory of its own, so that concurrent runs do not collide
+	string runDir = childPath(options._dir, "mdtest.", getpid());
+	if (mkdir(runDir.c_str(), 0755)) {
+		cerr << "Failed to create run directory {path: " << runDir << ", rc: " << -errno << "}" << endl;
+		return 1;
+	}
+
+	time_t startTime = time(NULL);
+	vector<PhaseResult> phaseResults(PH_COUNT);
+	bool failed = false;
+	{
+		MDTestRun run(options, runDir);
+		if (run.createRoots()) {
+			for (size_t iteration = 0; iteration < options._iterations; ++iteration) {
+				run.run(phaseResults);
+			}
+		} else {
+			failed = true;
+		}
+		run.removeRoots();
+	}
+	rmdir(runDir.c_str());
+
+	printHeader(options);
+	for (int phase = 0; phase < PH_COUNT; ++phase) {
+		printResult(options, (Phase)phase, phaseResults[phase], startTime);
+		failed = failed || phaseResults[phase]._errors;
+	}
+
+	return failed ? 1 : 0;
+}
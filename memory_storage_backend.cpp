@@ -0,0 +1,461 @@
+#include "memory_storage_backend.h"
+#include "fs_stats.h"
+#include "fs_logger.h"
+#include "utils.h"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <mongo/util/time_support.h>
+
+using namespace mgridfs;
+using namespace mongo;
+
+namespace {
+	// Chunk size of the stored files, same as the default of GridFS
+	const size_t EMULATED_CHUNK_SIZE = 256 * 1024;
+
+	// Space reported as available in the stats on top of the space in use
+	const long long EMULATED_FREE_SPACE = 16LL * 1024 * 1024 * 1024;
+
+	typedef boost::shared_lock<boost::shared_mutex> ReadLock;
+	typedef boost::unique_lock<boost::shared_mutex> WriteLock;
+
+	typedef map<string, BSONElement> FieldMap;
+
+	// Returns a copy of the object with the fields set the way $set does, field names can be
+	// dotted to set the fields of embedded objects, e.g. metadata.mode
+	BSONObj applySet(const BSONObj& obj, const FieldMap& fields) {
+		FieldMap direct;
+		map<string, FieldMap> nested;
+		for (FieldMap::const_iterator fIt = fields.begin(); fIt != fields.end(); ++fIt) {
+			size_t dot = fIt->first.find('.');
+			if (dot == string::npos) {
+				direct.insert(*fIt);
+			} else {
+				nested[fIt->first.substr(0, dot)].insert(make_pair(fIt->first.substr(dot + 1), fIt->second));
+			}
+		}
+
+		BSONObjBuilder builder;
+		BSONObjIterator oIt(obj);
+		while (oIt.more()) {
+			BSONElement elem = oIt.next();
+			string name = elem.fieldName();
+
+			FieldMap::iterator dIt = direct.find(name);
+			map<string, FieldMap>::iterator nIt = nested.find(name);
+			if (dIt != direct.end()) {
+				builder.appendAs(dIt->second, name);
+				direct.erase(dIt);
+			} else if (nIt != nested.end()) {
+				builder.append(name, applySet(elem.type() == Object ? elem.embeddedObject() : BSONObj(), nIt->second));
+				nested.erase(nIt);
+			} else {
+				builder.append(elem);
+			}
+		}
+
+		// Rest of the fields are not in the object yet
+		for (FieldMap::const_iterator dIt = direct.begin(); dIt != direct.end(); ++dIt) {
+			builder.appendAs(dIt->second, dIt->first);
+		}
+
+		for (map<string, FieldMap>::const_iterator nIt = nested.begin(); nIt != nested.end(); ++nIt) {
+			builder.append(nIt->first, applySet(BSONObj(), nIt->second));
+		}
+
+		return builder.obj();
+	}
+}
+
+MemoryStorageBackend::MemoryStorageBackend(size_t latencyMicros, size_t bandwidthBytesPerSec)
+	: _latencyMicros(latencyMicros), _bandwidthBytesPerSec(bandwidthBytesPerSec), _chunkSize(EMULATED_CHUNK_SIZE),
+	_linkBusyUntilMicros(0) {
+}
+
+MemoryStorageBackend::~MemoryStorageBackend() {
+}
+
+void MemoryStorageBackend::initialize() {
+	info() << "Using in-memory storage emulator, content is lost on unmount {latencyMicros: " << _latencyMicros
+		<< ", bandwidthBytesPerSec: " << _bandwidthBytesPerSec << ", chunkSize: " << _chunkSize << "}" << endl;
+}
+
+void MemoryStorageBackend::roundTrip(size_t bytes) {
+	uint64_t now = FSStats::nowMicros();
+	uint64_t completeAt = now + _latencyMicros;
+	if (_bandwidthBytesPerSec && bytes) {
+		// Transfer starts once the link is done with the ones queued up before it
+		uint64_t transferMicros = (uint64_t)bytes * 1000000 / _bandwidthBytesPerSec;
+		boost::mutex::scoped_lock lock(_linkLock);
+		_linkBusyUntilMicros = max(now, _linkBusyUntilMicros) + transferMicros;
+		completeAt = _linkBusyUntilMicros + _latencyMicros;
+	}
+
+	if (completeAt > now) {
+		boost::this_thread::sleep(boost::posix_time::microseconds(completeAt - now));
+	}
+}
+
+BSONObj MemoryStorageBackend::_findFile(const string& filename) {
+	BSONObj fileObj;
+	{
+		ReadLock lock(_filesLock);
+		StoredFileMap::const_iterator fIt = _filesByName.find(filename);
+		if (fIt != _filesByName.end()) {
+			fileObj = fIt->second->_fileObj;
+		}
+	}
+
+	roundTrip(fileObj.objsize());
+	return fileObj;
+}
+
+void MemoryStorageBackend::_findFiles(const vector<string>& filenames, vector<BSONObj>& files) {
+	size_t bytes = 0;
+	{
+		ReadLock lock(_filesLock);
+		for (vector<string>::const_iterator nIt = filenames.begin(); nIt != filenames.end(); ++nIt) {
+			StoredFileMap::const_iterator fIt = _filesByName.find(*nIt);
+			if (fIt != _filesByName.end()) {
+				files.push_back(fIt->second->_fileObj);
+				bytes += fIt->second->_fileObj.objsize();
+			}
+		}
+	}
+
+	roundTrip(bytes);
+}
+
+void MemoryStorageBackend::_listDirectory(const string& directory, vector<BSONObj>& files, int limit) {
+	size_t bytes = 0;
+	{
+		// Emulates a query without an index on metadata.directory, as GridFS does not create one
+		ReadLock lock(_filesLock);
+		for (StoredFileMap::const_iterator fIt = _filesByName.begin(); fIt != _filesByName.end(); ++fIt) {
+			if (limit && files.size() >= (size_t)limit) {
+				break;
+			}
+
+			const BSONObj& fileObj = fIt->second->_fileObj;
+			if (fileObj.getObjectField("metadata").getStringField("directory") == directory) {
+				files.push_back(fileObj);
+				bytes += fileObj.objsize();
+			}
+		}
+	}
+
+	roundTrip(bytes);
+}
+
+MemoryStorageBackend::StoredFilePtr MemoryStorageBackend::makeStoredFile(const char* data, size_t len) const {
+	StoredFilePtr storedFile(new StoredFile());
+	storedFile->_chunks.reset(new vector<string>());
+	for (size_t offset = 0; offset < len; offset += _chunkSize) {
+		storedFile->_chunks->push_back(string(data + offset, min(_chunkSize, len - offset)));
+	}
+	return storedFile;
+}
+
+BSONObj MemoryStorageBackend::_storeFile(const char* data, size_t len, const string& filename) {
+	StoredFilePtr storedFile = makeStoredFile(data, len);
+	storedFile->_fileObj = BSON("_id" << OID::gen()
+		<< "filename" << filename
+		<< "chunkSize" << (int)_chunkSize
+		<< "uploadDate" << jsTime()
+		<< "length" << (long long)len);
+
+	{
+		WriteLock lock(_filesLock);
+		eraseLocked(filename);
+		_filesByName[filename] = storedFile;
+		_filesById[storedFile->_fileObj["_id"].toString(false)] = storedFile;
+	}
+
+	roundTrip(len);
+	return storedFile->_fileObj;
+}
+
+int MemoryStorageBackend::_removeTree(const string& directory, const RemoveProgress& progress) {
+	int removed = 0;
+	{
+		WriteLock lock(_filesLock);
+		vector<string> filenames;
+		string prefix = directory + "/";
+		for (StoredFileMap::const_iterator fIt = _filesByName.lower_bound(prefix);
+				fIt != _filesByName.end() && !fIt->first.compare(0, prefix.size(), prefix); ++fIt) {
+			filenames.push_back(fIt->first);
+		}
+
+		if (_filesByName.count(directory)) {
+			filenames.push_back(directory);
+		}
+
+		for (vector<string>::const_iterator nIt = filenames.begin(); nIt != filenames.end(); ++nIt) {
+			eraseLocked(*nIt);
+		}
+		removed = filenames.size();
+	}
+
+	roundTrip(0);
+	progress(removed);
+	return removed;
+}
+
+BSONObj MemoryStorageBackend::_storeFileVersion(const char* data, size_t len, const string& filename, const BSONObj& fields) {
+	StoredFilePtr storedFile = makeStoredFile(data, len);
+	BSONObjBuilder fileBuilder;
+	fileBuilder.append("_id", OID::gen());
+	fileBuilder.append("filename", filename);
+	fileBuilder.append("chunkSize", (int)_chunkSize);
+	fileBuilder.append("length", (long long)len);
+	fileBuilder.appendElements(fields);
+	storedFile->_fileObj = fileBuilder.obj();
+
+	{
+		// Current version stays reachable by id for the readers that have its document
+		WriteLock lock(_filesLock);
+		_filesByName[filename] = storedFile;
+		_filesById[storedFile->_fileObj["_id"].toString(false)] = storedFile;
+	}
+
+	roundTrip(len);
+	return storedFile->_fileObj;
+}
+
+BSONObj MemoryStorageBackend::_cloneFileVersion(const BSONObj& srcFileObj, const string& filename, const BSONObj& fields) {
+	StoredFilePtr srcFile;
+	{
+		ReadLock lock(_filesLock);
+		StoredFileMap::const_iterator fIt = _filesById.find(srcFileObj["_id"].toString(false));
+		if (fIt != _filesById.end()) {
+			srcFile = fIt->second;
+		}
+	}
+
+	if (!srcFile) {
+		uasserted(17924, string("Source of the clone is gone {filename: ") + srcFileObj.getStringField("filename") + "}");
+	}
+
+	// Chunk list is shared rather than referred to by chunksId, the clone is fetched by its own _id
+	StoredFilePtr storedFile(new StoredFile());
+	storedFile->_chunks = srcFile->_chunks;
+	BSONObjBuilder fileBuilder;
+	fileBuilder.append("_id", OID::gen());
+	fileBuilder.append("filename", filename);
+	fileBuilder.append(srcFileObj.getField("chunkSize"));
+	fileBuilder.append(srcFileObj.getField("length"));
+	fileBuilder.appendElements(fields);
+	storedFile->_fileObj = fileBuilder.obj();
+
+	{
+		WriteLock lock(_filesLock);
+		_filesByName[filename] = storedFile;
+		_filesById[storedFile->_fileObj["_id"].toString(false)] = storedFile;
+	}
+
+	roundTrip(storedFile->_fileObj.objsize());
+	return storedFile->_fileObj;
+}
+
+int MemoryStorageBackend::_removeStaleVersions(const string& filename, long long currentVersion) {
+	int removed = 0;
+	{
+		WriteLock lock(_filesLock);
+		StoredFileMap::const_iterator nIt = _filesByName.find(filename);
+		for (StoredFileMap::iterator fIt = _filesById.begin(); fIt != _filesById.end(); ++fIt) {
+			bool stale = !fIt->second->_queued && (getVersion(fIt->second->_fileObj) < currentVersion)
+				&& (nIt == _filesByName.end() || nIt->second != fIt->second)
+				&& (fIt->second->_fileObj.getStringField("filename") == filename);
+			if (stale) {
+				queueLocked(fIt->second);
+				++removed;
+			}
+		}
+	}
+
+	roundTrip(0);
+	return removed;
+}
+
+void MemoryStorageBackend::_removeFile(const string& filename) {
+	{
+		WriteLock lock(_filesLock);
+		eraseLocked(filename);
+	}
+
+	roundTrip(0);
+}
+
+int MemoryStorageBackend::_updateFile(const string& filename, const BSONObj& fields) {
+	int updated = 0;
+	{
+		WriteLock lock(_filesLock);
+		StoredFileMap::iterator fIt = _filesByName.find(filename);
+		if (fIt != _filesByName.end()) {
+			updateLocked(fIt->second, fields);
+			updated = 1;
+		}
+	}
+
+	roundTrip(fields.objsize());
+	return updated;
+}
+
+int MemoryStorageBackend::_renamePath(const string& srcPath, const string& destPath, bool isDirectory) {
+	int renamed = 0;
+	{
+		WriteLock lock(_filesLock);
+		StoredFileMap::const_iterator sIt = _filesByName.find(srcPath);
+		if (sIt == _filesByName.end()) {
+			roundTrip(0);
+			return 0;
+		}
+
+		// Collected first, renaming re-keys the files by name
+		StoredFilePtr storedFile = sIt->second;
+		vector<StoredFilePtr> descendants;
+		string srcPrefix = srcPath + "/";
+		for (StoredFileMap::const_iterator fIt = _filesByName.lower_bound(srcPrefix);
+				isDirectory && fIt != _filesByName.end() && !fIt->first.compare(0, srcPrefix.size(), srcPrefix); ++fIt) {
+			descendants.push_back(fIt->second);
+		}
+
+		for (vector<StoredFilePtr>::const_iterator dIt = descendants.begin(); dIt != descendants.end(); ++dIt) {
+			BSONObj fileObj = (*dIt)->_fileObj;
+			updateLocked(*dIt, BSON("filename" << rebasePath(fileObj.getStringField("filename"), srcPath, destPath)
+				<< "metadata.directory" << rebasePath(fileObj.getObjectField("metadata").getStringField("directory"),
+					srcPath, destPath)));
+		}
+		updateLocked(storedFile, BSON("filename" << destPath << "metadata.filename" << getPathBasename(destPath)
+			<< "metadata.directory" << getPathDirname(destPath)));
+		renamed = descendants.size() + 1;
+	}
+
+	roundTrip(0);
+	return renamed;
+}
+
+int MemoryStorageBackend::_resumeRenames() {
+	// Renames complete under the lock, and nothing outlives the process anyway
+	return 0;
+}
+
+void MemoryStorageBackend::_updateFileById(const BSONElement& fileId, const BSONObj& fields) {
+	{
+		WriteLock lock(_filesLock);
+		StoredFileMap::iterator fIt = _filesById.find(fileId.toString(false));
+		if (fIt != _filesById.end()) {
+			updateLocked(fIt->second, fields);
+		}
+	}
+
+	roundTrip(fields.objsize());
+}
+
+int MemoryStorageBackend::_fetchChunks(const BSONObj& fileObj, int firstChunk, int endChunk, const ChunkSink& sink) {
+	StoredFilePtr storedFile;
+	{
+		ReadLock lock(_filesLock);
+		StoredFileMap::const_iterator fIt = _filesById.find(fileObj["_id"].toString(false));
+		if (fIt != _filesById.end()) {
+			storedFile = fIt->second;
+		}
+	}
+
+	if (!storedFile) {
+		roundTrip(0);
+		return 0;
+	}
+
+	const vector<string>& chunks = *storedFile->_chunks;
+	int available = min(endChunk, (int)chunks.size());
+	size_t bytes = 0;
+	for (int chunkNum = firstChunk; chunkNum < available; ++chunkNum) {
+		bytes += chunks[chunkNum].size();
+	}
+	roundTrip(bytes);
+
+	int chunkNum = firstChunk;
+	for (; chunkNum < available; ++chunkNum) {
+		const string& chunk = chunks[chunkNum];
+		if (!sink(chunkNum, chunk.data(), chunk.size())) {
+			break;
+		}
+	}
+
+	return max(chunkNum - firstChunk, 0);
+}
+
+int MemoryStorageBackend::_reapChunks(const Date_t& queuedBefore, int maxChunks) {
+	int reaped = 0;
+	{
+		WriteLock lock(_filesLock);
+		while (!_reapQueue.empty() && _reapQueue.front().first < queuedBefore.millis && reaped < maxChunks) {
+			StoredFileMap::iterator fIt = _filesById.find(_reapQueue.front().second);
+			if (fIt != _filesById.end()) {
+				// Chunks shared with a clone go with the last of the files
+				if (fIt->second->_chunks.unique()) {
+					reaped += fIt->second->_chunks->size();
+				}
+				_filesById.erase(fIt);
+			}
+			_reapQueue.pop_front();
+		}
+	}
+
+	roundTrip(0);
+	return reaped;
+}
+
+BSONObj MemoryStorageBackend::_getStats() {
+	long long objects = 0;
+	long long storageSize = 0;
+	{
+		ReadLock lock(_filesLock);
+		for (StoredFileMap::const_iterator fIt = _filesByName.begin(); fIt != _filesByName.end(); ++fIt) {
+			objects += 1 + fIt->second->_chunks->size();
+			storageSize += fIt->second->_fileObj.getField("length").numberLong();
+		}
+	}
+
+	roundTrip(0);
+	return BSON("objects" << objects << "storageSize" << storageSize << "fileSize" << (storageSize + EMULATED_FREE_SPACE));
+}
+
+void MemoryStorageBackend::eraseLocked(const string& filename) {
+	StoredFileMap::iterator fIt = _filesByName.find(filename);
+	if (fIt == _filesByName.end()) {
+		return;
+	}
+
+	queueLocked(fIt->second);
+	_filesByName.erase(fIt);
+}
+
+void MemoryStorageBackend::queueLocked(const StoredFilePtr& storedFile) {
+	storedFile->_queued = true;
+	_reapQueue.push_back(make_pair((unsigned long long)jsTime().millis, storedFile->_fileObj["_id"].toString(false)));
+}
+
+void MemoryStorageBackend::updateLocked(const StoredFilePtr& storedFile, const BSONObj& fields) {
+	FieldMap fieldMap;
+	BSONObjIterator fIt(fields);
+	while (fIt.more()) {
+		BSONElement elem = fIt.next();
+		fieldMap.insert(make_pair(string(elem.fieldName()), elem));
+	}
+
+	// Documents handed out earlier stay as they are, they are replaced rather than modified
+	string oldFilename = storedFile->_fileObj.getStringField("filename");
+	storedFile->_fileObj = applySet(storedFile->_fileObj, fieldMap);
+
+	// Renamed file replaces any file by the new name
+	string newFilename = storedFile->_fileObj.getStringField("filename");
+	if (newFilename != oldFilename) {
+		_filesByName.erase(oldFilename);
+		eraseLocked(newFilename);
+		_filesByName[newFilename] = storedFile;
+	}
+}
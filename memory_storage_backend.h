@@ -0,0 +1,99 @@
+#ifndef mgridfs_memory_storage_backend_h
+#define mgridfs_memory_storage_backend_h
+
+#include "storage_backend.h"
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+namespace mgridfs {
+
+/**
+ * In-process emulation of GridFS for benchmarking and testing without a mongod.
+ *
+ * Every call is charged one round trip of the configured latency plus the time to transfer its
+ * payload at the configured bandwidth. Transfers of all the threads share the bandwidth as they
+ * would share the link to a server, so both the cost of round trips and of saturating the link
+ * can be modelled deterministically.
+ *
+ * Storing a file under the name of an existing one replaces it, unlike GridFS which keeps both.
+ * Files removed and older versions of a file stay reachable by id until reaped.
+ */
+class MemoryStorageBackend : public StorageBackend {
+public:
+	// Latency is per round trip, a bandwidth of 0 leaves the transfers unlimited
+	MemoryStorageBackend(size_t latencyMicros, size_t bandwidthBytesPerSec);
+	virtual ~MemoryStorageBackend();
+
+	virtual string getName() const { return "memory"; }
+	virtual void initialize();
+
+protected:
+	virtual mongo::BSONObj _findFile(const string& filename);
+	virtual void _findFiles(const vector<string>& filenames, vector<mongo::BSONObj>& files);
+	virtual void _listDirectory(const string& directory, vector<mongo::BSONObj>& files, int limit);
+	virtual mongo::BSONObj _storeFile(const char* data, size_t len, const string& filename);
+	virtual void _removeFile(const string& filename);
+	virtual int _removeTree(const string& directory, const RemoveProgress& progress);
+	virtual mongo::BSONObj _storeFileVersion(const char* data, size_t len, const string& filename,
+		const mongo::BSONObj& fields);
+	virtual mongo::BSONObj _cloneFileVersion(const mongo::BSONObj& srcFileObj, const string& filename,
+		const mongo::BSONObj& fields);
+	virtual int _removeStaleVersions(const string& filename, long long currentVersion);
+	virtual int _reapChunks(const mongo::Date_t& queuedBefore, int maxChunks);
+	virtual int _renamePath(const string& srcPath, const string& destPath, bool isDirectory);
+	virtual int _resumeRenames();
+	virtual int _updateFile(const string& filename, const mongo::BSONObj& fields);
+	virtual void _updateFileById(const mongo::BSONElement& fileId, const mongo::BSONObj& fields);
+	virtual int _fetchChunks(const mongo::BSONObj& fileObj, int firstChunk, int endChunk, const ChunkSink& sink);
+	virtual mongo::BSONObj _getStats();
+
+private:
+	// Chunks are never modified once stored, readers keep using them after the lock is released
+	// and clones share them. The document is replaced under the files lock on updates.
+	typedef boost::shared_ptr<vector<string> > ChunkListPtr;
+	struct StoredFile {
+		StoredFile() : _queued(false) {}
+
+		mongo::BSONObj _fileObj;
+		ChunkListPtr _chunks;
+		bool _queued; // For reaping
+	};
+	typedef boost::shared_ptr<StoredFile> StoredFilePtr;
+	typedef map<string, StoredFilePtr> StoredFileMap;
+
+	size_t _latencyMicros;
+	size_t _bandwidthBytesPerSec;
+	size_t _chunkSize;
+
+	boost::shared_mutex _filesLock;
+	StoredFileMap _filesByName;
+	StoredFileMap _filesById; // Keyed on the string form of the _id, files queued for reaping included
+
+	// Files removed, in the order they were queued for reaping {queued millis, id}
+	deque<pair<unsigned long long, string> > _reapQueue;
+
+	// Time at which the emulated link is done with the transfers queued so far
+	boost::mutex _linkLock;
+	uint64_t _linkBusyUntilMicros;
+
+	// Splits the content into chunks of a new file, the document is up to the caller
+	StoredFilePtr makeStoredFile(const char* data, size_t len) const;
+
+	// Blocks the caller for the duration of a round trip transferring the specified bytes
+	void roundTrip(size_t bytes);
+
+	// Following expect the files lock to be held exclusively by the caller
+	void eraseLocked(const string& filename);
+	void queueLocked(const StoredFilePtr& storedFile);
+	void updateLocked(const StoredFilePtr& storedFile, const mongo::BSONObj& fields);
+};
+
+}
+
+#endif
@@ -0,0 +1,899 @@
+#include "mongo_storage_backend.h"
+#include "chunk_codec.h"
+#include "fs_connection.h"
+#include "fs_options.h"
+#include "fs_logger.h"
+#include "utils.h"
+
+#include <cstring>
+#include <set>
+
+#include <openssl/sha.h>
+
+#include <mongo/client/gridfs.h>
+#include <mongo/client/connpool.h>
+#include <mongo/util/md5.hpp>
+
+using namespace mgridfs;
+using namespace mongo;
+
+namespace {
+	// Chunks of a new version are inserted in batches of about this size
+	const size_t MAX_CHUNK_BATCH_BYTES = 4 * 1024 * 1024;
+
+	// Reaper works through the queue in batches of these many files / chunks
+	const int MAX_REAP_FILES = 64;
+	const int MAX_REAP_CHUNK_BATCH = 256;
+
+	// Files below a renamed / removed directory are moved / removed in batches of these many
+	const int MAX_RENAME_BATCH = 1000;
+	const int MAX_REMOVE_BATCH = 1000;
+
+	// Hashes of a deduplicated version are looked up in batches of these many
+	const size_t MAX_BLOB_LOOKUP_BATCH = 1000;
+
+	// Times the chunks of a deduplicated version reaped during its upload are uploaded again
+	const int MAX_BLOB_UPLOAD_ATTEMPTS = 3;
+
+	// lastRef of a blob is set by the clock of the flushing host and compared against the cut-off
+	// of the reaping host, blobs are kept for this long past the cut-off to allow for the skew
+	const unsigned long long MAX_CLOCK_SKEW_MILLIS = 5 * 60 * 1000;
+
+	// Writes are not acknowledged by themselves, wait on the last one and throw if it failed
+	void checkLastError(DBClientBase& conn, int code, const char* what) {
+		string lastError = conn.getLastError();
+		if (!lastError.empty()) {
+			uasserted(code, string(what) + ": " + lastError);
+		}
+	}
+
+	// Ids of the file documents matching the query, as {_id, chunksId, manifest} objects with
+	// chunksId only for clones and manifest only for deduplicated files, no more than limit of them
+	// if non-zero
+	void findFileIds(DBClientBase& conn, const BSONObj& query, vector<BSONObj>& fileIds, int limit = 0) {
+		BSONObj idFields = BSON("_id" << 1 << "chunksId" << 1 << "manifest" << 1);
+		auto_ptr<DBClientCursor> cursor = conn.query(globalFSOptions._filesNS, query, limit, 0, &idFields);
+		if (!cursor.get()) {
+			uasserted(17908, "Failed to create cursor for finding the file ids");
+		}
+
+		while (cursor->more() && (!limit || fileIds.size() < (size_t)limit)) {
+			fileIds.push_back(cursor->nextSafe().getOwned());
+		}
+	}
+
+	// Anchored regex matching the path itself and any path below it
+	string getSubtreeRegex(const string& path) {
+		string regex = "^";
+		for (string::const_iterator cIt = path.begin(); cIt != path.end(); ++cIt) {
+			if (strchr("\\^$.|?*+()[]{}", *cIt)) {
+				regex += '\\';
+			}
+			regex += *cIt;
+		}
+		return regex + "(/|$)";
+	}
+
+	// Moves the files below the directory, every batch moved takes a query and a single
+	// acknowledgement for all of its updates. Files moved no longer match the query, so that
+	// running it again after an interruption picks up where it stopped.
+	int moveDescendants(DBClientBase& conn, const string& srcPath, const string& destPath) {
+		BSONObjBuilder queryBuilder;
+		queryBuilder.appendRegex("metadata.directory", getSubtreeRegex(srcPath));
+		BSONObj query = queryBuilder.obj();
+		BSONObj pathFields = BSON("filename" << 1 << "metadata.directory" << 1);
+
+		int moved = 0;
+		for (;;) {
+			vector<BSONObj> batch;
+			auto_ptr<DBClientCursor> cursor = conn.query(globalFSOptions._filesNS, query, MAX_RENAME_BATCH, 0, &pathFields);
+			if (!cursor.get()) {
+				uasserted(17916, "Failed to create cursor for the files below the renamed directory");
+			}
+			while (cursor->more() && batch.size() < (size_t)MAX_RENAME_BATCH) {
+				batch.push_back(cursor->nextSafe().getOwned());
+			}
+
+			if (batch.empty()) {
+				return moved;
+			}
+
+			for (vector<BSONObj>::const_iterator bIt = batch.begin(); bIt != batch.end(); ++bIt) {
+				BSONObjBuilder idQuery;
+				idQuery.appendAs(bIt->getField("_id"), "_id");
+				conn.update(globalFSOptions._filesNS, idQuery.obj(), BSON("$set" << BSON(
+					"filename" << StorageBackend::rebasePath(bIt->getStringField("filename"), srcPath, destPath)
+					<< "metadata.directory" << StorageBackend::rebasePath(bIt->getObjectField("metadata").getStringField("directory"),
+						srcPath, destPath))));
+			}
+			checkLastError(conn, 17917, "Failed to move the files below the renamed directory");
+			moved += batch.size();
+		}
+	}
+
+	// Moves the file itself, every version of it, once whatever was below it has been moved
+	int moveFile(DBClientBase& conn, const string& srcPath, const string& destPath) {
+		conn.update(globalFSOptions._filesNS, BSON("filename" << srcPath), BSON("$set" << BSON("filename" << destPath
+			<< "metadata.filename" << getPathBasename(destPath) << "metadata.directory" << getPathDirname(destPath))), false, true);
+		BSONObj errorDetail = conn.getLastErrorDetailed();
+		if (errorDetail.getField("err").type() == String) {
+			uasserted(17918, string("Failed to rename the file: ") + errorDetail.getStringField("err"));
+		}
+		return errorDetail.getIntField("n");
+	}
+
+	// Appends the payload of the chunk / blob, compressed with --compress unless not worth it, in
+	// which case the compression fields are added. Returns whether the payload was compressed.
+	bool appendChunkData(BSONObjBuilder& chunkBuilder, const char* data, size_t len) {
+		string compressed;
+		if (!globalFSOptions._compress || !ChunkCodec::get().compress(data, len, compressed)) {
+			chunkBuilder.appendBinData("data", len, BinDataGeneral, data);
+			return false;
+		}
+
+		chunkBuilder.appendBinData("data", compressed.size(), BinDataGeneral, compressed.data());
+		chunkBuilder.append("compression", ChunkCodec::FORMAT);
+		chunkBuilder.append("rawLength", (int)len);
+		return true;
+	}
+
+	// Payload of the chunk / blob as it was written, inflated into buffer if compressed. Returns
+	// NULL if the payload is missing or corrupt.
+	const char* getChunkData(const BSONObj& chunkObj, int& len, string& buffer) {
+		BSONElement dataElem = chunkObj.getField("data");
+		if (dataElem.type() != BinData) {
+			return NULL;
+		}
+
+		const char* data = dataElem.binDataClean(len);
+		if (!chunkObj.hasField("compression")) {
+			return data;
+		}
+
+		if (strcmp(chunkObj.getStringField("compression"), ChunkCodec::FORMAT)
+				|| !ChunkCodec::get().decompress(data, len, chunkObj.getIntField("rawLength"), buffer)) {
+			return NULL;
+		}
+		len = buffer.size();
+		return buffer.data();
+	}
+
+	// Fields of the files document with metadata.compression set, so that other GridFS readers can
+	// tell. The chunks say whether they are compressed themselves.
+	BSONObj markCompressed(const BSONObj& fields) {
+		BSONObjBuilder fieldsBuilder;
+		BSONObjBuilder metadataBuilder;
+		BSONObjIterator fIt(fields);
+		while (fIt.more()) {
+			BSONElement elem = fIt.next();
+			if (strcmp(elem.fieldName(), "metadata")) {
+				fieldsBuilder.append(elem);
+				continue;
+			}
+
+			BSONObjIterator mIt(elem.embeddedObject());
+			while (mIt.more()) {
+				BSONElement metadataElem = mIt.next();
+				if (strcmp(metadataElem.fieldName(), "compression")) {
+					metadataBuilder.append(metadataElem);
+				}
+			}
+		}
+		metadataBuilder.append("compression", ChunkCodec::FORMAT);
+		fieldsBuilder.append("metadata", metadataBuilder.obj());
+		return fieldsBuilder.obj();
+	}
+
+	string toHex(const unsigned char* digest, size_t len) {
+		static const char HEX_DIGITS[] = "0123456789abcdef";
+		string hex;
+		hex.reserve(len * 2);
+		for (size_t i = 0; i < len; ++i) {
+			hex += HEX_DIGITS[digest[i] >> 4];
+			hex += HEX_DIGITS[digest[i] & 0x0f];
+		}
+		return hex;
+	}
+
+	// Content hash deduplicated chunks are stored under
+	string getChunkHash(const char* data, size_t len) {
+		unsigned char digest[SHA256_DIGEST_LENGTH];
+		SHA256((const unsigned char*)data, len, digest);
+		return toHex(digest, sizeof(digest));
+	}
+
+	BSONObj getLastRef() {
+		BSONObjBuilder lastRefBuilder;
+		lastRefBuilder.appendDate("lastRef", jsTime());
+		return lastRefBuilder.obj();
+	}
+
+	// Sets lastRef on the blobs and returns the ones not on the server in missing. Blobs found are
+	// referred to from now on as far as the reaper is concerned until a manifest does, they have to
+	// be marked before they are looked up for a blob removed in between to be found missing.
+	void markBlobsInUse(DBClientBase& conn, const vector<string>& hashes, const BSONObj& lastRef, set<string>& missing) {
+		BSONObj idFields = BSON("_id" << 1);
+		missing.insert(hashes.begin(), hashes.end());
+		for (size_t first = 0; first < hashes.size(); first += MAX_BLOB_LOOKUP_BATCH) {
+			BSONArrayBuilder hashList;
+			for (size_t i = first; i < hashes.size() && i < first + MAX_BLOB_LOOKUP_BATCH; ++i) {
+				hashList.append(hashes[i]);
+			}
+			BSONObj hashQuery = BSON("_id" << BSON("$in" << hashList.arr()));
+			conn.update(globalFSOptions._blobsNS, hashQuery, BSON("$set" << lastRef), false, true);
+			checkLastError(conn, 17925, "Failed to mark the chunks of the new version in use");
+
+			auto_ptr<DBClientCursor> cursor = conn.query(globalFSOptions._blobsNS, hashQuery, 0, 0, &idFields);
+			if (!cursor.get()) {
+				uasserted(17926, "Failed to create cursor for looking up the chunks of the new version");
+			}
+			while (cursor->more()) {
+				missing.erase(cursor->nextSafe().getStringField("_id"));
+			}
+		}
+	}
+
+	// Upserts the chunks of the content whose hashes are missing, emptying missing, and returns the
+	// bytes uploaded. Upserts rather than inserts, a concurrent flush may store the same content in
+	// the meantime.
+	size_t uploadBlobs(DBClientBase& conn, const char* data, size_t len, size_t chunkSize, const vector<string>& hashes,
+			const BSONObj& lastRef, set<string>& missing) {
+		size_t uploadedBytes = 0;
+		size_t batchBytes = 0;
+		for (size_t offset = 0, chunkNum = 0; offset < len && !missing.empty(); offset += chunkSize, ++chunkNum) {
+			const string& hash = hashes[chunkNum];
+			if (!missing.erase(hash)) {
+				continue;
+			}
+
+			size_t chunkLen = min(chunkSize, len - offset);
+			BSONObjBuilder blobBuilder;
+			blobBuilder.append("_id", hash);
+			appendChunkData(blobBuilder, data + offset, chunkLen);
+			blobBuilder.appendElements(lastRef);
+			conn.update(globalFSOptions._blobsNS, BSON("_id" << hash), blobBuilder.obj(), true);
+
+			uploadedBytes += chunkLen;
+			batchBytes += chunkLen;
+			if (batchBytes >= MAX_CHUNK_BATCH_BYTES) {
+				checkLastError(conn, 17927, "Failed to store the chunks of the new version");
+				batchBytes = 0;
+			}
+		}
+		if (batchBytes) {
+			checkLastError(conn, 17927, "Failed to store the chunks of the new version");
+		}
+
+		return uploadedBytes;
+	}
+
+	// Stores the version as a manifest of content hashes, uploading only the chunks the server does
+	// not have yet, uploadedBytes is set to the bytes of those
+	BSONObj storeManifestVersion(DBClientBase& conn, const char* data, size_t len, size_t chunkSize, const string& filename,
+			const BSONObj& fields, size_t& uploadedBytes) {
+		// md5 of the whole content in the same pass, there is no chunks collection for filemd5 to read
+		vector<string> hashes;
+		md5_state_t md5State;
+		md5_init(&md5State);
+		for (size_t offset = 0; offset < len; offset += chunkSize) {
+			size_t chunkLen = min(chunkSize, len - offset);
+			hashes.push_back(getChunkHash(data + offset, chunkLen));
+			md5_append(&md5State, (const md5_byte_t*)(data + offset), chunkLen);
+		}
+		md5digest md5Digest;
+		md5_finish(&md5State, md5Digest);
+
+		set<string> missing;
+		markBlobsInUse(conn, hashes, getLastRef(), missing);
+
+		// A failure part way leaves blobs that no manifest refers to, the current version is intact.
+		// The blobs reused are marked once more right before the manifest is stored: the upload may
+		// take longer than the gc delay, by when the blobs marked at the start can have been reaped.
+		// Blobs gone by then are uploaded again.
+		uploadedBytes = 0;
+		for (int attempt = 1; ; ++attempt) {
+			uploadedBytes += uploadBlobs(conn, data, len, chunkSize, hashes, getLastRef(), missing);
+			markBlobsInUse(conn, hashes, getLastRef(), missing);
+			if (missing.empty()) {
+				break;
+			}
+
+			if (attempt >= MAX_BLOB_UPLOAD_ATTEMPTS) {
+				uasserted(17930, string("Chunks of the new version keep getting reaped during the upload {filename: ")
+					+ filename + ", missing: " + *missing.begin() + "}");
+			}
+
+			warn() << "Chunks of the new version reaped during the upload, uploading them again {file: " << filename
+				<< ", missing: " << missing.size() << ", attempt: " << attempt << "}" << endl;
+		}
+
+		BSONArrayBuilder manifest;
+		for (vector<string>::const_iterator hIt = hashes.begin(); hIt != hashes.end(); ++hIt) {
+			manifest.append(*hIt);
+		}
+
+		BSONObjBuilder fileBuilder;
+		fileBuilder.append("_id", OID::gen());
+		fileBuilder.append("filename", filename);
+		fileBuilder.append("chunkSize", (int)chunkSize);
+		fileBuilder.append("length", (long long)len);
+		fileBuilder.append("md5", digestToString(md5Digest));
+		fileBuilder.append("manifest", manifest.arr());
+		fileBuilder.appendElements(globalFSOptions._compress ? markCompressed(fields) : fields);
+		BSONObj fileObj = fileBuilder.obj();
+
+		conn.insert(globalFSOptions._filesNS, fileObj);
+		checkLastError(conn, 17907, "Failed to store the document of the new version");
+		return fileObj;
+	}
+
+	// Chunks [firstChunk, endChunk) of a deduplicated file, chunks of the same content are fetched once
+	int fetchManifestChunks(DBClientBase& conn, const BSONElement& manifest, int firstChunk, int endChunk, const ChunkSink& sink) {
+		vector<string> hashes;
+		BSONArrayBuilder hashList;
+		BSONObjIterator mIt(manifest.embeddedObject());
+		for (int chunkNum = 0; mIt.more() && chunkNum < endChunk; ++chunkNum) {
+			BSONElement hash = mIt.next();
+			if (chunkNum >= firstChunk) {
+				hashes.push_back(hash.str());
+				hashList.append(hash.str());
+			}
+		}
+
+		map<string, BSONObj> blobs;
+		auto_ptr<DBClientCursor> cursor = conn.query(globalFSOptions._blobsNS, BSON("_id" << BSON("$in" << hashList.arr())));
+		if (!cursor.get()) {
+			uasserted(17928, "Failed to create cursor for fetching the chunks");
+		}
+		while (cursor->more()) {
+			BSONObj blobObj = cursor->nextSafe().getOwned();
+			blobs[blobObj.getStringField("_id")] = blobObj;
+		}
+
+		int chunkNum = firstChunk;
+		for (vector<string>::const_iterator hIt = hashes.begin(); hIt != hashes.end(); ++hIt, ++chunkNum) {
+			map<string, BSONObj>::const_iterator bIt = blobs.find(*hIt);
+			if (bIt == blobs.end()) {
+				error() << "Encountered missing chunk while fetching chunk range {chunk: " << chunkNum << ", hash: " << *hIt << "}" << endl;
+				break;
+			}
+
+			int chunkLen = 0;
+			string inflated;
+			const char* data = getChunkData(bIt->second, chunkLen, inflated);
+			if (!data || !sink(chunkNum, data, chunkLen)) {
+				break;
+			}
+		}
+
+		return chunkNum - firstChunk;
+	}
+
+	BSONObj getIdQuery(const BSONElement& id) {
+		BSONObjBuilder idQuery;
+		idQuery.appendAs(id, "_id");
+		return idQuery.obj();
+	}
+
+	// Queues the chunks of the files for the reaper before their documents are removed, so that a
+	// failure in between leaves the chunks to be checked by the reaper rather than leaking them.
+	// Chunks shared by a clone are queued on removing either, whichever goes last has them reaped.
+	void queueForReaping(DBClientBase& conn, const vector<BSONObj>& fileIds) {
+		if (fileIds.empty()) {
+			return;
+		}
+
+		Date_t now = jsTime();
+		BSONObjBuilder queued;
+		queued.appendDate("queued", now);
+		BSONObj update = BSON("$set" << queued.obj());
+		BSONObjBuilder blobQueued;
+		blobQueued.appendDate("queued", now);
+		blobQueued.append("blob", true);
+		BSONObj blobUpdate = BSON("$set" << blobQueued.obj());
+		for (vector<BSONObj>::const_iterator fIt = fileIds.begin(); fIt != fileIds.end(); ++fIt) {
+			conn.update(globalFSOptions._gcNS, getIdQuery(fIt->getField("_id")), update, true);
+			if (fIt->hasField("chunksId")) {
+				conn.update(globalFSOptions._gcNS, getIdQuery(fIt->getField("chunksId")), update, true);
+			}
+
+			// Every blob of a deduplicated file, the reaper checks whether other manifests still refer to it
+			set<string> hashes;
+			BSONObjIterator mIt(fIt->getObjectField("manifest"));
+			while (mIt.more()) {
+				string hash = mIt.next().str();
+				if (hashes.insert(hash).second) {
+					conn.update(globalFSOptions._gcNS, BSON("_id" << hash), blobUpdate, true);
+				}
+			}
+		}
+		checkLastError(conn, 17910, "Failed to queue the chunks for removal");
+	}
+
+	// Removes the queued blob unless a manifest still refers to it, returns the blobs removed. A blob
+	// referred to by a flush since the cut-off, less the clock skew allowed, may be about to be in a
+	// manifest, it is checked again later rather than removed.
+	int reapBlob(DBClientBase& conn, const BSONObj& queuedObj, const Date_t& queuedBefore) {
+		BSONObj idQuery = getIdQuery(queuedObj.getField("_id"));
+		BSONObjBuilder manifestQuery;
+		manifestQuery.appendAs(queuedObj.getField("_id"), "manifest");
+		if (!conn.findOne(globalFSOptions._filesNS, manifestQuery.obj()).isEmpty()) {
+			conn.remove(globalFSOptions._gcNS, idQuery);
+			checkLastError(conn, 17915, "Failed to dequeue the removed chunks");
+			return 0;
+		}
+
+		BSONObjBuilder blobQuery;
+		blobQuery.appendElements(idQuery);
+		BSONObjBuilder lastRefBuilder;
+		lastRefBuilder.appendDate("$lt", Date_t(queuedBefore.millis - MAX_CLOCK_SKEW_MILLIS));
+		blobQuery.append("lastRef", lastRefBuilder.obj());
+		conn.remove(globalFSOptions._blobsNS, blobQuery.obj());
+		BSONObj errorDetail = conn.getLastErrorDetailed();
+		int removed = errorDetail.getIntField("n");
+
+		if (removed || conn.findOne(globalFSOptions._blobsNS, idQuery).isEmpty()) {
+			conn.remove(globalFSOptions._gcNS, idQuery);
+		} else {
+			BSONObjBuilder requeued;
+			requeued.appendDate("queued", jsTime());
+			conn.update(globalFSOptions._gcNS, idQuery, BSON("$set" << requeued.obj()));
+		}
+		checkLastError(conn, 17915, "Failed to dequeue the removed chunks");
+		return removed;
+	}
+}
+
+MongoStorageBackend::MongoStorageBackend() {
+}
+
+MongoStorageBackend::~MongoStorageBackend() {
+}
+
+void MongoStorageBackend::initialize() {
+	ScopedDbConnection dbc(globalFSOptions._connectString);
+
+	info() << "Connection to mongodb succeeded {ConnId: " << dbc.conn().getConnectionId()
+		<< ", WireVersion: {Min: " << dbc.conn().getMinWireVersion() << ", Max: " << dbc.conn().getMaxWireVersion() << "}"
+		<< ", IsConnected: " << dbc.conn().isStillConnected() << ", SO-timeout: " << dbc.conn().getSoTimeout()
+		<< ", Type: " << (long)dbc.conn().type() << "}" << std::endl;
+
+	// Chunks queued for removal are reaped in the order they were queued
+	dbc.conn().ensureIndex(globalFSOptions._gcNS, BSON("queued" << 1));
+
+	// Listing directories and renaming them look up the files by their directory
+	dbc.conn().ensureIndex(globalFSOptions._filesNS, BSON("metadata.directory" << 1));
+
+	// Reaper looks for the clones still sharing the chunks of the files removed, and for the
+	// manifests still referring to the blobs of the files removed
+	dbc.conn().ensureIndex(globalFSOptions._filesNS, BSON("chunksId" << 1));
+	dbc.conn().ensureIndex(globalFSOptions._filesNS, BSON("manifest" << 1));
+	dbc.done();
+}
+
+BSONObj MongoStorageBackend::_findFile(const string& filename) {
+	ScopedFSConnection dbc;
+	BSONObj fileObj = dbc->findOne(globalFSOptions._filesNS,
+		Query(BSON("filename" << filename)).sort(BSON("metadata.version" << -1 << "_id" << -1))).getOwned();
+	dbc.done();
+	return fileObj;
+}
+
+void MongoStorageBackend::_findFiles(const vector<string>& filenames, vector<BSONObj>& files) {
+	BSONArrayBuilder filenameList;
+	for (vector<string>::const_iterator fIt = filenames.begin(); fIt != filenames.end(); ++fIt) {
+		filenameList.append(*fIt);
+	}
+
+	ScopedFSConnection dbc;
+	auto_ptr<DBClientCursor> cursor = dbc->query(globalFSOptions._filesNS,
+		Query(BSON("filename" << BSON("$in" << filenameList.arr()))));
+	if (!cursor.get()) {
+		uasserted(17902, "Failed to create cursor for looking up the files");
+	}
+
+	while (cursor->more()) {
+		files.push_back(cursor->nextSafe().getOwned());
+	}
+	dbc.done();
+}
+
+void MongoStorageBackend::_listDirectory(const string& directory, vector<BSONObj>& files, int limit) {
+	ScopedFSConnection dbc;
+	auto_ptr<DBClientCursor> cursor = dbc->query(globalFSOptions._filesNS, BSON("metadata.directory" << directory), limit);
+	if (!cursor.get()) {
+		uasserted(17903, "Failed to create cursor for listing the directory");
+	}
+
+	while (cursor->more()) {
+		files.push_back(cursor->nextSafe().getOwned());
+	}
+	dbc.done();
+}
+
+BSONObj MongoStorageBackend::_storeFile(const char* data, size_t len, const string& filename) {
+	ScopedFSConnection dbc;
+	BSONObj fileObj = dbc.gridFS().storeFile(data, len, filename).getOwned();
+	dbc.done();
+	return fileObj;
+}
+
+void MongoStorageBackend::_removeFile(const string& filename) {
+	ScopedFSConnection dbc;
+	vector<BSONObj> fileIds;
+	findFileIds(dbc.conn(), BSON("filename" << filename), fileIds);
+	queueForReaping(dbc.conn(), fileIds);
+	for (vector<BSONObj>::const_iterator fIt = fileIds.begin(); fIt != fileIds.end(); ++fIt) {
+		dbc->remove(globalFSOptions._filesNS, getIdQuery(fIt->getField("_id")));
+	}
+	if (!fileIds.empty()) {
+		checkLastError(dbc.conn(), 17911, "Failed to remove the file");
+	}
+	dbc.done();
+}
+
+int MongoStorageBackend::_removeTree(const string& directory, const RemoveProgress& progress) {
+	BSONObjBuilder queryBuilder;
+	queryBuilder.appendRegex("metadata.directory", getSubtreeRegex(directory));
+	BSONObj query = queryBuilder.obj();
+
+	// Directory itself last, so that an interrupted removal can be run again on it
+	ScopedFSConnection dbc;
+	int removed = 0;
+	for (bool below = true; ; ) {
+		vector<BSONObj> fileIds;
+		findFileIds(dbc.conn(), below ? query : BSON("filename" << directory), fileIds, MAX_REMOVE_BATCH);
+		if (fileIds.empty()) {
+			if (!below) {
+				break;
+			}
+			below = false;
+			continue;
+		}
+
+		queueForReaping(dbc.conn(), fileIds);
+		BSONArrayBuilder idList;
+		for (vector<BSONObj>::const_iterator fIt = fileIds.begin(); fIt != fileIds.end(); ++fIt) {
+			idList.append(fIt->getField("_id"));
+		}
+		dbc->remove(globalFSOptions._filesNS, BSON("_id" << BSON("$in" << idList.arr())));
+		checkLastError(dbc.conn(), 17922, "Failed to remove the files below the directory");
+
+		removed += fileIds.size();
+		progress(removed);
+	}
+	dbc.done();
+
+	return removed;
+}
+
+BSONObj MongoStorageBackend::_storeFileVersion(const char* data, size_t len, const string& filename, const BSONObj& fields) {
+	ScopedFSConnection dbc;
+	size_t chunkSize = dbc.gridFS().getChunkSize();
+	if (globalFSOptions._dedup) {
+		size_t uploadedBytes = 0;
+		BSONObj fileObj = storeManifestVersion(dbc.conn(), data, len, chunkSize, filename, fields, uploadedBytes);
+		dbc.done();
+
+		debug() << "Stored deduplicated version of the file {file: " << filename << ", length: " << len
+			<< ", uploadedBytes: " << uploadedBytes << "}" << endl;
+		return fileObj;
+	}
+
+	// A failure part way leaves chunks that no document refers to, the current version is intact
+	OID fileId = OID::gen();
+	vector<BSONObj> chunkBatch;
+	size_t batchBytes = 0;
+	int chunkNum = 0;
+	bool compressed = false;
+	md5_state_t md5State;
+	md5_init(&md5State);
+	for (size_t offset = 0; offset < len; offset += chunkSize, ++chunkNum) {
+		size_t chunkLen = min(chunkSize, len - offset);
+		BSONObjBuilder chunkBuilder;
+		chunkBuilder.append("_id", OID::gen());
+		chunkBuilder.append("files_id", fileId);
+		chunkBuilder.append("n", chunkNum);
+		compressed |= appendChunkData(chunkBuilder, data + offset, chunkLen);
+		chunkBatch.push_back(chunkBuilder.obj());
+		if (globalFSOptions._compress) {
+			md5_append(&md5State, (const md5_byte_t*)(data + offset), chunkLen);
+		}
+
+		batchBytes += chunkLen;
+		if (batchBytes >= MAX_CHUNK_BATCH_BYTES || offset + chunkLen >= len) {
+			dbc->insert(globalFSOptions._chunksNS, chunkBatch);
+			checkLastError(dbc.conn(), 17905, "Failed to store the chunks of the new version");
+			chunkBatch.clear();
+			batchBytes = 0;
+		}
+	}
+
+	// filemd5 would hash the compressed payloads, the md5 is of the content as written
+	string md5;
+	if (globalFSOptions._compress) {
+		md5digest md5Digest;
+		md5_finish(&md5State, md5Digest);
+		md5 = digestToString(md5Digest);
+	} else {
+		BSONObj md5Result;
+		if (!dbc->runCommand(globalFSOptions._db, BSON("filemd5" << fileId << "root" << globalFSOptions._collPrefix), md5Result)) {
+			uasserted(17906, "Failed to get the md5 of the new version");
+		}
+		md5 = md5Result.getStringField("md5");
+	}
+
+	BSONObjBuilder fileBuilder;
+	fileBuilder.append("_id", fileId);
+	fileBuilder.append("filename", filename);
+	fileBuilder.append("chunkSize", (int)chunkSize);
+	fileBuilder.append("length", (long long)len);
+	fileBuilder.append("md5", md5);
+	fileBuilder.appendElements(compressed ? markCompressed(fields) : fields);
+	BSONObj fileObj = fileBuilder.obj();
+
+	// Single insert switching the readers over to the new version
+	dbc->insert(globalFSOptions._filesNS, fileObj);
+	checkLastError(dbc.conn(), 17907, "Failed to store the document of the new version");
+	dbc.done();
+
+	return fileObj;
+}
+
+BSONObj MongoStorageBackend::_cloneFileVersion(const BSONObj& srcFileObj, const string& filename, const BSONObj& fields) {
+	BSONObjBuilder fileBuilder;
+	fileBuilder.append("_id", OID::gen());
+	fileBuilder.append("filename", filename);
+	fileBuilder.append(srcFileObj.getField("chunkSize"));
+	fileBuilder.append(srcFileObj.getField("length"));
+	if (srcFileObj.hasField("md5")) {
+		fileBuilder.append(srcFileObj.getField("md5"));
+	}
+
+	// Clone of a deduplicated file is a copy of its manifest, the blobs are shared as they are
+	if (srcFileObj.hasField("manifest")) {
+		fileBuilder.append(srcFileObj.getField("manifest"));
+	} else {
+		fileBuilder.appendAs(getChunksId(srcFileObj), "chunksId");
+	}
+
+	// Shared chunks are compressed as they were stored for the source
+	bool compressed = srcFileObj.getObjectField("metadata").hasField("compression");
+	fileBuilder.appendElements(compressed ? markCompressed(fields) : fields);
+	BSONObj fileObj = fileBuilder.obj();
+
+	ScopedFSConnection dbc;
+	if (srcFileObj.hasField("manifest")) {
+		// Blobs of a source removed in the meantime may be queued already, the reaper has to leave
+		// them alone until the clone refers to them in the same way as for a flush
+		vector<string> hashes;
+		BSONObjIterator mIt(srcFileObj.getObjectField("manifest"));
+		while (mIt.more()) {
+			hashes.push_back(mIt.next().str());
+		}
+
+		set<string> missing;
+		markBlobsInUse(dbc.conn(), hashes, getLastRef(), missing);
+		if (!missing.empty()) {
+			uasserted(17929, string("Chunks of the source of the clone are gone {filename: ")
+				+ srcFileObj.getStringField("filename") + ", missing: " + *missing.begin() + "}");
+		}
+	}
+
+	dbc->insert(globalFSOptions._filesNS, fileObj);
+	checkLastError(dbc.conn(), 17923, "Failed to store the document of the clone");
+	dbc.done();
+
+	return fileObj;
+}
+
+int MongoStorageBackend::_removeStaleVersions(const string& filename, long long currentVersion) {
+	// Files stored before versions were recorded have no metadata.version, which $lt does not match
+	BSONObj staleQuery = BSON("filename" << filename << "$or" << BSON_ARRAY(
+		BSON("metadata.version" << BSON("$lt" << currentVersion))
+		<< BSON("metadata.version" << BSON("$exists" << false))));
+
+	ScopedFSConnection dbc;
+	vector<BSONObj> staleIds;
+	findFileIds(dbc.conn(), staleQuery, staleIds);
+	queueForReaping(dbc.conn(), staleIds);
+	for (vector<BSONObj>::const_iterator sIt = staleIds.begin(); sIt != staleIds.end(); ++sIt) {
+		dbc->remove(globalFSOptions._filesNS, getIdQuery(sIt->getField("_id")));
+	}
+	if (!staleIds.empty()) {
+		checkLastError(dbc.conn(), 17909, "Failed to remove the stale versions");
+	}
+	dbc.done();
+
+	return staleIds.size();
+}
+
+int MongoStorageBackend::_reapChunks(const Date_t& queuedBefore, int maxChunks) {
+	BSONObjBuilder queuedBeforeBuilder;
+	queuedBeforeBuilder.appendDate("$lt", queuedBefore);
+
+	ScopedFSConnection dbc;
+	vector<BSONObj> queuedIds;
+	auto_ptr<DBClientCursor> cursor = dbc->query(globalFSOptions._gcNS,
+		Query(BSON("queued" << queuedBeforeBuilder.obj())).sort(BSON("queued" << 1)), MAX_REAP_FILES);
+	if (!cursor.get()) {
+		uasserted(17912, "Failed to create cursor for the chunks queued for removal");
+	}
+	while (cursor->more()) {
+		queuedIds.push_back(cursor->nextSafe().getOwned());
+	}
+
+	BSONObj idFields = BSON("_id" << 1);
+	int reaped = 0;
+	for (vector<BSONObj>::const_iterator qIt = queuedIds.begin(); qIt != queuedIds.end() && reaped < maxChunks; ++qIt) {
+		if (qIt->getBoolField("blob")) {
+			reaped += reapBlob(dbc.conn(), *qIt, queuedBefore);
+			continue;
+		}
+
+		// Chunks still in use, by a document that was never removed after all (e.g. queued right
+		// before a failure) or by a clone, are dequeued as they are. Removing the last of the
+		// documents queues them again.
+		BSONObjBuilder chunksIdQuery;
+		chunksIdQuery.appendAs(qIt->getField("_id"), "chunksId");
+		BSONObj idQuery = getIdQuery(qIt->getField("_id"));
+		bool done = !dbc->findOne(globalFSOptions._filesNS, Query(BSON("$or" << BSON_ARRAY(idQuery << chunksIdQuery.obj())))).isEmpty();
+
+		BSONObjBuilder chunksQuery;
+		chunksQuery.appendAs(qIt->getField("_id"), "files_id");
+		BSONObj chunksQueryObj = chunksQuery.obj();
+		while (!done && reaped < maxChunks) {
+			int batch = min(maxChunks - reaped, MAX_REAP_CHUNK_BATCH);
+			auto_ptr<DBClientCursor> chunkCursor = dbc->query(globalFSOptions._chunksNS, chunksQueryObj, batch, 0, &idFields);
+			if (!chunkCursor.get()) {
+				uasserted(17913, "Failed to create cursor for the chunks to remove");
+			}
+
+			BSONArrayBuilder chunkIds;
+			int found = 0;
+			while (chunkCursor->more()) {
+				chunkIds.append(chunkCursor->nextSafe().getField("_id"));
+				++found;
+			}
+
+			if (found) {
+				dbc->remove(globalFSOptions._chunksNS, BSON("_id" << BSON("$in" << chunkIds.arr())));
+				checkLastError(dbc.conn(), 17914, "Failed to remove the queued chunks");
+				reaped += found;
+			}
+			done = found < batch;
+		}
+
+		if (done) {
+			dbc->remove(globalFSOptions._gcNS, idQuery);
+			checkLastError(dbc.conn(), 17915, "Failed to dequeue the removed chunks");
+		}
+	}
+	dbc.done();
+
+	return reaped;
+}
+
+int MongoStorageBackend::_renamePath(const string& srcPath, const string& destPath, bool isDirectory) {
+	ScopedFSConnection dbc;
+	if (!isDirectory) {
+		int renamed = moveFile(dbc.conn(), srcPath, destPath);
+		dbc.done();
+		return renamed;
+	}
+
+	OID renameId = OID::gen();
+	dbc->insert(globalFSOptions._renamesNS, BSON("_id" << renameId << "src" << srcPath << "dest" << destPath));
+	checkLastError(dbc.conn(), 17919, "Failed to record the directory rename");
+
+	int renamed = moveDescendants(dbc.conn(), srcPath, destPath);
+	int dirRenamed = moveFile(dbc.conn(), srcPath, destPath);
+	dbc->remove(globalFSOptions._renamesNS, BSON("_id" << renameId));
+	checkLastError(dbc.conn(), 17920, "Failed to complete the directory rename");
+	dbc.done();
+
+	// Nothing renamed if the directory itself was not found, irrespective of what was below it
+	return dirRenamed ? renamed + dirRenamed : 0;
+}
+
+int MongoStorageBackend::_resumeRenames() {
+	ScopedFSConnection dbc;
+	vector<BSONObj> renames;
+	auto_ptr<DBClientCursor> cursor = dbc->query(globalFSOptions._renamesNS, BSONObj());
+	if (!cursor.get()) {
+		uasserted(17921, "Failed to create cursor for the incomplete renames");
+	}
+	while (cursor->more()) {
+		renames.push_back(cursor->nextSafe().getOwned());
+	}
+
+	for (vector<BSONObj>::const_iterator rIt = renames.begin(); rIt != renames.end(); ++rIt) {
+		string srcPath = rIt->getStringField("src");
+		string destPath = rIt->getStringField("dest");
+		int moved = moveDescendants(dbc.conn(), srcPath, destPath);
+		moved += moveFile(dbc.conn(), srcPath, destPath);
+
+		BSONObjBuilder idQuery;
+		idQuery.appendAs(rIt->getField("_id"), "_id");
+		dbc->remove(globalFSOptions._renamesNS, idQuery.obj());
+		checkLastError(dbc.conn(), 17920, "Failed to complete the directory rename");
+		info() << "Completed interrupted directory rename {src: " << srcPath << ", dest: " << destPath
+			<< ", moved: " << moved << "}" << endl;
+	}
+	dbc.done();
+
+	return renames.size();
+}
+
+int MongoStorageBackend::_updateFile(const string& filename, const BSONObj& fields) {
+	// Every version of the file, the current one may well not be the one a single update picks
+	ScopedFSConnection dbc;
+	dbc->update(globalFSOptions._filesNS, BSON("filename" << filename), BSON("$set" << fields), false, true);
+	BSONObj errorDetail = dbc->getLastErrorDetailed();
+	dbc.done();
+
+	return errorDetail.getIntField("n");
+}
+
+void MongoStorageBackend::_updateFileById(const BSONElement& fileId, const BSONObj& fields) {
+	BSONObjBuilder queryBuilder;
+	queryBuilder.appendAs(fileId, "_id");
+
+	ScopedFSConnection dbc;
+	dbc->update(globalFSOptions._filesNS, queryBuilder.obj(), BSON("$set" << fields));
+	dbc.done();
+}
+
+int MongoStorageBackend::_fetchChunks(const BSONObj& fileObj, int firstChunk, int endChunk, const ChunkSink& sink) {
+	ScopedFSConnection dbc;
+	BSONElement manifest = fileObj.getField("manifest");
+	if (!manifest.eoo()) {
+		int fetched = fetchManifestChunks(dbc.conn(), manifest, firstChunk, endChunk, sink);
+		dbc.done();
+		return fetched;
+	}
+
+	BSONObjBuilder queryBuilder;
+	queryBuilder.appendAs(getChunksId(fileObj), "files_id");
+	queryBuilder.append("n", BSON("$gte" << firstChunk << "$lt" << endChunk));
+
+	auto_ptr<DBClientCursor> cursor = dbc->query(globalFSOptions._chunksNS,
+		Query(queryBuilder.obj()).sort(BSON("files_id" << 1 << "n" << 1)));
+	if (!cursor.get()) {
+		uasserted(17901, "Failed to create cursor for fetching the chunks");
+	}
+
+	int expectedChunk = firstChunk;
+	while (cursor->more()) {
+		BSONObj chunkObj = cursor->nextSafe();
+		int chunkNum = chunkObj.getField("n").numberInt();
+		if (chunkNum != expectedChunk) {
+			error() << "Encountered out-of-sequence chunk while fetching chunk range {expected: " << expectedChunk
+				<< ", found: " << chunkNum << "}" << endl;
+			break;
+		}
+
+		int chunkLen = 0;
+		string inflated;
+		const char* data = getChunkData(chunkObj, chunkLen, inflated);
+		if (!data || !sink(chunkNum, data, chunkLen)) {
+			break;
+		}
+		++expectedChunk;
+	}
+	dbc.done();
+
+	return expectedChunk - firstChunk;
+}
+
+BSONObj MongoStorageBackend::_getStats() {
+	BSONObj retInfo;
+	ScopedFSConnection dbc;
+	if (!dbc->runCommand(globalFSOptions._db, BSON("dbstats" << 1), retInfo)) {
+		fatal() << "Failed to get db.stats from server " << retInfo << endl;
+		uasserted(17904, "Failed to get db.stats from server");
+	}
+	dbc.done();
+
+	return retInfo;
+}
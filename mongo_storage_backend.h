@@ -0,0 +1,51 @@
+#ifndef mgridfs_mongo_storage_backend_h
+#define mgridfs_mongo_storage_backend_h
+
+#include "storage_backend.h"
+
+namespace mgridfs {
+
+/**
+ * Files stored in MongoDB GridFS, accessed through the connection of the calling thread
+ *
+ * With --dedup new versions are stored as a manifest instead: the files document lists the
+ * SHA-256 of every chunk, and the chunks are documents {_id: hash, data, lastRef} of the
+ * <collprefix>.blobs collection, one per distinct content. A flush looks the hashes up first and
+ * uploads only the chunks missing. A blob is reaped once no manifest refers to it; a flush
+ * reusing a blob sets its lastRef, and the reaper leaves the blobs referred to within the gc delay
+ * (plus an allowance for the clock skew between the hosts) alone. A flush marks its blobs again
+ * right before storing the manifest and uploads the ones reaped in the meantime again, so that a
+ * manifest is never stored referring to a blob removed under it, however long the upload takes.
+ */
+class MongoStorageBackend : public StorageBackend {
+public:
+	MongoStorageBackend();
+	virtual ~MongoStorageBackend();
+
+	virtual string getName() const { return "mongo"; }
+	virtual void initialize();
+
+protected:
+	virtual mongo::BSONObj _findFile(const string& filename);
+	virtual void _findFiles(const vector<string>& filenames, vector<mongo::BSONObj>& files);
+	virtual void _listDirectory(const string& directory, vector<mongo::BSONObj>& files, int limit);
+	virtual mongo::BSONObj _storeFile(const char* data, size_t len, const string& filename);
+	virtual void _removeFile(const string& filename);
+	virtual int _removeTree(const string& directory, const RemoveProgress& progress);
+	virtual mongo::BSONObj _storeFileVersion(const char* data, size_t len, const string& filename,
+		const mongo::BSONObj& fields);
+	virtual mongo::BSONObj _cloneFileVersion(const mongo::BSONObj& srcFileObj, const string& filename,
+		const mongo::BSONObj& fields);
+	virtual int _removeStaleVersions(const string& filename, long long currentVersion);
+	virtual int _reapChunks(const mongo::Date_t& queuedBefore, int maxChunks);
+	virtual int _renamePath(const string& srcPath, const string& destPath, bool isDirectory);
+	virtual int _resumeRenames();
+	virtual int _updateFile(const string& filename, const mongo::BSONObj& fields);
+	virtual void _updateFileById(const mongo::BSONElement& fileId, const mongo::BSONObj& fields);
+	virtual int _fetchChunks(const mongo::BSONObj& fileObj, int firstChunk, int endChunk, const ChunkSink& sink);
+	virtual mongo::BSONObj _getStats();
+};
+
+}
+
+#endif
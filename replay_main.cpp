@@ -0,0 +1,1008 @@
+#include "fs_trace.h"
+#include "fs_stats.h"
+#include "fs_options.h"
+#include "fs_meta_ops.h"
+#include "file_meta_ops.h"
+#include "dir_meta_ops.h"
+#include "fs_logger.h"
+#include "utils.h"
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/statvfs.h>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <fuse.h>
+
+using namespace std;
+using namespace mgridfs;
+
+/**
+ * Replays a trace recorded with --traceFile, either against a mount with plain syscalls or
+ * through the mgridfs operations directly (local files and storage backend, without fuse).
+ *
+ * Calls are issued at their recorded time scaled by --speed, or as fast as possible with a
+ * speed of 0. Either way a call is only issued once every call that had completed before it
+ * started in the trace has completed in the replay too, so that the calls that depended on
+ * each other are still ordered while the ones that overlapped can overlap again.
+ */
+
+namespace {
+	struct ReplayOptions {
+		ReplayOptions() : _speed(1.0), _threads(8), _prepare(true) {}
+
+		string _trace;
+		string _mount; // Replays through the operations when empty
+		double _speed;
+		size_t _threads;
+		bool _prepare;
+		vector<string> _fsArgs; // Passed on to the mgridfs options for the replay through the operations
+	};
+
+	// Outcome of replaying a record
+	typedef enum {
+		RS_DONE,
+		RS_SKIPPED,
+	} ReplayStatus;
+
+	uint64_t nowMicros() {
+		return FSStats::nowMicros();
+	}
+
+	bool isDirectoryOp(uint16_t op) {
+		return op == FSOP_OPENDIR || op == FSOP_READDIR || op == FSOP_RELEASEDIR || op == FSOP_FSYNCDIR || op == FSOP_RMDIR;
+	}
+
+	bool isFileOp(uint16_t op) {
+		return op == FSOP_OPEN || op == FSOP_READ || op == FSOP_WRITE || op == FSOP_FLUSH || op == FSOP_RELEASE
+			|| op == FSOP_TRUNCATE || op == FSOP_FTRUNCATE || op == FSOP_FSYNC || op == FSOP_FALLOCATE
+			|| op == FSOP_UNLINK || op == FSOP_FGETATTR;
+	}
+
+	// Content written by the replay, the recorded data is not part of the trace
+	void fillWriteBuffer(vector<char>& buffer, size_t len) {
+		if (buffer.size() < len) {
+			size_t oldSize = buffer.size();
+			buffer.resize(len);
+			for (size_t i = oldSize; i < len; ++i) {
+				buffer[i] = (char)('a' + i % 26);
+			}
+		}
+	}
+
+	/**
+	 * Where the calls are replayed, handles recorded in the trace are mapped to the handles of the
+	 * replay. Handles opened before the trace was started are opened on their first use.
+	 */
+	class ReplayTarget : protected boost::noncopyable {
+	public:
+		virtual ~ReplayTarget() {}
+
+		virtual bool initialize() = 0;
+		virtual void shutdown() = 0;
+
+		// Returns the result as the FUSE call would, 0 / bytes on success or -errno
+		virtual int replay(const FSTraceRecord& record, const string& path, const string& path2, vector<char>& buffer,
+			ReplayStatus& status) = 0;
+
+		// Used to create what the trace expects to exist before it starts, failures are ignored
+		virtual void prepareDirectory(const string& path) = 0;
+		virtual void prepareFile(const string& path, off_t size) = 0;
+	};
+
+	class MountTarget : public ReplayTarget {
+	public:
+		MountTarget(const string& mount)
+			: _mount(mount) {
+		}
+
+		virtual bool initialize() {
+			struct stat st;
+			if (stat(_mount.c_str(), &st) || !S_ISDIR(st.st_mode)) {
+				cerr << "Mount point is not a directory {mount: " << _mount << "}" << endl;
+				return false;
+			}
+
+			return true;
+		}
+
+		virtual void shutdown() {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			for (map<uint64_t, int>::iterator fIt = _files.begin(); fIt != _files.end(); ++fIt) {
+				close(fIt->second);
+			}
+			for (map<uint64_t, DIR*>::iterator dIt = _dirs.begin(); dIt != _dirs.end(); ++dIt) {
+				closedir(dIt->second);
+			}
+			_files.clear();
+			_dirs.clear();
+		}
+
+		virtual int replay(const FSTraceRecord& record, const string& tracePath, const string& tracePath2, vector<char>& buffer,
+				ReplayStatus& status) {
+			string path = _mount + tracePath;
+			string path2 = _mount + tracePath2;
+			const char* p = path.c_str();
+			status = RS_DONE;
+
+			switch (record._op) {
+				case FSOP_STATFS: {
+					struct statvfs st;
+					return status0(statvfs(p, &st));
+				}
+				case FSOP_GETATTR: {
+					struct stat st;
+					return status0(lstat(p, &st));
+				}
+				case FSOP_FGETATTR: {
+					struct stat st;
+					int fd = getFile(record, path);
+					return (fd < 0) ? fd : status0(fstat(fd, &st));
+				}
+				case FSOP_CHMOD:
+					return status0(chmod(p, record._mode));
+				case FSOP_CHOWN:
+					return status0(lchown(p, (uid_t)record._offset, (gid_t)record._length));
+				case FSOP_UTIME:
+				case FSOP_UTIMENS:
+					return status0(utimensat(AT_FDCWD, p, NULL, AT_SYMLINK_NOFOLLOW));
+				case FSOP_MKNOD:
+					return status0(mknod(p, record._mode, 0));
+				case FSOP_MKDIR:
+					return status0(mkdir(p, record._mode));
+				case FSOP_RMDIR:
+					return status0(rmdir(p));
+				case FSOP_OPENDIR: {
+					DIR* dir = opendir(p);
+					if (!dir) {
+						return -errno;
+					}
+
+					addDir(record._fileHandle, dir);
+					return 0;
+				}
+				case FSOP_READDIR: {
+					// The whole listing is read with the first readdir of a handle
+					if (record._offset) {
+						return 0;
+					}
+
+					boost::mutex::scoped_lock lock(_handlesLock);
+					DIR* dir = NULL;
+					map<uint64_t, DIR*>::iterator dIt = _dirs.find(record._fileHandle);
+					if (dIt != _dirs.end()) {
+						dir = dIt->second;
+					} else if ((dir = opendir(p)) != NULL) {
+						_dirs[record._fileHandle] = dir;
+					} else {
+						return -errno;
+					}
+
+					rewinddir(dir);
+					while (readdir(dir) != NULL) {
+					}
+					return 0;
+				}
+				case FSOP_RELEASEDIR: {
+					DIR* dir = takeDir(record._fileHandle);
+					return dir ? status0(closedir(dir)) : 0;
+				}
+				case FSOP_READLINK: {
+					buffer.resize(max((size_t)record._length, (size_t)1));
+					ssize_t len = readlink(p, &buffer[0], buffer.size());
+					return (len < 0) ? -errno : 0;
+				}
+				case FSOP_UNLINK:
+					return status0(unlink(p));
+				case FSOP_SYMLINK:
+					return status0(symlink(tracePath.c_str(), path2.c_str()));
+				case FSOP_RENAME:
+					return status0(rename(p, path2.c_str()));
+				case FSOP_CREATE:
+				case FSOP_OPEN: {
+					int flags = record._flags;
+					if (record._op == FSOP_CREATE) {
+						flags |= O_CREAT;
+					}
+
+					int fd = open(p, flags, record._mode);
+					if (fd < 0) {
+						return -errno;
+					}
+
+					addFile(record._fileHandle, fd);
+					return 0;
+				}
+				case FSOP_READ: {
+					int fd = getFile(record, path);
+					if (fd < 0) {
+						return fd;
+					}
+
+					buffer.resize(max((size_t)record._length, buffer.size()));
+					ssize_t len = pread(fd, &buffer[0], record._length, record._offset);
+					return (len < 0) ? -errno : (int)len;
+				}
+				case FSOP_WRITE: {
+					int fd = getFile(record, path);
+					if (fd < 0) {
+						return fd;
+					}
+
+					fillWriteBuffer(buffer, record._length);
+					ssize_t len = pwrite(fd, &buffer[0], record._length, record._offset);
+					return (len < 0) ? -errno : (int)len;
+				}
+				case FSOP_FLUSH: {
+					// Closing a duplicate of the descriptor is what makes the kernel send a flush
+					int fd = getFile(record, path);
+					if (fd < 0) {
+						return fd;
+					}
+
+					int dupFd = dup(fd);
+					return (dupFd < 0) ? -errno : status0(close(dupFd));
+				}
+				case FSOP_RELEASE: {
+					int fd = takeFile(record._fileHandle);
+					return (fd < 0) ? 0 : status0(close(fd));
+				}
+				case FSOP_TRUNCATE:
+					return status0(truncate(p, record._offset));
+				case FSOP_FTRUNCATE: {
+					int fd = getFile(record, path);
+					return (fd < 0) ? fd : status0(ftruncate(fd, record._offset));
+				}
+				case FSOP_FSYNC: {
+					int fd = getFile(record, path);
+					if (fd < 0) {
+						return fd;
+					}
+
+					return status0(record._flags ? fdatasync(fd) : fsync(fd));
+				}
+				case FSOP_FALLOCATE: {
+					int fd = getFile(record, path);
+					return (fd < 0) ? fd : status0(fallocate(fd, record._mode, record._offset, record._length));
+				}
+			}
+
+			// Calls with arguments that are not part of the trace (e.g. xattr names, locks)
+			status = RS_SKIPPED;
+			return 0;
+		}
+
+		virtual void prepareDirectory(const string& path) {
+			mkdir((_mount + path).c_str(), 0755);
+		}
+
+		virtual void prepareFile(const string& path, off_t size) {
+			string fullPath = _mount + path;
+			struct stat st;
+			if (!lstat(fullPath.c_str(), &st)) {
+				return;
+			}
+
+			int fd = open(fullPath.c_str(), O_CREAT | O_WRONLY, 0644);
+			if (fd >= 0) {
+				if (size && ftruncate(fd, size)) {
+					cerr << "Failed to size prepared file {path: " << fullPath << ", errno: " << errno << "}" << endl;
+				}
+				close(fd);
+			}
+		}
+
+	private:
+		static int status0(int rc) {
+			return rc ? -errno : 0;
+		}
+
+		void addFile(uint64_t handle, int fd) {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			map<uint64_t, int>::iterator fIt = _files.find(handle);
+			if (fIt != _files.end()) {
+				close(fIt->second);
+			}
+			_files[handle] = fd;
+		}
+
+		int takeFile(uint64_t handle) {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			map<uint64_t, int>::iterator fIt = _files.find(handle);
+			if (fIt == _files.end()) {
+				return -1;
+			}
+
+			int fd = fIt->second;
+			_files.erase(fIt);
+			return fd;
+		}
+
+		// Descriptor for the handle of the record, opening the file if the handle is not known
+		int getFile(const FSTraceRecord& record, const string& path) {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			map<uint64_t, int>::iterator fIt = _files.find(record._fileHandle);
+			if (fIt != _files.end()) {
+				return fIt->second;
+			}
+
+			int fd = open(path.c_str(), O_RDWR);
+			if (fd < 0) {
+				fd = open(path.c_str(), O_RDONLY);
+			}
+			if (fd < 0) {
+				return -errno;
+			}
+
+			_files[record._fileHandle] = fd;
+			return fd;
+		}
+
+		void addDir(uint64_t handle, DIR* dir) {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			map<uint64_t, DIR*>::iterator dIt = _dirs.find(handle);
+			if (dIt != _dirs.end()) {
+				closedir(dIt->second);
+			}
+			_dirs[handle] = dir;
+		}
+
+		DIR* takeDir(uint64_t handle) {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			map<uint64_t, DIR*>::iterator dIt = _dirs.find(handle);
+			if (dIt == _dirs.end()) {
+				return NULL;
+			}
+
+			DIR* dir = dIt->second;
+			_dirs.erase(dIt);
+			return dir;
+		}
+
+		string _mount;
+		boost::mutex _handlesLock;
+		map<uint64_t, int> _files;
+		map<uint64_t, DIR*> _dirs;
+	};
+
+	int ignoreEntry(void* dirlist, const char* name, const struct stat* st, off_t offset) {
+		return 0;
+	}
+
+	/**
+	 * Replays through the mgridfs operations in-process, to measure a change to the layers below
+	 * fuse without the kernel in the numbers. Runs on the memory backend unless --backend is set.
+	 */
+	class OperationsTarget : public ReplayTarget {
+	public:
+		OperationsTarget(const vector<string>& fsArgs)
+			: _fsArgs(fsArgs) {
+			memset(&_context, 0, sizeof(_context));
+			memset(&_fuseArgs, 0, sizeof(_fuseArgs));
+		}
+
+		virtual bool initialize() {
+			// Arguments are parsed the way mgridfs parses them, the later value wins for repeated ones
+			_argStorage.push_back("mgridfs_replay");
+			_argStorage.push_back("--backend=memory");
+			_argStorage.insert(_argStorage.end(), _fsArgs.begin(), _fsArgs.end());
+			for (size_t i = 0; i < _argStorage.size(); ++i) {
+				_argv.push_back(const_cast<char*>(_argStorage[i].c_str()));
+			}
+
+			_fuseArgs.argc = _argv.size();
+			_fuseArgs.argv = &_argv[0];
+			_fuseArgs.allocated = 0;
+			if (!FSOptions::fromCommandLine(_fuseArgs)) {
+				return false;
+			}
+
+			_context.uid = geteuid();
+			_context.gid = getegid();
+			_context.pid = getpid();
+			_context.umask = 022;
+			setStandaloneContext(&_context);
+
+			mgridfs_init(NULL);
+			return true;
+		}
+
+		virtual void shutdown() {
+			vector<pair<string, struct fuse_file_info> > files;
+			vector<pair<string, struct fuse_file_info> > dirs;
+			{
+				boost::mutex::scoped_lock lock(_handlesLock);
+				for (map<uint64_t, Handle>::iterator hIt = _handles.begin(); hIt != _handles.end(); ++hIt) {
+					(hIt->second._directory ? dirs : files).push_back(make_pair(hIt->second._path, hIt->second._ffinfo));
+				}
+				_handles.clear();
+			}
+
+			for (size_t i = 0; i < files.size(); ++i) {
+				mgridfs_release(files[i].first.c_str(), &files[i].second);
+			}
+			for (size_t i = 0; i < dirs.size(); ++i) {
+				mgridfs_releasedir(dirs[i].first.c_str(), &dirs[i].second);
+			}
+
+			mgridfs_destroy(NULL);
+			setStandaloneContext(NULL);
+			fuse_opt_free_args(&_fuseArgs);
+		}
+
+		virtual int replay(const FSTraceRecord& record, const string& path, const string& path2, vector<char>& buffer,
+				ReplayStatus& status) {
+			const char* p = path.c_str();
+			struct fuse_file_info ffinfo;
+			memset(&ffinfo, 0, sizeof(ffinfo));
+			status = RS_DONE;
+
+			switch (record._op) {
+				case FSOP_STATFS: {
+					struct statvfs st;
+					return mgridfs_statfs(p, &st);
+				}
+				case FSOP_GETATTR: {
+					struct stat st;
+					return mgridfs_getattr(p, &st);
+				}
+				case FSOP_FGETATTR: {
+					struct stat st;
+					int rc = getHandle(record, path, false, ffinfo);
+					return rc ? rc : mgridfs_fgetattr(p, &st, &ffinfo);
+				}
+				case FSOP_CHMOD:
+					return mgridfs_chmod(p, record._mode);
+				case FSOP_CHOWN:
+					return mgridfs_chown(p, (uid_t)record._offset, (gid_t)record._length);
+				case FSOP_UTIME:
+				case FSOP_UTIMENS: {
+					struct timespec tv[2];
+					clock_gettime(CLOCK_REALTIME, &tv[0]);
+					tv[1] = tv[0];
+					return mgridfs_utimens(p, tv);
+				}
+				case FSOP_MKNOD:
+					return mgridfs_mknod(p, record._mode, 0);
+				case FSOP_MKDIR:
+					return mgridfs_mkdir(p, record._mode);
+				case FSOP_RMDIR:
+					return mgridfs_rmdir(p);
+				case FSOP_OPENDIR: {
+					int rc = mgridfs_opendir(p, &ffinfo);
+					if (!rc) {
+						addHandle(record._fileHandle, path, true, ffinfo);
+					}
+					return rc;
+				}
+				case FSOP_READDIR: {
+					int rc = getHandle(record, path, true, ffinfo);
+					return rc ? rc : mgridfs_readdir(p, NULL, ignoreEntry, record._offset, &ffinfo);
+				}
+				case FSOP_RELEASEDIR:
+					return takeHandle(record._fileHandle, ffinfo) ? mgridfs_releasedir(p, &ffinfo) : 0;
+				case FSOP_FSYNCDIR: {
+					int rc = getHandle(record, path, true, ffinfo);
+					return rc ? rc : mgridfs_fsyncdir(p, record._flags, &ffinfo);
+				}
+				case FSOP_READLINK:
+					buffer.resize(max((size_t)record._length, (size_t)1));
+					return mgridfs_readlink(p, &buffer[0], buffer.size());
+				case FSOP_UNLINK:
+					return mgridfs_unlink(p);
+				case FSOP_SYMLINK:
+					return mgridfs_symlink(p, path2.c_str());
+				case FSOP_RENAME:
+					return mgridfs_rename(p, path2.c_str());
+				case FSOP_CREATE:
+				case FSOP_OPEN: {
+					ffinfo.flags = record._flags;
+					int rc = (record._op == FSOP_CREATE) ? mgridfs_create(p, record._mode, &ffinfo) : mgridfs_open(p, &ffinfo);
+					if (!rc) {
+						addHandle(record._fileHandle, path, false, ffinfo);
+					}
+					return rc;
+				}
+				case FSOP_READ: {
+					int rc = getHandle(record, path, false, ffinfo);
+					buffer.resize(max((size_t)record._length, buffer.size()));
+					return rc ? rc : mgridfs_read(p, &buffer[0], record._length, record._offset, &ffinfo);
+				}
+				case FSOP_WRITE: {
+					int rc = getHandle(record, path, false, ffinfo);
+					fillWriteBuffer(buffer, record._length);
+					return rc ? rc : mgridfs_write(p, &buffer[0], record._length, record._offset, &ffinfo);
+				}
+				case FSOP_FLUSH: {
+					int rc = getHandle(record, path, false, ffinfo);
+					return rc ? rc : mgridfs_flush(p, &ffinfo);
+				}
+				case FSOP_RELEASE:
+					return takeHandle(record._fileHandle, ffinfo) ? mgridfs_release(p, &ffinfo) : 0;
+				case FSOP_TRUNCATE:
+					return mgridfs_truncate(p, record._offset);
+				case FSOP_FTRUNCATE: {
+					int rc = getHandle(record, path, false, ffinfo);
+					return rc ? rc : mgridfs_ftruncate(p, record._offset, &ffinfo);
+				}
+				case FSOP_FSYNC: {
+					int rc = getHandle(record, path, false, ffinfo);
+					return rc ? rc : mgridfs_fsync(p, record._flags, &ffinfo);
+				}
+				case FSOP_FALLOCATE: {
+					int rc = getHandle(record, path, false, ffinfo);
+					return rc ? rc : mgridfs_fallocate(p, record._mode, record._offset, record._length, &ffinfo);
+				}
+			}
+
+			status = RS_SKIPPED;
+			return 0;
+		}
+
+		virtual void prepareDirectory(const string& path) {
+			struct stat st;
+			if (mgridfs_getattr(path.c_str(), &st)) {
+				mgridfs_create_directory(path, 0755, _context.uid, _context.gid);
+			}
+		}
+
+		virtual void prepareFile(const string& path, off_t size) {
+			struct stat st;
+			if (!mgridfs_getattr(path.c_str(), &st)) {
+				return;
+			}
+
+			struct fuse_file_info ffinfo;
+			memset(&ffinfo, 0, sizeof(ffinfo));
+			ffinfo.flags = O_CREAT | O_WRONLY;
+			if (!mgridfs_create(path.c_str(), 0644, &ffinfo)) {
+				if (size) {
+					mgridfs_ftruncate(path.c_str(), size, &ffinfo);
+				}
+				mgridfs_release(path.c_str(), &ffinfo);
+			}
+		}
+
+	private:
+		struct Handle {
+			string _path;
+			bool _directory;
+			struct fuse_file_info _ffinfo;
+		};
+
+		void addHandle(uint64_t handle, const string& path, bool directory, const struct fuse_file_info& ffinfo) {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			Handle& entry = _handles[handle];
+			entry._path = path;
+			entry._directory = directory;
+			entry._ffinfo = ffinfo;
+		}
+
+		bool takeHandle(uint64_t handle, struct fuse_file_info& ffinfo) {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			map<uint64_t, Handle>::iterator hIt = _handles.find(handle);
+			if (hIt == _handles.end()) {
+				return false;
+			}
+
+			ffinfo = hIt->second._ffinfo;
+			_handles.erase(hIt);
+			return true;
+		}
+
+		// Handle for the record, opening the file or directory if the handle is not known
+		int getHandle(const FSTraceRecord& record, const string& path, bool directory, struct fuse_file_info& ffinfo) {
+			boost::mutex::scoped_lock lock(_handlesLock);
+			map<uint64_t, Handle>::iterator hIt = _handles.find(record._fileHandle);
+			if (hIt != _handles.end()) {
+				ffinfo = hIt->second._ffinfo;
+				return 0;
+			}
+
+			memset(&ffinfo, 0, sizeof(ffinfo));
+			int rc = 0;
+			if (directory) {
+				rc = mgridfs_opendir(path.c_str(), &ffinfo);
+			} else {
+				ffinfo.flags = O_RDWR;
+				rc = mgridfs_open(path.c_str(), &ffinfo);
+			}
+
+			if (!rc) {
+				Handle& entry = _handles[record._fileHandle];
+				entry._path = path;
+				entry._directory = directory;
+				entry._ffinfo = ffinfo;
+			}
+			return rc;
+		}
+
+		vector<string> _fsArgs;
+		vector<string> _argStorage;
+		vector<char*> _argv;
+		struct fuse_args _fuseArgs;
+		struct fuse_context _context;
+
+		boost::mutex _handlesLock;
+		map<uint64_t, Handle> _handles;
+	};
+
+	struct OpResults {
+		OpResults() : _count(0), _skipped(0), _mismatched(0) {}
+
+		void merge(const OpResults& other) {
+			_count += other._count;
+			_skipped += other._skipped;
+			_mismatched += other._mismatched;
+			_latencies.insert(_latencies.end(), other._latencies.begin(), other._latencies.end());
+			_tracedLatencies.insert(_tracedLatencies.end(), other._tracedLatencies.begin(), other._tracedLatencies.end());
+		}
+
+		uint64_t _count;
+		uint64_t _skipped;
+		uint64_t _mismatched; // Succeeded in the trace and failed in the replay or the other way round
+		vector<uint64_t> _latencies; // In micros
+		vector<uint64_t> _tracedLatencies;
+	};
+
+	class Replayer : protected boost::noncopyable {
+	public:
+		Replayer(const ReplayOptions& options, const FSTraceReader& reader, ReplayTarget& target)
+			: _options(options), _reader(reader), _records(reader.getRecords()), _target(target),
+			_done(_records.size(), 0), _stopping(false), _elapsedMicros(0), _results(options._threads) {
+			_endOrder.reserve(_records.size());
+			for (size_t i = 0; i < _records.size(); ++i) {
+				_endOrder.push_back(i);
+			}
+			sort(_endOrder.begin(), _endOrder.end(), CompareEnd(_records));
+		}
+
+		// Creates the directories and files used by the trace that it does not create itself
+		void prepare() {
+			set<string> created;
+			set<string> directories;
+			map<string, off_t> files;
+			for (size_t i = 0; i < _records.size(); ++i) {
+				const FSTraceRecord& record = _records[i];
+				const string& path = _reader.getPath(record._pathId);
+				if (path.empty()) {
+					continue;
+				}
+
+				if (record._op == FSOP_CREATE || record._op == FSOP_MKDIR || record._op == FSOP_MKNOD) {
+					created.insert(path);
+				} else if (record._op == FSOP_RENAME || record._op == FSOP_SYMLINK) {
+					created.insert(_reader.getPath(record._path2Id));
+				}
+
+				addParents(path, directories);
+				if (record._retCode < 0 || created.count(path)) {
+					continue;
+				}
+
+				if (isDirectoryOp(record._op)) {
+					directories.insert(path);
+				} else if (isFileOp(record._op)) {
+					off_t size = (record._op == FSOP_READ) ? record._offset + record._retCode : 0;
+					off_t& fileSize = files[path];
+					fileSize = max(fileSize, size);
+				}
+			}
+
+			for (set<string>::const_iterator dIt = directories.begin(); dIt != directories.end(); ++dIt) {
+				if (!created.count(*dIt)) {
+					_target.prepareDirectory(*dIt);
+				}
+			}
+
+			for (map<string, off_t>::const_iterator fIt = files.begin(); fIt != files.end(); ++fIt) {
+				_target.prepareFile(fIt->first, fIt->second);
+			}
+
+			info() << "Prepared for the replay {directories: " << directories.size() << ", files: " << files.size() << "}" << endl;
+		}
+
+		void run() {
+			boost::thread_group workers;
+			for (size_t w = 0; w < _options._threads; ++w) {
+				workers.create_thread(boost::bind(&Replayer::runWorker, this, w));
+			}
+
+			uint64_t startMicros = nowMicros();
+			size_t endPos = 0;
+			for (size_t i = 0; i < _records.size(); ++i) {
+				const FSTraceRecord& record = _records[i];
+				{
+					boost::mutex::scoped_lock lock(_lock);
+					while (endPos < _endOrder.size() && endMicros(_records[_endOrder[endPos]]) <= record._startMicros
+							&& _endOrder[endPos] < i) {
+						while (!_done[_endOrder[endPos]]) {
+							_doneCond.wait(lock);
+						}
+						++endPos;
+					}
+				}
+
+				if (_options._speed > 0) {
+					uint64_t dueMicros = startMicros + (uint64_t)(record._startMicros / _options._speed);
+					uint64_t now = nowMicros();
+					if (dueMicros > now) {
+						boost::this_thread::sleep(boost::posix_time::microseconds(dueMicros - now));
+					}
+				}
+
+				boost::mutex::scoped_lock lock(_lock);
+				_queue.push_back(i);
+				_queueCond.notify_one();
+			}
+
+			{
+				boost::mutex::scoped_lock lock(_lock);
+				_stopping = true;
+				_queueCond.notify_all();
+			}
+			workers.join_all();
+			_elapsedMicros = nowMicros() - startMicros;
+		}
+
+		bool report() {
+			OpResults total;
+			OpResults perOp[FSOP_COUNT];
+			for (size_t w = 0; w < _results.size(); ++w) {
+				for (size_t op = 0; op < FSOP_COUNT; ++op) {
+					perOp[op].merge(_results[w][op]);
+				}
+			}
+
+			uint64_t tracedMicros = 0;
+			for (size_t i = 0; i < _records.size(); ++i) {
+				tracedMicros = max(tracedMicros, endMicros(_records[i]));
+			}
+
+			cout << left << setw(12) << "op" << right << setw(10) << "count" << setw(9) << "skipped" << setw(11) << "mismatched"
+				<< setw(14) << "trace p50(us)" << setw(12) << "p50(us)" << setw(14) << "trace p99(us)" << setw(12) << "p99(us)"
+				<< setw(12) << "max(us)" << endl;
+			for (size_t op = 0; op < FSOP_COUNT; ++op) {
+				OpResults& results = perOp[op];
+				if (!results._count) {
+					continue;
+				}
+
+				sort(results._latencies.begin(), results._latencies.end());
+				sort(results._tracedLatencies.begin(), results._tracedLatencies.end());
+				cout << left << setw(12) << FSStats::getOperationName((FSOperation)op) << right << setw(10) << results._count
+					<< setw(9) << results._skipped << setw(11) << results._mismatched
+					<< setw(14) << percentile(results._tracedLatencies, 0.50) << setw(12) << percentile(results._latencies, 0.50)
+					<< setw(14) << percentile(results._tracedLatencies, 0.99) << setw(12) << percentile(results._latencies, 0.99)
+					<< setw(12) << (results._latencies.empty() ? 0 : results._latencies.back()) << endl;
+				total.merge(results);
+			}
+
+			cout << endl << "Replayed " << total._count << " calls {skipped: " << total._skipped << ", mismatched: "
+				<< total._mismatched << ", traceSecs: " << fixed << setprecision(3) << tracedMicros / 1e6
+				<< ", replaySecs: " << _elapsedMicros / 1e6 << "}" << endl;
+			return total._mismatched == 0;
+		}
+
+	private:
+		struct CompareEnd {
+			CompareEnd(const vector<FSTraceRecord>& records) : _records(records) {}
+
+			bool operator()(size_t left, size_t right) const {
+				return endMicros(_records[left]) < endMicros(_records[right]);
+			}
+
+			const vector<FSTraceRecord>& _records;
+		};
+
+		static uint64_t endMicros(const FSTraceRecord& record) {
+			return record._startMicros + record._durationMicros;
+		}
+
+		static uint64_t percentile(const vector<uint64_t>& sorted, double fraction) {
+			return sorted.empty() ? 0 : sorted[(size_t)(fraction * (sorted.size() - 1) + 0.5)];
+		}
+
+		void runWorker(size_t worker) {
+			vector<OpResults>& results = _results[worker];
+			results.resize(FSOP_COUNT);
+			vector<char> buffer;
+
+			while (true) {
+				size_t index = 0;
+				{
+					boost::mutex::scoped_lock lock(_lock);
+					while (_queue.empty() && !_stopping) {
+						_queueCond.wait(lock);
+					}
+
+					if (_queue.empty()) {
+						return;
+					}
+
+					index = _queue.front();
+					_queue.pop_front();
+				}
+
+				const FSTraceRecord& record = _records[index];
+				ReplayStatus status = RS_DONE;
+				uint64_t start = nowMicros();
+				int rc = _target.replay(record, _reader.getPath(record._pathId), _reader.getPath(record._path2Id), buffer, status);
+				uint64_t elapsed = nowMicros() - start;
+
+				if (record._op < FSOP_COUNT) {
+					OpResults& opResults = results[record._op];
+					++opResults._count;
+					if (status == RS_SKIPPED) {
+						++opResults._skipped;
+					} else {
+						opResults._latencies.push_back(elapsed);
+						opResults._tracedLatencies.push_back(record._durationMicros);
+						if ((rc < 0) != (record._retCode < 0) || (rc < 0 && rc != record._retCode)) {
+							++opResults._mismatched;
+							debug() << "Replayed call differs from the trace {op: " << FSStats::getOperationName((FSOperation)record._op)
+								<< ", path: " << _reader.getPath(record._pathId) << ", traced: " << record._retCode
+								<< ", replayed: " << rc << "}" << endl;
+						}
+					}
+				}
+
+				boost::mutex::scoped_lock lock(_lock);
+				_done[index] = 1;
+				_doneCond.notify_all();
+			}
+		}
+
+		void addParents(const string& path, set<string>& directories) {
+			for (size_t pos = path.find('/', 1); pos != string::npos; pos = path.find('/', pos + 1)) {
+				directories.insert(path.substr(0, pos));
+			}
+		}
+
+		const ReplayOptions& _options;
+		const FSTraceReader& _reader;
+		const vector<FSTraceRecord>& _records;
+		ReplayTarget& _target;
+		vector<size_t> _endOrder; // Indexes of the records ordered by their traced end
+
+		boost::mutex _lock;
+		boost::condition_variable _queueCond;
+		boost::condition_variable _doneCond;
+		deque<size_t> _queue;
+		vector<char> _done;
+		bool _stopping;
+		uint64_t _elapsedMicros;
+
+		vector<vector<OpResults> > _results; // Per worker, indexed by the operation
+	};
+
+	void printHelp(const char* program) {
+		cout << "usage: " << program << " --trace=<file> [options] [mgridfs-options]" << endl
+			<< endl
+			<< "Replays a trace recorded by mgridfs with --traceFile." << endl
+			<< endl
+			<< "Options:" << endl
+			<< " --trace=<file>             Trace to replay, required" << endl
+			<< " --mount=<dir>              Replay with syscalls against the mount point, otherwise the calls go" << endl
+			<< "                            straight to the mgridfs operations in-process with the mgridfs-options" << endl
+			<< "                            (e.g. --backend, --memChunkSize), on the memory backend by default" << endl
+			<< " --speed=<factor>           Pacing relative to the trace, 2 replays twice as fast, 0 as fast as the" << endl
+			<< "                            ordering of the calls allows, defaults to 1" << endl
+			<< " --threads=<num>            Calls replayed concurrently at most, defaults to 8" << endl
+			<< " --prepare=<0|1>            Create the files and directories the trace uses without creating them," << endl
+			<< "                            defaults to 1" << endl
+			<< " --help                     Prints this help" << endl;
+	}
+
+	bool parseOptions(int argc, char* argv[], ReplayOptions& options) {
+		for (int i = 1; i < argc; ++i) {
+			string arg = argv[i];
+			size_t pos = arg.find('=');
+			string name = arg.substr(0, pos);
+			string value = (pos == string::npos) ? "" : arg.substr(pos + 1);
+
+			bool valid = true;
+			if (name == "--trace") {
+				options._trace = value;
+				valid = !value.empty();
+			} else if (name == "--mount") {
+				options._mount = value;
+				valid = !value.empty();
+			} else if (name == "--speed") {
+				char* end = NULL;
+				options._speed = strtod(value.c_str(), &end);
+				valid = !value.empty() && !*end && options._speed >= 0;
+			} else if (name == "--threads") {
+				options._threads = strtoul(value.c_str(), NULL, 10);
+				valid = options._threads > 0;
+			} else if (name == "--prepare") {
+				options._prepare = (value != "0");
+			} else {
+				options._fsArgs.push_back(arg);
+			}
+
+			if (!valid) {
+				cerr << "Invalid option {option: " << arg << "}" << endl;
+				return false;
+			}
+		}
+
+		if (options._trace.empty()) {
+			cerr << "Missing --trace" << endl;
+			return false;
+		}
+
+		if (!options._mount.empty() && !options._fsArgs.empty()) {
+			cerr << "mgridfs-options only apply without --mount {option: " << options._fsArgs[0] << "}" << endl;
+			return false;
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char* argv[], char* arge[]) {
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+			printHelp(argv[0]);
+			return 0;
+		}
+	}
+
+	ReplayOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printHelp(argv[0]);
+		return 1;
+	}
+
+	FSTraceReader reader;
+	if (!reader.load(options._trace)) {
+		return 1;
+	}
+	info() << "Loaded trace {file: " << options._trace << ", records: " << reader.getRecords().size() << "}" << endl;
+
+	boost::scoped_ptr<ReplayTarget> target;
+	if (options._mount.empty()) {
+		target.reset(new OperationsTarget(options._fsArgs));
+	} else {
+		target.reset(new MountTarget(options._mount));
+	}
+
+	if (!target->initialize()) {
+		return 1;
+	}
+
+	bool matched = true;
+	{
+		Replayer replayer(options, reader, *target);
+		if (options._prepare) {
+			replayer.prepare();
+		}
+
+		replayer.run();
+		matched = replayer.report();
+	}
+
+	target->shutdown();
+	return matched ? 0 : 1;
+}
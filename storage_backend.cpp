@@ -0,0 +1,239 @@
+#include "storage_backend.h"
+#include "mongo_storage_backend.h"
+#include "memory_storage_backend.h"
+#include "fs_options.h"
+#include "fs_stats.h"
+#include "fs_logger.h"
+
+#include <map>
+
+#include <boost/ref.hpp>
+
+using namespace mgridfs;
+using namespace mongo;
+
+namespace {
+	// Sizes of the documents returned by a call, for the slow operation log
+	size_t getTotalSize(const vector<BSONObj>& files, size_t first) {
+		size_t bytes = 0;
+		for (size_t i = first; i < files.size(); ++i) {
+			bytes += files[i].objsize();
+		}
+		return bytes;
+	}
+
+	// Whether the file document is of a later version than the other, by _id for the same version
+	bool isLaterVersion(const BSONObj& fileObj, const BSONObj& otherObj) {
+		long long version = StorageBackend::getVersion(fileObj);
+		long long otherVersion = StorageBackend::getVersion(otherObj);
+		if (version != otherVersion) {
+			return version > otherVersion;
+		}
+
+		return fileObj.getField("_id").woCompare(otherObj.getField("_id"), false) > 0;
+	}
+
+	// Leaves out all but the current version of the files found more than once, i.e. ones caught
+	// between storing a new version and removing the older ones
+	void dropStaleVersions(vector<BSONObj>& files, size_t first) {
+		map<string, size_t> current;
+		for (size_t i = first; i < files.size(); ++i) {
+			pair<map<string, size_t>::iterator, bool> inserted = current.insert(make_pair(string(files[i].getStringField("filename")), i));
+			if (!inserted.second && isLaterVersion(files[i], files[inserted.first->second])) {
+				inserted.first->second = i;
+			}
+		}
+
+		if (current.size() == files.size() - first) {
+			return;
+		}
+
+		vector<BSONObj> currentFiles(files.begin(), files.begin() + first);
+		for (size_t i = first; i < files.size(); ++i) {
+			if (current[files[i].getStringField("filename")] == i) {
+				currentFiles.push_back(files[i]);
+			}
+		}
+		files.swap(currentFiles);
+	}
+
+	// Passes the chunks on, counting the bytes fetched
+	struct CountingChunkSink {
+		CountingChunkSink(const ChunkSink& sink)
+			: _sink(sink), _bytes(0) {
+		}
+
+		bool operator()(int chunkNum, const char* data, int len) {
+			_bytes += len;
+			return _sink(chunkNum, data, len);
+		}
+
+		const ChunkSink& _sink;
+		uint64_t _bytes;
+	};
+}
+
+boost::scoped_ptr<StorageBackend> StorageBackend::_instance;
+
+StorageBackend::StorageBackend() {
+}
+
+StorageBackend::~StorageBackend() {
+}
+
+bool StorageBackend::create(const string& name) {
+	if (name == "mongo") {
+		_instance.reset(new MongoStorageBackend());
+	} else if (name == "memory") {
+		_instance.reset(new MemoryStorageBackend(globalFSOptions._backendLatencyMicros,
+			globalFSOptions._backendBandwidthKB * 1024));
+	} else {
+		error() << "Unknown storage backend {backend: " << name << "}" << endl;
+		return false;
+	}
+
+	info() << "Created storage backend {backend: " << name << "}" << endl;
+	return true;
+}
+
+StorageBackend& StorageBackend::get() {
+	return *_instance;
+}
+
+BSONObj StorageBackend::findFile(const string& filename) {
+	MongoCallTimer findTimer(MCT_FIND_FILE, "{filename: ?}");
+	BSONObj fileObj = _findFile(filename);
+	findTimer.done(fileObj.isEmpty() ? 0 : 1, fileObj.objsize());
+	return fileObj;
+}
+
+void StorageBackend::findFiles(const vector<string>& filenames, vector<BSONObj>& files) {
+	MongoCallTimer findTimer(MCT_FIND_FILE, "{filename: {$in: [$1 names]}}", filenames.size());
+	size_t filesBefore = files.size();
+	_findFiles(filenames, files);
+	findTimer.done(files.size() - filesBefore, getTotalSize(files, filesBefore));
+	dropStaleVersions(files, filesBefore);
+}
+
+void StorageBackend::listDirectory(const string& directory, vector<BSONObj>& files, int limit) {
+	MongoCallTimer listTimer(MCT_LIST, "{metadata.directory: ?} limit $1", limit);
+	size_t filesBefore = files.size();
+	_listDirectory(directory, files, limit);
+	listTimer.done(files.size() - filesBefore, getTotalSize(files, filesBefore));
+	dropStaleVersions(files, filesBefore);
+}
+
+BSONObj StorageBackend::storeFile(const char* data, size_t len, const string& filename) {
+	MongoCallTimer storeTimer(MCT_STORE_FILE, "gridfs.storeFile {filename: ?}");
+	BSONObj fileObj = _storeFile(data, len, filename);
+	storeTimer.done(1, len);
+	return fileObj;
+}
+
+void StorageBackend::removeFile(const string& filename) {
+	MongoCallTimer removeTimer(MCT_REMOVE_FILE, "{filename: ?} remove, chunks queued");
+	_removeFile(filename);
+	removeTimer.done();
+}
+
+int StorageBackend::removeTree(const string& directory, const RemoveProgress& progress) {
+	MongoCallTimer removeTimer(MCT_REMOVE_FILE, "{metadata.directory: /^?/} remove batched, chunks queued");
+	int removed = _removeTree(directory, progress);
+	removeTimer.done(removed);
+	return removed;
+}
+
+BSONObj StorageBackend::storeFileVersion(const char* data, size_t len, const string& filename, const BSONObj& fields) {
+	MongoCallTimer storeTimer(MCT_STORE_FILE, "{files_id: ?} insert chunks, {filename: ?} insert");
+	BSONObj fileObj = _storeFileVersion(data, len, filename, fields);
+	storeTimer.done(1, len);
+	return fileObj;
+}
+
+BSONObj StorageBackend::cloneFileVersion(const BSONObj& srcFileObj, const string& filename, const BSONObj& fields) {
+	MongoCallTimer cloneTimer(MCT_STORE_FILE, "{filename: ?, chunksId: ?} insert");
+	BSONObj fileObj = _cloneFileVersion(srcFileObj, filename, fields);
+	cloneTimer.done(1, fileObj.objsize());
+	return fileObj;
+}
+
+int StorageBackend::removeStaleVersions(const string& filename, long long currentVersion) {
+	MongoCallTimer removeTimer(MCT_REMOVE_FILE, "{filename: ?, metadata.version: {$lt: ?}} remove, chunks queued");
+	int removed = _removeStaleVersions(filename, currentVersion);
+	removeTimer.done(removed);
+	return removed;
+}
+
+int StorageBackend::reapChunks(const Date_t& queuedBefore, int maxChunks) {
+	MongoCallTimer reapTimer(MCT_REMOVE_FILE, "{files_id: {$in: [...]}} remove, max $1 chunks", maxChunks);
+	int reaped = _reapChunks(queuedBefore, maxChunks);
+	reapTimer.done(reaped);
+	return reaped;
+}
+
+long long StorageBackend::getVersion(const BSONObj& fileObj) {
+	BSONElement version = fileObj.getObjectField("metadata").getField("version");
+	return version.isNumber() ? version.numberLong() : 0;
+}
+
+int StorageBackend::renamePath(const string& srcPath, const string& destPath, bool isDirectory) {
+	MongoCallTimer renameTimer(MCT_UPDATE, "{metadata.directory: /^?/} {$set: {filename, metadata.directory}} batched, dir $1",
+		isDirectory);
+	int renamed = _renamePath(srcPath, destPath, isDirectory);
+	renameTimer.done(renamed);
+	return renamed;
+}
+
+int StorageBackend::resumeRenames() {
+	MongoCallTimer resumeTimer(MCT_UPDATE, "renames {} resume");
+	int resumed = _resumeRenames();
+	resumeTimer.done(resumed);
+	return resumed;
+}
+
+BSONElement StorageBackend::getChunksId(const BSONObj& fileObj) {
+	BSONElement chunksId = fileObj.getField("chunksId");
+	return chunksId.eoo() ? fileObj.getField("_id") : chunksId;
+}
+
+string StorageBackend::rebasePath(const string& path, const string& srcPath, const string& destPath) {
+	if (path == srcPath) {
+		return destPath;
+	} else if (path.size() > srcPath.size() && path[srcPath.size()] == '/' && !path.compare(0, srcPath.size(), srcPath)) {
+		return destPath + path.substr(srcPath.size());
+	}
+	return path;
+}
+
+int StorageBackend::updateFile(const string& filename, const BSONObj& fields) {
+	MongoCallTimer updateTimer(MCT_UPDATE, "{filename: ?} {$set: {$1 fields}}", fields.nFields());
+	int updated = _updateFile(filename, fields);
+	updateTimer.done(updated, fields.objsize());
+	return updated;
+}
+
+void StorageBackend::updateFileById(const BSONElement& fileId, const BSONObj& fields) {
+	MongoCallTimer updateTimer(MCT_UPDATE, "{_id: ?} {$set: {$1 fields}} unacknowledged", fields.nFields());
+	_updateFileById(fileId, fields);
+	updateTimer.done(0, fields.objsize());
+}
+
+int StorageBackend::fetchChunks(const BSONObj& fileObj, int firstChunk, int endChunk, const ChunkSink& sink) {
+	if (firstChunk >= endChunk) {
+		return 0;
+	}
+
+	MongoCallTimer chunkTimer(MCT_GET_CHUNK, fileObj.hasField("manifest") ? "{_id: {$in: manifest[$1, $2)}} blobs"
+		: "{files_id: ?, n: {$gte: $1, $lt: $2}}", firstChunk, endChunk);
+	CountingChunkSink countingSink(sink);
+	int fetched = _fetchChunks(fileObj, firstChunk, endChunk, boost::ref(countingSink));
+	chunkTimer.done(fetched, countingSink._bytes);
+	return fetched;
+}
+
+BSONObj StorageBackend::getStats() {
+	MongoCallTimer statsTimer(MCT_DBSTATS, "{dbstats: 1}");
+	BSONObj stats = _getStats();
+	statsTimer.done(1, stats.objsize());
+	return stats;
+}
@@ -0,0 +1,164 @@
+#ifndef mgridfs_storage_backend_h
+#define mgridfs_storage_backend_h
+
+#include <string>
+#include <vector>
+
+#include <boost/utility.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <mongo/client/dbclient.h>
+
+using namespace std;
+
+namespace mgridfs {
+
+// Receives the fetched chunks in order {chunkNumber, data, length}, returns false to stop fetching
+typedef boost::function<bool (int, const char*, int)> ChunkSink;
+
+// Receives the number of files removed so far by a subtree removal, after every batch
+typedef boost::function<void (int)> RemoveProgress;
+
+/**
+ * Storage for the files and their content that all the file system operations go through.
+ *
+ * Files are described by documents in the layout of the GridFS files collection, i.e.
+ * {_id, filename, length, chunkSize, uploadDate, metadata: {...}}, irrespective of the backend
+ * and the content is addressed in chunks of the chunkSize of the file. Failures are reported
+ * by throwing DBException as the mongo client does.
+ *
+ * Content is replaced by storing a new version of the file under a new _id. A file has more
+ * than one version, i.e. document of the same filename, only until the older ones are removed;
+ * the one of the highest metadata.version is the current one and the only one found by name.
+ * Flushes of the same file racing on different mounts can store the same version, the one of the
+ * highest _id is the current one among those.
+ *
+ * A clone shares the chunks of the file it was cloned from, its document refers to them by
+ * chunksId. Chunks are addressed by getChunksId() of the document for that reason, and are
+ * reaped only once no document refers to them.
+ *
+ * Files stored with --dedup have no chunks of their own, their document lists the content hashes
+ * of their chunks in manifest and the chunks are stored once per distinct content, shared by all
+ * the files (see MongoStorageBackend). Readers need not know the difference, chunks are fetched
+ * by the file document.
+ *
+ * The public calls are timed for the stats, the backends implement the protected ones.
+ */
+class StorageBackend : protected boost::noncopyable {
+public:
+	virtual ~StorageBackend();
+
+	// Creates the backend by name (mongo / memory), has to be done before get() is used
+	static bool create(const string& name);
+	static StorageBackend& get();
+
+	virtual string getName() const = 0;
+
+	// Verifies that the backend can be used, called once before the file system is mounted
+	virtual void initialize() = 0;
+
+	// Returns the file document, or an empty object if there is no such file
+	mongo::BSONObj findFile(const string& filename);
+
+	// Looks up multiple files with a single round trip, files not found are left out
+	void findFiles(const vector<string>& filenames, vector<mongo::BSONObj>& files);
+
+	// Documents of the entries in the directory, no more than limit of them if it is non-zero
+	void listDirectory(const string& directory, vector<mongo::BSONObj>& files, int limit = 0);
+
+	// Stores a new file with the specified content and returns its document
+	mongo::BSONObj storeFile(const char* data, size_t len, const string& filename);
+
+	// Removes the documents of the file right away, the chunks are queued for reapChunks
+	void removeFile(const string& filename);
+
+	// Stores the content as a new version of the file with the fields, e.g. {uploadDate, metadata},
+	// in its document and returns the document. The document is written once all of the chunks
+	// have been, which is when finding the file starts returning the new version. Fetching the
+	// chunks of the older versions keeps working until they are reaped.
+	mongo::BSONObj storeFileVersion(const char* data, size_t len, const string& filename, const mongo::BSONObj& fields);
+
+	// Removes the directory and every file below it in batches, each a query on metadata.directory
+	// and a single remove of the documents found, with the chunks queued in the same way as
+	// removeFile. Returns the number of documents removed.
+	int removeTree(const string& directory, const RemoveProgress& progress);
+
+	// Stores a new version of the file sharing the chunks of the source file document, in the same
+	// way as storeFileVersion otherwise. Nothing is copied on the server, a later version of
+	// either file is stored in chunks of its own.
+	mongo::BSONObj cloneFileVersion(const mongo::BSONObj& srcFileObj, const string& filename, const mongo::BSONObj& fields);
+
+	// Removes the versions of the file older than the specified metadata.version, queueing their
+	// chunks for reapChunks in the same way as removeFile. Versions stored concurrently with the
+	// same or a later version are left for a later flush, never does a flush remove the version of
+	// another. Returns the number of versions removed.
+	int removeStaleVersions(const string& filename, long long currentVersion);
+
+	// Removes the chunks of the files queued for removal before the specified time, oldest first
+	// and no more than maxChunks of them. Files are dequeued once all of their chunks are gone,
+	// the queue is kept on the server and survives restarts. Returns the chunks removed.
+	int reapChunks(const mongo::Date_t& queuedBefore, int maxChunks);
+
+	// metadata.version of the file document, 0 for files stored before versions were recorded
+	static long long getVersion(const mongo::BSONObj& fileObj);
+
+	// Id the chunks of the file document are stored under, its own _id unless it is a clone
+	static mongo::BSONElement getChunksId(const mongo::BSONObj& fileObj);
+
+	// Path of the file moved from below srcPath to below destPath, other paths are left as they are
+	static string rebasePath(const string& path, const string& srcPath, const string& destPath);
+
+	// Renames the file and, for a directory, every file below it by rewriting their paths. The
+	// files below are moved in batches, each a query on metadata.directory and pipelined updates.
+	// A directory rename is recorded on the server before anything is moved, and one interrupted
+	// by a crash is completed by resumeRenames. Returns the number of documents renamed.
+	int renamePath(const string& srcPath, const string& destPath, bool isDirectory);
+
+	// Completes the directory renames left incomplete, called before the file system is mounted.
+	// Returns the number of renames completed.
+	int resumeRenames();
+
+	// Sets the fields, e.g. {"metadata.mode": 0644}, on the file. Updates by name apply to all the
+	// versions of the file, are acknowledged and return the number of documents updated, updates
+	// by id are not waited upon.
+	int updateFile(const string& filename, const mongo::BSONObj& fields);
+	void updateFileById(const mongo::BSONElement& fileId, const mongo::BSONObj& fields);
+
+	// Fetches the chunks [firstChunk, endChunk) of the file document with a single round trip.
+	// Returns the number of chunks passed on to the sink, callers should compare it with the
+	// expected count to detect missing chunks.
+	int fetchChunks(const mongo::BSONObj& fileObj, int firstChunk, int endChunk, const ChunkSink& sink);
+
+	// Usage of the storage in the layout of the dbstats command, i.e. {objects, storageSize, fileSize}
+	mongo::BSONObj getStats();
+
+protected:
+	StorageBackend();
+
+	virtual mongo::BSONObj _findFile(const string& filename) = 0;
+	virtual void _findFiles(const vector<string>& filenames, vector<mongo::BSONObj>& files) = 0;
+	virtual void _listDirectory(const string& directory, vector<mongo::BSONObj>& files, int limit) = 0;
+	virtual mongo::BSONObj _storeFile(const char* data, size_t len, const string& filename) = 0;
+	virtual void _removeFile(const string& filename) = 0;
+	virtual int _removeTree(const string& directory, const RemoveProgress& progress) = 0;
+	virtual mongo::BSONObj _storeFileVersion(const char* data, size_t len, const string& filename,
+		const mongo::BSONObj& fields) = 0;
+	virtual mongo::BSONObj _cloneFileVersion(const mongo::BSONObj& srcFileObj, const string& filename,
+		const mongo::BSONObj& fields) = 0;
+	virtual int _removeStaleVersions(const string& filename, long long currentVersion) = 0;
+	virtual int _reapChunks(const mongo::Date_t& queuedBefore, int maxChunks) = 0;
+	virtual int _renamePath(const string& srcPath, const string& destPath, bool isDirectory) = 0;
+	virtual int _resumeRenames() = 0;
+	virtual int _updateFile(const string& filename, const mongo::BSONObj& fields) = 0;
+	virtual void _updateFileById(const mongo::BSONElement& fileId, const mongo::BSONObj& fields) = 0;
+	virtual int _fetchChunks(const mongo::BSONObj& fileObj, int firstChunk, int endChunk, const ChunkSink& sink) = 0;
+	virtual mongo::BSONObj _getStats() = 0;
+
+private:
+	static boost::scoped_ptr<StorageBackend> _instance;
+};
+
+}
+
+#endif
@@ -3,9 +3,17 @@
 #include <libgen.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
 
 using namespace mgridfs;
 
+namespace {
+	struct fuse_context* standaloneContext = NULL;
+}
+
 string mgridfs::getPathBasename(const string& path) {
 	char* pathTemp = strdup(path.c_str());
 	char* baseName = basename(pathTemp);
@@ -42,3 +50,32 @@ char* mgridfs::toUpper(char* str) {
 unsigned long mgridfs::get512BlockCount(unsigned long size) {
 	return ((size + 511) / 512);
 }
+
+struct fuse_context* mgridfs::getRequestContext() {
+	return standaloneContext ? standaloneContext : fuse_get_context();
+}
+
+void mgridfs::setStandaloneContext(struct fuse_context* context) {
+	standaloneContext = context;
+}
+
+bool mgridfs::isMountOwnerRequest() {
+	uid_t uid = getRequestContext()->uid;
+	return uid == 0 || uid == getuid();
+}
+
+bool mgridfs::hasRequestAccess(const struct stat& fileStat, int mask) {
+	fuse_context* fuseContext = getRequestContext();
+	if (fuseContext->uid == 0) {
+		return true;
+	}
+
+	// Mask bits are those of the other class, shifted up for the owner / group
+	mode_t granted = fileStat.st_mode;
+	if (fuseContext->uid == fileStat.st_uid) {
+		granted >>= 6;
+	} else if (fuseContext->gid == fileStat.st_gid) {
+		granted >>= 3;
+	}
+	return (granted & mask & 07) == (mode_t)(mask & 07);
+}
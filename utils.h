@@ -5,6 +5,9 @@
 
 using namespace std;
 
+struct fuse_context;
+struct stat;
+
 namespace mgridfs {
 
 string getPathBasename(const string& path);
@@ -14,6 +17,19 @@ char* toUpper(char* str);
 
 unsigned long get512BlockCount(unsigned long size);
 
+// Context of the FUSE request being served by the calling thread. Tools calling the operations
+// outside of a fuse session (e.g. the trace replay) set a context to be used by all threads instead.
+struct fuse_context* getRequestContext();
+void setStandaloneContext(struct fuse_context* context);
+
+// Whether the caller of the request is the user the file system is mounted by, or root
+bool isMountOwnerRequest();
+
+// Whether the caller of the request has the access (R_OK | W_OK | X_OK) to the file of the stats,
+// by the owner / group / other bits of its mode, root always does. Only the primary group of the
+// caller is known through FUSE 2.6.
+bool hasRequestAccess(const struct stat& fileStat, int mask);
+
 }
 
 #endif
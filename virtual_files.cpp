@@ -0,0 +1,172 @@
+#include "virtual_files.h"
+#include "file_handle.h"
+#include "fs_stats.h"
+#include "fs_logger.h"
+#include "fs_control.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+
+using namespace mgridfs;
+
+const string mgridfs::VIRTUAL_DIR = "/.mgridfs";
+
+namespace {
+	// Mount time is reported as the times of all the virtual files
+	const time_t mountTime = time(NULL);
+
+	void fillStat(struct stat* fileStat, mode_t mode, size_t size) {
+		bzero(fileStat, sizeof(*fileStat));
+		fileStat->st_mode = mode;
+		fileStat->st_nlink = S_ISDIR(mode) ? 2 : 1;
+		fileStat->st_uid = getuid();
+		fileStat->st_gid = getgid();
+		fileStat->st_size = size;
+		fileStat->st_ctime = fileStat->st_mtime = fileStat->st_atime = mountTime;
+	}
+}
+
+VirtualFile::VirtualFile(const string& content)
+	: _content(content) {
+}
+
+VirtualFile::~VirtualFile() {
+}
+
+int VirtualFile::read(char* data, size_t len, off_t offset) const {
+	if (offset < 0 || (size_t)offset >= _content.size()) {
+		return 0;
+	}
+
+	size_t bytesRead = min(len, _content.size() - offset);
+	memcpy(data, _content.data() + offset, bytesRead);
+	return bytesRead;
+}
+
+int VirtualFile::write(const char* data, size_t len, off_t offset) {
+	return -EBADF;
+}
+
+CommandVirtualFile::CommandVirtualFile(const string& content, const CommandHandler& handler)
+	: VirtualFile(content), _handler(handler) {
+}
+
+int CommandVirtualFile::write(const char* data, size_t len, off_t offset) {
+	string commands(data, len);
+	size_t lineStart = 0;
+	while (lineStart < commands.size()) {
+		size_t lineEnd = commands.find('\n', lineStart);
+		if (lineEnd == string::npos) {
+			lineEnd = commands.size();
+		}
+
+		string command = commands.substr(lineStart, lineEnd - lineStart);
+		lineStart = lineEnd + 1;
+		if (command.find_first_not_of(" \t\r") == string::npos) {
+			continue;
+		}
+
+		string response;
+		int retCode = _handler(command, response);
+		if (retCode) {
+			return retCode;
+		}
+	}
+
+	return len;
+}
+
+VirtualFiles::VirtualFiles() {
+	_files[VIRTUAL_DIR + "/stats"] = boost::bind(&FSStats::toJSON, &FSStats::get());
+	_files[VIRTUAL_DIR + "/stats.prom"] = boost::bind(&FSStats::toPrometheus, &FSStats::get());
+	_files[VIRTUAL_DIR + "/control"] = boost::bind(&FSControl::getStatus, &FSControl::get());
+	_commandHandlers[VIRTUAL_DIR + "/control"] = boost::bind(&FSControl::execute, &FSControl::get(), _1, _2);
+}
+
+VirtualFiles& VirtualFiles::get() {
+	static VirtualFiles instance;
+	return instance;
+}
+
+bool VirtualFiles::isVirtualPath(const char* path) {
+	size_t prefixLen = VIRTUAL_DIR.size();
+	return !strncmp(path, VIRTUAL_DIR.c_str(), prefixLen) && (path[prefixLen] == 0 || path[prefixLen] == '/');
+}
+
+int VirtualFiles::getattr(const char* path, struct stat* fileStat) const {
+	if (VIRTUAL_DIR == path) {
+		fillStat(fileStat, S_IFDIR | 0555, 0);
+		return 0;
+	}
+
+	if (_files.find(path) == _files.end()) {
+		return -ENOENT;
+	}
+
+	// Content is generated on open, the handles are opened with direct_io for the size not to matter
+	fillStat(fileStat, S_IFREG | (_commandHandlers.count(path) ? 0644 : 0444), 0);
+	return 0;
+}
+
+int VirtualFiles::opendir(const char* path, struct fuse_file_info* ffinfo) const {
+	if (VIRTUAL_DIR != path) {
+		return (_files.find(path) == _files.end()) ? -ENOENT : -ENOTDIR;
+	}
+
+	ffinfo->fh = FileHandle::assign(path);
+	return ffinfo->fh ? 0 : -ENFILE;
+}
+
+int VirtualFiles::readdir(const char* path, void* dirlist, fuse_fill_dir_t ffdir) const {
+	if (VIRTUAL_DIR != path) {
+		return -ENOTDIR;
+	}
+
+	ffdir(dirlist, ".", NULL, 0);
+	ffdir(dirlist, "..", NULL, 0);
+	for (map<string, ContentGenerator>::const_iterator fIt = _files.begin(); fIt != _files.end(); ++fIt) {
+		ffdir(dirlist, fIt->first.c_str() + VIRTUAL_DIR.size() + 1, NULL, 0);
+	}
+	return 0;
+}
+
+int VirtualFiles::open(const char* path, struct fuse_file_info* ffinfo) const {
+	map<string, ContentGenerator>::const_iterator fIt = _files.find(path);
+	if (fIt == _files.end()) {
+		return (VIRTUAL_DIR == path) ? -EISDIR : -ENOENT;
+	}
+
+	VirtualFilePtr virtualFile;
+	if ((ffinfo->flags & O_ACCMODE) == O_RDONLY) {
+		virtualFile.reset(new VirtualFile(fIt->second()));
+	} else {
+		map<string, CommandHandler>::const_iterator hIt = _commandHandlers.find(path);
+		if (hIt == _commandHandlers.end()) {
+			return -EACCES;
+		}
+		virtualFile.reset(new CommandVirtualFile(fIt->second(), hIt->second));
+	}
+
+	ffinfo->fh = FileHandle::assign(path, virtualFile);
+	if (!ffinfo->fh) {
+		return -ENFILE;
+	}
+
+	ffinfo->direct_io = 1;
+	ffinfo->keep_cache = 0;
+	debug() << "Opened virtual file {file: " << path << ", size: " << virtualFile->getSize() << "}" << endl;
+	return 0;
+}
+
+int VirtualFiles::truncate(const char* path) const {
+	if (_commandHandlers.count(path)) {
+		return 0;
+	}
+
+	return (_files.find(path) == _files.end() && VIRTUAL_DIR != path) ? -ENOENT : -EPERM;
+}
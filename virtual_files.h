@@ -0,0 +1,92 @@
+#ifndef mgridfs_virtual_files_h
+#define mgridfs_virtual_files_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include <map>
+#include <string>
+
+#include <boost/utility.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+using namespace std;
+
+namespace mgridfs {
+
+// Directory holding the file system's own virtual files, served locally and never stored on the server
+extern const string VIRTUAL_DIR;
+
+/**
+ * Content of a virtual file as of the time it was opened, so that all the reads on a handle
+ * see a consistent view irrespective of how the underlying state changes in the meantime
+ */
+class VirtualFile : protected boost::noncopyable {
+public:
+	VirtualFile(const string& content);
+	virtual ~VirtualFile();
+
+	virtual int read(char* data, size_t len, off_t offset) const;
+	virtual int write(const char* data, size_t len, off_t offset);
+
+	inline size_t getSize() const {
+		return _content.size();
+	}
+
+protected:
+	string _content;
+};
+
+typedef boost::shared_ptr<VirtualFile> VirtualFilePtr;
+
+// Runs a command written to a virtual file, returns 0 or -errno along with the response
+typedef boost::function<int (const string&, string&)> CommandHandler;
+
+/**
+ * Virtual file taking commands, every line written is run as a command. Lines are not
+ * buffered across writes, so a command has to be written with a single write call.
+ */
+class CommandVirtualFile : public VirtualFile {
+public:
+	CommandVirtualFile(const string& content, const CommandHandler& handler);
+
+	virtual int write(const char* data, size_t len, off_t offset);
+
+private:
+	CommandHandler _handler;
+};
+
+/**
+ * Files exposed under VIRTUAL_DIR, e.g. the runtime stats. Content of a file is generated on
+ * open. Files registered with a command handler can be written, the rest are read-only. All
+ * the operations modifying the namespace are rejected for these paths
+ */
+class VirtualFiles : protected boost::noncopyable {
+public:
+	typedef boost::function<string ()> ContentGenerator;
+
+	static VirtualFiles& get();
+
+	static bool isVirtualPath(const char* path);
+
+	int getattr(const char* path, struct stat* fileStat) const;
+	int opendir(const char* path, struct fuse_file_info* ffinfo) const;
+	int readdir(const char* path, void* dirlist, fuse_fill_dir_t ffdir) const;
+	int open(const char* path, struct fuse_file_info* ffinfo) const;
+
+	// Truncation is accepted as a no-op for the writable files, for "echo cmd > file" to work
+	int truncate(const char* path) const;
+
+private:
+	VirtualFiles();
+
+	// Registered on construction and only read afterwards, so no locking is needed
+	map<string, ContentGenerator> _files;
+	map<string, CommandHandler> _commandHandlers;
+};
+
+}
+
+#endif
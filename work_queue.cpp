@@ -0,0 +1,192 @@
+#include "work_queue.h"
+#include "fs_connection.h"
+#include "fs_logger.h"
+#include "fs_stats.h"
+
+#include <cerrno>
+
+#include <boost/bind.hpp>
+#include <boost/thread/tss.hpp>
+
+using namespace mgridfs;
+
+namespace {
+	// Set for the worker threads of the work queue, never deleted (no-op cleanup)
+	void noCleanup(bool*) {}
+	boost::thread_specific_ptr<bool> isWorker(noCleanup);
+	bool workerFlag = true;
+}
+
+FSFuture::FSFuture() {
+}
+
+int FSFuture::wait() const {
+	if (!_state) {
+		return -EINVAL;
+	}
+
+	boost::mutex::scoped_lock lock(_state->_lock);
+	while (!_state->_done) {
+		_state->_completed.wait(lock);
+	}
+	return _state->_result;
+}
+
+bool FSFuture::isDone() const {
+	if (!_state) {
+		return false;
+	}
+
+	boost::mutex::scoped_lock lock(_state->_lock);
+	return _state->_done;
+}
+
+void FSFuture::complete(int result) {
+	boost::mutex::scoped_lock lock(_state->_lock);
+	_state->_result = result;
+	_state->_done = true;
+	_state->_completed.notify_all();
+}
+
+FSWorkQueue::FSWorkQueue()
+	: _capacity(0), _running(false) {
+}
+
+FSWorkQueue::~FSWorkQueue() {
+	stop();
+}
+
+FSWorkQueue& FSWorkQueue::get() {
+	static FSWorkQueue instance;
+	return instance;
+}
+
+void FSWorkQueue::start(size_t workerCount, size_t capacity) {
+	boost::mutex::scoped_lock lock(_queueLock);
+	if (_running) {
+		return;
+	}
+
+	_capacity = capacity;
+	_running = true;
+	for (size_t i = 0; i < workerCount; ++i) {
+		_workers.create_thread(boost::bind(&FSWorkQueue::workerLoop, this));
+	}
+	info() << "Started work queue {workers: " << workerCount << ", capacity: " << capacity << "}" << endl;
+}
+
+void FSWorkQueue::stop() {
+	{
+		boost::mutex::scoped_lock lock(_queueLock);
+		if (!_running) {
+			return;
+		}
+		_running = false;
+		_workAvailable.notify_all();
+		_spaceAvailable.notify_all();
+	}
+
+	// Workers drain the pending work before exiting
+	_workers.join_all();
+	info() << "Stopped work queue" << endl;
+}
+
+bool FSWorkQueue::isWorkerThread() const {
+	return isWorker.get() != NULL;
+}
+
+void FSWorkQueue::runWork(const WorkItem& item) {
+	FSOpContext::Adopt adoptContext(item._context);
+	int result = -EIO;
+	try {
+		result = item._work();
+	} catch (std::exception& e) {
+		error() << "Caught exception in queued work {what: " << e.what() << "}" << endl;
+	} catch (...) {
+		error() << "Caught unknown exception in queued work" << endl;
+	}
+	const_cast<FSFuture&>(item._future).complete(result);
+}
+
+FSFuture FSWorkQueue::runInline(const FSWork& work) {
+	WorkItem item;
+	item._work = work;
+	item._future._state.reset(new FSFuture::State());
+	item._context = FSOpContext::current();
+	runWork(item);
+	return item._future;
+}
+
+FSFuture FSWorkQueue::submit(const FSWork& work) {
+	if (isWorkerThread()) {
+		return runInline(work);
+	}
+
+	WorkItem item;
+	item._work = work;
+	item._future._state.reset(new FSFuture::State());
+	item._context = FSOpContext::current();
+	{
+		boost::mutex::scoped_lock lock(_queueLock);
+		while (_running && _pending.size() >= _capacity) {
+			_spaceAvailable.wait(lock);
+		}
+
+		if (_running) {
+			_pending.push_back(item);
+			_workAvailable.notify_one();
+			return item._future;
+		}
+	}
+
+	return runInline(work);
+}
+
+bool FSWorkQueue::trySubmit(const FSWork& work, FSFuture* future) {
+	WorkItem item;
+	item._work = work;
+	item._future._state.reset(new FSFuture::State());
+
+	boost::mutex::scoped_lock lock(_queueLock);
+	if (!_running || _pending.size() >= _capacity) {
+		return false;
+	}
+
+	_pending.push_back(item);
+	_workAvailable.notify_one();
+	if (future) {
+		*future = item._future;
+	}
+	return true;
+}
+
+size_t FSWorkQueue::getPendingCount() const {
+	boost::mutex::scoped_lock lock(_queueLock);
+	return _pending.size();
+}
+
+void FSWorkQueue::workerLoop() {
+	isWorker.reset(&workerFlag);
+	FSConnectionManager::get().setAuxiliaryThread();
+
+	for (;;) {
+		WorkItem item;
+		{
+			boost::mutex::scoped_lock lock(_queueLock);
+			while (_running && _pending.empty()) {
+				_workAvailable.wait(lock);
+			}
+
+			if (_pending.empty()) {
+				// Stopped and fully drained
+				break;
+			}
+
+			item = _pending.front();
+			_pending.pop_front();
+			_spaceAvailable.notify_one();
+		}
+
+		runWork(item);
+	}
+}
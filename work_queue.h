@@ -0,0 +1,108 @@
+#ifndef mgridfs_work_queue_h
+#define mgridfs_work_queue_h
+
+#include <deque>
+
+#include <boost/utility.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+using namespace std;
+
+namespace mgridfs {
+
+class FSOpContext;
+
+// Unit of work for the work queue, returns 0 or -errno in the same way as the file system operations
+typedef boost::function<int ()> FSWork;
+
+/**
+ * Completion of a queued unit of work
+ */
+class FSFuture {
+public:
+	FSFuture();
+
+	// Blocks until the work has completed and returns its result
+	int wait() const;
+	bool isDone() const;
+
+	// Empty future, e.g. in case the work could not be queued
+	inline bool isValid() const { return _state.get() != NULL; }
+
+private:
+	friend class FSWorkQueue;
+
+	struct State {
+		State() : _done(false), _result(0) {}
+
+		mutable boost::mutex _lock;
+		mutable boost::condition_variable _completed;
+		bool _done;
+		int _result;
+	};
+
+	boost::shared_ptr<State> _state;
+
+	void complete(int result);
+};
+
+/**
+ * Bounded work queue served by a pool of worker threads.
+ *
+ * Used to fan out independent sub-requests of a file system operation (e.g. the chunk ranges of
+ * a file being downloaded) and to run background work (flush, prefetch, garbage collection) off
+ * the FUSE threads. Workers are auxiliary threads for the connection manager and share its
+ * bounded pool of connections.
+ *
+ * Work submitted from a worker thread is run inline, so that work waiting on other work can
+ * never dead-lock the pool. Until the queue is started all work is run inline as well.
+ */
+class FSWorkQueue : protected boost::noncopyable {
+public:
+	static FSWorkQueue& get();
+
+	void start(size_t workerCount, size_t capacity);
+	void stop();
+
+	// Queues the work, blocking while the queue is full. The work is accounted to the operation
+	// of the caller (e.g. in the slow operation log), which is expected to wait for it.
+	FSFuture submit(const FSWork& work);
+
+	// Queues the work only if there is room for it, for background work that can be skipped or retried later
+	bool trySubmit(const FSWork& work, FSFuture* future = NULL);
+
+	size_t getPendingCount() const;
+
+private:
+	FSWorkQueue();
+	~FSWorkQueue();
+
+	struct WorkItem {
+		WorkItem() : _context(NULL) {}
+
+		FSWork _work;
+		FSFuture _future;
+		FSOpContext* _context; // Operation the work is done for, if it waits for the work
+	};
+
+	mutable boost::mutex _queueLock;
+	boost::condition_variable _workAvailable;
+	boost::condition_variable _spaceAvailable;
+	deque<WorkItem> _pending;
+	size_t _capacity;
+	bool _running;
+	boost::thread_group _workers;
+
+	void workerLoop();
+	bool isWorkerThread() const;
+	FSFuture runInline(const FSWork& work);
+	static void runWork(const WorkItem& item);
+};
+
+}
+
+#endif
@@ -0,0 +1,152 @@
+#include "write_back.h"
+#include "fs_connection.h"
+#include "fs_logger.h"
+#include "fs_options.h"
+#include "local_gridfs.h"
+#include "local_grid_file.h"
+
+#include <ctime>
+#include <vector>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread_time.hpp>
+
+using namespace mgridfs;
+using namespace std;
+
+namespace {
+	struct DirtyFile {
+		DirtyFile(time_t dirtySince, size_t size, const LocalGridFilePtr& localGridFile)
+			: _dirtySince(dirtySince), _size(size), _localGridFile(localGridFile) {}
+
+		bool operator<(const DirtyFile& other) const {
+			return _dirtySince < other._dirtySince;
+		}
+
+		time_t _dirtySince;
+		size_t _size;
+		LocalGridFilePtr _localGridFile;
+	};
+}
+
+FSWriteBack::FSWriteBack()
+	: _running(false) {
+	_stats._flushedByAge = 0;
+	_stats._flushedByRatio = 0;
+	_stats._flushedBytes = 0;
+	_stats._failed = 0;
+}
+
+FSWriteBack::~FSWriteBack() {
+	stop();
+}
+
+FSWriteBack& FSWriteBack::get() {
+	static FSWriteBack instance;
+	return instance;
+}
+
+void FSWriteBack::start() {
+	boost::mutex::scoped_lock lock(_lock);
+	if (_thread) {
+		return;
+	}
+
+	_running = true;
+	_thread.reset(new boost::thread(boost::bind(&FSWriteBack::writeBackLoop, this)));
+	info() << "Started write-back {intervalSecs: " << globalFSOptions._writeBackSecs << ", dirtyExpireSecs: "
+		<< globalFSOptions._dirtyExpireSecs << ", dirtyRatio: " << globalFSOptions._dirtyRatio << "}" << endl;
+}
+
+void FSWriteBack::stop() {
+	boost::scoped_ptr<boost::thread> thread;
+	{
+		boost::mutex::scoped_lock lock(_lock);
+		if (!_thread) {
+			return;
+		}
+
+		_running = false;
+		_thread.swap(thread);
+		_wakeup.notify_one();
+	}
+
+	thread->join();
+	info() << "Stopped write-back" << endl;
+}
+
+void FSWriteBack::writeBackLoop() {
+	// Flushes borrow connections in the same way as the work queue threads
+	FSConnectionManager::get().setAuxiliaryThread();
+
+	for (;;) {
+		{
+			boost::mutex::scoped_lock lock(_lock);
+			boost::system_time wakeupTime = boost::get_system_time() + boost::posix_time::seconds(globalFSOptions._writeBackSecs);
+			while (_running && boost::get_system_time() < wakeupTime) {
+				_wakeup.timed_wait(lock, wakeupTime);
+			}
+
+			if (!_running) {
+				return;
+			}
+		}
+
+		writeBack();
+	}
+}
+
+size_t FSWriteBack::writeBack() {
+	vector<LocalGridFilePtr> localGridFiles;
+	LocalGridFS::get().getAllFiles(localGridFiles);
+
+	vector<DirtyFile> dirtyFiles;
+	size_t dirtyBytes = 0;
+	for (vector<LocalGridFilePtr>::const_iterator fIt = localGridFiles.begin(); fIt != localGridFiles.end(); ++fIt) {
+		time_t dirtySince = (*fIt)->getDirtySince();
+		if (dirtySince) {
+			size_t size = (*fIt)->getSize();
+			dirtyFiles.push_back(DirtyFile(dirtySince, size, *fIt));
+			dirtyBytes += size;
+		}
+	}
+
+	// Oldest first, the ratio is brought down by flushing the files that have waited the longest
+	sort(dirtyFiles.begin(), dirtyFiles.end());
+	time_t expireTime = time(NULL) - globalFSOptions._dirtyExpireSecs;
+	size_t dirtyLimit = globalFSOptions._memBudget / 100 * globalFSOptions._dirtyRatio;
+
+	size_t flushed = 0;
+	for (vector<DirtyFile>::const_iterator dIt = dirtyFiles.begin(); dIt != dirtyFiles.end(); ++dIt) {
+		bool expired = dIt->_dirtySince <= expireTime;
+		if (!expired && dirtyBytes <= dirtyLimit) {
+			break;
+		}
+
+		int retCode = dIt->_localGridFile->flush();
+		boost::mutex::scoped_lock lock(_lock);
+		if (retCode) {
+			warn() << "Failed to write back local file {file: " << dIt->_localGridFile->getFilename()
+				<< ", retCode: " << retCode << "}" << endl;
+			++_stats._failed;
+			continue;
+		}
+
+		++(expired ? _stats._flushedByAge : _stats._flushedByRatio);
+		_stats._flushedBytes += dIt->_size;
+		dirtyBytes -= dIt->_size;
+		++flushed;
+	}
+
+	if (flushed) {
+		debug() << "Wrote back local files {dirty: " << dirtyFiles.size() << ", flushed: " << flushed
+			<< ", dirtyBytes: " << dirtyBytes << ", dirtyLimit: " << dirtyLimit << "}" << endl;
+	}
+	return flushed;
+}
+
+void FSWriteBack::getStats(WriteBackStats& stats) const {
+	boost::mutex::scoped_lock lock(_lock);
+	stats = _stats;
+}
@@ -0,0 +1,58 @@
+#ifndef mgridfs_write_back_h
+#define mgridfs_write_back_h
+
+#include <stdint.h>
+
+#include <boost/utility.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace mgridfs {
+
+struct WriteBackStats {
+	uint64_t _flushedByAge;
+	uint64_t _flushedByRatio;
+	uint64_t _flushedBytes;
+	uint64_t _failed;
+};
+
+/**
+ * Background write-back of the dirty local files, so that data of files kept open for long
+ * reaches the server without waiting for the close / fsync and the close finds little to flush.
+ *
+ * Every --writeBackSecs the files dirty for longer than --dirtyExpireSecs are flushed, oldest
+ * first, and so are further files while the dirty files together take more than --dirtyRatio
+ * percent of the memory budget. Flushes wait for the writes in progress on the file and block
+ * further writes until done, in the same way as a flush on close.
+ */
+class FSWriteBack : protected boost::noncopyable {
+public:
+	static FSWriteBack& get();
+
+	void start();
+	void stop();
+
+	// Runs a single pass on the calling thread, returns the files flushed
+	size_t writeBack();
+
+	void getStats(WriteBackStats& stats) const;
+
+private:
+	FSWriteBack();
+	~FSWriteBack();
+
+	mutable boost::mutex _lock;
+	boost::condition_variable _wakeup;
+	boost::scoped_ptr<boost::thread> _thread;
+	bool _running;
+
+	WriteBackStats _stats;
+
+	void writeBackLoop();
+};
+
+}
+
+#endif